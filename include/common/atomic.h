@@ -42,6 +42,20 @@ static inline int atomic_set(atomic_t *v, int i)
         return __sync_val_compare_and_swap(&v->value, atomic_read(v), i);
 }
 
+static inline int atomic_add_unless(atomic_t *v, int a, int u)
+{
+        int c = atomic_read(v);
+
+        while (c != u) {
+                int old = __sync_val_compare_and_swap(&v->value, c, c + a);
+
+                if (old == c)
+                        return 1;
+                c = old;
+        }
+        return 0;
+}
+
 #elif defined(__BIONIC__)
 #include <sys/atomics.h>
 typedef struct {
@@ -77,6 +91,21 @@ static inline int atomic_sub_return(int i, atomic_t *v)
 
 #define atomic_set(v, i) __atomic_swap(i, &(v)->value)
 
+static inline int atomic_add_unless(atomic_t *v, int a, int u)
+{
+        int c;
+
+        do {
+                c = *(volatile int *)&v->value;
+
+                if (c == u)
+                        return 0;
+        }
+        while (__atomic_cmpxchg(c, c+a, (volatile int*)&v->value));
+
+        return 1;
+}
+
 #else /* GENERIC */
 #include <pthread.h>
 
@@ -119,6 +148,18 @@ static inline int atomic_sub_return(int i, atomic_t *v)
 /* Probably this is ok for most platforms */
 #define atomic_set(v, i) (((v)->value) = (i))
 
+static inline int atomic_add_unless(atomic_t *v, int a, int u)
+{
+        int ret = 0;
+        pthread_mutex_lock(&v->mutex);
+        if (v->value != u) {
+                v->value += a;
+                ret = 1;
+        }
+        pthread_mutex_unlock(&v->mutex);
+	return ret;
+}
+
 
 #endif /* __GLIBC__ */
 
@@ -153,6 +194,7 @@ static inline void atomic_dec(atomic_t *v)
 #define atomic_sub_and_test(i, v)       (atomic_sub_return((i), (v)) == 0)
 #define atomic_dec_and_test(v)          (atomic_sub_return(1, (v)) == 0)
 #define atomic_inc_and_test(v)          (atomic_add_return(1, (v)) == 0)
+#define atomic_inc_not_zero(v)          atomic_add_unless((v), 1, 0)
 
 #endif /* __linux__ && __KERNEL__ */
 
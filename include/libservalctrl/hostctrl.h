@@ -138,6 +138,59 @@ struct hostctrl_callback {
                                       unsigned int xid,
                                       unsigned int pkt_id,
                                       struct service_id *service);
+
+    /**
+     * @brief Service table dump result callback.
+     *
+     * This callback will be called in response to a service table
+     * dump request. The entries follow the cursor given in the
+     * request. If @p more is non-zero, there are entries left and
+     * the next chunk can be requested with @p cursor, @p cursor_bits
+     * and @p cursor_target.
+     */
+    int (*service_dump_result)(struct hostctrl *hc,
+                               unsigned int xid,
+                               int retval,
+                               const struct service_info *si,
+                               unsigned int num,
+                               const struct service_id *cursor,
+                               unsigned short cursor_bits,
+                               unsigned int cursor_target,
+                               int more);
+
+    /**
+     * @brief Flow table dump result callback.
+     *
+     * This callback will be called in response to a flow table dump
+     * request. Flows are returned in flowID order. If @p more is
+     * non-zero, the next chunk can be requested with @p cursor.
+     */
+    int (*flow_dump_result)(struct hostctrl *hc,
+                            unsigned int xid,
+                            int retval,
+                            const struct flow_entry_info *fi,
+                            unsigned int num,
+                            const struct flow_id *cursor,
+                            int more);
+
+    /**
+     * @brief Service batch result callback.
+     *
+     * This callback will be called in response to a batch of
+     * service updates. Each update in @p ops carries its own result
+     * in its retval field: CTRLMSG_RETVAL_OK if it was applied,
+     * CTRLMSG_RETVAL_NOENTRY if there was nothing to do,
+     * CTRLMSG_RETVAL_INVALID for a bad operation,
+     * CTRLMSG_RETVAL_NODEV if no interface has the address of a
+     * forwarding rule, and CTRLMSG_RETVAL_ERROR otherwise. @p count
+     * is the number of updates applied.
+     */
+    int (*services_batch_result)(struct hostctrl *hc,
+                                 unsigned int xid,
+                                 int retval,
+                                 const struct service_update_info *ops,
+                                 unsigned int num,
+                                 unsigned int count);
     int (*start)(struct hostctrl *hc); /* Called one time, when thread starts */
     void (*stop)(struct hostctrl *hc); /* Called when thread stops */
 };
@@ -527,4 +580,109 @@ int hostctrl_get_peer_addr(struct hostctrl *hc, struct sockaddr *addr,
 int hostctrl_set_delay_verdict(struct hostctrl *hc,
                                unsigned int pkt_id,
                                enum delay_verdict verdict);
+
+/**
+ * @brief Set the verdict of all packets queued for a service.
+ *
+ * Releases or drops, in one message, every packet that is queued in
+ * the network stack due to matching a DELAY rule for the service
+ * ID @p srvid.
+ *
+ * @param hc A host control handle.
+ * @param srvid The service ID given in the delay notifications.
+ * @param verdict The packets' verdict (DELAY_RELEASE or DELAY_DROP).
+ * @return Zero on success or -1 on failure. Note, that success only
+ * indicates that the message was successfully sent.
+ */
+int hostctrl_set_service_delay_verdict(struct hostctrl *hc,
+                                       const struct service_id *srvid,
+                                       enum delay_verdict verdict);
+
+/**
+ * @brief Set the limits of the delay queue for a service.
+ *
+ * At most @p limit packets are queued for the service, and packets
+ * that get no verdict within @p timeout_ms milliseconds are given
+ * @p timeout_verdict. A limit or timeout of zero removes it. By
+ * default, a service may queue 256 packets and they are dropped
+ * after five seconds. As with verdicts, the stack only accepts this
+ * from the peer that gives the verdicts.
+ *
+ * @param hc A host control handle.
+ * @param srvid The service ID, or NULL to set the defaults for
+ * services without their own limits.
+ * @param limit The maximum number of packets queued.
+ * @param timeout_ms The time a packet waits for a verdict.
+ * @param timeout_verdict DELAY_RELEASE or DELAY_DROP.
+ * @return Zero on success or -1 on failure.
+ */
+int hostctrl_set_delay_conf(struct hostctrl *hc,
+                            const struct service_id *srvid,
+                            unsigned int limit,
+                            unsigned int timeout_ms,
+                            enum delay_verdict timeout_verdict);
+
+/**
+ * @brief Apply a batch of service table updates.
+ *
+ * Additions, deletions and modifications (SERVICE_UPDATE_ADD,
+ * SERVICE_UPDATE_DEL and SERVICE_UPDATE_MOD in the op field of each
+ * element of @p ops) are sent in one message and applied by the
+ * stack under one lock of its service table. The result of each
+ * update is delivered through the services_batch_result callback.
+ *
+ * @param hc A host control handle.
+ * @param ops The updates to apply. The retval fields are ignored.
+ * @param num The number of updates, at most CTRLMSG_SERVICE_BATCH_MAX.
+ * @return Zero on success or -1 on failure. Note, that success only
+ * indicates that the message was successfully sent.
+ */
+int hostctrl_services_batch(struct hostctrl *hc,
+                            const struct service_update_info *ops,
+                            unsigned int num);
+
+/**
+ * @brief Dump a chunk of the service table.
+ *
+ * Requests at most @p max service table entries following the
+ * position given by @p cursor and @p cursor_bits, in prefix
+ * order. The stack holds the table lock only while it collects one
+ * chunk, so large tables can be dumped without stalling
+ * lookups. The result is delivered through the service_dump_result
+ * callback, along with the cursor to use for the next chunk.
+ *
+ * @param hc A host control handle.
+ * @param cursor The position to continue from, or NULL to start
+ * from the beginning of the table.
+ * @param cursor_bits The prefix length of the cursor.
+ * @param cursor_target The number of targets of the cursor entry
+ * that were already returned, as given in the last result (an
+ * entry with more targets than fit in one chunk is split).
+ * @param max The maximum number of entries to return. Zero means as
+ * many as fit in one message.
+ * @return Zero on success or -1 on failure.
+ */
+int hostctrl_service_dump(struct hostctrl *hc,
+                          const struct service_id *cursor,
+                          unsigned short cursor_bits,
+                          unsigned int cursor_target,
+                          unsigned int max);
+
+/**
+ * @brief Dump a chunk of the flow table.
+ *
+ * Requests at most @p max flows with a flowID larger than
+ * @p cursor. The result is delivered through the flow_dump_result
+ * callback.
+ *
+ * @param hc A host control handle.
+ * @param cursor The flowID to continue from, or NULL to start from
+ * the beginning of the table.
+ * @param max The maximum number of flows to return. Zero means as
+ * many as fit in one message.
+ * @return Zero on success or -1 on failure.
+ */
+int hostctrl_flow_dump(struct hostctrl *hc,
+                       const struct flow_id *cursor,
+                       unsigned int max);
 #endif /* _HOSTCTRL_H_ */
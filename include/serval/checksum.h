@@ -133,6 +133,25 @@ static inline __wsum csum_unfold(__sum16 n)
 	return (__force __wsum)n;
 }
 
+#define CSUM_MANGLED_0 ((__force __sum16)0xffff)
+
+/*
+ * Incrementally update a checksum when a 32-bit (or 16-bit) field
+ * covered by it changes from "from" to "to" (RFC 1624)
+ */
+static inline void csum_replace4(__sum16 *sum, __be32 from, __be32 to)
+{
+	__be32 diff[] = { ~from, to };
+
+	*sum = csum_fold(csum_partial(diff, sizeof(diff), 
+                                      ~csum_unfold(*sum)));
+}
+
+static inline void csum_replace2(__sum16 *sum, __be16 from, __be16 to)
+{
+	csum_replace4(sum, (__force __be32)from, (__force __be32)to);
+}
+
 static inline
 __wsum csum_and_copy_from_user (const void *src, void *dst,
 				int len, __wsum sum, int *err_ptr)
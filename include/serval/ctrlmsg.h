@@ -38,6 +38,10 @@ enum ctrlmsg_type {
         CTRLMSG_TYPE_DELAY_NOTIFY,
         CTRLMSG_TYPE_DELAY_VERDICT,
         CTRLMSG_TYPE_DUMMY,
+        CTRLMSG_TYPE_BATCH_SERVICE,
+        CTRLMSG_TYPE_DUMP_SERVICE,
+        CTRLMSG_TYPE_DUMP_FLOW,
+        CTRLMSG_TYPE_DELAY_CONF,
         _CTRLMSG_TYPE_MAX,
 };
 
@@ -102,6 +106,8 @@ enum ctrlmsg_retval {
         CTRLMSG_RETVAL_ERROR,
         CTRLMSG_RETVAL_NOENTRY,
         CTRLMSG_RETVAL_MALFORMED,
+        CTRLMSG_RETVAL_INVALID,
+        CTRLMSG_RETVAL_NODEV,
 };
  
 struct ctrlmsg {
@@ -222,6 +228,115 @@ CTRLMSG_ASSERT(sizeof(struct ctrlmsg_service_stat) == 40)
         (((cmsg)->cmh.len - sizeof(struct ctrlmsg)) /                  \
          sizeof(struct service_stat))
 
+/* Updates of the service table to apply as one batch */
+enum service_update_op {
+        SERVICE_UPDATE_ADD = 0,
+        SERVICE_UPDATE_DEL,
+        SERVICE_UPDATE_MOD,
+};
+
+struct service_update_info {
+        uint8_t op;
+        uint8_t retval; /* Result of this update in the response */
+        uint16_t pad;
+        struct in_addr new_address; /* New address when modifying */
+        struct service_info service;
+} CTRLMSG_PACKED;
+
+CTRLMSG_ASSERT(sizeof(struct service_update_info) == 68)
+
+struct ctrlmsg_service_batch {
+        struct ctrlmsg cmh;
+        uint32_t xid;
+        uint32_t count; /* Successful updates, set in the response */
+        struct service_update_info op[0];
+} CTRLMSG_PACKED;
+
+CTRLMSG_ASSERT(sizeof(struct ctrlmsg_service_batch) == 16)
+
+#define CTRLMSG_SERVICE_BATCH_NUM_LEN(num)                              \
+        (sizeof(struct ctrlmsg_service_batch) +                         \
+         ((num) * sizeof(struct service_update_info)))
+
+#define CTRLMSG_SERVICE_BATCH_NUM(cmsg)                                 \
+        (((cmsg)->cmh.len - sizeof(struct ctrlmsg_service_batch)) /     \
+         sizeof(struct service_update_info))
+
+/* The most updates that fit in one message */
+#define CTRLMSG_SERVICE_BATCH_MAX                                       \
+        ((0xffff - sizeof(struct ctrlmsg_service_batch)) /              \
+         sizeof(struct service_update_info))
+
+/* 
+   Chunked dumps of the service and flow tables. The request carries
+   a cursor (unless CTRLMSG_DUMP_F_CURSOR is unset, which starts from
+   the beginning) and the maximum number of entries to return. The
+   response carries the entries following the cursor and a cursor
+   positioned at the last of them, so that the response can be sent
+   back as is to get the next chunk. CTRLMSG_DUMP_F_MORE is set in the
+   response if there are entries left. A service table entry with
+   more targets than fit in one chunk is split, and cursor_target
+   then tells how many of its targets were already returned.
+*/
+enum ctrlmsg_dump_flags {
+        CTRLMSG_DUMP_F_CURSOR = 1 << 0,
+        CTRLMSG_DUMP_F_MORE = 1 << 1,
+};
+
+struct ctrlmsg_service_dump {
+        struct ctrlmsg cmh;
+        uint32_t xid;
+        uint16_t flags;
+        uint16_t cursor_prefix_bits;
+        uint32_t count; /* Max entries in request, entries in response */
+        uint32_t cursor_target; /* Targets of the cursor entry dumped */
+        struct service_id cursor;
+        struct service_info service[0];
+} CTRLMSG_PACKED;
+
+CTRLMSG_ASSERT(sizeof(struct ctrlmsg_service_dump) == 56)
+
+#define CTRLMSG_SERVICE_DUMP_NUM_LEN(num)                               \
+        (sizeof(struct ctrlmsg_service_dump) +                          \
+         ((num) * sizeof(struct service_info)))
+
+#define CTRLMSG_SERVICE_DUMP_MAX                                        \
+        ((0xffff - sizeof(struct ctrlmsg_service_dump)) /               \
+         sizeof(struct service_info))
+
+struct flow_entry_info {
+        struct flow_id src_flowid;
+        struct flow_id dst_flowid;
+        struct in_addr src_address;
+        struct in_addr dst_address;
+        uint32_t if_index;
+        uint8_t state;
+        uint8_t protocol;
+        uint16_t pad;
+} CTRLMSG_PACKED;
+
+CTRLMSG_ASSERT(sizeof(struct flow_entry_info) == 24)
+
+struct ctrlmsg_flow_dump {
+        struct ctrlmsg cmh;
+        uint32_t xid;
+        uint16_t flags;
+        uint16_t pad;
+        uint32_t count; /* Max entries in request, entries in response */
+        struct flow_id cursor;
+        struct flow_entry_info flow[0];
+} CTRLMSG_PACKED;
+
+CTRLMSG_ASSERT(sizeof(struct ctrlmsg_flow_dump) == 24)
+
+#define CTRLMSG_FLOW_DUMP_NUM_LEN(num)                                  \
+        (sizeof(struct ctrlmsg_flow_dump) +                             \
+         ((num) * sizeof(struct flow_entry_info)))
+
+#define CTRLMSG_FLOW_DUMP_MAX                                           \
+        ((0xffff - sizeof(struct ctrlmsg_flow_dump)) /                  \
+         sizeof(struct flow_entry_info))
+
 struct ctrlmsg_capabilities {
         struct ctrlmsg cmh;
         uint32_t capabilities;
@@ -258,6 +373,10 @@ CTRLMSG_ASSERT(sizeof(struct ctrlmsg_migrate) == 57)
 enum delay_verdict {
         DELAY_RELEASE = 0,
         DELAY_DROP,
+        /* Apply to every packet queued for the service in the
+           message, the packet ID is ignored */
+        DELAY_RELEASE_SERVICE,
+        DELAY_DROP_SERVICE,
 };
 
 struct ctrlmsg_delay {
@@ -271,6 +390,30 @@ struct ctrlmsg_delay {
 
 CTRLMSG_ASSERT(sizeof(struct ctrlmsg_delay) == 48)
 
+enum ctrlmsg_delay_conf_flags {
+        /* Set the defaults for services without their own
+           configuration, the service ID is ignored */
+        DELAY_CONF_F_DEFAULT = 1 << 0,
+};
+
+/* Limits of the delay queue for a service. A limit of zero leaves
+ * the number of packets bounded by the size of the whole queue
+ * only, and a timeout of zero keeps packets until there is a
+ * verdict. On timeout, a packet gets the timeout verdict. */
+struct ctrlmsg_delay_conf {
+        struct ctrlmsg cmh;
+        uint8_t flags;
+        uint8_t timeout_verdict; /* DELAY_RELEASE or DELAY_DROP */
+        uint16_t reserved;
+        uint32_t limit; /* Max packets queued */
+        uint32_t timeout; /* Milliseconds */
+        struct service_id service;
+} CTRLMSG_PACKED;
+
+#define CTRLMSG_DELAY_CONF_SIZE (sizeof(struct ctrlmsg_delay_conf))
+
+CTRLMSG_ASSERT(sizeof(struct ctrlmsg_delay_conf) == 52)
+
 #define CTRLMSG_MIGRATE_SIZE (sizeof(struct ctrlmsg_migrate))
 
 struct ctrlmsg_stats_query {
@@ -312,6 +455,9 @@ struct stats_proto_tcp {
 
         uint32_t rcv_wnd;
         uint32_t rcv_nxt;
+
+        uint32_t migrations;
+        uint32_t mig_retrans; /* retransmits since last migration */
 };
 
 /* Contains the individual flow statistics */
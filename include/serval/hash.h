@@ -1,5 +1,6 @@
 #if defined(__KERNEL__) && defined(__linux__)
 #include <linux/hash.h>
+#include <linux/jhash.h>
 
 static inline unsigned int
 full_bitstring_hash(const void *bits_in, unsigned int num_bits)
@@ -26,4 +27,5 @@ full_bitstring_hash(const void *bits_in, unsigned int num_bits)
 
 #else
 #include <common/hash.h>
+#include <common/jhash.h>
 #endif
@@ -106,11 +106,31 @@ struct packet_ops;
 #define net_xmit_eval(e)	((e) == NET_XMIT_CN ? 0 : (e))
 #define net_xmit_errno(e)	((e) != NET_XMIT_CN ? -ENOBUFS : 0)
 
+struct dev_fq;
+
 struct netdev_queue {
 	struct net_device	*dev;
 	struct sk_buff_head	q;
+	unsigned long		state;
 };
 
+#define __QUEUE_STATE_XOFF	0
+
+static inline void netif_tx_stop_queue(struct netdev_queue *dev_queue)
+{
+	__sync_fetch_and_or(&dev_queue->state, 1UL << __QUEUE_STATE_XOFF);
+}
+
+static inline void netif_tx_start_queue(struct netdev_queue *dev_queue)
+{
+	__sync_fetch_and_and(&dev_queue->state, ~(1UL << __QUEUE_STATE_XOFF));
+}
+
+static inline int netif_tx_queue_stopped(const struct netdev_queue *dev_queue)
+{
+	return (ACCESS_ONCE(dev_queue->state) >> __QUEUE_STATE_XOFF) & 1;
+}
+
 struct net_device {        
 	int                     ifindex;
         char                    name[IFNAMSIZ];
@@ -183,6 +203,10 @@ struct net_device {
 #define NETIF_F_ONE_FOR_ALL	(NETIF_F_GSO_SOFTWARE | NETIF_F_GSO_ROBUST | \
 				 NETIF_F_SG | NETIF_F_HIGHDMA |		\
 				 NETIF_F_FRAGLIST)
+	/* Largest super-segment handed to the device, and
+	   segmented in software before transmission */
+	unsigned int		gso_max_size;
+#define GSO_MAX_SIZE		65536
 	/* device index hash chain */
 	struct hlist_node	index_hlist;
 	struct list_head	dev_list;
@@ -200,6 +224,15 @@ struct net_device {
         int should_exit;
         pthread_t thr;
         struct packet_ops *pack_ops;
+        struct dev_tx_ring *tx_ring; /* Packets queued for transmission */
+        int txfd[2]; /* Transmit doorbell */
+        unsigned int rx_batch; /* Max packets read per wakeup */
+        unsigned int rx_ring;  /* Preallocated receive buffers */
+        unsigned int netem_delay; /* Emulated delay of sent packets (ms) */
+        unsigned int netem_loss;  /* Emulated loss (1/100 percent) */
+        struct sk_buff_head netem_q; /* Delayed packets, in due order */
+        struct dev_fq *fq; /* Fair queue scheduler, if enabled */
+        struct sk_buff_head gro_list; /* Received packets held for merging */
         /* Here follows private data */
 };
 
@@ -242,6 +275,12 @@ static inline int dev_hard_header(struct sk_buff *skb, struct net_device *dev,
 	return -ETH_HLEN;
 }
 
+static inline int net_gso_ok(int features, int gso_type)
+{
+	int feature = gso_type << NETIF_F_GSO_SHIFT;
+	return (features & feature) == feature;
+}
+
 void ether_setup(struct net_device *dev);
 struct net_device *alloc_netdev(int sizeof_priv, const char *name,
 				void (*setup)(struct net_device *));
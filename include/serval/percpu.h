@@ -0,0 +1,87 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*- */
+#ifndef _PERCPU_H_
+#define _PERCPU_H_
+
+#include <serval/platform.h>
+
+#if defined(OS_LINUX_KERNEL)
+#include <linux/version.h>
+#include <linux/percpu.h>
+
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(3,18,0))
+/* Older kernels cannot allocate per-CPU memory atomically, and
+   alloc_percpu() may sleep. Callers that allocate in atomic context
+   must check HAVE_ALLOC_PERCPU_GFP and do without. */
+#define alloc_percpu_gfp(type, gfp) alloc_percpu(type)
+#else
+#define HAVE_ALLOC_PERCPU_GFP 1
+#endif
+
+#endif /* OS_LINUX_KERNEL */
+
+#if defined(OS_USER)
+#include <stddef.h>
+
+/*
+  User-level emulation of per-CPU data.
+
+  There is a copy of each per-CPU object for every configured CPU, up
+  to NR_CPUS, each on its own cache line(s). Every thread is bound to one copy when it first
+  accesses per-CPU data. Since several threads may share a copy,
+  updates must still be atomic, but threads rarely contend on the
+  same cache line.
+*/
+#define NR_CPUS 16
+#define PERCPU_CACHE_BYTES 64
+#define PERCPU_STRIDE(size)                                             \
+        (((size) + PERCPU_CACHE_BYTES - 1) & ~(PERCPU_CACHE_BYTES - 1))
+
+#define __percpu
+#define HAVE_ALLOC_PERCPU_GFP 1
+
+extern __thread int percpu_thread_cpu;
+extern int percpu_nr_cpus;
+
+int percpu_thread_bind(void);
+int percpu_init_cpus(void);
+
+static inline int percpu_possible_cpus(void)
+{
+        int n = percpu_nr_cpus;
+
+        if (unlikely(n == 0))
+                n = percpu_init_cpus();
+
+        return n;
+}
+
+#define nr_cpu_ids percpu_possible_cpus()
+
+#define for_each_possible_cpu(cpu)                      \
+        for ((cpu) = 0; (cpu) < nr_cpu_ids; (cpu)++)
+
+static inline int smp_processor_id(void)
+{
+        int cpu = percpu_thread_cpu;
+
+        if (unlikely(cpu < 0))
+                cpu = percpu_thread_bind();
+
+        return cpu;
+}
+
+void *__alloc_percpu(size_t size, size_t align);
+void free_percpu(void *ptr);
+
+#define alloc_percpu(type)                                      \
+        ((type *)__alloc_percpu(sizeof(type), __alignof__(type)))
+#define alloc_percpu_gfp(type, gfp) alloc_percpu(type)
+
+#define per_cpu_ptr(ptr, cpu)                                           \
+        ((typeof(ptr))((char *)(ptr) +                                  \
+                       (cpu) * PERCPU_STRIDE(sizeof(*(ptr)))))
+#define this_cpu_ptr(ptr) per_cpu_ptr(ptr, smp_processor_id())
+
+#endif /* OS_USER */
+
+#endif /* _PERCPU_H_ */
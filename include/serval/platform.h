@@ -72,7 +72,9 @@ typedef unsigned char gfp_t;
 #define EXPORT_SYMBOL(x)
 #define EXPORT_SYMBOL_GPL(x)
 
-#define smp_wmb()
+#define smp_mb() __sync_synchronize()
+#define smp_rmb() __sync_synchronize()
+#define smp_wmb() __sync_synchronize()
 
 #define prefetch(x) x
 #define __read_mostly
@@ -323,6 +325,17 @@ static inline uint32_t __div64_32(uint64_t *n, uint32_t base)
 
 #endif /* BITS_PER_LONG */
 
+static inline uint64_t div64_u64(uint64_t dividend, uint64_t divisor)
+{
+	return dividend / divisor;
+}
+
+/* Find last (most significant) bit set, 1-based, zero if none */
+static inline int fls64(uint64_t x)
+{
+	return x ? 64 - __builtin_clzll(x) : 0;
+}
+
 /**
  * ns_to_timespec - Convert nanoseconds to timespec
  * @nsec:	the nanoseconds value to be converted
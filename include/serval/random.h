@@ -0,0 +1,67 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*- */
+#ifndef _SERVAL_RANDOM_H_
+#define _SERVAL_RANDOM_H_
+
+#include <serval/platform.h>
+
+/*
+  Fast, non-cryptographic pseudo random numbers for the data path
+  (e.g., load balancing decisions). Use get_random_bytes() for
+  nonces, sequence numbers and anything else that must be hard to
+  guess.
+*/
+#if defined(OS_LINUX_KERNEL)
+#include <linux/version.h>
+#include <linux/random.h>
+
+static inline uint32_t serval_random_u32(void)
+{
+        /* Uses per-CPU state */
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(3,8,0))
+        return random32();
+#else
+        return prandom_u32();
+#endif
+}
+
+#endif /* OS_LINUX_KERNEL */
+
+#if defined(OS_USER)
+#include <stdint.h>
+#include <time.h>
+
+/*
+  xorshift64* with per-thread state, so that threads never contend
+  on a lock or a shared cache line as they do with random().
+*/
+static __thread uint64_t serval_random_state;
+
+static inline uint32_t serval_random_u32(void)
+{
+        uint64_t x = serval_random_state;
+
+        if (unlikely(x == 0)) {
+                struct timespec ts;
+
+                /* Seed with the time and the address of the
+                 * thread-local state, which differs between
+                 * threads. */
+                clock_gettime(CLOCK_MONOTONIC, &ts);
+                x = ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec) ^
+                        ((uint64_t)(uintptr_t)&serval_random_state << 16);
+
+                if (x == 0)
+                        x = 0x9e3779b97f4a7c15ULL;
+        }
+
+        x ^= x >> 12;
+        x ^= x << 25;
+        x ^= x >> 27;
+        serval_random_state = x;
+
+        return (uint32_t)((x * 0x2545f4914f6cdd1dULL) >> 32);
+}
+
+#endif /* OS_USER */
+
+#endif /* _SERVAL_RANDOM_H_ */
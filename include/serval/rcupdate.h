@@ -0,0 +1,172 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*- */
+#ifndef _RCUPDATE_H_
+#define _RCUPDATE_H_
+
+#include <serval/platform.h>
+
+#if defined(OS_LINUX_KERNEL)
+#include <linux/rcupdate.h>
+#include <linux/rculist.h>
+#include <linux/rculist_nulls.h>
+#endif /* OS_LINUX_KERNEL */
+
+#if defined(OS_USER)
+#include <serval/list.h>
+
+/*
+  User-level emulation of the kernel's RCU API.
+
+  Read-side critical sections only write to a per-thread reader
+  record, so readers on different threads never share a written cache
+  line. Grace periods are detected by epoch counting: a writer bumps
+  the global epoch and waits for all readers that entered their
+  critical section in an earlier epoch. Callbacks queued with
+  call_rcu() are run by a reclaimer thread once a grace period has
+  elapsed.
+
+  synchronize_rcu() must not be called from within a read-side
+  critical section.
+ */
+struct rcu_reader {
+        unsigned long ctr; /* Epoch at entry, zero when quiescent */
+        unsigned int nesting;
+        struct list_head lh;
+} __attribute__((aligned(64)));
+
+struct rcu_head {
+        struct rcu_head *next;
+        void (*func)(struct rcu_head *head);
+};
+
+extern unsigned long rcu_gp_ctr;
+extern __thread struct rcu_reader *rcu_reader_self;
+
+struct rcu_reader *rcu_register_thread(void);
+
+static inline void rcu_read_lock(void)
+{
+        struct rcu_reader *r = rcu_reader_self;
+
+        if (unlikely(!r))
+                r = rcu_register_thread();
+
+        if (r->nesting++ == 0) {
+                ACCESS_ONCE(r->ctr) = ACCESS_ONCE(rcu_gp_ctr);
+                __sync_synchronize();
+        }
+}
+
+static inline void rcu_read_unlock(void)
+{
+        struct rcu_reader *r = rcu_reader_self;
+
+        if (--r->nesting == 0) {
+                __sync_synchronize();
+                ACCESS_ONCE(r->ctr) = 0;
+        }
+}
+
+#define rcu_read_lock_bh() rcu_read_lock()
+#define rcu_read_unlock_bh() rcu_read_unlock()
+
+#define rcu_dereference(p) ({                           \
+                        typeof(p) _________p1 = ACCESS_ONCE(p); \
+                        (_________p1);                  \
+                })
+#define rcu_dereference_bh(p) rcu_dereference(p)
+#define rcu_dereference_protected(p, c) (p)
+
+#define rcu_assign_pointer(p, v) ({                     \
+                        __sync_synchronize();           \
+                        ACCESS_ONCE(p) = (v);           \
+                })
+
+#define RCU_INIT_POINTER(p, v) ((p) = (v))
+#define __rcu
+
+void synchronize_rcu(void);
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head));
+void rcu_barrier(void);
+
+/* RCU-safe list operations (from linux/rculist.h) */
+static inline void __list_add_rcu(struct list_head *new,
+                                  struct list_head *prev,
+                                  struct list_head *next)
+{
+	new->next = next;
+	new->prev = prev;
+	rcu_assign_pointer(prev->next, new);
+	next->prev = new;
+}
+
+static inline void list_add_rcu(struct list_head *new,
+                                struct list_head *head)
+{
+	__list_add_rcu(new, head, head->next);
+}
+
+static inline void list_add_tail_rcu(struct list_head *new,
+                                     struct list_head *head)
+{
+	__list_add_rcu(new, head->prev, head);
+}
+
+static inline void list_del_rcu(struct list_head *entry)
+{
+	__list_del(entry->prev, entry->next);
+	entry->prev = NULL;
+}
+
+static inline void list_replace_rcu(struct list_head *old,
+                                    struct list_head *new)
+{
+	new->next = old->next;
+	new->prev = old->prev;
+	rcu_assign_pointer(new->prev->next, new);
+	new->next->prev = new;
+	old->prev = NULL;
+}
+
+#define list_entry_rcu(ptr, type, member) \
+	container_of(rcu_dereference(ptr), type, member)
+
+#define list_for_each_entry_rcu(pos, head, member)                      \
+	for (pos = list_entry_rcu((head)->next, typeof(*pos), member);  \
+	     &pos->member != (head);                                    \
+	     pos = list_entry_rcu(pos->member.next, typeof(*pos), member))
+
+/* RCU-safe 'nulls' list operations (from linux/rculist_nulls.h) */
+static inline void hlist_nulls_del_init_rcu(struct hlist_nulls_node *n)
+{
+	if (!hlist_nulls_unhashed(n)) {
+		__hlist_nulls_del(n);
+		n->pprev = NULL;
+	}
+}
+
+static inline void hlist_nulls_del_rcu(struct hlist_nulls_node *n)
+{
+	__hlist_nulls_del(n);
+}
+
+static inline void hlist_nulls_add_head_rcu(struct hlist_nulls_node *n,
+					    struct hlist_nulls_head *h)
+{
+	struct hlist_nulls_node *first = h->first;
+
+	n->next = first;
+	n->pprev = &h->first;
+	rcu_assign_pointer(h->first, n);
+	if (!is_a_nulls(first))
+		first->pprev = &n->next;
+}
+
+#define hlist_nulls_for_each_entry_rcu(tpos, pos, head, member)		\
+	for (pos = rcu_dereference((head)->first);			\
+	     (!is_a_nulls(pos)) &&					\
+		({ tpos = hlist_nulls_entry(pos, typeof(*tpos), member); 1; }); \
+	     pos = rcu_dereference(pos->next))
+
+#endif /* OS_USER */
+
+#endif /* _RCUPDATE_H_ */
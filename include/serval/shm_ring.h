@@ -0,0 +1,235 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * Shared memory channel between libserval and the user-level stack.
+ *
+ * A channel is a single mapping holding a header and two single
+ * producer, single consumer byte rings: the TX ring carries data
+ * from the application to the stack, and the RX ring data from the
+ * stack to the application. Each side sleeps on an eventfd doorbell
+ * that the other side rings only if the sleeper has announced
+ * itself in the header, so that a busy channel moves data without
+ * any system calls.
+ *
+ * This header is shared by the stack (C) and libserval (C++).
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License as
+ *	published by the Free Software Foundation; either version 2 of
+ *	the License, or (at your option) any later version.
+ */
+#ifndef _SERVAL_SHM_RING_H
+#define _SERVAL_SHM_RING_H
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#define SHM_CHAN_MAGIC 0x5356534d
+#define SHM_CACHELINE 64
+#define SHM_RING_SIZE_MIN (1 << 14)
+#define SHM_RING_SIZE_MAX (1 << 22)
+#define SHM_RING_SIZE_DEFAULT (1 << 18)
+
+/* Channel flags, set by the stack */
+enum {
+        SHM_F_RX_EOF = 1 << 0, /* No more data after what is in the RX ring */
+        SHM_F_HAVE_DATA = 1 << 1, /* HaveData sent, until a ClearData */
+};
+
+/* Positions are free-running and wrap at 2^32. The ring size is a
+   power of two, so a position maps to the data at (pos & (size - 1)). */
+struct shm_ring {
+        /* Advanced by the producer */
+        uint32_t tail __attribute__((aligned(SHM_CACHELINE)));
+        /* Advanced by the consumer */
+        uint32_t head __attribute__((aligned(SHM_CACHELINE)));
+        unsigned char data[0] __attribute__((aligned(SHM_CACHELINE)));
+};
+
+struct shm_chan {
+        uint32_t magic;
+        uint32_t ring_size;
+        uint32_t tx_offset;
+        uint32_t rx_offset;
+        uint32_t flags;
+        uint32_t error; /* Socket error, as a positive errno */
+        /* Set by the application before it sleeps on the notify
+           doorbell, waiting for RX data or TX space */
+        uint32_t app_wait __attribute__((aligned(SHM_CACHELINE)));
+        /* Set by the stack before it sleeps on the kick doorbell,
+           waiting for TX data or, if the RX ring filled up, RX
+           space */
+        uint32_t tx_wait __attribute__((aligned(SHM_CACHELINE)));
+        uint32_t rx_wait;
+};
+
+#define SHM_ALIGN(x) (((x) + SHM_CACHELINE - 1) & ~(SHM_CACHELINE - 1))
+
+static inline uint32_t shm_chan_len(uint32_t ring_size)
+{
+        return SHM_ALIGN(sizeof(struct shm_chan)) +
+                2 * (sizeof(struct shm_ring) + ring_size);
+}
+
+/* Offsets of the rings, for a side that must not trust those in the
+   header */
+static inline uint32_t shm_chan_tx_offset(void)
+{
+        return SHM_ALIGN(sizeof(struct shm_chan));
+}
+
+static inline uint32_t shm_chan_rx_offset(uint32_t ring_size)
+{
+        return shm_chan_tx_offset() + sizeof(struct shm_ring) + ring_size;
+}
+
+/* Lay out a zeroed mapping of shm_chan_len() bytes */
+static inline void shm_chan_init(struct shm_chan *chan, uint32_t ring_size)
+{
+        chan->magic = SHM_CHAN_MAGIC;
+        chan->ring_size = ring_size;
+        chan->tx_offset = shm_chan_tx_offset();
+        chan->rx_offset = shm_chan_rx_offset(ring_size);
+}
+
+/* Check the layout of a mapping of len bytes, as found by the side
+   that did not create it */
+static inline int shm_chan_valid(const struct shm_chan *chan, uint32_t len)
+{
+        uint32_t size = chan->ring_size;
+
+        return chan->magic == SHM_CHAN_MAGIC &&
+                size >= SHM_RING_SIZE_MIN && size <= SHM_RING_SIZE_MAX &&
+                (size & (size - 1)) == 0 &&
+                len >= shm_chan_len(size) &&
+                chan->tx_offset == shm_chan_tx_offset() &&
+                chan->rx_offset == shm_chan_rx_offset(size);
+}
+
+static inline struct shm_ring *shm_chan_tx(struct shm_chan *chan)
+{
+        return (struct shm_ring *)((unsigned char *)chan + chan->tx_offset);
+}
+
+static inline struct shm_ring *shm_chan_rx(struct shm_chan *chan)
+{
+        return (struct shm_ring *)((unsigned char *)chan + chan->rx_offset);
+}
+
+/* Bytes the consumer may read */
+static inline uint32_t shm_ring_readable(const struct shm_ring *r)
+{
+        return __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) - r->head;
+}
+
+/* Bytes the producer may write */
+static inline uint32_t shm_ring_writable(const struct shm_ring *r,
+                                         uint32_t size)
+{
+        return size - (r->tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE));
+}
+
+/* Describe len bytes of the ring from position pos with at most two
+   iovecs, as the bytes may wrap. Returns the number of iovecs. */
+static inline int shm_ring_iov(struct shm_ring *r, uint32_t size,
+                               uint32_t pos, uint32_t len,
+                               struct iovec *iov)
+{
+        uint32_t off = pos & (size - 1);
+        uint32_t first = size - off;
+
+        iov[0].iov_base = r->data + off;
+
+        if (len <= first) {
+                iov[0].iov_len = len;
+                return 1;
+        }
+        iov[0].iov_len = first;
+        iov[1].iov_base = r->data;
+        iov[1].iov_len = len - first;
+
+        return 2;
+}
+
+/* Make len written bytes visible to the consumer */
+static inline void shm_ring_produce(struct shm_ring *r, uint32_t len)
+{
+        __atomic_store_n(&r->tail, r->tail + len, __ATOMIC_RELEASE);
+}
+
+/* Give len read bytes back to the producer */
+static inline void shm_ring_consume(struct shm_ring *r, uint32_t len)
+{
+        __atomic_store_n(&r->head, r->head + len, __ATOMIC_RELEASE);
+}
+
+/* Copy up to len bytes into the ring. Returns the bytes copied. */
+static inline uint32_t shm_ring_write(struct shm_ring *r, uint32_t size,
+                                      const void *buf, uint32_t len)
+{
+        uint32_t avail = shm_ring_writable(r, size);
+        struct iovec iov[2];
+        int i, n;
+
+        if (len > avail)
+                len = avail;
+
+        n = shm_ring_iov(r, size, r->tail, len, iov);
+
+        for (i = 0; i < n; i++) {
+                memcpy(iov[i].iov_base, buf, iov[i].iov_len);
+                buf = (const unsigned char *)buf + iov[i].iov_len;
+        }
+        shm_ring_produce(r, len);
+
+        return len;
+}
+
+/* Copy up to len bytes out of the ring, consuming them unless peek
+   is set. Returns the bytes copied. */
+static inline uint32_t shm_ring_read(struct shm_ring *r, uint32_t size,
+                                     void *buf, uint32_t len, int peek)
+{
+        uint32_t avail = shm_ring_readable(r);
+        struct iovec iov[2];
+        int i, n;
+
+        if (len > avail)
+                len = avail;
+
+        n = shm_ring_iov(r, size, r->head, len, iov);
+
+        for (i = 0; i < n; i++) {
+                memcpy(buf, iov[i].iov_base, iov[i].iov_len);
+                buf = (unsigned char *)buf + iov[i].iov_len;
+        }
+
+        if (!peek)
+                shm_ring_consume(r, len);
+
+        return len;
+}
+
+/* Announce that the caller is about to sleep on its doorbell. The
+   caller must check its ring again before sleeping, as the other
+   side may have missed the flag. */
+static inline void shm_chan_wait(uint32_t *flag)
+{
+        __atomic_store_n(flag, 1, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/* After making progress on a ring, check if the other side sleeps
+   waiting for it. Returns 1 if the caller should ring the
+   doorbell. */
+static inline int shm_chan_waiting(uint32_t *flag)
+{
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+        if (!__atomic_load_n(flag, __ATOMIC_RELAXED))
+                return 0;
+
+        return __atomic_exchange_n(flag, 0, __ATOMIC_SEQ_CST);
+}
+
+#endif /* _SERVAL_SHM_RING_H */
@@ -293,7 +293,8 @@ struct sk_buff {
 	};
         __u32                   priority;
 
-        __u8                    cloned:1, ip_summed:2, nohdr:1, pkt_type:3;
+        __u8                    cloned:1, ip_summed:2, nohdr:1, pkt_type:3,
+                                chunk:1; /* Allocated with its data */
 	__be16	         	protocol;
         union {
 		__u32	mark; /* Used for packet type in Serval */
@@ -318,12 +319,6 @@ static inline int skb_is_nonlinear(const struct sk_buff *skb)
 	return skb->data_len;
 }
 
-static inline int skb_linearize(struct sk_buff *skb)
-{
-        /* We always have linear SKBs */
-        return 0;
-}
-
 static inline unsigned int skb_headlen(const struct sk_buff *skb)
 {
 	return skb->len - skb->data_len;
@@ -339,6 +334,22 @@ static inline unsigned char *skb_tail_pointer(const struct sk_buff *skb)
 	return skb->head + skb->tail;
 }
 
+static inline int skb_has_frag_list(const struct sk_buff *skb)
+{
+	return skb_shinfo(skb)->frag_list != NULL;
+}
+
+#define skb_walk_frags(skb, iter)                                       \
+        for (iter = skb_shinfo(skb)->frag_list; iter; iter = iter->next)
+
+int __skb_linearize(struct sk_buff *skb);
+
+static inline int skb_linearize(struct sk_buff *skb)
+{
+        /* Only SKBs with a frag_list are non-linear */
+	return skb_is_nonlinear(skb) ? __skb_linearize(skb) : 0;
+}
+
 static inline void skb_reset_tail_pointer(struct sk_buff *skb)
 {
 	skb->tail = skb->data - skb->head;
@@ -469,6 +480,11 @@ enum {
 	SKB_GSO_FCOE = 1 << 5,
 };
 
+static inline int skb_is_gso(const struct sk_buff *skb)
+{
+	return skb_shinfo(skb)->gso_size;
+}
+
 extern struct sk_buff *skb_clone(struct sk_buff *skb,
 				 gfp_t priority);
 extern struct sk_buff *skb_copy(const struct sk_buff *skb,
@@ -599,6 +615,8 @@ static inline int skb_dst_is_noref(const struct sk_buff *skb)
 void __kfree_skb(struct sk_buff *skb);
 void kfree_skb(struct sk_buff *);
 struct sk_buff *__alloc_skb(unsigned int size, int fclone, int node);
+/* Print sk_buff pool statistics */
+int skb_pool_print(char *buf, size_t buflen);
 
 static inline struct sk_buff *alloc_skb(unsigned int size,
 					gfp_t priority)
@@ -1201,6 +1219,8 @@ static inline int skb_csum_unnecessary(const struct sk_buff *skb)
 	return skb->ip_summed & CHECKSUM_UNNECESSARY;
 }
 
+int skb_to_iovec(const struct sk_buff *skb, struct iovec *iov, int iovlen);
+
 int skb_copy_datagram_iovec(const struct sk_buff *from,
                             int offset, struct iovec *to,
                             int size);
@@ -1244,4 +1264,9 @@ static inline struct tcphdr *tcp_hdr(const struct sk_buff *skb)
 
 #endif /* OS_USER */
 
+/* Copy of an skb with private, writable headers that shares the
+   payload with the original. See skbuff.c. */
+struct sk_buff *skb_share_copy(struct sk_buff *skb, unsigned int hdr_len,
+                               unsigned int headroom, gfp_t gfp_mask);
+
 #endif /* _SKBUFF_H_ */
@@ -55,7 +55,9 @@ out:
 #include <serval/atomic.h>
 #include <serval/lock.h>
 #include <serval/dst.h>
+#include <serval/netdevice.h>
 #include <serval/list.h>
+#include <serval/rcupdate.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <stdlib.h>
@@ -112,7 +114,10 @@ typedef struct {
 } socket_lock_t;
 
 struct sock_common {
-        struct hlist_node	skc_node;
+        union {
+                struct hlist_node	skc_node;
+                struct hlist_nulls_node skc_nulls_node;
+        };
 	atomic_t		skc_refcnt;
         int     	        skc_tx_queue_mapping;
         union  {
@@ -130,6 +135,7 @@ struct sock_common {
 struct sock {
         struct sock_common      __sk_common;
 #define sk_node __sk_common.skc_node
+#define sk_nulls_node __sk_common.skc_nulls_node
 #define sk_refcnt __sk_common.skc_refcnt
 #define sk_tx_queue_mapping __sk_common.skc_tx_queue_mapping
 #define sk_copy_start __sk_common.skc_hash
@@ -180,6 +186,7 @@ struct sock {
         int                     sk_err,
                                 sk_err_soft;
         __u32                   sk_priority;
+        __u32                   sk_pacing_rate; /* bytes per sec, 0 if none */
 	long			sk_rcvtimeo;
 	long			sk_sndtimeo;
 	struct timer_list	sk_timer;
@@ -193,6 +200,10 @@ struct sock {
 	void (*sk_error_report)(struct sock *sk);
   	int (*sk_backlog_rcv)(struct sock *sk,
                               struct sk_buff *skb);  
+        /* Lockless flow table lookups may still be looking at the
+         * socket after it is freed, so the memory is released only
+         * after a grace period. */
+        struct rcu_head         sk_rcu;
 };
 
 struct kiocb;
@@ -328,6 +339,11 @@ static inline void sk_node_init(struct hlist_node *node)
         node->pprev = NULL;
 }
 
+static inline void sk_nulls_node_init(struct hlist_nulls_node *node)
+{
+        node->pprev = NULL;
+}
+
 static inline void sk_tx_queue_set(struct sock *sk, int tx_queue)
 {
 	sk->sk_tx_queue_mapping = tx_queue;
@@ -694,7 +710,8 @@ struct dst_entry *sk_dst_check(struct sock *sk, u32 cookie);
 
 static inline int sk_can_gso(const struct sock *sk)
 {
-	return 0; //net_gso_ok(sk->sk_route_caps, sk->sk_gso_type);
+	return sk->sk_gso_type &&
+		net_gso_ok(sk->sk_route_caps, sk->sk_gso_type);
 }
 
 extern void sk_setup_caps(struct sock *sk, struct dst_entry *dst);
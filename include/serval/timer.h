@@ -15,7 +15,7 @@
 struct timer_list {	
 	struct list_head entry;
         unsigned long expires;
-	struct timespec expires_abs; /* For internal use, do not touch */
+	void *base; /* For internal use, do not touch */
 	void (*function)(unsigned long);
 	unsigned long data;
 };
@@ -24,7 +24,7 @@ struct timer_list {
 		.entry = { NULL, NULL },                        \
 		.function = (_function),			\
 		.expires = (_expires),				\
-                .expires_abs = { 0, 0 },                        \
+                .base = NULL,                                   \
 		.data = (_data),				\
 	}
 
@@ -30,7 +30,8 @@ struct __wait_queue {
 	struct task_struct *private_data;
 	wait_queue_func_t func;
 	pthread_mutex_t lock;
-        int pipefd[2];
+        /* Notifier of the sleeping thread, see init_wait() */
+        int fd;
 	struct list_head thread_list;
 };
 
@@ -53,7 +54,7 @@ typedef struct __wait_queue_head wait_queue_head_t;
 	.private_data	= tsk,						\
 	.func		= default_wake_function,			\
         .lock           = PTHREAD_MUTEX_INITIALIZER,                    \
-        .pipefd	        = { -1, -1 },                                   \
+        .fd	        = -1,                                           \
         .thread_list	= { &(name).thread_list, &(name).thread_list } }
 
 #define DECLARE_WAITQUEUE(name, tsk)					\
@@ -6,6 +6,7 @@ LOCAL_HDR_FILES := \
 	$(LOCAL_PATH)/../../include/common/debug.h \
 	$(LOCAL_PATH)/../../include/common/hash.h \
 	$(LOCAL_PATH)/../../include/common/hashtable.h \
+	$(LOCAL_PATH)/../../include/common/jhash.h \
 	$(LOCAL_PATH)/../../include/common/heap.h \
 	$(LOCAL_PATH)/../../include/common/list.h \
 	$(LOCAL_PATH)/../../include/common/platform.h \
@@ -19,7 +19,11 @@
 // DEALINGS IN THE WORK.
 
 #include <serval/platform.h>
+#include <poll.h>
 #include "cli.hh"
+#include "select.hh"
+#include "send.hh"
+#include "lock.hh"
 
 uint32_t Cli::_UNIX_ID = 0;
 
@@ -35,7 +39,8 @@ char Cli::strbuf[STRBUFLEN] = { 0 };
 Cli::Cli(int fd)
     : _unix_id(_UNIX_ID), _fd(fd), _rcv_lowat(0), _snd_lowat(0),
       _state(State::CLOSED), _err(0), _connect_in_progress(false), 
-      _interrupted(false), _flags(0)
+      _interrupted(false), _flags(0), _snd_bufsize(0), _rcv_bufsize(0),
+      _shm(NULL), _shm_tried(false)
 {
     _err = 0;
     bzero(&_cli, sizeof(_cli));
@@ -43,13 +48,15 @@ Cli::Cli(int fd)
     lerr("cli construct");
     INIT_LIST_HEAD(&lh);
     pthread_mutex_init(&_lock, NULL);
+    init_rsp();
 }
 
 Cli::Cli(const Cli &c)
     : _unix_id(c._unix_id), _fd(c._fd), _rcv_lowat(c._rcv_lowat), 
       _snd_lowat(c._snd_lowat), _state(c._state), 
       _err(c._err), _connect_in_progress(c._connect_in_progress),
-      _interrupted(false), _flags(c._flags)
+      _interrupted(false), _flags(c._flags), _snd_bufsize(c._snd_bufsize),
+      _rcv_bufsize(c._rcv_bufsize), _shm(NULL), _shm_tried(false)
 {
     _cli.sun_family = c._cli.sun_family;
     // sun_path is never anonymous; we always bind
@@ -57,12 +64,18 @@ Cli::Cli(const Cli &c)
     _proto.v = SERVAL_PROTO_UDP;
     INIT_LIST_HEAD(&lh);
     pthread_mutex_init(&_lock, NULL);
+    init_rsp();
 }
 
 Cli::~Cli()
 {
+    delete _shm;
+    close_fds();
     unlink(_cli.sun_path);
     pthread_mutex_destroy(&_lock);
+    pthread_mutex_destroy(&_req_lock);
+    pthread_mutex_destroy(&_rsp_lock);
+    pthread_cond_destroy(&_rsp_cond);
 }
 
 int Cli::bind(sv_err_t &err)
@@ -89,6 +102,7 @@ int Cli::bind(sv_err_t &err)
 bool Cli::is_blocking() const
 {
     int flags;
+
     if ((flags = fcntl (_fd, F_GETFL, 0)) < 0) {
         fprintf(stderr, "F_GETFL error on fd %d (%s)", _fd,
                 strerror(errno));
@@ -135,6 +149,397 @@ int Cli::set_sync()
     return 0;
 }
 
+// Count the calls in progress on the socket. Sends and receives
+// leave the socket in the application's blocking mode, as SockIO
+// completes messages on a non-blocking socket
+void Cli::begin_call()
+{
+    pthread_mutex_lock(&_rsp_lock);
+    _calls++;
+    pthread_mutex_unlock(&_rsp_lock);
+}
+
+void Cli::end_call()
+{
+    pthread_mutex_lock(&_rsp_lock);
+
+    if (--_calls == 0)
+        pthread_cond_broadcast(&_rsp_cond);
+
+    pthread_mutex_unlock(&_rsp_lock);
+}
+
+// Wait until no call is in progress on the socket, e.g., before the
+// client is deleted on close
+void Cli::wait_unused()
+{
+    pthread_mutex_lock(&_rsp_lock);
+
+    while (_calls > 0)
+        pthread_cond_wait(&_rsp_cond, &_rsp_lock);
+
+    pthread_mutex_unlock(&_rsp_lock);
+}
+
+//
+// Response demultiplexing
+//
+
+void Cli::init_rsp()
+{
+    pthread_mutex_init(&_req_lock, NULL);
+    pthread_mutex_init(&_rsp_lock, NULL);
+    pthread_cond_init(&_rsp_cond, NULL);
+    INIT_LIST_HEAD(&_rsp_slots);
+    _reading = false;
+    _next_id = 0;
+    _have_data = false;
+    _async_err = 0;
+    _sends = 0;
+    _calls = 0;
+
+    for (int i = 0; i < SHM_NUM_FDS; i++)
+        _fds[i] = -1;
+}
+
+void Cli::close_fds()
+{
+    for (int i = 0; i < SHM_NUM_FDS; i++) {
+        if (_fds[i] != -1)
+            ::close(_fds[i]);
+        _fds[i] = -1;
+    }
+}
+
+// Write a request. If slot is given, the request gets an id, and
+// the slot is registered so that whoever reads the response header
+// can hand it over. The slot must then be passed to read_rsp_hdr().
+// On a non-blocking socket that is full, the request fails with
+// EWOULDBLOCK unless wait is set, as for acknowledgements that the
+// stack relies on.
+int Cli::write_req(Message &m, RspSlot *slot, sv_err_t &err, bool wait)
+{
+    SimpleLock slock(_req_lock);
+
+    if (slot) {
+        pthread_mutex_lock(&_rsp_lock);
+
+        if (++_next_id == 0)
+            _next_id = 1;
+
+        slot->id = _next_id;
+        slot->ready = false;
+        list_add_tail(&slot->lh, &_rsp_slots);
+        pthread_mutex_unlock(&_rsp_lock);
+        m.set_id(slot->id);
+    } else {
+        m.set_id(0);
+    }
+
+    int ret;
+
+    while ((ret = m.write_to_stream_soc(_fd, err)) < 0 && wait &&
+           err == EWOULDBLOCK && SockIO::wait(_fd, POLLOUT) == 0)
+        ;
+
+    if (ret < 0) {
+        if (slot) {
+            pthread_mutex_lock(&_rsp_lock);
+            list_del(&slot->lh);
+            pthread_mutex_unlock(&_rsp_lock);
+        }
+        return -1;
+    }
+    return 0;
+}
+
+// Read one message header. Messages that are not responses are dealt
+// with here: HaveData is noted, and so are errors of sends without
+// response. Descriptors that come with a response are kept for
+// take_fds(). Returns 1 if m holds the header of a response, whose
+// payload is still to be read, and 0 if the message was consumed.
+int Cli::read_msg_hdr(Message &m, sv_err_t &err)
+{
+    int fds[SHM_NUM_FDS] = { -1, -1, -1 };
+    unsigned char buf[16];
+    int ret = SockIO::readn(_fd, buf, m.hdr_len(), fds, SHM_NUM_FDS);
+
+    if (fds[0] != -1) {
+        // Nobody took the ones of an earlier response
+        close_fds();
+        memcpy(_fds, fds, sizeof(_fds));
+    }
+
+    if (ret <= 0) {
+        err = ret == 0 ? ECONNRESET : errno;
+        return -1;
+    }
+
+    if (m.read_hdr(buf) < 0) {
+        err = ESVINTERNAL;
+        return -1;
+    }
+
+    if (m.id() != 0)
+        return 1;
+
+    if (m.type() == Message::HAVE_DATA) {
+        m.print("hdata:app:rx");
+        pthread_mutex_lock(&_rsp_lock);
+        _have_data = true;
+        pthread_mutex_unlock(&_rsp_lock);
+        return skip_pld(m, err);
+    }
+
+    if (m.type() == Message::SEND_RSP) {
+        SendRsp srsp;
+
+        if (srsp.read_pld_from_stream_soc(_fd, err) < 0)
+            return -1;
+
+        srsp.print("send:app:rx:async");
+        pthread_mutex_lock(&_rsp_lock);
+
+        if (srsp.err().v && !_async_err.v)
+            _async_err = srsp.err();
+
+        pthread_mutex_unlock(&_rsp_lock);
+        return 0;
+    }
+
+    lerr("unexpected message %s", m.type_cstr());
+    return skip_pld(m, err);
+}
+
+int Cli::skip_pld(const Message &m, sv_err_t &err)
+{
+    if (m.pld_len_v() == 0)
+        return 0;
+
+    unsigned char *buf = new unsigned char[m.pld_len_v()];
+    int n = SockIO::readn(_fd, buf, m.pld_len_v());
+    delete[] buf;
+
+    if (n <= 0) {
+        err = n == 0 ? ECONNRESET : errno;
+        return -1;
+    }
+    return 0;
+}
+
+// Wait for the response header of a request. One waiting thread at a
+// time reads headers; a header that belongs to another request is
+// handed over to the thread that waits for it, which then reads the
+// payload straight into its own buffers. The caller owns the read
+// side on return, and must call release_rsp() after reading the
+// payload.
+int Cli::read_rsp_hdr(RspSlot &slot, Message &m, sv_err_t &err)
+{
+    pthread_mutex_lock(&_rsp_lock);
+
+    while (!slot.ready) {
+        if (_reading) {
+            pthread_cond_wait(&_rsp_cond, &_rsp_lock);
+            continue;
+        }
+        _reading = true;
+        pthread_mutex_unlock(&_rsp_lock);
+
+        int ret;
+
+        while ((ret = read_msg_hdr(m, err)) == 0)
+            ;
+
+        pthread_mutex_lock(&_rsp_lock);
+
+        if (ret < 0) {
+            list_del(&slot.lh);
+            _reading = false;
+            pthread_cond_broadcast(&_rsp_cond);
+            pthread_mutex_unlock(&_rsp_lock);
+            return -1;
+        }
+
+        if (m.id() == slot.id) {
+            list_del(&slot.lh);
+            pthread_mutex_unlock(&_rsp_lock);
+            return 0;
+        }
+
+        RspSlot *s = NULL;
+        struct list_head *pos;
+
+        list_for_each(pos, &_rsp_slots) {
+            if (((RspSlot *)pos)->id == m.id()) {
+                s = (RspSlot *)pos;
+                break;
+            }
+        }
+
+        if (s) {
+            // The read side passes to the owner of the response
+            s->hdr = m;
+            s->ready = true;
+            pthread_cond_broadcast(&_rsp_cond);
+            continue;
+        }
+
+        // Nobody waits for it anymore, e.g., after an interrupted call
+        pthread_mutex_unlock(&_rsp_lock);
+        lerr("dropping response %s id=%u", m.type_cstr(), m.id());
+        ret = skip_pld(m, err);
+        pthread_mutex_lock(&_rsp_lock);
+        _reading = false;
+        pthread_cond_broadcast(&_rsp_cond);
+
+        if (ret < 0) {
+            list_del(&slot.lh);
+            pthread_mutex_unlock(&_rsp_lock);
+            return -1;
+        }
+    }
+
+    m = slot.hdr;
+    list_del(&slot.lh);
+    pthread_mutex_unlock(&_rsp_lock);
+    return 0;
+}
+
+void Cli::release_rsp()
+{
+    pthread_mutex_lock(&_rsp_lock);
+    _reading = false;
+    pthread_cond_broadcast(&_rsp_cond);
+    pthread_mutex_unlock(&_rsp_lock);
+}
+
+// Consume messages that nobody asked for, i.e., errors of sends
+// without response, without blocking. Stops at HaveData, which is
+// left for select() to see.
+int Cli::drain(sv_err_t &err)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&_rsp_lock);
+
+    // Peeking costs a system call, so only look every few sends;
+    // errors are reported late anyway
+    if (++_sends < DRAIN_INTERVAL) {
+        pthread_mutex_unlock(&_rsp_lock);
+        return 0;
+    }
+    _sends = 0;
+
+    if (_reading || !list_empty(&_rsp_slots)) {
+        // Whoever reads will see them
+        pthread_mutex_unlock(&_rsp_lock);
+        return 0;
+    }
+    _reading = true;
+    pthread_mutex_unlock(&_rsp_lock);
+
+    while (1) {
+        unsigned char buf[16];
+        Message m;
+        int n = recv(_fd, buf, m.hdr_len(), MSG_PEEK | MSG_DONTWAIT);
+
+        if (n < (int)m.hdr_len() || m.read_hdr(buf) < 0 ||
+            m.type() == Message::HAVE_DATA || m.id() != 0)
+            break;
+
+        if (read_msg_hdr(m, err) < 0) {
+            ret = -1;
+            break;
+        }
+    }
+
+    release_rsp();
+    return ret;
+}
+
+// Check, without blocking, whether the stack said there is data to
+// read
+enum Cli::data_val Cli::poll_have_data(sv_err_t &err)
+{
+    enum data_val ret;
+
+    pthread_mutex_lock(&_rsp_lock);
+
+    if (_have_data) {
+        pthread_mutex_unlock(&_rsp_lock);
+        return DATA_READY;
+    }
+
+    if (_reading || !list_empty(&_rsp_slots)) {
+        pthread_mutex_unlock(&_rsp_lock);
+        return DATA_WOULD_BLOCK;
+    }
+    _reading = true;
+    pthread_mutex_unlock(&_rsp_lock);
+
+    while ((ret = has_unread_data(Message().hdr_len(), err)) == DATA_READY) {
+        Message m;
+        int r = read_msg_hdr(m, err);
+
+        if (r < 0) {
+            ret = DATA_ERROR;
+            break;
+        } else if (r == 1) {
+            lerr("dropping response %s id=%u", m.type_cstr(), m.id());
+
+            if (skip_pld(m, err) < 0) {
+                ret = DATA_ERROR;
+                break;
+            }
+        }
+
+        pthread_mutex_lock(&_rsp_lock);
+        bool have_data = _have_data;
+        pthread_mutex_unlock(&_rsp_lock);
+
+        if (have_data)
+            break;
+    }
+
+    release_rsp();
+    return ret;
+}
+
+// Returns whether HaveData was seen since the last call, in which
+// case the caller owes the stack a ClearData
+bool Cli::take_have_data()
+{
+    pthread_mutex_lock(&_rsp_lock);
+    bool ret = _have_data;
+    _have_data = false;
+    pthread_mutex_unlock(&_rsp_lock);
+    return ret;
+}
+
+// Take the descriptors that came with the response just read, if
+// any. Returns their number.
+int Cli::take_fds(int *fds)
+{
+    int n = 0;
+
+    for (int i = 0; i < SHM_NUM_FDS; i++) {
+        fds[i] = _fds[i];
+        if (_fds[i] != -1)
+            n++;
+        _fds[i] = -1;
+    }
+    return n;
+}
+
+sv_err_t Cli::take_async_err()
+{
+    pthread_mutex_lock(&_rsp_lock);
+    sv_err_t ret = _async_err;
+    _async_err = 0;
+    pthread_mutex_unlock(&_rsp_lock);
+    return ret;
+}
+
 int Cli::get_bufsize(bool rcv, int &len, sv_err_t &err)
 {
     int l;
@@ -174,7 +579,9 @@ int Cli::set_bufsize(bool rcv, int len, sv_err_t &err)
         return -1;
     }
     info("setsockopt: %s -> %d", (rcv ? "SO_RCVBUF" : "SO_SNDBUF"), len);
-    return 0;
+
+    // The kernel adjusts the size, so cache what it reports
+    return get_bufsize(rcv, rcv ? _rcv_bufsize : _snd_bufsize, err);
 }
 
 int Cli::set_unreadable(sv_err_t &err)
@@ -303,7 +710,7 @@ enum Cli::data_val Cli::has_unread_data(int atleast, sv_err_t &err) const
     if (n == 0)
         return DATA_CLOSED;
 
-    if (n >= atleast)
+    if (n < atleast)
         return DATA_NOT_ENOUGH;
 
     return DATA_READY;
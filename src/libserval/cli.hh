@@ -18,6 +18,7 @@
 #include <pthread.h>
 
 #include "state.hh"
+#include "shm.hh"
 #include "log.hh"
 
 #include <libserval/serval.h>
@@ -38,6 +39,8 @@ public:
     bool is_blocking() const;
     bool is_non_blocking() const;
     bool is_connecting() const       { return _connect_in_progress; }
+    ShmChannel *shm() const          { return _shm; }
+    bool shm_tried() const           { return _shm_tried; }
     enum data_val {
         DATA_ERROR = -1,
         DATA_CLOSED,
@@ -61,10 +64,33 @@ public:
     void set_err(sv_err_t err)       { _err = err; }
     void set_connect_in_progress(bool v)   { _connect_in_progress = v; }
     void set_interrupted(bool val = true) { _interrupted = val; }
+    void set_shm(ShmChannel *shm)    { _shm = shm; _shm_tried = true; }
     int set_sync();
   
     int save_flags();
     int restore_flags();
+    void begin_call();
+    void end_call();
+    void wait_unused();
+
+    // Several requests may be in flight on the IPC socket. A request
+    // that wants a response registers a slot, in which the thread
+    // that reads the response header hands it over.
+    struct RspSlot {
+        struct list_head lh; // Must be first member
+        uint16_t id;
+        bool ready;
+        Message hdr;
+    };
+    int write_req(Message &m, RspSlot *slot, sv_err_t &err,
+                  bool wait = false);
+    int read_rsp_hdr(RspSlot &slot, Message &m, sv_err_t &err);
+    void release_rsp();
+    int drain(sv_err_t &err);
+    enum data_val poll_have_data(sv_err_t &err);
+    bool take_have_data();
+    sv_err_t take_async_err();
+    int take_fds(int *fds);
   
     int set_unreadable(sv_err_t &err);
     int set_unwritable(sv_err_t &err);
@@ -72,6 +98,7 @@ public:
     int reset_writability(sv_err_t &err);
 
     int get_bufsize(bool rcv, int &len, sv_err_t &err);
+    int bufsize(bool rcv) const { return rcv ? _rcv_bufsize : _snd_bufsize; }
     int set_bufsize(bool rcv, int len, sv_err_t &err);
 #define STRBUFLEN 100
     static char strbuf[STRBUFLEN];
@@ -91,9 +118,33 @@ private:
     bool _connect_in_progress;
     bool _interrupted;
     int _flags;
+    int _snd_bufsize;             // as last set, see set_bufsize()
+    int _rcv_bufsize;
+    ShmChannel *_shm;             // shared memory data path, if any
+    bool _shm_tried;
     struct sockaddr_un _cli;      // local socket
     pthread_mutex_t _lock;
     static uint32_t _UNIX_ID;
+
+    int read_msg_hdr(Message &m, sv_err_t &err);
+    int skip_pld(const Message &m, sv_err_t &err);
+    void init_rsp();
+    void close_fds();
+
+    // Response demultiplexing; the read side of the IPC socket is
+    // owned by one thread at a time
+    pthread_mutex_t _req_lock;    // serializes writes of requests
+    mutable pthread_mutex_t _rsp_lock;
+    pthread_cond_t _rsp_cond;
+    struct list_head _rsp_slots;
+    bool _reading;
+    uint16_t _next_id;
+    bool _have_data;              // got HaveData, owe a ClearData
+    int _fds[SHM_NUM_FDS];        // passed with the last response
+    sv_err_t _async_err;          // from a send without response
+    unsigned int _sends;          // since errors were last looked for
+    unsigned int _calls;          // in progress, see begin_call()
+    static const unsigned int DRAIN_INTERVAL = 8;
 };
 
 #endif /* CLI_HH */
@@ -53,6 +53,8 @@ const char *Message::msg_str[] = {
     "MSG_RECVMESG", 
     "MSG_CLEAR_DATA", 
     "MSG_HAVE_DATA",
+    "MSG_SHM_REQ",
+    "MSG_SHM_RSP",
     NULL
 };
 
@@ -67,14 +69,15 @@ int Message::read_hdr(const unsigned char *buf)
     p += serial_read(&_version, p);
     p += serial_read(&_type, p);
     p += serial_read(&_pld_len_v, p);
+    p += serial_read(&_id, p);
 
     if (check_hdr() < 0) {
         lerr("check header failed");
         return -1;
     }
 
-    info("Message::read (hdr) version = %d, type = %d, len = %d",
-         _version, _type, _pld_len_v);
+    info("Message::read (hdr) version = %d, type = %d, len = %d, id = %u",
+         _version, _type, _pld_len_v, _id);
     return p - buf;
 }
 
@@ -86,8 +89,9 @@ int Message::write_hdr(unsigned char *buf) const
     p += serial_write(_version, p);
     p += serial_write(_type, p);
     p += serial_write(_pld_len_v, p);
-    info("Message::write (hdr) version = %d, type = %d, len = %d",
-         _version, _type, _pld_len_v);
+    p += serial_write(_id, p);
+    info("Message::write (hdr) version = %d, type = %d, len = %d, id = %u",
+         _version, _type, _pld_len_v, _id);
     return p - buf;
 }
 
@@ -131,11 +135,15 @@ int Message::write_to_stream_soc(int soc, sv_err_t &err) /*  const */
     int n = 0;
     if ((n = SockIO::writev(soc, vec, iovcnt)) <= 0) {
         //(n += SockIO::writen(soc, nonserial_buf(), nonserial_pld_len())) < 0)) {
+        // Nothing was written if the socket was full, so the message
+        // can simply be retried
+        bool full = n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+
         delete[] buf;
         delete[] vec;
         if (n == 0)  // EOF
             return 0;
-        err = ESVINTERNAL;
+        err = full ? EWOULDBLOCK : ESVINTERNAL;
         return -1;
     }
     delete[] buf;
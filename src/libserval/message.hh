@@ -30,15 +30,21 @@ public:
         CLOSE_RSP,
         RECVMESG, 
         CLEAR_DATA, 
-        HAVE_DATA
+        HAVE_DATA,
+        SHM_REQ,
+        SHM_RSP
     } Type;
     Message()
-        : _version(version), _type(UNKNOWN), _pld_len_v(0) { }
+        : _version(version), _type(UNKNOWN), _pld_len_v(0), _id(0) { }
     Message(Type type)
-        : _version(version), _type(type), _pld_len_v(0) { }
+        : _version(version), _type(type), _pld_len_v(0), _id(0) { }
     virtual ~Message() {}
 
     unsigned char type() const             { return _type; }
+    // Id of a request, echoed in its response; 0 if no response is
+    // expected or the message is not a response
+    uint16_t id() const                     { return _id; }
+    void set_id(uint16_t id)                { _id = id; }
     uint16_t hdr_len() const;
     uint16_t total_len() const;
     uint16_t pld_len() const;
@@ -69,7 +75,7 @@ public:
     void print(const char *label) const;
     const char *type_cstr() const;
 
-    static const unsigned char version = 1;
+    static const unsigned char version = 2;
 
 protected:
     
@@ -82,6 +88,7 @@ protected:
     unsigned char _version;
     unsigned char _type;
     uint16_t _pld_len_v;
+    uint16_t _id;
 private:
     static const char *msg_str[];
 };
@@ -133,7 +140,8 @@ inline uint16_t Message::hdr_len() const
 {
     return sizeof(_version) +
         sizeof(_type) +
-        sizeof(_pld_len_v);
+        sizeof(_pld_len_v) +
+        sizeof(_id);
 }
 
 #ifdef ENABLE_DEBUG
@@ -143,8 +151,8 @@ inline void Message::print(const char *label) const
     Message::print(const char *) const
 #endif
 {
-    info("%s: version = %d, type = %s, len = %d",
-         label, _version, type_cstr(), _pld_len_v);
+    info("%s: version = %d, type = %s, len = %d, id = %u",
+         label, _version, type_cstr(), _pld_len_v, _id);
 }
 
 inline const char *Message::type_cstr() const
@@ -0,0 +1,424 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+// Copyright (c) 2010 The Trustees of Princeton University (Trustees)
+
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and/or hardware specification (the “Work”) to deal
+// in the Work without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Work, and to permit persons to whom the Work is
+// furnished to do so, subject to the following conditions: The above
+// copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Work.
+
+// THE WORK IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+// THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+// OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+// ARISING FROM, OUT OF OR IN CONNECTION WITH THE WORK OR THE USE OR OTHER
+// DEALINGS IN THE WORK.
+
+#include "shm.hh"
+#include "socket.hh"
+#include "lock.hh"
+#include "log.hh"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+//
+// ShmReq
+//
+
+ShmReq::ShmReq(uint32_t ring_size)
+        :Message(SHM_REQ), _ring_size(ring_size)
+{
+    set_pld_len_v(serial_pld_len());
+}
+
+int ShmReq::check_type() const
+{
+    return _type == SHM_REQ;
+}
+
+uint16_t ShmReq::serial_pld_len() const
+{
+    return sizeof(_ring_size);
+}
+
+int ShmReq::write_serial_payload(unsigned char *buf) const
+{
+    unsigned char *p = buf;
+    p += serial_write(_ring_size, p);
+    return p - buf;
+}
+
+int ShmReq::read_serial_payload(const unsigned char *buf)
+{
+    const unsigned char *p = buf;
+    p += serial_read(&_ring_size, p);
+    return p - buf;
+}
+
+void ShmReq::print(const char *label) const
+{
+    Message::print(label);
+    info("%s: ring_size=%u", label, _ring_size);
+}
+
+//
+// ShmRsp
+//
+
+ShmRsp::ShmRsp()
+        :Message(SHM_RSP), _ring_size(0), _err(0)
+{
+    set_pld_len_v(serial_pld_len());
+}
+
+int ShmRsp::check_type() const
+{
+    return _type == SHM_RSP;
+}
+
+uint16_t ShmRsp::serial_pld_len() const
+{
+    return sizeof(_ring_size) + sizeof(_err);
+}
+
+int ShmRsp::write_serial_payload(unsigned char *buf) const
+{
+    unsigned char *p = buf;
+    p += serial_write(_ring_size, p);
+    p += serial_write(_err, p);
+    return p - buf;
+}
+
+int ShmRsp::read_serial_payload(const unsigned char *buf)
+{
+    const unsigned char *p = buf;
+    p += serial_read(&_ring_size, p);
+    p += serial_read(&_err, p);
+    return p - buf;
+}
+
+void ShmRsp::print(const char *label) const
+{
+    Message::print(label);
+    info("%s: ring_size=%u err=%s", label, _ring_size,
+         _err.v ? _strerror_sv(_err.v) : "none");
+}
+
+//
+// ShmChannel
+//
+
+ShmChannel::ShmChannel(int soc, struct shm_chan *chan, size_t len,
+                       int kick_fd, int notify_fd)
+    : _soc(soc), _chan(chan), _len(len), _size(chan->ring_size),
+      _kick_fd(kick_fd), _notify_fd(notify_fd), _polling(false),
+      _wakeups(0)
+{
+    pthread_mutex_init(&_tx_lock, NULL);
+    pthread_mutex_init(&_rx_lock, NULL);
+    pthread_mutex_init(&_wait_lock, NULL);
+    pthread_cond_init(&_wait_cond, NULL);
+}
+
+ShmChannel::~ShmChannel()
+{
+    munmap(_chan, _len);
+    ::close(_kick_fd);
+    ::close(_notify_fd);
+    pthread_mutex_destroy(&_tx_lock);
+    pthread_mutex_destroy(&_rx_lock);
+    pthread_mutex_destroy(&_wait_lock);
+    pthread_cond_destroy(&_wait_cond);
+}
+
+// Ask the stack for a shared memory channel for the socket, which
+// must be connected. The caller must hold the socket lock and have
+// the socket in synchronous mode. Returns NULL if the stack has no
+// channel to give, in which case data keeps going through messages.
+ShmChannel *ShmChannel::attach(Cli &cli, uint32_t ring_size, sv_err_t &err)
+{
+    int fds[SHM_NUM_FDS] = { -1, -1, -1 };
+    struct shm_chan *chan;
+    struct stat st;
+    ShmReq sreq(ring_size);
+    ShmRsp srsp;
+    Cli::RspSlot slot;
+    Message m;
+    int ret;
+
+    if (cli.write_req(sreq, &slot, err) < 0)
+        return NULL;
+
+    sreq.print("shm:app:tx");
+
+    if (cli.read_rsp_hdr(slot, m, err) < 0)
+        return NULL;
+
+    // The descriptors came along with the header
+    cli.take_fds(fds);
+
+    if (m.type() != Message::SHM_RSP) {
+        lerr("expected ShmRsp message got %s", m.type_cstr());
+        cli.release_rsp();
+        err = ESVINTERNAL;
+        goto fail;
+    }
+
+    ret = srsp.read_pld_from_stream_soc(cli.fd(), err);
+    cli.release_rsp();
+
+    if (ret <= 0) {
+        if (ret == 0)
+            err = ECONNRESET;
+        goto fail;
+    }
+
+    srsp.print("shm:app:rx");
+
+    if (srsp.err().v) {
+        info("stack gave no shm channel: %s", _strerror_sv(srsp.err().v));
+        err = srsp.err();
+        goto fail;
+    }
+
+    if (fds[0] == -1 || fds[1] == -1 || fds[2] == -1 ||
+        fstat(fds[0], &st) == -1) {
+        lerr("bad shm channel file descriptors");
+        err = ESVINTERNAL;
+        goto fail;
+    }
+
+    chan = (struct shm_chan *)mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+                                   MAP_SHARED, fds[0], 0);
+
+    if (chan == MAP_FAILED) {
+        lerr("could not map shm channel: %s", strerror(errno));
+        err = errno;
+        goto fail;
+    }
+
+    if (!shm_chan_valid(chan, st.st_size)) {
+        lerr("bad shm channel layout");
+        munmap(chan, st.st_size);
+        err = ESVINTERNAL;
+        goto fail;
+    }
+
+    // The mapping keeps the memory around
+    ::close(fds[0]);
+
+    info("attached shm channel with rings of %u bytes", chan->ring_size);
+
+    return new ShmChannel(cli.fd(), chan, st.st_size, fds[1], fds[2]);
+fail:
+    for (int i = 0; i < SHM_NUM_FDS; i++)
+        if (fds[i] != -1)
+            ::close(fds[i]);
+    return NULL;
+}
+
+// Only consulted before sleeping, so that the fast path needs no
+// system calls
+bool ShmChannel::is_non_blocking(int flags) const
+{
+    if (flags & MSG_DONTWAIT)
+        return true;
+
+    return (fcntl(_soc, F_GETFL, 0) & O_NONBLOCK) != 0;
+}
+
+// Ring the doorbell of the stack, if it waits for it
+void ShmChannel::kick(uint32_t *flag)
+{
+    uint64_t val = 1;
+
+    if (shm_chan_waiting(flag) &&
+        ::write(_kick_fd, &val, sizeof(val)) == -1)
+        lerr("could not kick stack: %s", strerror(errno));
+}
+
+// Tell the stack that we are about to sleep. Returns the number of
+// wakeups so far, to pass to wait().
+uint32_t ShmChannel::arm()
+{
+    pthread_mutex_lock(&_wait_lock);
+    uint32_t armed = _wakeups;
+    pthread_mutex_unlock(&_wait_lock);
+
+    shm_chan_wait(&_chan->app_wait);
+    return armed;
+}
+
+// Sleep until the stack rings our doorbell. The caller must have
+// armed and checked its ring again. As the stack closes the IPC
+// socket when it goes away, watch that too.
+//
+// A sender and a receiver may sleep at once on the one doorbell, and
+// whoever resets it would eat the wakeup of the other. So one thread
+// polls the doorbell and wakes up the others, and a thread that armed
+// before the last wakeup returns at once, as it may have been its.
+int ShmChannel::wait(uint32_t armed, sv_err_t &err)
+{
+    struct pollfd fds[2];
+    uint64_t val;
+    int ret = 0;
+
+    pthread_mutex_lock(&_wait_lock);
+
+    if (_wakeups != armed) {
+        pthread_mutex_unlock(&_wait_lock);
+        return 0;
+    }
+
+    if (_polling) {
+        while (_wakeups == armed)
+            pthread_cond_wait(&_wait_cond, &_wait_lock);
+        pthread_mutex_unlock(&_wait_lock);
+        return 0;
+    }
+
+    _polling = true;
+    pthread_mutex_unlock(&_wait_lock);
+
+    fds[0].fd = _notify_fd;
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+    fds[1].fd = _soc;
+    fds[1].events = POLLRDHUP;
+    fds[1].revents = 0;
+
+    if (poll(fds, 2, -1) == -1) {
+        err = errno;
+        ret = -1;
+    } else if (fds[1].revents & (POLLRDHUP | POLLHUP | POLLERR)) {
+        err = ECONNRESET;
+        ret = -1;
+    } else if (fds[0].revents & POLLIN) {
+        ::read(_notify_fd, &val, sizeof(val));
+    }
+
+    pthread_mutex_lock(&_wait_lock);
+    _polling = false;
+    _wakeups++;
+    pthread_cond_broadcast(&_wait_cond);
+    pthread_mutex_unlock(&_wait_lock);
+
+    return ret;
+}
+
+// The stack also tells us about data in the RX ring with HaveData,
+// for select(), and only once until we clear it. Returns whether we
+// owe it a ClearData, which we do once we have drained the ring.
+bool ShmChannel::owes_clear_data() const
+{
+    uint32_t state = __atomic_load_n(&_chan->flags, __ATOMIC_ACQUIRE);
+
+    return (state & SHM_F_HAVE_DATA) &&
+        shm_ring_readable(shm_chan_rx(_chan)) == 0;
+}
+
+ssize_t ShmChannel::send(const void *buffer, size_t length, int flags,
+                         sv_err_t &err)
+{
+    struct shm_ring *r = shm_chan_tx(_chan);
+    const unsigned char *p = (const unsigned char *)buffer;
+    size_t total = 0;
+
+    SimpleLock slock(_tx_lock);
+
+    while (total < length) {
+        uint32_t error = __atomic_load_n(&_chan->error, __ATOMIC_ACQUIRE);
+        uint32_t n;
+
+        if (error) {
+            err = error;
+            break;
+        }
+
+        n = shm_ring_write(r, _size, p + total, length - total);
+
+        if (n > 0) {
+            total += n;
+            kick(&_chan->tx_wait);
+            continue;
+        }
+
+        // The ring is full
+        if (is_non_blocking(flags)) {
+            err = EWOULDBLOCK;
+            break;
+        }
+
+        uint32_t armed = arm();
+
+        if (shm_ring_writable(r, _size) > 0 || _chan->error)
+            continue;
+
+        if (wait(armed, err) < 0)
+            break;
+    }
+
+    if (total == 0 && length > 0)
+        return SERVAL_SOCKET_ERROR;
+
+    return total;
+}
+
+ssize_t ShmChannel::recv(void *buffer, size_t length, int flags,
+                         sv_err_t &err)
+{
+    struct shm_ring *r = shm_chan_rx(_chan);
+    bool peek = (flags & MSG_PEEK) != 0;
+
+    SimpleLock slock(_rx_lock);
+
+    while (1) {
+        // Look at the state before the ring, as the stack fills the
+        // ring before it flags the end of the stream or an error
+        uint32_t state = __atomic_load_n(&_chan->flags, __ATOMIC_ACQUIRE);
+        uint32_t error = __atomic_load_n(&_chan->error, __ATOMIC_ACQUIRE);
+        uint32_t n;
+
+        n = shm_ring_read(r, _size, buffer, length, peek);
+
+        if (n > 0) {
+            if (!peek)
+                kick(&_chan->rx_wait);
+            return n;
+        }
+
+        if (state & SHM_F_RX_EOF)
+            return 0;
+
+        if (error) {
+            err = error;
+            return SERVAL_SOCKET_ERROR;
+        }
+
+        if (is_non_blocking(flags)) {
+            err = EWOULDBLOCK;
+            return SERVAL_SOCKET_ERROR;
+        }
+
+        uint32_t armed = arm();
+
+        if (shm_ring_readable(r) > 0 || (_chan->flags & SHM_F_RX_EOF) ||
+            _chan->error)
+            continue;
+
+        if (wait(armed, err) < 0)
+            return SERVAL_SOCKET_ERROR;
+    }
+}
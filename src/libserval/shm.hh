@@ -0,0 +1,87 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+#ifndef SHM_HH
+#define SHM_HH
+
+#include <pthread.h>
+#include <serval/shm_ring.h>
+#include "message.hh"
+
+// Descriptors that come with a ShmRsp: the channel memory, and the
+// kick and notify eventfds
+#define SHM_NUM_FDS 3
+
+class Cli;
+
+class ShmReq : public Message {
+  public:
+    ShmReq(uint32_t ring_size = 0);
+
+    uint32_t ring_size() const { return _ring_size; }
+
+    int check_type() const;
+    int write_serial_payload(unsigned char *buf) const;
+    int read_serial_payload(const unsigned char *buf);
+    uint16_t serial_pld_len() const;
+    void print(const char *label) const;
+
+  private:
+    uint32_t _ring_size;
+};
+
+class ShmRsp : public Message {
+  public:
+    ShmRsp();
+
+    uint32_t ring_size() const { return _ring_size; }
+    sv_err_t err() const       { return _err; }
+
+    int check_type() const;
+    int write_serial_payload(unsigned char *buf) const;
+    int read_serial_payload(const unsigned char *buf);
+    uint16_t serial_pld_len() const;
+    void print(const char *label) const;
+
+  private:
+    uint32_t _ring_size;
+    sv_err_t _err;
+};
+
+// Shared memory data path of a connected socket. Data moves through
+// a pair of rings shared with the stack rather than through send and
+// receive messages, and the send and receive sides have their own
+// locks, so that a socket can send while another thread blocks
+// receiving.
+class ShmChannel {
+  public:
+    static ShmChannel *attach(Cli &cli, uint32_t ring_size, sv_err_t &err);
+    ~ShmChannel();
+
+    ssize_t send(const void *buffer, size_t length, int flags,
+                 sv_err_t &err);
+    ssize_t recv(void *buffer, size_t length, int flags, sv_err_t &err);
+    bool owes_clear_data() const;
+
+  private:
+    ShmChannel(int soc, struct shm_chan *chan, size_t len,
+               int kick_fd, int notify_fd);
+
+    bool is_non_blocking(int flags) const;
+    void kick(uint32_t *flag);
+    uint32_t arm();
+    int wait(uint32_t armed, sv_err_t &err);
+
+    int _soc;
+    struct shm_chan *_chan;
+    size_t _len;
+    uint32_t _size;
+    int _kick_fd;
+    int _notify_fd;
+    pthread_mutex_t _tx_lock;
+    pthread_mutex_t _rx_lock;
+    pthread_mutex_t _wait_lock;   // for sleeping on the notify doorbell
+    pthread_cond_t _wait_cond;
+    bool _polling;
+    uint32_t _wakeups;
+};
+
+#endif /* SHM_HH */
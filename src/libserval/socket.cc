@@ -31,6 +31,7 @@ const char *SVSockLib::SERVAL_UDP_PATH = "/tmp/serval-udp.sock";
 #endif
 Cli SVSockLib::null_cli;
 uint32_t SVSockLib::_serval_id = 0;
+bool SVSockLib::_use_shm = false;
 
 //
 // SVSockLib
@@ -58,6 +59,14 @@ SVSockLib::SVSockLib(int serval_id)
         }
     } else
         _serval_id = serval_id;
+
+    // Move data of connected TCP sockets through shared memory rings
+    // instead of messages; the value is the ring size in bytes, or 1
+    // for the default
+    char *shm_str = getenv("SERVAL_SHM");
+    if (shm_str && strtoul(shm_str, NULL, 10) > 0)
+        _use_shm = true;
+
     bzero(&_udp_srv, sizeof(_udp_srv));
     _udp_srv.sun_family = AF_LOCAL;
     sprintf(_udp_srv.sun_path, SERVAL_UDP_PATH, _serval_id);
@@ -67,6 +76,8 @@ SVSockLib::SVSockLib(int serval_id)
     sprintf(_tcp_srv.sun_path, SERVAL_TCP_PATH, _serval_id);
 
     INIT_LIST_HEAD(&_cli_list);
+    memset(_cli_table, 0, sizeof(_cli_table));
+    pthread_mutex_init(&_cli_lock, NULL);
 }
 
 SVSockLib::~SVSockLib()
@@ -80,6 +91,11 @@ SVSockLib::~SVSockLib()
 
         delete_cli(c, err);
     }
+
+    for (int i = 0; i < CLI_CHUNKS; i++)
+        delete[] _cli_table[i];
+
+    pthread_mutex_destroy(&_cli_lock);
 }
 
 int SVSockLib::socket_sv(int domain, int type, int proto, sv_err_t &err)
@@ -123,6 +139,17 @@ Cli &SVSockLib::get_cli(int soc, sv_err_t &err)
 {
     struct list_head *pos;
 
+    if (soc >= 0 && soc < CLI_CHUNKS * CLI_CHUNK_SIZE) {
+        Cli **chunk = _cli_table[soc >> CLI_CHUNK_SHIFT];
+        Cli *c = chunk ? chunk[soc & (CLI_CHUNK_SIZE - 1)] : NULL;
+
+        if (c)
+            return *c;
+
+        err = EBADF;
+        return null_cli;
+    }
+
     list_for_each(pos, &_cli_list) {
         Cli *c = (Cli *)pos;
         if (c->fd() == soc) {
@@ -134,6 +161,35 @@ Cli &SVSockLib::get_cli(int soc, sv_err_t &err)
     return null_cli;
 }
 
+void SVSockLib::add_cli(Cli *cli)
+{
+    SimpleLock slock(_cli_lock);
+    int soc = cli->fd();
+
+    if (soc >= 0 && soc < CLI_CHUNKS * CLI_CHUNK_SIZE) {
+        Cli **&chunk = _cli_table[soc >> CLI_CHUNK_SHIFT];
+
+        if (!chunk) {
+            Cli **c = new Cli *[CLI_CHUNK_SIZE];
+            memset(c, 0, sizeof(Cli *) * CLI_CHUNK_SIZE);
+            chunk = c;
+        }
+        chunk[soc & (CLI_CHUNK_SIZE - 1)] = cli;
+    }
+    list_add_tail(&cli->lh, &_cli_list);
+}
+
+void SVSockLib::remove_cli(Cli *cli)
+{
+    SimpleLock slock(_cli_lock);
+    int soc = cli->fd();
+
+    if (soc >= 0 && soc < CLI_CHUNKS * CLI_CHUNK_SIZE)
+        _cli_table[soc >> CLI_CHUNK_SHIFT][soc & (CLI_CHUNK_SIZE - 1)] = NULL;
+
+    list_del(&cli->lh);
+}
+
 int SVSockLib::basic_checks(int soc, const struct sockaddr *addr, 
                             socklen_t addr_len, bool check_local,
                             sv_err_t &err)
@@ -703,7 +759,7 @@ int SVSockLib::create_cli(sv_proto_t proto, int &new_soc, sv_err_t &err)
         new_cli->set_bufsize(false, SEND_BUFSIZE_LEN, err) < 0)
         return SERVAL_SOCKET_ERROR;
 
-    list_add_tail(&new_cli->lh, &_cli_list);
+    add_cli(new_cli);
 
     info("create_cli: %s", new_cli->s());
 
@@ -712,22 +768,27 @@ int SVSockLib::create_cli(sv_proto_t proto, int &new_soc, sv_err_t &err)
 
 int SVSockLib::delete_cli(Cli *cli, sv_err_t &err)
 {
+    int ret = 0;
+
+    if (&get_cli(cli->fd(), err) != cli) {
+        err = ESVINTERNAL;
+        return SERVAL_SOCKET_ERROR;
+    }
+
+    // Remove the client before its fd is closed, as the fd may be
+    // reused as soon as it is
+    remove_cli(cli);
+
     if (cli->fd() >= 0)
         if (::close(cli->fd()) < 0) {
             //lerr("error closing fd %d", cli->fd());
             err = ESVINTERNAL;
-            return SERVAL_SOCKET_ERROR;
+            ret = SERVAL_SOCKET_ERROR;
         }
   
-    if (get_cli(cli->fd(), err).is_null()) {
-        err = ESVINTERNAL;
-        return SERVAL_SOCKET_ERROR;
-    }
-  
-    list_del(&cli->lh);
     delete cli;
 
-    return 0;
+    return ret;
 }
 
 int SVSockLib::query_serval_accept1(bool nb, Cli &cli, AcceptRsp &aresp,
@@ -874,29 +935,28 @@ ssize_t SVSockLib::send_sv(int soc, const void *buffer, size_t length, int flags
         return 0;
     }
 
-    int bufsize;
-    if (cli.get_bufsize(false, bufsize, err) < 0)  // false => snd buf
-        return SERVAL_SOCKET_ERROR;
-    
+    ShmChannel *shm = get_shm(cli);
+
+    if (shm)
+        return shm->send(buffer, length, flags, err);
+
+    int bufsize = cli.bufsize(false);  // false => snd buf
+
     if ((int)length > bufsize) {
         lerr("send: buf len (%d) > bufsize (%d)",  length, bufsize);
         err = EMSGSIZE;
         return SERVAL_SOCKET_ERROR;
     }
 
-    SimpleLock slock(cli.get_lock());
-
-    bool nb = false;
-    if (cli.is_non_blocking())
-        nb = true;
-  
-    cli.save_flags();
-    cli.set_sync();
-    if (query_serval_send(nb, buffer, length, flags, cli, err) < 0) {
-        cli.restore_flags();
+    // Sends do not wait for a response, and go ahead of receives
+    // that wait for data. Whether the socket blocks is thus of no
+    // concern to the stack, which saves looking it up.
+    cli.begin_call();
+    if (query_serval_send(false, buffer, length, flags, cli, err) < 0) {
+        cli.end_call();
         return SERVAL_SOCKET_ERROR;
     }
-    cli.restore_flags();
+    cli.end_call();
     return length;
 }
 
@@ -933,29 +993,67 @@ ssize_t SVSockLib::sendto_sv(int soc, const void *buffer, size_t length, int fla
         return 0;
     }
 
-    int bufsize;
-    if (cli.get_bufsize(false, bufsize, err) < 0)  // false => snd buf
-        return SERVAL_SOCKET_ERROR;
-    
+    int bufsize = cli.bufsize(false);  // false => snd buf
+
     if ((int)length > bufsize) {
         lerr("send: buf len (%d) > bufsize (%d)",  length, bufsize);
         err = EMSGSIZE;
         return SERVAL_SOCKET_ERROR;
     }
   
-    SimpleLock slock(cli.get_lock());
-
-    cli.save_flags();
-    cli.set_sync();
+    cli.begin_call();
     if (query_serval_sendto(*remote_service_id, ipaddr, 
                             buffer, length, flags, cli, err) < 0) {
-        cli.restore_flags();
+        cli.end_call();
         return SERVAL_SOCKET_ERROR;
     }
-    cli.restore_flags();
+    cli.end_call();
     return length;
 }
 
+// Read a HaveData that the stack sent and acknowledge it, so that it
+// tells us about new data again
+void SVSockLib::clear_have_data(Cli &cli)
+{
+    sv_err_t err;
+
+    if (cli.poll_have_data(err) != Cli::DATA_READY || !cli.take_have_data())
+        return;
+
+    ClearData cdata;
+
+    if (cli.write_req(cdata, NULL, err, true) < 0)
+        lerr("Error writing ClearData to stream");
+    else
+        cdata.print("cdata:app:tx");
+}
+
+// Return the shared memory channel of a connected TCP socket,
+// asking the stack for one the first time. Sockets that get no
+// channel keep using messages.
+ShmChannel *SVSockLib::get_shm(Cli &cli)
+{
+    if (!_use_shm || cli.shm_tried() ||
+        cli.proto().v != SERVAL_PROTO_TCP || cli.state() != State::BOUND)
+        return cli.shm();
+
+    SimpleLock slock(cli.get_lock());
+
+    if (cli.shm_tried())
+        return cli.shm();
+
+    uint32_t ring_size = strtoul(getenv("SERVAL_SHM"), NULL, 10);
+    sv_err_t err;
+
+    cli.save_flags();
+    cli.set_sync();
+    cli.set_shm(ShmChannel::attach(cli, ring_size > 1 ? ring_size : 0,
+                                   err));
+    cli.restore_flags();
+
+    return cli.shm();
+}
+
 int SVSockLib::check_state_for_send(const Cli &cli, sv_err_t &err) const
 {
     if (cli.state() == State::REQUEST) {
@@ -990,58 +1088,26 @@ int SVSockLib::query_serval_send(bool nb, const void *buffer,
                                  size_t length, int flags,
                                  Cli &cli, sv_err_t &err)
 {
+    // Report errors of earlier sends first
+    if (cli.drain(err) < 0)
+        return SERVAL_SOCKET_ERROR;
+
+    sv_err_t async_err = cli.take_async_err();
+
+    if (async_err.v) {
+        err = async_err;
+        return SERVAL_SOCKET_ERROR;
+    }
+
     SendReq sreq(nb, (unsigned char *)buffer, length, flags);
 
-    if (sreq.write_to_stream_soc(cli.fd(), err) < 0)
+    // No response to wait for; the stack only responds if the send
+    // fails
+    if (cli.write_req(sreq, NULL, err) < 0)
         return SERVAL_SOCKET_ERROR;
     sreq.print("send:app:tx");
-    
-    bool got_havedata_msg = false;
- 
-    Message m;
-    if (m.read_hdr_from_stream_soc(cli.fd(), err) < 0)
-        return SERVAL_SOCKET_ERROR;
-  
-    if (m.type() == Message::HAVE_DATA) {
-        info("Got HaveData before SendRsp; discarding");
-        HaveData hdata;
-        hdata.read_pld_from_stream_soc(cli.fd(), err);
-        hdata.print("hdata:app:rx");
-        got_havedata_msg = true;
-        // read SendRsp
-        m = Message();
-        m.read_hdr_from_stream_soc(cli.fd(), err);
-        if (m.type() != Message::SEND_RSP) {
-            lerr("expected SendRsp message got %d type", 
-                 m.type());
-            err = ESVINTERNAL;
-            return SERVAL_SOCKET_ERROR;
-        }
-    } else if (errno == EAGAIN)
-        info("no data to read; ok to send req");
-  
-    if (m.type() == Message::SEND_RSP) {
-        // Only message payload to read
-        SendRsp srsp;
-        if (srsp.read_pld_from_stream_soc(cli.fd(), err) < 0)
-            return SERVAL_SOCKET_ERROR;
-    
-        srsp.print("send:app:rx");
-        if (srsp.err().v) {
-            err = srsp.err();
-            return SERVAL_SOCKET_ERROR;
-        }
-        info("sent %d bytes through soc %s", length, cli.s());
-    } else
-        lerr("got invalid message, expected SEND_RSP got %s", 
-             m.type_cstr());
-  
-    if (got_havedata_msg) {
-        ClearData cdata;
-        if (cdata.write_to_stream_soc(cli.fd(), err) < 0)
-            return SERVAL_SOCKET_ERROR;
-    }
-  
+
+    info("sent %d bytes through soc %s", length, cli.s());
     return 0;
 }
 
@@ -1051,59 +1117,40 @@ int SVSockLib::query_serval_sendto(const sv_srvid_t& dst_service_id,
                                    Cli &cli, sv_err_t &err)
 {
     SendReq sreq(dst_service_id, ipaddr, (unsigned char *)buffer, length, flags);
+    Cli::RspSlot slot;
 
-    if (sreq.write_to_stream_soc(cli.fd(), err) < 0)
+    if (cli.write_req(sreq, &slot, err) < 0)
         return SERVAL_SOCKET_ERROR;
 
     sreq.print("sendto:app:tx");
 
-    bool got_havedata_msg = false;
-
     Message m;
-    if (m.read_hdr_from_stream_soc(cli.fd(), err) < 0)
-        return SERVAL_SOCKET_ERROR;
-
-    if (m.type() == Message::HAVE_DATA) {
-        info("Got HaveData before SendRsp; discarding");
-        HaveData hdata;
-        hdata.read_pld_from_stream_soc(cli.fd(), err);
-        hdata.print("hdata:app:rx");
-        got_havedata_msg = true;
-        // read SendRsp
-        m = Message();
-        m.read_hdr_from_stream_soc(cli.fd(), err);
-        if (m.type() != Message::SEND_RSP) {
-            lerr("expected SendRsp message got %d type", m.type());
-            err = ESVINTERNAL;
-            return SERVAL_SOCKET_ERROR;
-        }
-    } else if (errno == EAGAIN) {
-        info("no data to read; ok to send req");
-    }
+    if (cli.read_rsp_hdr(slot, m, err) < 0)
+        return SERVAL_SOCKET_ERROR;
+
+    int ret = 0;
 
     if (m.type() == Message::SEND_RSP) {
         // Only message payload to read
         SendRsp srsp;
-        if (srsp.read_pld_from_stream_soc(cli.fd(), err) < 0)
-            return SERVAL_SOCKET_ERROR;
-
-        srsp.print("send:app:rx");
-        if (srsp.err().v) {
+        if (srsp.read_pld_from_stream_soc(cli.fd(), err) < 0) {
+            ret = SERVAL_SOCKET_ERROR;
+        } else if (srsp.err().v) {
+            srsp.print("send:app:rx");
             err = srsp.err();
-            return SERVAL_SOCKET_ERROR;
+            ret = SERVAL_SOCKET_ERROR;
+        } else {
+            srsp.print("send:app:rx");
+            info("sent %d bytes through soc %s", length, cli.s());
         }
-        info("sent %d bytes through soc %s", length, cli.s());
     } else {
         lerr("got invalid message, expected SEND_RSP got %s",m.type_cstr());
+        err = ESVINTERNAL;
+        ret = SERVAL_SOCKET_ERROR;
     }
+    cli.release_rsp();
 
-    if (got_havedata_msg) {
-        ClearData cdata;
-        if (cdata.write_to_stream_soc(cli.fd(), err) < 0)
-            return SERVAL_SOCKET_ERROR;
-    }
-
-    return 0;
+    return ret;
 }
 
 ssize_t SVSockLib::recv_sv(int soc, void *buffer, size_t length, int flags,
@@ -1117,9 +1164,17 @@ ssize_t SVSockLib::recv_sv(int soc, void *buffer, size_t length, int flags,
         err = EINVAL;
         return SERVAL_SOCKET_ERROR;
     }
-  
-    SimpleLock slock(cli.get_lock());
 
+    ShmChannel *shm = get_shm(cli);
+
+    if (shm) {
+        ssize_t ret = shm->recv(buffer, length, flags, err);
+
+        if (shm->owes_clear_data())
+            clear_have_data(cli);
+        return ret;
+    }
+  
     bool nb = false;
     if (cli.is_non_blocking())
         nb = true;
@@ -1128,16 +1183,15 @@ ssize_t SVSockLib::recv_sv(int soc, void *buffer, size_t length, int flags,
 
     sv_srvid_t src_service_id; // ignore this since it's connected 
     uint32_t src_ipaddr;
-    cli.save_flags();
-    cli.set_sync();
+    cli.begin_call();
     if (query_serval_recv(nb, (unsigned char *)buffer, 
                           length, flags, src_service_id, src_ipaddr,
                           cli, err) < 0) {
-        cli.restore_flags();
+        cli.end_call();
         lerr("query_serval_recv returned error '%s'", strerror_sv(err.v));
         return SERVAL_SOCKET_ERROR;
     }
-    cli.restore_flags();
+    cli.end_call();
   
     info("received %zu bytes data", length);
 
@@ -1157,17 +1211,13 @@ ssize_t SVSockLib::recvfrom_sv(int soc, void *buffer, size_t length, int flags,
         return SERVAL_SOCKET_ERROR;
     }
   
-    int bufsize;
-    if (cli.get_bufsize(true, bufsize, err) < 0)  // false => rcv buf
-        return SERVAL_SOCKET_ERROR;
+    int bufsize = cli.bufsize(true);  // true => rcv buf
 
     if (bufsize == 0) {
         lerr("recv buffer size is 0");
         return SERVAL_SOCKET_ERROR;
     }
   
-    SimpleLock slock(cli.get_lock());
-
     bool nb = false;
     if (cli.is_non_blocking())
         nb = true;
@@ -1175,15 +1225,18 @@ ssize_t SVSockLib::recvfrom_sv(int soc, void *buffer, size_t length, int flags,
     sv_srvid_t src_service_id;
     uint32_t src_ipaddr = 0;
   
-    cli.save_flags();
-    cli.set_sync();
+    cli.begin_call();
     if (query_serval_recv(nb, (unsigned char *)buffer, 
                           length, flags, src_service_id, src_ipaddr,
                           cli, err) < 0) {
-        cli.restore_flags();
+        cli.end_call();
         return SERVAL_SOCKET_ERROR;
     }
-    cli.restore_flags();
+    cli.end_call();
+
+    // The caller may not want the source address
+    if (!src_addr || !addr_len)
+        return length;
 
     struct sockaddr_sv *sv_addr = (struct sockaddr_sv *)&src_addr[0];
     sv_addr->sv_family = AF_SERVAL;
@@ -1207,20 +1260,15 @@ int SVSockLib::query_serval_recv(bool nb, unsigned char *buffer, size_t &len,
                                  Cli &cli, sv_err_t &err)
 {
     info("query_serval_recv");
-    bool got_havedata_msg = false;
 
-    //if (cli.proto().v == SERVAL_PROTO_TCP) {
     if (nb) {  // NON-BLOCKING
-        // first check for null HaveData message
-        // this is used to activate select
-
+        // Only ask for data once the stack said there is some, in
+        // a HaveData message. This is also what activates select
         info("non-blocking socket %i, type = %i", cli.fd(), cli.proto().v);
-        HaveData hdata;
-        int size = hdata.total_len();
 
-        switch (cli.has_unread_data(size, err)) {
+        switch (cli.poll_have_data(err)) {
         case Cli::DATA_ERROR:
-            lerr("has_unread_data returned error");
+            lerr("poll_have_data returned error");
             return SERVAL_SOCKET_ERROR;
         case Cli::DATA_WOULD_BLOCK:
         case Cli::DATA_NOT_ENOUGH:
@@ -1233,134 +1281,86 @@ int SVSockLib::query_serval_recv(bool nb, unsigned char *buffer, size_t &len,
         case Cli::DATA_READY:
             break;
         }
-        info("reading hdata in nb mode");
-        hdata.read_from_stream_soc(cli.fd(), err);
-        hdata.print("hdata:app:rx");
-        // we have a message, request for data
-    } else {          // BLOCKING
-        // check if HaveData exists and discard it
-        // This allows select() to wake up without
-        // reading anything from the socket buffers
-        info("recv_sv on blocking socket %i",cli.fd());
-        
-        switch (cli.has_unread_data(1, err)) {
-        case Cli::DATA_ERROR:
-            return -1;
-        case Cli::DATA_WOULD_BLOCK:
-            break;
-        case Cli::DATA_NOT_ENOUGH:
-            break;
-        case Cli::DATA_CLOSED:
-            len = 0;
-            return 0;
-        case Cli::DATA_READY:
-            // This must be HaveData
-            HaveData hdata;
-            //int size = hdata.total_len();
-            int len = hdata.read_from_stream_soc(cli.fd(), err);
-
-            if (len < 0) {
-                lerr("found unexpected msg (want HaveData)");
-                err = ESVINTERNAL;
-                return SERVAL_SOCKET_ERROR;
-            } else {
-                info("Got HaveData Msg len=%d", len);
-                hdata.print("hdata:app:rx");
-                got_havedata_msg = true;
-            }
-            break;
-        }
+        // Never wait in the stack
+        flags |= MSG_DONTWAIT;
     }
 
-    // Now ready to send read request
+    // Now ready to send read request. A blocking request waits in the
+    // stack for data, while other requests, e.g., sends, go ahead.
     info("sending recv req of len %d", len);
     RecvReq rreq(len, flags);
-    if (rreq.write_to_stream_soc(cli.fd(), err) < 0) {
+    Cli::RspSlot slot;
+    if (cli.write_req(rreq, &slot, err) < 0) {
         lerr("Error writing RecvReq to stream");
         return SERVAL_SOCKET_ERROR;
     }
     rreq.print("recv:app:tx");
 
-    // In 3 diff cases, we still reach here
-    // TCP non-blocking, we found a HaveData message,
-    //  and we sent a RecvReq, and waiting for a resp
-    // TCP blocking, we sent a RecvReq, and waiting for a resp
-    // UDP blocking, we simply wait for a RecvRsp
     Message m;
-    if (m.read_hdr_from_stream_soc(cli.fd(), err) < 0) {
+    if (cli.read_rsp_hdr(slot, m, err) < 0) {
         lerr("Cannot read response message from stream");
         return SERVAL_SOCKET_ERROR;
     }
 
     info("read message type=%s", m.type_cstr());
-
-    //if (cli.proto().v == SERVAL_PROTO_TCP && m.type() == Message::HAVE_DATA) {
-    if (m.type() == Message::HAVE_DATA) {
-        info("Got HaveData before RecvRsp; discarding");
-        HaveData hdata;
-        hdata.read_pld_from_stream_soc(cli.fd(), err);
-        hdata.print("hdata:app:rx");
-        got_havedata_msg = true;
-        // read RecvRsp
-        m = Message();
-        m.read_hdr_from_stream_soc(cli.fd(), err);
-        if (m.type() != Message::RECV_RSP) {
-            lerr("expected RecvRsp message got %d type", 
-                 m.type());
-            err = ESVINTERNAL;
-            return SERVAL_SOCKET_ERROR;
-        }
-    }
-
-    // We read RecvRsp header; now send a ClearData message if TCP NON-BLOCKING
-    // OR, if we received a HaveData in blocking mode to wake up 
-    // a select(), to clear the notification
-    //if (cli.proto().v == SERVAL_PROTO_TCP && (nb || got_havedata_msg)) {
-    if (nb || got_havedata_msg) {
-        ClearData cdata;
-        if (cdata.write_to_stream_soc(cli.fd(), err) < 0) {
-            lerr("Error writing ClearData to stream");
-            return SERVAL_SOCKET_ERROR;
-        }
-        cdata.print("cdata:app:tx");
-    }
-
     m.print("recv:app:rx:hdr");
 
-    if (m.pld_len_v()) {
+    int ret = 0;
+
+    if (m.type() != Message::RECV_RSP) {
+        lerr("expected RecvRsp message got %s", m.type_cstr());
+        err = ESVINTERNAL;
+        ret = SERVAL_SOCKET_ERROR;
+    } else if (m.pld_len_v()) {
         RecvRsp rresp(SERVAL_OK);
         uint16_t nonserial_len = m.pld_len_v() - rresp.serial_pld_len();
         if (nonserial_len > len) {
             err = ENOMEM;          // todo: support incoming msg truncation
             lerr("No memory error for RecvRsp");
+            cli.release_rsp();
             return SERVAL_SOCKET_ERROR;
         }
         info("reading recv rsp");
         rresp.reset_nonserial(buffer, nonserial_len);
         if (rresp.read_pld_from_stream_soc(cli.fd(), err) < 0) {
             lerr("Error reading RecvRsp from stream");
-            return SERVAL_SOCKET_ERROR;
-        }
-        rresp.print("recv:app:rx:hdr");
-
-        if (rresp.err().v) {
+            ret = SERVAL_SOCKET_ERROR;
+        } else if (rresp.err().v) {
+            rresp.print("recv:app:rx:hdr");
             err = rresp.err();
             lerr("RecvRsp has error %s", strerror_sv(err.v));
-            return SERVAL_SOCKET_ERROR;
+            ret = SERVAL_SOCKET_ERROR;
+        } else {
+            rresp.print("recv:app:rx:hdr");
+            info("read recv response");
+
+            if (len > rresp.nonserial_pld_len())
+                len = rresp.nonserial_pld_len();
+            memcpy(&src_service_id, &rresp.src_service_id(), 
+                   sizeof(src_service_id));
+            src_ipaddr = rresp.src_ipaddr();
         }
-        info("read recv response");
-
-        if (len > rresp.nonserial_pld_len())
-            len = rresp.nonserial_pld_len();
-        memcpy(&src_service_id, &rresp.src_service_id(), 
-               sizeof(src_service_id));
-        src_ipaddr = rresp.src_ipaddr();
     } else {
         info("recv: expected to read data, found EOF on soc %s", 
              cli.s());
         len = 0;
-        return 0;
     }
+    cli.release_rsp();
+
+    // Acknowledge any HaveData seen on the way, so that the stack
+    // tells us about new data again
+    if (cli.take_have_data()) {
+        ClearData cdata;
+        sv_err_t cerr;
+        if (cli.write_req(cdata, NULL, cerr, true) < 0)
+            lerr("Error writing ClearData to stream");
+        else
+            cdata.print("cdata:app:tx");
+    }
+
+    if (ret < 0)
+        return ret;
+
     info("returning length=%u", len);
     //SockIO::print("recv:app:data", (const unsigned char *)buffer, len);
     return 0;
@@ -1380,16 +1380,18 @@ int SVSockLib::close_sv(int soc, sv_err_t &err)
     
         info("closing serval socket");
     
-        cli.save_flags();
-        cli.set_sync();
+        cli.begin_call();
     
         if (query_serval_close(cli, err) < 0) {
-            cli.restore_flags();
             lerr("query_serval_close failed");
             err = -1;
         }
     
-        cli.restore_flags();
+        cli.end_call();
+
+        // Receives that waited in the stack failed as it closed the
+        // socket; let them return before the client goes away
+        cli.wait_unused();
         //
         // Socket -> CLOSED or TIMEDWAIT
         //
@@ -1403,46 +1405,34 @@ int SVSockLib::close_sv(int soc, sv_err_t &err)
 int SVSockLib::query_serval_close(Cli &cli, sv_err_t &err)
 {
     CloseReq creq;
+    Cli::RspSlot slot;
 
-    if (creq.write_to_stream_soc(cli.fd(), err) < 0)
+    if (cli.write_req(creq, &slot, err) < 0)
         return SERVAL_SOCKET_ERROR;
     creq.print("close:app:tx");
 
     Message m;
-    if (m.read_hdr_from_stream_soc(cli.fd(), err) < 0)
+    if (cli.read_rsp_hdr(slot, m, err) < 0)
         return SERVAL_SOCKET_ERROR;
-   
-    if (m.type() == Message::HAVE_DATA) {
-        info("Got HaveData before CloseRsp; discarding");
-        HaveData hdata;
-        hdata.read_pld_from_stream_soc(cli.fd(), err);
-        hdata.print("hdata:app:rx");
-          
-        // Expect a CloseRsp directly after HaveData
-        CloseRsp crsp;
-        if (crsp.read_from_stream_soc(cli.fd(), err) < 0)
-            return SERVAL_SOCKET_ERROR;
-        crsp.print("close:app:rx");
-     
-        if (crsp.err().v) {
-            err = crsp.err();
-            return SERVAL_SOCKET_ERROR;
-        }
-    } else if (m.type() == Message::CLOSE_RSP) {
+
+    int ret = 0;
+
+    if (m.type() == Message::CLOSE_RSP) {
         CloseRsp crsp;
         crsp.read_pld_from_stream_soc(cli.fd(), err);
         crsp.print("close:app:rx");
      
         if (crsp.err().v) {
             err = crsp.err();
-            return SERVAL_SOCKET_ERROR;
+            ret = SERVAL_SOCKET_ERROR;
         }
     } else {
         lerr("unexpected message after CloseReq");
-        return SERVAL_SOCKET_ERROR;
+        ret = SERVAL_SOCKET_ERROR;
     }
+    cli.release_rsp();
    
-    return 0;
+    return ret;
 }
 
 bool SVSockLib::is_valid(const struct sockaddr_sv &addr, bool local) const
@@ -15,16 +15,19 @@
 #include "close.hh"
 #include "cli.hh"
 #include "select.hh"
+#include "shm.hh"
 
 #define SERVAL_SOCKET_ERROR -2
 #define MAX_MSG_SIZE 1500
 
-/* TODO
- * As it stands, the user space serval socket library does NOT support full duplex
- * operation (concurrent send/receive), since all operations traverse the same
- * unix domain socket and must be serialized: send cli req/recv cli resp. To properly
- * interleave send_sv/recv_sv requests, we probably need to add a cli response
- * demultiplexing facility
+/*
+ * All operations on a socket traverse the same unix domain socket. Requests
+ * carry an id that the stack echoes in its response, and Cli demultiplexes
+ * the responses, so that send_sv/recv_sv requests may interleave: a blocking
+ * receive waits for data in the stack rather than on the unix domain socket,
+ * and send_sv does not wait for a response at all (an error is reported by
+ * a later send). Sockets with a shared memory channel (see SERVAL_SHM below)
+ * bypass the unix domain socket for data altogether.
  */
 class SVSockLib {
 public:
@@ -74,6 +77,8 @@ public:
 
 private:
     Cli & get_cli(int soc, sv_err_t &err);
+    void add_cli(Cli *cli);
+    void remove_cli(Cli *cli);
     int create_cli(sv_proto_t proto, int &soc, sv_err_t &err);
     int delete_cli(Cli *cli, sv_err_t &err);
   
@@ -81,6 +86,8 @@ private:
                   bool is_valid) const;
     bool is_reserved(const sv_srvid_t& service_id) const;
     bool is_non_blocking(int soc) const;
+    ShmChannel *get_shm(Cli &cli);
+    void clear_have_data(Cli &cli);
 
     void print(const char *label, const unsigned char *buf, int buflen);
     int basic_checks(int soc, const struct sockaddr *addr, 
@@ -121,7 +128,18 @@ private:
     struct sockaddr_un _tcp_srv;
     struct sockaddr_un _udp_srv;
     struct list_head _cli_list;
+
+    // Clients indexed by fd, for lookups in constant time on every
+    // call. The table grows in chunks that stay put, so that lookups
+    // need no lock; clients with larger fds are only on _cli_list.
+    static const int CLI_CHUNK_SHIFT = 10;
+    static const int CLI_CHUNK_SIZE = 1 << CLI_CHUNK_SHIFT;
+    static const int CLI_CHUNKS = 256;
+    Cli **_cli_table[CLI_CHUNKS];
+    pthread_mutex_t _cli_lock;   // serializes adding and removing clients
+
     static uint32_t _serval_id;
+    static bool _use_shm;
 };
 
 #endif
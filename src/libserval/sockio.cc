@@ -24,10 +24,12 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/uio.h>
+#include <sys/socket.h>
 #include <unistd.h>
 #include <errno.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <poll.h>
 
 #include "log.hh"
 
@@ -47,9 +49,72 @@ void SockIO::print(const char *label, const unsigned char *buf, int buflen)
 }
 #endif
 //
-// SockIO, only blocking I/O
+// SockIO, blocking I/O. The application may have put the socket in
+// non-blocking mode. A write that finds the socket full before any
+// byte has gone out fails with EWOULDBLOCK; once part of a message is
+// written, the rest is completed by waiting for the socket. Reads are
+// only made for messages the stack owes, i.e., responses and headers
+// seen by peeking, so they always wait.
 //
-int SockIO::readn(io_sock_t fd, void *vptr, int n)
+int SockIO::wait(io_sock_t fd, short events)
+{
+    struct pollfd pfd;
+
+    pfd.fd = fd;
+    pfd.events = events;
+    pfd.revents = 0;
+
+    return ::poll(&pfd, 1, -1) < 0 ? -1 : 0;
+}
+
+// Read like read(), but also take file descriptors passed along with
+// the data. Unused slots of fds are left alone, and descriptors beyond
+// nfds are closed.
+ssize_t SockIO::recv_fds(io_sock_t fd, void *buf, size_t len,
+                         int *fds, int nfds)
+{
+    union {
+        struct cmsghdr cmh;
+        char buf[CMSG_SPACE(sizeof(int) * MAX_FDS)];
+    } control;
+    struct cmsghdr *cmh;
+    struct msghdr mh;
+    struct iovec iov;
+    ssize_t n;
+
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control.buf;
+    mh.msg_controllen = sizeof(control.buf);
+
+    n = ::recvmsg(fd, &mh, MSG_CMSG_CLOEXEC);
+
+    if (n <= 0)
+        return n;
+
+    for (cmh = CMSG_FIRSTHDR(&mh); cmh; cmh = CMSG_NXTHDR(&mh, cmh)) {
+        if (cmh->cmsg_level != SOL_SOCKET || cmh->cmsg_type != SCM_RIGHTS)
+            continue;
+
+        int *p = (int *)CMSG_DATA(cmh);
+        int num = (cmh->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+        for (int i = 0; i < num; i++) {
+            if (i < nfds)
+                fds[i] = p[i];
+            else
+                ::close(p[i]);
+        }
+    }
+    return n;
+}
+
+// Read n bytes. If fds is given, file descriptors that come with the
+// data are stored there, see recv_fds().
+int SockIO::readn(io_sock_t fd, void *vptr, int n, int *fds, int nfds)
 {
     size_t nleft;
     int nr;
@@ -58,15 +123,18 @@ int SockIO::readn(io_sock_t fd, void *vptr, int n)
     ptr = (char *)vptr;
     nleft = n;
     while (nleft > 0) {
-        if ( (nr = ::read(fd, ptr, nleft)) < 0 &&
+        nr = fds ? recv_fds(fd, ptr, nleft, fds, nfds) :
+            ::read(fd, ptr, nleft);
+
+        if (nr < 0 &&
              errno != ECONNRESET) {
             if (errno == EINTR)
                 //nr = 0;
                 return -1;
             else if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                //lerr("SockIO::readn only supports blocking IO (got %s)",
-                //strerror(errno));
-                return -1;
+                if (wait(fd, POLLIN) < 0)
+                    return -1;
+                continue;
             } else {
                 lerr("SockIO::readn error %s", strerror(errno));
                 return -1;
@@ -99,9 +167,9 @@ int SockIO::writen(io_sock_t fd, const void *vptr, int n)
             if (nwritten < 0 && errno == EINTR)
                 nwritten = 0;
             else if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                lerr("SockIO::writen only supports blocking IO (got %s)",
-                     strerror(errno));
-                return -1;
+                if (nleft == n || wait(fd, POLLOUT) < 0)
+                    return -1;
+                continue;
             } else if (errno == EPIPE) {
                 lerr("SockIO::writen cLosed socket (%s)",
                      strerror(errno));
@@ -126,13 +194,13 @@ int SockIO::writev(io_sock_t fd, struct iovec *iov, int iovcnt)
     nleft = iovcnt;
     int nbytes = 0;
     while (nleft > 0) {
-        if ( (nwritten = ::writev(fd, (const struct iovec *)iov, nleft)) <= 0) {
+        if ( (nwritten = ::writev(fd, (const struct iovec *)fptr, nleft)) <= 0) {
             if (nwritten < 0 && errno == EINTR)
                 nwritten = 0;
             else if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                lerr("SockIO::writev only supports blocking IO (got %s)",
-                     strerror(errno));
-                return -1;
+                if (nbytes == 0 || wait(fd, POLLOUT) < 0)
+                    return -1;
+                continue;
             } else if (errno == EPIPE) {
                 lerr("SockIO::writev closed socket (%s)",
                      strerror(errno));
@@ -10,12 +10,18 @@ class SockIO {
     typedef int io_sock_t;
     static int writen(io_sock_t fd, const void *vptr, int n);
     static int writev(io_sock_t fd, struct iovec *iov, int iovcnt);
-    static int readn(io_sock_t fd, void *vptr, int n);
+    static int readn(io_sock_t fd, void *vptr, int n,
+                     int *fds = NULL, int nfds = 0);
+    static int wait(io_sock_t fd, short events);
+    static const int MAX_FDS = 4;
 #ifdef DEBUG_MODE
     static void print(const char *, const unsigned char *, int);
 #else
     static void print(const char *, const unsigned char *, int) { return; }
 #endif
+  private:
+    static ssize_t recv_fds(io_sock_t fd, void *buf, size_t len,
+                            int *fds, int nfds);
 };
 
 template<typename T> size_t
@@ -388,3 +388,55 @@ int hostctrl_set_delay_verdict(struct hostctrl *hc,
         return hc->ops->service_delay_verdict(hc, pkt_id, verdict);
     return -1;
 }
+
+int hostctrl_set_service_delay_verdict(struct hostctrl *hc,
+                                       const struct service_id *srvid,
+                                       enum delay_verdict verdict)
+{
+    if (hc && srvid && hc->ops->service_delay_verdict_all)
+        return hc->ops->service_delay_verdict_all(hc, srvid, verdict);
+    return -1;
+}
+
+int hostctrl_set_delay_conf(struct hostctrl *hc,
+                            const struct service_id *srvid,
+                            unsigned int limit,
+                            unsigned int timeout_ms,
+                            enum delay_verdict timeout_verdict)
+{
+    if (hc && hc->ops->service_delay_conf)
+        return hc->ops->service_delay_conf(hc, srvid, limit, timeout_ms,
+                                           timeout_verdict);
+    return -1;
+}
+
+int hostctrl_services_batch(struct hostctrl *hc,
+                            const struct service_update_info *ops,
+                            unsigned int num)
+{
+    if (hc && ops && num > 0 && num <= CTRLMSG_SERVICE_BATCH_MAX &&
+        hc->ops->services_batch)
+        return hc->ops->services_batch(hc, ops, num);
+    return -1;
+}
+
+int hostctrl_service_dump(struct hostctrl *hc,
+                          const struct service_id *cursor,
+                          unsigned short cursor_bits,
+                          unsigned int cursor_target,
+                          unsigned int max)
+{
+    if (hc && hc->ops->service_dump)
+        return hc->ops->service_dump(hc, cursor, cursor_bits, 
+                                     cursor_target, max);
+    return -1;
+}
+
+int hostctrl_flow_dump(struct hostctrl *hc,
+                       const struct flow_id *cursor,
+                       unsigned int max)
+{
+    if (hc && hc->ops->flow_dump)
+        return hc->ops->flow_dump(hc, cursor, max);
+    return -1;
+}
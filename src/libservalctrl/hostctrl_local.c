@@ -260,6 +260,121 @@ static int local_service_delay_verdict(struct hostctrl *hc,
     return message_channel_send(hc->mc, &cmd.cmh, cmd.cmh.len);
 }
 
+static int local_service_delay_verdict_all(struct hostctrl *hc,
+                                           const struct service_id *srvid,
+                                           enum delay_verdict verdict)
+{
+    struct ctrlmsg_delay cmd;
+
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.cmh.type = CTRLMSG_TYPE_DELAY_VERDICT;
+    cmd.cmh.len = sizeof(cmd);
+    cmd.cmh.xid = ++hc->xid;
+    cmd.verdict = (verdict == DELAY_DROP || verdict == DELAY_DROP_SERVICE) ?
+        DELAY_DROP_SERVICE : DELAY_RELEASE_SERVICE;
+    memcpy(&cmd.service, srvid, sizeof(*srvid));
+    
+    return message_channel_send(hc->mc, &cmd.cmh, cmd.cmh.len);
+}
+
+static int local_service_delay_conf(struct hostctrl *hc,
+                                    const struct service_id *srvid,
+                                    unsigned int limit,
+                                    unsigned int timeout_ms,
+                                    enum delay_verdict timeout_verdict)
+{
+    struct ctrlmsg_delay_conf cmd;
+
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.cmh.type = CTRLMSG_TYPE_DELAY_CONF;
+    cmd.cmh.len = sizeof(cmd);
+    cmd.cmh.xid = ++hc->xid;
+    cmd.limit = limit;
+    cmd.timeout = timeout_ms;
+    cmd.timeout_verdict = timeout_verdict;
+
+    if (srvid)
+        memcpy(&cmd.service, srvid, sizeof(*srvid));
+    else
+        cmd.flags |= DELAY_CONF_F_DEFAULT;
+
+    return message_channel_send(hc->mc, &cmd.cmh, cmd.cmh.len);
+}
+
+static int local_services_batch(struct hostctrl *hc,
+                                const struct service_update_info *ops,
+                                unsigned int num)
+{
+    size_t size = CTRLMSG_SERVICE_BATCH_NUM_LEN(num);
+    struct ctrlmsg_service_batch *req = malloc(size);
+    int ret;
+
+    if (!req) {
+        LOG_ERR("Could not allocate message\n");
+        return -1;
+    }
+
+    memset(req, 0, size);
+    req->cmh.type = CTRLMSG_TYPE_BATCH_SERVICE;
+    req->cmh.len = size;
+    req->cmh.xid = ++hc->xid;
+    req->xid = req->cmh.xid;
+    memcpy(req->op, ops, num * sizeof(*ops));
+
+    ret = message_channel_send(hc->mc, &req->cmh, req->cmh.len);
+    free(req);
+
+    return ret;
+}
+
+static int local_service_dump(struct hostctrl *hc,
+                              const struct service_id *cursor,
+                              unsigned short cursor_bits,
+                              unsigned int cursor_target,
+                              unsigned int max)
+{
+    struct ctrlmsg_service_dump req;
+
+    memset(&req, 0, sizeof(req));
+    req.cmh.type = CTRLMSG_TYPE_DUMP_SERVICE;
+    req.cmh.len = sizeof(req);
+    req.cmh.xid = ++hc->xid;
+    req.xid = req.cmh.xid;
+    req.count = max;
+
+    if (cursor) {
+        req.flags |= CTRLMSG_DUMP_F_CURSOR;
+        req.cursor_prefix_bits = 
+            (cursor_bits > SERVICE_ID_MAX_PREFIX_BITS) ?
+            SERVICE_ID_MAX_PREFIX_BITS : cursor_bits;
+        req.cursor_target = cursor_target;
+        memcpy(&req.cursor, cursor, sizeof(*cursor));
+    }
+
+    return message_channel_send(hc->mc, &req.cmh, req.cmh.len);
+}
+
+static int local_flow_dump(struct hostctrl *hc,
+                           const struct flow_id *cursor,
+                           unsigned int max)
+{
+    struct ctrlmsg_flow_dump req;
+
+    memset(&req, 0, sizeof(req));
+    req.cmh.type = CTRLMSG_TYPE_DUMP_FLOW;
+    req.cmh.len = sizeof(req);
+    req.cmh.xid = ++hc->xid;
+    req.xid = req.cmh.xid;
+    req.count = max;
+
+    if (cursor) {
+        req.flags |= CTRLMSG_DUMP_F_CURSOR;
+        memcpy(&req.cursor, cursor, sizeof(*cursor));
+    }
+
+    return message_channel_send(hc->mc, &req.cmh, req.cmh.len);
+}
+
 int local_ctrlmsg_recv(struct hostctrl *hc, struct ctrlmsg *cm, 
                        struct sockaddr *from, socklen_t from_len)
 {
@@ -382,6 +497,62 @@ int local_ctrlmsg_recv(struct hostctrl *hc, struct ctrlmsg *cm,
                                                       cmd->pkt_id,
                                                       &cmd->service);
         break;
+    }
+    case CTRLMSG_TYPE_BATCH_SERVICE: {
+        struct ctrlmsg_service_batch *cmb = 
+            (struct ctrlmsg_service_batch *)cm;
+
+        if (cm->len < sizeof(*cmb))
+            break;
+
+        if (hc->cbs->services_batch_result)
+            ret = hc->cbs->services_batch_result(hc,
+                                                 cm->xid,
+                                                 cm->retval,
+                                                 &cmb->op[0],
+                                                 CTRLMSG_SERVICE_BATCH_NUM(cmb),
+                                                 cmb->count);
+        break;
+    }
+    case CTRLMSG_TYPE_DUMP_SERVICE: {
+        struct ctrlmsg_service_dump *cmd = 
+            (struct ctrlmsg_service_dump *)cm;
+
+        if (cm->len < sizeof(*cmd) || 
+            cm->len < CTRLMSG_SERVICE_DUMP_NUM_LEN(cmd->count))
+            break;
+
+        if (hc->cbs->service_dump_result)
+            ret = hc->cbs->service_dump_result(hc,
+                                               cm->xid,
+                                               cm->retval,
+                                               &cmd->service[0],
+                                               cmd->count,
+                                               &cmd->cursor,
+                                               cmd->cursor_prefix_bits,
+                                               cmd->cursor_target,
+                                               cmd->flags & 
+                                               CTRLMSG_DUMP_F_MORE);
+        break;
+    }
+    case CTRLMSG_TYPE_DUMP_FLOW: {
+        struct ctrlmsg_flow_dump *cmd = 
+            (struct ctrlmsg_flow_dump *)cm;
+
+        if (cm->len < sizeof(*cmd) || 
+            cm->len < CTRLMSG_FLOW_DUMP_NUM_LEN(cmd->count))
+            break;
+
+        if (hc->cbs->flow_dump_result)
+            ret = hc->cbs->flow_dump_result(hc,
+                                            cm->xid,
+                                            cm->retval,
+                                            &cmd->flow[0],
+                                            cmd->count,
+                                            &cmd->cursor,
+                                            cmd->flags & 
+                                            CTRLMSG_DUMP_F_MORE);
+        break;
     }
 	default:
 		LOG_DBG("Received message type %u\n", cm->type);
@@ -403,5 +574,10 @@ struct hostctrl_ops local_ops = {
 	.service_modify = local_service_modify,
     .service_get = local_service_get,
     .service_delay_verdict = local_service_delay_verdict,
+    .service_delay_verdict_all = local_service_delay_verdict_all,
+    .service_delay_conf = local_service_delay_conf,
+    .services_batch = local_services_batch,
+    .service_dump = local_service_dump,
+    .flow_dump = local_flow_dump,
     .ctrlmsg_recv = local_ctrlmsg_recv,
 };
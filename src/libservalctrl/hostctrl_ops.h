@@ -59,6 +59,25 @@ struct hostctrl_ops {
     int (*service_delay_verdict)(struct hostctrl *hc,
                                  unsigned int pkt_id,
                                  enum delay_verdict verdict);
+    int (*service_delay_verdict_all)(struct hostctrl *hc,
+                                     const struct service_id *srvid,
+                                     enum delay_verdict verdict);
+    int (*service_delay_conf)(struct hostctrl *hc,
+                              const struct service_id *srvid,
+                              unsigned int limit,
+                              unsigned int timeout_ms,
+                              enum delay_verdict timeout_verdict);
+    int (*services_batch)(struct hostctrl *hc,
+                          const struct service_update_info *ops,
+                          unsigned int num);
+    int (*service_dump)(struct hostctrl *hc,
+                        const struct service_id *cursor,
+                        unsigned short cursor_bits,
+                        unsigned int cursor_target,
+                        unsigned int max);
+    int (*flow_dump)(struct hostctrl *hc,
+                     const struct flow_id *cursor,
+                     unsigned int max);
     int (*ctrlmsg_recv)(struct hostctrl *hc, struct ctrlmsg *cm,
                         struct sockaddr *from, socklen_t from_len);
 };
@@ -17,6 +17,8 @@ public abstract class HostCtrlCallbacks {
 	public static final int RETVAL_ERROR = 1;
 	public static final int RETVAL_NOENTRY = 2;
 	public static final int RETVAL_MALFORMED = 3;
+	public static final int RETVAL_INVALID = 4;
+	public static final int RETVAL_NODEV = 5;
 
 	/**
 	 * Translate an callback return value into a descriptive string.
@@ -35,6 +37,10 @@ public abstract class HostCtrlCallbacks {
 			return "NOENTRY";
 		case RETVAL_MALFORMED:
 			return "MALFORMED";
+		case RETVAL_INVALID:
+			return "INVALID";
+		case RETVAL_NODEV:
+			return "NODEV";
 		default:
 		}
 		return "UNKNOWN";
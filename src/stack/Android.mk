@@ -23,6 +23,8 @@ LOCAL_SRC_FILES := \
 	userlevel/skbuff.c \
 	userlevel/timer.c \
 	userlevel/wait.c \
+	userlevel/rcu.c \
+	userlevel/percpu.c \
 	userlevel/client_msg.c \
 	userlevel/client.c \
 	userlevel/packet_raw.c \
@@ -44,6 +44,7 @@ extern void serval_tcp_offload_fini(void);
 #include <serval/list.h>
 #include <serval/atomic.h>
 #include <serval/wait.h>
+#include <serval/rcupdate.h>
 #include <serval/sock.h>
 #include <serval/net.h>
 #include <serval/skbuff.h>
@@ -76,10 +77,12 @@ struct netns_serval net_serval = {
         .sysctl_debug = 0,
         .sysctl_udp_encap = 0,
         .sysctl_sal_max_retransmits = SAL_RETRANSMITS_MAX,
+        .sysctl_sal_csum_verify = 0,
         .sysctl_resolution_mode = SERVICE_ITER_ANYCAST,
 };
 
 extern void serval_tcp_init(void);
+extern void serval_tcp_cong_fini(void);
 
 static struct sock *serval_accept_dequeue(struct sock *parent,
                                           struct socket *newsock);
@@ -1155,8 +1158,11 @@ void serval_fini(void)
      	sock_unregister(PF_SERVAL);
 	proto_unregister(&serval_udp_proto);
 	proto_unregister(&serval_tcp_proto);
+        serval_tcp_cong_fini();
         serval_sock_tables_fini();
         packet_fini();
         service_fini();
         delay_queue_fini();
+        /* Wait for deferred frees of service table state */
+        rcu_barrier();
 }
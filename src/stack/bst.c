@@ -4,7 +4,18 @@
  * called a bitwise trie. It works well for LPM lookups of arbitrary
  * length bit strings. Do not confuse with binary search trees.
  * 
- * The code is not particularly optimized at this point.
+ * The plain bitwise trie is not particularly optimized; a lookup may
+ * visit one node per prefix bit. Trees initialized with
+ * bst_init_multibit() instead use a path-compressed multibit trie
+ * that consumes 'stride' bits per level and skips over chains of
+ * single-child levels, so that lookups only visit a handful of nodes
+ * even for long prefixes.
+ *
+ * Lookups are safe to run concurrently with a single writer as long
+ * as they are done within an RCU read-side critical section. Writers
+ * must serialize among themselves. New nodes are fully initialized
+ * before being published and unlinked nodes are freed only after an
+ * RCU grace period.
  *
  * Authors: Erik Nordström <enordstr@cs.princeton.edu>
  * 
@@ -17,6 +28,7 @@
 #include <serval/platform.h>
 #include <serval/debug.h>
 #include <serval/list.h>
+#include <serval/rcupdate.h>
 #if defined(OS_USER)
 #include <stdlib.h>
 #include <string.h>
@@ -41,12 +53,20 @@
   A non-NULL private pointer indicates that the node is "active",
   i.e., there is data associated with this node. A node can be freed
   when private is NULL and there are no children.  
+
+  In a multibit tree, nodes are only used for prefixes that were
+  inserted. They hang off the branch that covers their prefix length
+  and never have children of their own.
 */
 struct bst_node {       
         struct bst *tree;
 	struct bst_node *parent, *left, *right;
         struct bst_node_ops *ops;
         struct list_head lh; /* Used for printing trees non-recursively */
+        struct bst_branch *branch; /* Multibit: the owning branch */
+        struct list_head entry_lh; /* Multibit: branch entry list */
+        struct list_head node_lh; /* Multibit: list of all tree nodes */
+        struct rcu_head rcu;
 	unsigned char flags;
         void *private;
 	unsigned int prefix_bits;
@@ -54,6 +74,27 @@ struct bst_node {
 	unsigned char prefix[0];
 };
 
+/*
+  struct bst_branch:
+
+  An internal node in a multibit tree. A branch sits at a bit
+  position 'pos' that is a multiple of the tree's stride. It holds
+  the nodes whose prefix length is in [pos, pos + stride), sorted by
+  decreasing length, and 2^stride children indexed by the 'stride'
+  bits following 'pos'. A child may sit any number of strides further
+  down (path compression), in which case the skipped bits are stored
+  in the child's prefix and verified during lookup.
+*/
+struct bst_branch {
+        struct bst_branch *parent;
+        struct rcu_head rcu;
+        struct list_head entries;
+        unsigned int pos;
+        unsigned int nchildren;
+        unsigned char *prefix;
+        struct bst_branch *child[0];
+};
+
 const unsigned char *bst_node_get_prefix(const struct bst_node *n)
 {
         return n->prefix;
@@ -100,6 +141,356 @@ int bst_node_print_prefix(struct bst_node *n, char *buf, size_t buflen)
         return len;
 }
 
+static void bst_node_free_rcu(struct rcu_head *head)
+{
+        kfree(container_of(head, struct bst_node, rcu));
+}
+
+static void bst_branch_free_rcu(struct rcu_head *head)
+{
+        kfree(container_of(head, struct bst_branch, rcu));
+}
+
+/*
+  Multibit tree implementation.
+ */
+static void bst_node_orphan(struct bst_node *n);
+static int bst_node_init(struct bst_node *n,
+                         struct bst_node_ops *ops, 
+                         void *private);
+
+/* Extract 'nbits' (at most 8) bits starting at bit offset 'pos' */
+static inline unsigned int prefix_get_bits(const void *prefix, 
+                                           unsigned int pos,
+                                           unsigned int nbits)
+{
+        const unsigned char *p = (const unsigned char *)prefix;
+        unsigned int v = p[PREFIX_BYTE(pos)] << 8;
+
+        if ((pos % 8) + nbits > 8)
+                v |= p[PREFIX_BYTE(pos) + 1];
+
+        return (v >> (16 - (pos % 8) - nbits)) & ((1 << nbits) - 1);
+}
+
+/* 
+   Return the offset of the first bit in [from, to) that differs
+   between the two prefixes, or 'to' if they are equal in that range.
+*/
+static unsigned int prefix_common_bits(const void *a, const void *b,
+                                       unsigned int from, unsigned int to)
+{
+        const unsigned char *pa = (const unsigned char *)a;
+        const unsigned char *pb = (const unsigned char *)b;
+        unsigned int i = from;
+
+        while (i < to) {
+                if ((i % 8) == 0 && to - i >= 8) {
+                        if (pa[PREFIX_BYTE(i)] == pb[PREFIX_BYTE(i)]) {
+                                i += 8;
+                                continue;
+                        }
+                }
+                if (!CHECK_BIT(pa, i) != !CHECK_BIT(pb, i))
+                        break;
+                i++;
+        }
+        return i;
+}
+
+static inline int prefix_match_range(const void *a, const void *b,
+                                     unsigned int from, unsigned int to)
+{
+        return prefix_common_bits(a, b, from, to) >= to;
+}
+
+static void prefix_copy(unsigned char *dst, const void *src, 
+                        unsigned int bits)
+{
+        if (bits == 0)
+                return;
+
+        memcpy(dst, src, PREFIX_SIZE(bits));
+
+        /* Zero out the extra bits copied in the last byte */
+        if (bits % 8)
+                dst[PREFIX_SIZE(bits) - 1] &= (0xff << (8 - (bits % 8)));
+}
+
+static struct bst_branch *bst_branch_create(struct bst *tree,
+                                            struct bst_branch *parent,
+                                            const void *prefix,
+                                            unsigned int pos,
+                                            gfp_t alloc)
+{
+        struct bst_branch *b;
+        size_t size = sizeof(*b) + 
+                (sizeof(b->child[0]) << tree->stride) + 
+                PREFIX_SIZE(pos);
+
+        b = (struct bst_branch *)kmalloc(size, alloc);
+
+        if (!b)
+                return NULL;
+
+        memset(b, 0, size);
+        b->parent = parent;
+        b->pos = pos;
+        INIT_LIST_HEAD(&b->entries);
+        b->prefix = (unsigned char *)&b->child[1 << tree->stride];
+        prefix_copy(b->prefix, prefix, pos);
+
+        return b;
+}
+
+/*
+  Free branches that no longer serve a purpose, starting from 'b' and
+  moving up. A branch without entries is freed if it has no children,
+  and replaced by its child if it has only one (path compression).
+ */
+static void bst_branch_collapse(struct bst *tree, struct bst_branch *b)
+{
+        while (b && b != tree->branch_root && 
+               list_empty(&b->entries) && b->nchildren <= 1) {
+                struct bst_branch *parent = b->parent;
+                unsigned int slot = prefix_get_bits(b->prefix, parent->pos, 
+                                                    tree->stride);
+                
+                if (b->nchildren == 1) {
+                        unsigned int i;
+
+                        for (i = 0; i < (1 << tree->stride); i++) {
+                                if (b->child[i]) {
+                                        b->child[i]->parent = parent;
+                                        rcu_assign_pointer(parent->child[slot],
+                                                           b->child[i]);
+                                        break;
+                                }
+                        }
+                } else {
+                        rcu_assign_pointer(parent->child[slot], NULL);
+                        parent->nchildren--;
+                }
+                call_rcu(&b->rcu, bst_branch_free_rcu);
+                b = parent;
+        }
+}
+
+static struct bst_node *bst_mb_find_longest_prefix(struct bst *tree,
+                                                   void *prefix,
+                                                   unsigned int prefix_bits,
+                                                   int (*match)(struct bst_node *))
+{
+        struct bst_branch *b = rcu_dereference(tree->branch_root);
+        struct bst_node *best = NULL;
+
+        while (b) {
+                struct bst_branch *c;
+                struct bst_node *n;
+
+                /* The first match is the longest in this branch,
+                 * since entries are sorted by decreasing length. */
+                list_for_each_entry_rcu(n, &b->entries, entry_lh) {
+                        if (n->prefix_bits > prefix_bits || !n->private)
+                                continue;
+
+                        if (prefix_match_range(n->prefix, prefix, 
+                                               b->pos, n->prefix_bits) &&
+                            (match == NULL || match(n))) {
+                                best = n;
+                                break;
+                        }
+                }
+                
+                if (prefix_bits < b->pos + tree->stride)
+                        break;
+
+                c = rcu_dereference(b->child[prefix_get_bits(prefix, b->pos,
+                                                             tree->stride)]);
+
+                /* Verify the bits skipped by path compression */
+                if (!c || c->pos > prefix_bits ||
+                    !prefix_match_range(c->prefix, prefix, 
+                                        b->pos + tree->stride, c->pos))
+                        break;
+                b = c;
+        }
+        
+        return best;
+}
+
+static struct bst_node *bst_mb_insert_prefix(struct bst *tree, 
+                                             struct bst_node_ops *ops, 
+                                             void *private, void *prefix, 
+                                             unsigned int prefix_bits,
+                                             gfp_t alloc)
+{
+        unsigned int stride = tree->stride;
+        struct bst_branch *b;
+        struct bst_node *n, *pos;
+        size_t size;
+
+        if (!tree->branch_root) {
+                b = bst_branch_create(tree, NULL, NULL, 0, alloc);
+                
+                if (!b)
+                        return NULL;
+
+                rcu_assign_pointer(tree->branch_root, b);
+        }
+
+        b = tree->branch_root;
+        
+        /* Find, or create, the branch covering this prefix length */
+        while (prefix_bits >= b->pos + stride) {
+                unsigned int slot = prefix_get_bits(prefix, b->pos, stride);
+                struct bst_branch *c = b->child[slot], *x;
+                unsigned int common;
+
+                if (!c) {
+                        c = bst_branch_create(tree, b, prefix, 
+                                              prefix_bits - 
+                                              (prefix_bits % stride),
+                                              alloc);
+                        if (!c)
+                                goto fail;
+
+                        rcu_assign_pointer(b->child[slot], c);
+                        b->nchildren++;
+                        b = c;
+                        break;
+                }
+                
+                common = prefix_common_bits(c->prefix, prefix, 
+                                            b->pos + stride,
+                                            min(c->pos, prefix_bits));
+                
+                if (common >= c->pos) {
+                        b = c;
+                        continue;
+                }
+
+                /* The prefix diverges from the child within the
+                 * compressed path, so split it with a new branch */
+                x = bst_branch_create(tree, b, prefix, 
+                                      common - (common % stride), alloc);
+                
+                if (!x)
+                        goto fail;
+                
+                x->child[prefix_get_bits(c->prefix, x->pos, stride)] = c;
+                x->nchildren = 1;
+                c->parent = x;
+                rcu_assign_pointer(b->child[slot], x);
+                b = x;
+        }
+
+        list_for_each_entry(n, &b->entries, entry_lh) {
+                if (n->prefix_bits == prefix_bits &&
+                    prefix_match_range(n->prefix, prefix, 
+                                       b->pos, prefix_bits))
+                        goto init;
+        }
+        
+        size = PREFIX_SIZE(prefix_bits);
+        n = (struct bst_node *)kmalloc(sizeof(*n) + size, alloc);
+        
+        if (!n)
+                goto fail;
+
+        memset(n, 0, sizeof(*n) + size);
+        n->tree = tree;
+        n->branch = b;
+        n->prefix_bits = prefix_bits;
+        n->prefix_size = size;
+        prefix_copy(n->prefix, prefix, prefix_bits);
+        INIT_LIST_HEAD(&n->lh);
+
+        /* Keep entries sorted by decreasing prefix length */
+        list_for_each_entry(pos, &b->entries, entry_lh) {
+                if (pos->prefix_bits < prefix_bits)
+                        break;
+        }
+        list_add_tail_rcu(&n->entry_lh, &pos->entry_lh);
+        list_add_tail(&n->node_lh, &tree->nodes);
+ init:
+        if (bst_node_init(n, ops, private) == -1) {
+                LOG_ERR("node_init failed\n");
+                return NULL;
+        }
+
+        return n;
+ fail:
+        LOG_ERR("Memory allocation failed\n");
+        bst_branch_collapse(tree, b);
+        return NULL;
+}
+
+static void bst_mb_node_release(struct bst_node *n)
+{
+        bst_node_orphan(n);
+        list_del_rcu(&n->entry_lh);
+        list_del(&n->node_lh);
+        bst_branch_collapse(n->tree, n->branch);
+        call_rcu(&n->rcu, bst_node_free_rcu);
+}
+
+static void bst_mb_destroy(struct bst *tree)
+{
+        struct bst_branch *b = tree->branch_root;
+        
+        while (!list_empty(&tree->nodes)) {
+                struct bst_node *n = list_first_entry(&tree->nodes, 
+                                                      struct bst_node, 
+                                                      node_lh);
+                list_del(&n->node_lh);
+                bst_node_orphan(n);
+                call_rcu(&n->rcu, bst_node_free_rcu);
+        }
+
+        /* Free branches depth first without recursing */
+        while (b) {
+                struct bst_branch *parent = b->parent;
+                unsigned int i;
+
+                for (i = 0; i < (1 << tree->stride); i++) {
+                        if (b->child[i])
+                                break;
+                }
+
+                if (i < (1 << tree->stride)) {
+                        struct bst_branch *c = b->child[i];
+                        b->child[i] = NULL;
+                        b = c;
+                } else {
+                        call_rcu(&b->rcu, bst_branch_free_rcu);
+                        b = parent;
+                }
+        }
+        rcu_assign_pointer(tree->branch_root, NULL);
+}
+
+static int bst_mb_tree_func(struct bst *tree,
+                            int (*func)(struct bst_node *, void *arg),
+                            void *arg)
+{
+        struct bst_node *n, *tmp;
+        int ret = 0, count = 0;
+
+        /* Safe against func() releasing the node it is passed */
+        list_for_each_entry_safe(n, tmp, &tree->nodes, node_lh) {
+                if (n->private) {
+                        ret = func(n, arg);
+                        
+                        if (ret < 0)
+                                return ret;
+                        
+                        count += ret;
+                }
+        }
+        return count;
+}
+
 static void stack_push(struct list_head *stack, struct bst_node *n)
 {
         list_add(&n->lh, stack);
@@ -120,7 +511,15 @@ static struct bst_node *stack_pop(struct list_head *stack)
 
 void bst_iterator_init(struct bst *tree, struct bst_iterator *iter)
 {
+        iter->tree = tree;
         INIT_LIST_HEAD(&iter->stack);
+        iter->pos = &tree->nodes;
+
+        if (tree->stride) {
+                iter->curr = NULL;
+                return;
+        }
+
         iter->curr = tree->root;
         if (iter->curr)
                 stack_push(&iter->stack, iter->curr);
@@ -135,6 +534,19 @@ struct bst_node *bst_iterator_next(struct bst_iterator *iter)
 {
         struct bst_node *n = NULL;
 
+        if (iter->tree->stride) {
+                while (iter->pos->next != &iter->tree->nodes) {
+                        iter->pos = iter->pos->next;
+                        n = list_entry(iter->pos, struct bst_node, node_lh);
+
+                        if (n->private)
+                                break;
+                        n = NULL;
+                }
+                iter->curr = n;
+                return n;
+        }
+
         /* Skip over entries without private pointer set (i.e., those
            nodes without data) */
         while (!list_empty(&iter->stack)) {
@@ -280,14 +692,18 @@ struct bst_node *bst_node_find_longest_prefix(struct bst_node *n,
                         PREFIX_BYTE(n->prefix_bits), n->prefix_bits);
                 */
                 if (CHECK_BIT(prefix, n->prefix_bits)) {
-                        if (n->right) {
-                                n = n->right;
+                        struct bst_node *right = rcu_dereference(n->right);
+
+                        if (right) {
+                                n = right;
                         } else {
                                 break;
                         }
                 } else {
-                        if (n->left) {
-                                n = n->left;
+                        struct bst_node *left = rcu_dereference(n->left);
+
+                        if (left) {
+                                n = left;
                         } else {
                                 break;
                         }
@@ -303,7 +719,11 @@ struct bst_node *bst_find_longest_prefix_match(struct bst *tree,
 {
         struct bst_node *n, *prev = NULL;
 
-        n = bst_node_find_longest_prefix(tree->root, 
+        if (tree->stride)
+                return bst_mb_find_longest_prefix(tree, prefix, 
+                                                  prefix_bits, match);
+
+        n = bst_node_find_longest_prefix(rcu_dereference(tree->root), 
                                          &prev, prefix, 
                                          prefix_bits, match);
 
@@ -330,13 +750,13 @@ static void bst_node_free(struct bst_node *n)
          * parent is the node itself. */
         if (n->parent != n) {
                 if (n->parent->right == n)
-                        n->parent->right = NULL;
+                        rcu_assign_pointer(n->parent->right, NULL);
                 else
-                        n->parent->left = NULL;
+                        rcu_assign_pointer(n->parent->left, NULL);
         } else {
-                n->tree->root = NULL;
+                rcu_assign_pointer(n->tree->root, NULL);
         }
-        kfree(n);
+        call_rcu(&n->rcu, bst_node_free_rcu);
 }
 
 static void bst_node_orphan(struct bst_node *n)
@@ -362,6 +782,11 @@ void bst_node_release(struct bst_node *n)
 {
         struct bst_node *parent;
 
+        if (n->tree && n->tree->stride) {
+                bst_mb_node_release(n);
+                return;
+        }
+
         bst_node_orphan(n);
 
         /* Node still has children, so do not free it */
@@ -482,16 +907,288 @@ int bst_subtree_func_recursive(struct bst_node *n,
         return count;
 }
 
+/* Apply function to all active nodes in the tree */
+int bst_tree_func(struct bst *tree,
+                  int (*func)(struct bst_node *, void *arg),
+                  void *arg)
+{
+        if (tree->stride)
+                return bst_mb_tree_func(tree, func, arg);
+
+        if (!tree->root)
+                return 0;
+
+        return bst_subtree_func(tree->root, func, arg);
+}
+
+/*
+  Order of prefixes used for ordered walks: bitwise lexicographic,
+  with a prefix coming before all longer prefixes it covers. This is
+  the pre-order of the bitwise trie.
+*/
+static int prefix_cmp(const void *a, unsigned int a_bits,
+                      const void *b, unsigned int b_bits)
+{
+        unsigned int bits = a_bits < b_bits ? a_bits : b_bits;
+        unsigned int common = prefix_common_bits(a, b, 0, bits);
+
+        if (common < bits)
+                return CHECK_BIT(a, common) ? 1 : -1;
+
+        return (int)a_bits - (int)b_bits;
+}
+
+static inline int node_cmp(const struct bst_node *a, const struct bst_node *b)
+{
+        return prefix_cmp(a->prefix, a->prefix_bits, 
+                          b->prefix, b->prefix_bits);
+}
+
+/* The first node in pre-order that is not in the subtree of n */
+static struct bst_node *bst_node_next_skip(struct bst_node *n)
+{
+        while (n->parent != n) {
+                struct bst_node *p = n->parent;
+
+                if (n == p->left && p->right)
+                        return p->right;
+                n = p;
+        }
+        return NULL;
+}
+
+static struct bst_node *bst_node_next(struct bst_node *n)
+{
+        if (n->left)
+                return n->left;
+        if (n->right)
+                return n->right;
+        return bst_node_next_skip(n);
+}
+
+/*
+  The next active node or child branch of 'b' in prefix order that
+  comes after 'key' (or the first one, if 'key' is NULL). Entries of a
+  branch are sorted by length, not prefix order, and they interleave
+  with the children, so both are compared against the key. If a child
+  comes first, it is returned in 'child' and its subtree is next.
+*/
+static struct bst_node *bst_mb_branch_next(struct bst *tree, 
+                                           struct bst_branch *b,
+                                           const void *key,
+                                           unsigned int key_bits,
+                                           struct bst_branch **child)
+{
+        struct bst_node *n, *best = NULL;
+        unsigned int i;
+
+        *child = NULL;
+
+        list_for_each_entry(n, &b->entries, entry_lh) {
+                if (!n->private)
+                        continue;
+
+                if (key && prefix_cmp(n->prefix, n->prefix_bits, 
+                                      key, key_bits) <= 0)
+                        continue;
+
+                if (!best || node_cmp(n, best) < 0)
+                        best = n;
+        }
+
+        /* Children are in prefix order, and an entry never extends a
+         * child's prefix, so the first child after the key is the
+         * only one to compare with the best entry */
+        for (i = 0; i < (1U << tree->stride); i++) {
+                struct bst_branch *c = b->child[i];
+
+                if (!c || (key && prefix_cmp(c->prefix, c->pos, 
+                                             key, key_bits) <= 0))
+                        continue;
+
+                if (!best || prefix_cmp(best->prefix, best->prefix_bits, 
+                                        c->prefix, c->pos) > 0) {
+                        *child = c;
+                        return NULL;
+                }
+                break;
+        }
+
+        return best;
+}
+
+/*
+  The first active node after 'key' in prefix order, starting in
+  branch 'b', which must cover the key. Moves down into children
+  that come next and back up once a subtree is exhausted, so each
+  step visits only the branches on the way between two nodes.
+*/
+static struct bst_node *bst_mb_next(struct bst *tree, 
+                                    struct bst_branch *b,
+                                    const void *key,
+                                    unsigned int key_bits)
+{
+        while (b) {
+                struct bst_branch *c;
+                struct bst_node *n;
+
+                n = bst_mb_branch_next(tree, b, key, key_bits, &c);
+
+                if (n)
+                        return n;
+
+                if (c) {
+                        /* Continue with the first node of the child */
+                        b = c;
+                        key = NULL;
+                        continue;
+                }
+
+                /* Continue after the subtree of b in its parent */
+                key = b->prefix;
+                key_bits = b->pos;
+                b = b->parent;
+        }
+        return NULL;
+}
+
+/* 
+   Resume an ordered walk of a multibit tree from the branch that
+   covers the cursor.
+*/
+static int bst_mb_find_next(struct bst *tree, const void *prefix,
+                            unsigned int prefix_bits,
+                            struct bst_node **nodes, unsigned int num)
+{
+        struct bst_branch *b = tree->branch_root;
+        unsigned int count = 0;
+        struct bst_node *n;
+
+        if (!b)
+                return 0;
+
+        if (prefix) {
+                while (prefix_bits >= b->pos + tree->stride) {
+                        struct bst_branch *c = 
+                                b->child[prefix_get_bits(prefix, b->pos, 
+                                                         tree->stride)];
+
+                        if (!c || c->pos > prefix_bits ||
+                            !prefix_match_range(c->prefix, prefix, 
+                                                b->pos + tree->stride, 
+                                                c->pos))
+                                break;
+                        b = c;
+                }
+        }
+
+        n = bst_mb_next(tree, b, prefix, prefix_bits);
+
+        while (n && count < num) {
+                nodes[count++] = n;
+
+                if (count < num)
+                        n = bst_mb_next(tree, n->branch, n->prefix, 
+                                        n->prefix_bits);
+        }
+
+        return count;
+}
+
+/*
+  Find up to 'num' active nodes that come after the given prefix,
+  in prefix order (see prefix_cmp()). A NULL prefix starts from the
+  first node. Since the cursor is a prefix rather than a node, a walk
+  can be resumed after the tree was modified, e.g., to dump a large
+  tree in chunks without holding a lock across chunks.
+
+  The tree must be locked against modification. Returns the number
+  of nodes written to 'nodes'.
+*/
+int bst_find_next(struct bst *tree, const void *prefix,
+                  unsigned int prefix_bits, 
+                  struct bst_node **nodes, unsigned int num)
+{
+        struct bst_node *n;
+        unsigned int count = 0;
+
+        if (num == 0)
+                return 0;
+
+        if (tree->stride)
+                return bst_mb_find_next(tree, prefix, prefix_bits, 
+                                        nodes, num);
+
+        n = tree->root;
+
+        if (!n)
+                return 0;
+
+        if (prefix) {
+                /* Follow the cursor as far down as the trie goes */
+                while (n->prefix_bits < prefix_bits) {
+                        struct bst_node *child = 
+                                CHECK_BIT(prefix, n->prefix_bits) ? 
+                                n->right : n->left;
+                        
+                        if (!child)
+                                break;
+                        n = child;
+                }
+                
+                if (n->prefix_bits == prefix_bits || 
+                    !CHECK_BIT(prefix, n->prefix_bits)) {
+                        /* The node is the cursor itself, or the
+                         * cursor would have been in its missing left
+                         * subtree */
+                        n = bst_node_next(n);
+                } else {
+                        /* Everything below n comes before the cursor */
+                        n = bst_node_next_skip(n);
+                }
+        }
+
+        while (n && count < num) {
+                if (n->private)
+                        nodes[count++] = n;
+                n = bst_node_next(n);
+        }
+
+        return count;
+}
+
 int bst_init(struct bst *t)
 {
         t->root = NULL;
         t->entries = 0;
+        t->stride = 0;
+        t->branch_root = NULL;
+        INIT_LIST_HEAD(&t->nodes);
+
+        return 0;
+}
+
+int bst_init_multibit(struct bst *t, unsigned int stride)
+{
+        if (stride == 0 || stride > BST_STRIDE_MAX) {
+                LOG_ERR("Invalid stride %u\n", stride);
+                return -1;
+        }
+
+        bst_init(t);
+        t->stride = stride;
 
         return 0;
 }
 
 void bst_destroy(struct bst *tree)
 {
+        if (tree->stride) {
+                bst_mb_destroy(tree);
+                tree->entries = 0;
+                return;
+        }
+
         if (tree->entries > 0 && tree->root) {
                 __bst_destroy_subtree(tree->root);
                 tree->root = NULL;
@@ -539,12 +1236,6 @@ static struct bst_node *bst_create_node(struct bst_node *parent,
 	
 	memset(n, 0, sizeof(*n) + prefix_size);
 
-	if (CHECK_BIT(prefix, parent->prefix_bits)) {
-		parent->right = n;
-	} else {
-		parent->left = n;
-	}
-
         n->tree = parent->tree;
 	n->left = NULL;
 	n->right = NULL;
@@ -573,6 +1264,13 @@ static struct bst_node *bst_create_node(struct bst_node *parent,
 		
 		n->prefix[n->prefix_size-1] &= endmask;
 	}
+
+        /* Publish the node only once it is fully initialized */
+	if (CHECK_BIT(prefix, parent->prefix_bits)) {
+		rcu_assign_pointer(parent->right, n);
+	} else {
+		rcu_assign_pointer(parent->left, n);
+	}
     
         return n;
 }
@@ -606,15 +1304,11 @@ static struct bst_node *bst_node_new(struct bst_node *parent,
                 }
                 
                 if (CHECK_BIT(prefix, parent->prefix_bits)) {
-                        parent->right = n;
-                        
                         if (parent->prefix_bits + 1 != prefix_bits)
                                 parent = parent->right;
                         else 
                                 break;
                 } else {
-                        parent->left = n;
-                        
                         if (parent->prefix_bits + 1 != prefix_bits)
                                 parent = parent->left;
                         else
@@ -667,20 +1361,32 @@ struct bst_node *bst_insert_prefix(struct bst *tree, struct bst_node_ops *ops,
 {
         struct bst_node *n;
 
+        if (tree->stride) {
+                n = bst_mb_insert_prefix(tree, ops, private, 
+                                         prefix, prefix_bits, alloc);
+                if (n)
+                        tree->entries++;
+
+                return n;
+        }
+
         if (tree->entries == 0) {
-                tree->root = kmalloc(sizeof(struct bst_node), alloc);
+                struct bst_node *root;
+
+                root = kmalloc(sizeof(struct bst_node), alloc);
                 
-                if (!tree->root)
+                if (!root)
                         return NULL;
 
-                memset(tree->root, 0, sizeof(*tree->root));
-                tree->root->left = tree->root->right = NULL;
-                tree->root->parent = tree->root;
-                tree->root->ops = NULL;
-                tree->root->private = NULL;
-                tree->root->flags = 0;
-                tree->root->prefix_bits = 0;
-                tree->root->tree = tree;
+                memset(root, 0, sizeof(*root));
+                root->left = root->right = NULL;
+                root->parent = root;
+                root->ops = NULL;
+                root->private = NULL;
+                root->flags = 0;
+                root->prefix_bits = 0;
+                root->tree = tree;
+                rcu_assign_pointer(tree->root, root);
         }
 
         n = bst_node_insert_prefix(tree->root, ops, private, 
@@ -709,10 +1415,26 @@ int bst_remove_prefix(struct bst *tree, void *prefix, unsigned int prefix_bits)
 
 int bst_print(struct bst *tree, char *buf, size_t buflen)
 {
+        struct bst_node *n;
+        int len = 0, tot_len = 0;
+
         if (!tree || tree->entries == 0)
                 return 0;
 
-        return bst_node_print_nonrecursive(tree->root, buf, buflen);
+        if (!tree->stride)
+                return bst_node_print_nonrecursive(tree->root, buf, buflen);
+
+        list_for_each_entry(n, &tree->nodes, node_lh) {
+                len = bst_node_print(n, buf + tot_len, buflen);
+                
+                tot_len += len;
+                
+                if (len > buflen)
+                        buflen = 0;
+                else
+                        buflen -= len;
+        }
+        return tot_len;
 }
 
 static int bst_node_init_default(struct bst_node *n)
@@ -5,13 +5,24 @@
 #include <serval/list.h>
 
 struct bst_node;
+struct bst_branch;
+
+/*
+  A tree with stride zero is a plain bitwise trie that branches on one
+  bit per level. A non-zero stride (1-8) selects the multibit backend,
+  which is path-compressed and consumes 'stride' bits per level.
+*/
+#define BST_STRIDE_MAX 8
 
 struct bst {
         struct bst_node *root;
         unsigned int entries;
+        unsigned int stride;
+        struct bst_branch *branch_root;
+        struct list_head nodes;
 };
 
-#define BST_INITIALIZER { NULL, 0 }
+#define BST_INITIALIZER(name) { NULL, 0, 0, NULL, LIST_HEAD_INIT(name.nodes) }
  
 struct bst_node_ops {
         int (*init)(struct bst_node *);
@@ -20,13 +31,16 @@ struct bst_node_ops {
 };
 
 struct bst_iterator {
+        struct bst *tree;
         struct list_head stack;
+        struct list_head *pos;
         struct bst_node *curr;
 };
 
 extern struct bst_node_ops default_bst_node_ops;
 
 int bst_init(struct bst *tree);
+int bst_init_multibit(struct bst *tree, unsigned int stride);
 void bst_destroy(struct bst *tree);
 struct bst_node *bst_insert_prefix(struct bst *tree, struct bst_node_ops *ops,
                                    void *private, void *prefix, 
@@ -46,6 +60,10 @@ struct bst_node *bst_find_longest_prefix_match(struct bst *tree,
                                                unsigned int prefix_bits,
                                                int (*match)(struct bst_node *));
 
+int bst_find_next(struct bst *tree, const void *prefix,
+                  unsigned int prefix_bits, 
+                  struct bst_node **nodes, unsigned int num);
+
 void bst_iterator_init(struct bst *tree, struct bst_iterator *iter);
 struct bst_node *bst_iterator_node(struct bst_iterator *iter);
 struct bst_node *bst_iterator_next(struct bst_iterator *iter);
@@ -59,6 +77,9 @@ unsigned long bst_node_get_prefix_bits(const struct bst_node *n);
 int bst_subtree_func(struct bst_node *n, 
                      int (*func)(struct bst_node *, void *arg), 
                      void *arg);
+int bst_tree_func(struct bst *tree,
+                  int (*func)(struct bst_node *, void *arg), 
+                  void *arg);
 
 #define bst_node_private(n, type) ((type *)bst_node_get_private((n)))
 
@@ -41,6 +41,10 @@ static const char *ctrlmsg_str[] = {
         [CTRLMSG_TYPE_DELAY_NOTIFY] = "CTRLMSG_TYPE_DELAY_NOTIFY",
         [CTRLMSG_TYPE_DELAY_VERDICT] = "CTRLMSG_TYPE_DELAY_VERDICT",
         [CTRLMSG_TYPE_DUMMY] = "CTRLMSG_TYPE_DUMMY",
+        [CTRLMSG_TYPE_BATCH_SERVICE] = "CTRLMSG_TYPE_BATCH_SERVICE",
+        [CTRLMSG_TYPE_DUMP_SERVICE] = "CTRLMSG_TYPE_DUMP_SERVICE",
+        [CTRLMSG_TYPE_DUMP_FLOW] = "CTRLMSG_TYPE_DUMP_FLOW",
+        [CTRLMSG_TYPE_DELAY_CONF] = "CTRLMSG_TYPE_DELAY_CONF",
         NULL
 };
 #endif
@@ -201,7 +205,7 @@ static int ctrl_handle_del_service_msg(struct ctrlmsg *cm, int peer)
                         stat->packets_resolved = tstat.packets_resolved;
                         stat->bytes_resolved = tstat.bytes_resolved;
                         stat->packets_dropped = tstat.packets_dropped;
-                        stat->bytes_dropped = tstat.packets_dropped;
+                        stat->bytes_dropped = tstat.bytes_dropped;
 
                         //if (index < i) {
                                 memcpy(&stat->service, entry, 
@@ -322,6 +326,268 @@ static int ctrl_handle_mod_service_msg(struct ctrlmsg *cm, int peer)
         return 0;
 }
 
+/*
+  Apply a set of additions, deletions and modifications as one update
+  of the service table. The request is returned with the result of
+  each update.
+*/
+static int ctrl_handle_batch_service_msg(struct ctrlmsg *cm, int peer)
+{
+        struct ctrlmsg_service_batch *cmb = (struct ctrlmsg_service_batch *)cm;
+        struct service_id null_service = { .s_sid = { 0 } };
+        struct service_update *upd;
+        unsigned int num_ops, i;
+        int count;
+
+        if (cm->len < sizeof(*cmb)) {
+                cm->retval = CTRLMSG_RETVAL_MALFORMED;
+                ctrl_sendmsg(cm, peer, GFP_KERNEL);
+                return 0;
+        }
+
+        num_ops = CTRLMSG_SERVICE_BATCH_NUM(cmb);
+
+        LOG_DBG("batch of %u service updates\n", num_ops);
+
+        if (num_ops == 0) {
+                cm->retval = CTRLMSG_RETVAL_MALFORMED;
+                ctrl_sendmsg(cm, peer, GFP_KERNEL);
+                return 0;
+        }
+
+        upd = kmalloc(sizeof(*upd) * num_ops, GFP_KERNEL);
+
+        if (!upd) {
+                cm->retval = CTRLMSG_RETVAL_ERROR;
+                ctrl_sendmsg(cm, peer, GFP_KERNEL);
+                return -ENOMEM;
+        }
+
+        memset(upd, 0, sizeof(*upd) * num_ops);
+
+        for (i = 0; i < num_ops; i++) {
+                struct service_update_info *info = &cmb->op[i];
+                struct service_info *entry = &info->service;
+                struct service_update *u = &upd[i];
+                struct net_device *dev = NULL;
+
+                u->op = info->op;
+                u->srvid = &entry->srvid;
+                u->prefix_bits = SERVICE_ID_MAX_PREFIX_BITS;
+                u->type = entry->type;
+                u->flags = entry->srvid_flags;
+                u->priority = entry->priority;
+                u->weight = entry->weight;
+                u->dst = &entry->address;
+                u->dstlen = sizeof(entry->address);
+
+                if (entry->srvid_prefix_bits > 0 ||
+                    memcmp(&entry->srvid, &null_service, 
+                           sizeof(null_service)) == 0)
+                        u->prefix_bits = entry->srvid_prefix_bits;
+
+                switch (info->op) {
+                case SERVICE_UPDATE_ADD:
+                        if (entry->type == SERVICE_RULE_FORWARD) {
+                                dev = resolve_dev(entry);
+
+                                if (!dev)
+                                        u->err = -ENODEV;
+                        }
+                        break;
+                case SERVICE_UPDATE_MOD:
+                        /* Only forwarding rules can be modified */
+                        u->type = SERVICE_RULE_FORWARD;
+                        u->new_dst = &info->new_address;
+                        u->new_dstlen = sizeof(info->new_address);
+                        dev = resolve_dev(entry);
+                        
+                        if (!dev)
+                                u->err = -ENODEV;
+                        break;
+                case SERVICE_UPDATE_DEL:
+                        break;
+                default:
+                        LOG_DBG("bad service update op %u\n", info->op);
+                        u->err = -EINVAL;
+                        break;
+                }
+
+                u->out = make_target(dev);
+        }
+
+        count = service_update_batch(upd, num_ops, GFP_KERNEL);
+
+        for (i = 0; i < num_ops; i++) {
+                struct service_update_info *info = &cmb->op[i];
+
+                if (upd[i].out.dev && upd[i].type == SERVICE_RULE_FORWARD)
+                        dev_put(upd[i].out.dev);
+
+                if (upd[i].err > 0) {
+                        info->retval = CTRLMSG_RETVAL_OK;
+                } else if (upd[i].err == 0) {
+                        info->retval = CTRLMSG_RETVAL_NOENTRY;
+                } else if (upd[i].err == -EINVAL) {
+                        info->retval = CTRLMSG_RETVAL_INVALID;
+                } else if (upd[i].err == -ENODEV) {
+                        info->retval = CTRLMSG_RETVAL_NODEV;
+                } else {
+                        info->retval = CTRLMSG_RETVAL_ERROR;
+                        LOG_ERR("Service update %u of %s failed: err=%d\n",
+                                info->op, 
+                                service_id_to_str(&info->service.srvid), 
+                                upd[i].err);
+                }
+        }
+
+        kfree(upd);
+
+        LOG_DBG("%d of %u service updates applied\n", count, num_ops);
+
+        cmb->count = count;
+        cm->retval = count > 0 ? CTRLMSG_RETVAL_OK : CTRLMSG_RETVAL_NOENTRY;
+        ctrl_sendmsg(cm, peer, GFP_KERNEL);
+
+        return 0;
+}
+
+static int ctrl_handle_dump_service_msg(struct ctrlmsg *cm, int peer)
+{
+        struct ctrlmsg_service_dump *cmd = (struct ctrlmsg_service_dump *)cm;
+        struct ctrlmsg_service_dump *cres;
+        struct service_dump_cursor cursor;
+        unsigned int max = cmd->count;
+        size_t size;
+        int ret;
+
+        if (cm->len < sizeof(*cmd)) {
+                cm->retval = CTRLMSG_RETVAL_MALFORMED;
+                ctrl_sendmsg(cm, peer, GFP_KERNEL);
+                return 0;
+        }
+
+        if (max == 0 || max > CTRLMSG_SERVICE_DUMP_MAX)
+                max = CTRLMSG_SERVICE_DUMP_MAX;
+
+        size = CTRLMSG_SERVICE_DUMP_NUM_LEN(max);
+        cres = kmalloc(size, GFP_KERNEL);
+
+        if (!cres) {
+                cm->retval = CTRLMSG_RETVAL_ERROR;
+                ctrl_sendmsg(cm, peer, GFP_KERNEL);
+                return -ENOMEM;
+        }
+
+        memset(&cursor, 0, sizeof(cursor));
+
+        if (cmd->flags & CTRLMSG_DUMP_F_CURSOR) {
+                memcpy(&cursor.srvid, &cmd->cursor, sizeof(cursor.srvid));
+                cursor.prefix_bits = cmd->cursor_prefix_bits;
+                cursor.target = cmd->cursor_target;
+                cursor.valid = 1;
+        }
+
+        ret = service_dump(&cursor, cres->service, max, GFP_KERNEL);
+
+        if (ret < 0) {
+                kfree(cres);
+                cm->retval = CTRLMSG_RETVAL_ERROR;
+                ctrl_sendmsg(cm, peer, GFP_KERNEL);
+                return ret;
+        }
+
+        LOG_DBG("dumping %d service table entries, more=%d\n", 
+                ret, cursor.more);
+
+        memcpy(&cres->cmh, &cmd->cmh, sizeof(cres->cmh));
+        cres->cmh.len = CTRLMSG_SERVICE_DUMP_NUM_LEN(ret);
+        cres->cmh.retval = ret > 0 ? 
+                CTRLMSG_RETVAL_OK : CTRLMSG_RETVAL_NOENTRY;
+        cres->xid = cmd->xid;
+        cres->count = ret;
+        cres->flags = 0;
+        cres->cursor_prefix_bits = cursor.prefix_bits;
+        cres->cursor_target = cursor.target;
+        memcpy(&cres->cursor, &cursor.srvid, sizeof(cres->cursor));
+
+        if (cursor.valid)
+                cres->flags |= CTRLMSG_DUMP_F_CURSOR;
+        if (cursor.more)
+                cres->flags |= CTRLMSG_DUMP_F_MORE;
+
+        ctrl_sendmsg(&cres->cmh, peer, GFP_KERNEL);
+        kfree(cres);
+
+        return 0;
+}
+
+static int ctrl_handle_dump_flow_msg(struct ctrlmsg *cm, int peer)
+{
+        struct ctrlmsg_flow_dump *cmd = (struct ctrlmsg_flow_dump *)cm;
+        struct ctrlmsg_flow_dump *cres;
+        struct flow_dump_cursor cursor;
+        unsigned int max = cmd->count;
+        size_t size;
+        int ret;
+
+        if (cm->len < sizeof(*cmd)) {
+                cm->retval = CTRLMSG_RETVAL_MALFORMED;
+                ctrl_sendmsg(cm, peer, GFP_KERNEL);
+                return 0;
+        }
+
+        if (max == 0 || max > CTRLMSG_FLOW_DUMP_MAX)
+                max = CTRLMSG_FLOW_DUMP_MAX;
+
+        size = CTRLMSG_FLOW_DUMP_NUM_LEN(max);
+        cres = kmalloc(size, GFP_KERNEL);
+
+        if (!cres) {
+                cm->retval = CTRLMSG_RETVAL_ERROR;
+                ctrl_sendmsg(cm, peer, GFP_KERNEL);
+                return -ENOMEM;
+        }
+
+        memset(&cursor, 0, sizeof(cursor));
+
+        if (cmd->flags & CTRLMSG_DUMP_F_CURSOR) {
+                memcpy(&cursor.flowid, &cmd->cursor, sizeof(cursor.flowid));
+                cursor.valid = 1;
+        }
+
+        ret = flow_table_dump(&cursor, cres->flow, max);
+
+        if (ret < 0) {
+                kfree(cres);
+                cm->retval = CTRLMSG_RETVAL_ERROR;
+                ctrl_sendmsg(cm, peer, GFP_KERNEL);
+                return ret;
+        }
+
+        LOG_DBG("dumping %d flows, more=%d\n", ret, cursor.more);
+
+        memcpy(&cres->cmh, &cmd->cmh, sizeof(cres->cmh));
+        cres->cmh.len = CTRLMSG_FLOW_DUMP_NUM_LEN(ret);
+        cres->cmh.retval = ret > 0 ? 
+                CTRLMSG_RETVAL_OK : CTRLMSG_RETVAL_NOENTRY;
+        cres->xid = cmd->xid;
+        cres->count = ret;
+        cres->flags = 0;
+        cres->pad = 0;
+        memcpy(&cres->cursor, &cursor.flowid, sizeof(cres->cursor));
+
+        if (cursor.valid)
+                cres->flags |= CTRLMSG_DUMP_F_CURSOR;
+        if (cursor.more)
+                cres->flags |= CTRLMSG_DUMP_F_MORE;
+
+        ctrl_sendmsg(&cres->cmh, peer, GFP_KERNEL);
+        kfree(cres);
+
+        return 0;
+}
+
 static int ctrl_handle_get_service_msg(struct ctrlmsg *cm, int peer)
 {
         struct ctrlmsg_service *cmg = (struct ctrlmsg_service *)cm;
@@ -434,10 +700,13 @@ static int ctrl_handle_service_stats_msg(struct ctrlmsg *cm, int peer)
         cms->stats.bytes_dropped = tstats.bytes_dropped;
         cms->stats.packets_dropped = tstats.packets_dropped;
 
-        LOG_DBG("service stats: instances(%i) services(%i) "
-                "bytes resolved(%i) packets resolved(%i) capabilities\n",
-                tstats.instances, tstats.services, tstats.bytes_resolved,
-                tstats.packets_resolved, cms->stats.capabilities);
+        LOG_DBG("service stats: instances(%u) services(%u) "
+                "bytes resolved(%llu) packets resolved(%llu) "
+                "capabilities(%u)\n",
+                tstats.instances, tstats.services, 
+                (unsigned long long)tstats.bytes_resolved,
+                (unsigned long long)tstats.packets_resolved, 
+                cms->stats.capabilities);
 
         ctrl_sendmsg(&cms->cmh, peer, GFP_KERNEL);
 
@@ -538,6 +807,20 @@ static int ctrl_handle_delay_verdict_msg(struct ctrlmsg *cm, int peer)
 {
         struct ctrlmsg_delay *cmd = (struct ctrlmsg_delay *)cm;
 
+        switch (cmd->verdict) {
+        case DELAY_RELEASE_SERVICE:
+        case DELAY_DROP_SERVICE:
+                LOG_DBG("delay queue verdict %s for service %s\n",
+                        cmd->verdict == DELAY_RELEASE_SERVICE ? 
+                        "RELEASE" : "DROP",
+                        service_id_to_str(&cmd->service));
+                
+                return delay_queue_set_service_verdict(&cmd->service, 
+                                                       cmd->verdict, peer);
+        default:
+                break;
+        }
+
         LOG_DBG("delay queue verdict %s for pkt_id=%u\n",
                 cmd->verdict == DELAY_RELEASE ? "RELEASE" : "DROP",
                 cmd->pkt_id);
@@ -545,6 +828,24 @@ static int ctrl_handle_delay_verdict_msg(struct ctrlmsg *cm, int peer)
         return delay_queue_set_verdict(cmd->pkt_id, cmd->verdict, peer);
 }
 
+static int ctrl_handle_delay_conf_msg(struct ctrlmsg *cm, int peer)
+{
+        struct ctrlmsg_delay_conf *cmd = (struct ctrlmsg_delay_conf *)cm;
+
+        if (cm->len < sizeof(*cmd))
+                return -EINVAL;
+
+        LOG_DBG("delay queue limit=%u timeout=%ums for %s\n",
+                cmd->limit, cmd->timeout, 
+                (cmd->flags & DELAY_CONF_F_DEFAULT) ? "default" :
+                service_id_to_str(&cmd->service));
+
+        return delay_queue_configure((cmd->flags & DELAY_CONF_F_DEFAULT) ?
+                                     NULL : &cmd->service,
+                                     cmd->limit, cmd->timeout, 
+                                     cmd->timeout_verdict, peer);
+}
+
 ctrlmsg_handler_t handlers[] = {
         [CTRLMSG_TYPE_REGISTER] = dummy_ctrlmsg_handler,
         [CTRLMSG_TYPE_UNREGISTER] = dummy_ctrlmsg_handler,
@@ -561,4 +862,8 @@ ctrlmsg_handler_t handlers[] = {
         [CTRLMSG_TYPE_DELAY_NOTIFY] = dummy_ctrlmsg_handler,
         [CTRLMSG_TYPE_DELAY_VERDICT] = ctrl_handle_delay_verdict_msg,
         [CTRLMSG_TYPE_DUMMY] = dummy_ctrlmsg_handler,
+        [CTRLMSG_TYPE_BATCH_SERVICE] = ctrl_handle_batch_service_msg,
+        [CTRLMSG_TYPE_DUMP_SERVICE] = ctrl_handle_dump_service_msg,
+        [CTRLMSG_TYPE_DUMP_FLOW] = ctrl_handle_dump_flow_msg,
+        [CTRLMSG_TYPE_DELAY_CONF] = ctrl_handle_delay_conf_msg,
 };
@@ -16,6 +16,9 @@
 #include <serval/skbuff.h>
 #include <serval/debug.h>
 #include <serval/sock.h>
+#include <serval/hash.h>
+#include <serval/timer.h>
+#include <serval/random.h>
 #if defined(OS_LINUX_KERNEL)
 #include <linux/netlink.h>
 #endif
@@ -24,43 +27,188 @@
 #include "serval_sal.h"
 
 #define DELAY_QUEUE_MAX_DEFAULT 1024
+/* Packets a service may have queued, and how long they wait for a
+   verdict, unless configured otherwise */
+#define DELAY_SERVICE_MAX_DEFAULT 256
+#define DELAY_TIMEOUT_DEFAULT (5 * HZ)
+#define DELAY_QUEUE_HASH_BITS 9
+#define DELAY_QUEUE_HASH_SIZE (1 << DELAY_QUEUE_HASH_BITS)
+#define DELAY_SERVICE_HASH_BITS 6
+#define DELAY_SERVICE_HASH_SIZE (1 << DELAY_SERVICE_HASH_BITS)
 
 static int peer_pid __read_mostly;
 static unsigned int queue_id = 0;
 static unsigned int queue_total = 0;
 static unsigned int queue_dropped = 0;
+static unsigned int queue_expired = 0;
 static unsigned int queue_maxlen = DELAY_QUEUE_MAX_DEFAULT;
 static DEFINE_SPINLOCK(queue_lock);
-static struct list_head delay_queue = { &delay_queue, &delay_queue };
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3,7,0)
 #define portid pid
 #endif
 
+/* Packets queued for one service ID, in the order they were queued,
+   and thus in the order they expire. The limits are those of the
+   service when it has been configured, or the defaults. */
+struct delay_service {
+        struct hlist_node node;
+        struct list_head active;
+        struct list_head queue;
+        struct service_id srvid;
+        unsigned int len;
+        unsigned int limit;
+        unsigned long timeout;
+        enum delay_verdict timeout_verdict;
+        unsigned char configured;
+};
+
 struct delay_entry {
+        struct hlist_node node;
         struct list_head lh;
+        struct delay_service *ds;
         unsigned int id;
+        unsigned long expires;
         struct sk_buff *skb;
         struct sock *sk;
 };
 
+static struct hlist_head delay_hash[DELAY_QUEUE_HASH_SIZE];
+static struct hlist_head delay_service_hash[DELAY_SERVICE_HASH_SIZE];
+/* Services with packets queued, walked by the expiry timer */
+static LIST_HEAD(delay_services);
+static struct timer_list delay_timer;
+static u32 delay_service_seed;
+
+static struct {
+        unsigned int limit;
+        unsigned long timeout;
+        enum delay_verdict timeout_verdict;
+} delay_default = {
+        .limit = DELAY_SERVICE_MAX_DEFAULT,
+        .timeout = DELAY_TIMEOUT_DEFAULT,
+        .timeout_verdict = DELAY_DROP,
+};
+
+static inline struct hlist_head *delay_service_head(struct service_id *srvid)
+{
+        return &delay_service_hash[jhash(srvid, sizeof(*srvid), 
+                                         delay_service_seed) & 
+                                   (DELAY_SERVICE_HASH_SIZE - 1)];
+}
+
+static struct delay_service *__delay_service_find(struct service_id *srvid)
+{
+        struct hlist_node *pos;
+
+        hlist_for_each(pos, delay_service_head(srvid)) {
+                struct delay_service *ds = 
+                        hlist_entry(pos, struct delay_service, node);
+
+                if (memcmp(&ds->srvid, srvid, sizeof(*srvid)) == 0)
+                        return ds;
+        }
+        return NULL;
+}
+
+static struct delay_service *__delay_service_get(struct service_id *srvid)
+{
+        struct delay_service *ds = __delay_service_find(srvid);
+
+        if (ds)
+                return ds;
+
+        ds = kmalloc(sizeof(*ds), GFP_ATOMIC);
+
+        if (!ds)
+                return NULL;
+
+        memset(ds, 0, sizeof(*ds));
+        memcpy(&ds->srvid, srvid, sizeof(*srvid));
+        INIT_LIST_HEAD(&ds->active);
+        INIT_LIST_HEAD(&ds->queue);
+        ds->limit = delay_default.limit;
+        ds->timeout = delay_default.timeout;
+        ds->timeout_verdict = delay_default.timeout_verdict;
+        hlist_add_head(&ds->node, delay_service_head(srvid));
+
+        return ds;
+}
+
+/* Free the state of a service that has nothing queued, unless it
+   holds a configuration */
+static void __delay_service_put(struct delay_service *ds)
+{
+        if (ds->len || ds->configured)
+                return;
+
+        hlist_del(&ds->node);
+        kfree(ds);
+}
+
+static void __delay_timer_update(void)
+{
+        struct delay_service *ds;
+        unsigned long expires = 0;
+        int pending = 0;
+
+        list_for_each_entry(ds, &delay_services, active) {
+                struct delay_entry *de;
+
+                if (!ds->timeout)
+                        continue;
+
+                de = list_first_entry(&ds->queue, struct delay_entry, lh);
+                
+                if (!pending || time_before(de->expires, expires))
+                        expires = de->expires;
+                pending = 1;
+        }
+
+        if (pending)
+                mod_timer(&delay_timer, expires);
+}
+
 static inline void __delay_queue_add(struct delay_entry *de)
 {
-        list_add_tail(&de->lh, &delay_queue);
+        struct delay_service *ds = de->ds;
+
+        hlist_add_head(&de->node, 
+                       &delay_hash[de->id & (DELAY_QUEUE_HASH_SIZE - 1)]);
+        list_add_tail(&de->lh, &ds->queue);
+
+        if (ds->len++ == 0) {
+                list_add_tail(&ds->active, &delay_services);
+
+                if (ds->timeout && (!timer_pending(&delay_timer) ||
+                                    time_before(de->expires, 
+                                                delay_timer.expires)))
+                        mod_timer(&delay_timer, de->expires);
+        }
         queue_total++;
 }
 
+/* Unlink an entry. The caller puts the service once done with it. */
 static inline void __delay_queue_remove(struct delay_entry *de)
 {
+        struct delay_service *ds = de->ds;
+
+        hlist_del(&de->node);
         list_del(&de->lh);
+
+        if (--ds->len == 0)
+                list_del_init(&ds->active);
         queue_total--;
 }
 
 static inline struct delay_entry *__delay_queue_find(unsigned int id)
 {
-        struct delay_entry *entry;
+        struct hlist_node *pos;
+
+        hlist_for_each(pos, &delay_hash[id & (DELAY_QUEUE_HASH_SIZE - 1)]) {
+                struct delay_entry *entry = 
+                        hlist_entry(pos, struct delay_entry, node);
 
-        list_for_each_entry(entry, &delay_queue, lh) {
                 if (id == entry->id)
                         return entry;
         }
@@ -74,32 +222,165 @@ static inline void delay_entry_free(struct delay_entry *de)
         kfree(de);
 }
 
-static inline void __delay_queue_purge_sock(struct sock *sk)
+/* Move all packets of a service to a list, to be given their verdict
+   once the queue lock is released */
+static void __delay_service_splice(struct delay_service *ds,
+                                   struct list_head *head)
+{
+        struct delay_entry *entry;
+
+        list_for_each_entry(entry, &ds->queue, lh)
+                hlist_del(&entry->node);
+
+        queue_total -= ds->len;
+        ds->len = 0;
+        list_splice_tail_init(&ds->queue, head);
+        list_del_init(&ds->active);
+}
+
+static int delay_entry_verdict(struct delay_entry *entry, 
+                               enum delay_verdict verdict)
+{
+        int ret = 0;
+
+        switch (verdict) {
+        case DELAY_DROP:
+        case DELAY_DROP_SERVICE:
+                LOG_DBG("Verdict for pkt %u is DROP\n", entry->id);
+                kfree_skb(entry->skb);
+                queue_dropped++;
+                break;
+        case DELAY_RELEASE:
+        case DELAY_RELEASE_SERVICE:
+                LOG_DBG("Verdict for pkt %u is RELEASE\n", entry->id);
+                /* FIXME: 
+                   Here we need to be careful that the RELEASE does
+                   not cause the skb to be DELAYED again, which could
+                   cause a loop until the queue is full. This only
+                   happens with unbehaved apps though. We should
+                   figure out a way to ensure that a re-resolution
+                   does not hit a DELAY rule more than once.
+                */
+                if (entry->sk) {
+                        /* If the skb is owned by a socket, it means
+                           it was generated locally and was not
+                           received from the network */
+                        if (sock_flag(entry->sk, SOCK_DEAD)) {
+                                kfree_skb(entry->skb);
+                                queue_dropped++;
+                                LOG_DBG("Socket is DEAD, dropping pkt %u\n",
+                                        entry->id);
+                        } else {
+                                serval_sal_xmit_skb(entry->skb);
+                                ret = 1;
+                        }
+                } else {
+                        /* Just reinject this packet as if received
+                           from the network */
+                        serval_sal_reresolve(entry->skb);
+                        ret = 1;
+                }
+                break;
+        }
+
+        delay_entry_free(entry);
+
+        return ret;
+}
+
+/* Give each packet on a list its verdict, without holding the queue
+   lock, since released packets may be delayed again. Returns the
+   number of packets released. */
+static int delay_list_verdict(struct list_head *head,
+                              enum delay_verdict verdict)
 {
         struct delay_entry *entry, *tmp;
+        int n = 0;
+
+        list_for_each_entry_safe(entry, tmp, head, lh) {
+                list_del(&entry->lh);
+                n += delay_entry_verdict(entry, verdict);
+        }
+        return n;
+}
+
+static void delay_timeout(unsigned long data)
+{
+        struct delay_service *ds, *tmp;
+        LIST_HEAD(drop);
+        LIST_HEAD(release);
+
+        spin_lock_bh(&queue_lock);
+
+        list_for_each_entry_safe(ds, tmp, &delay_services, active) {
+                struct list_head *head = ds->timeout_verdict == DELAY_DROP ?
+                        &drop : &release;
+
+                if (!ds->timeout)
+                        continue;
+
+                while (ds->len) {
+                        struct delay_entry *de = 
+                                list_first_entry(&ds->queue, 
+                                                 struct delay_entry, lh);
+
+                        if (time_before(jiffies, de->expires))
+                                break;
+
+                        __delay_queue_remove(de);
+                        list_add_tail(&de->lh, head);
+                        queue_expired++;
+                }
+                __delay_service_put(ds);
+        }
+
+        __delay_timer_update();
+
+        spin_unlock_bh(&queue_lock);
+
+        delay_list_verdict(&drop, DELAY_DROP);
+        delay_list_verdict(&release, DELAY_RELEASE);
+}
+
+static inline void __delay_queue_purge_sock(struct sock *sk, 
+                                            struct list_head *head)
+{
+        struct delay_service *ds, *tmp;
         
-        list_for_each_entry_safe(entry, tmp, &delay_queue, lh) {                
-                if (sk == NULL || (sk == entry->sk)) {
-                        list_del_init(&entry->lh);
-                        queue_total--;
-                        kfree_skb(entry->skb);
-                        delay_entry_free(entry);
-                        queue_dropped++;
+        list_for_each_entry_safe(ds, tmp, &delay_services, active) {
+                struct delay_entry *entry, *etmp;
+
+                list_for_each_entry_safe(entry, etmp, &ds->queue, lh) {
+                        if (sk == NULL || (sk == entry->sk)) {
+                                __delay_queue_remove(entry);
+                                list_add_tail(&entry->lh, head);
+                        }
                 }
+                __delay_service_put(ds);
         }
 }
 
 void delay_queue_purge_sock(struct sock *sk)
 {
+        LIST_HEAD(purged);
+
         spin_lock_bh(&queue_lock);
-        __delay_queue_purge_sock(sk);
+        __delay_queue_purge_sock(sk, &purged);
         spin_unlock_bh(&queue_lock);
+
+        delay_list_verdict(&purged, DELAY_DROP);
 }
 
-static void __delay_queue_reset(void)
+static void delay_queue_reset(void)
 {
-        __delay_queue_purge_sock(NULL);
+        LIST_HEAD(purged);
+
+        spin_lock_bh(&queue_lock);
+        __delay_queue_purge_sock(NULL, &purged);
         peer_pid = 0;
+        spin_unlock_bh(&queue_lock);
+
+        delay_list_verdict(&purged, DELAY_DROP);
 }
 
 int delay_queue_skb(struct sk_buff *skb, struct service_id *srvid)
@@ -117,7 +398,6 @@ int delay_queue_skb(struct sk_buff *skb, struct service_id *srvid)
 
         *de = (struct delay_entry) {
                 .skb = skb,
-                .id = queue_id++,
                 .sk = skb->sk,
         };
         
@@ -131,13 +411,32 @@ int delay_queue_skb(struct sk_buff *skb, struct service_id *srvid)
 #if defined(OS_LINUX_KERNEL)
 		if (net_ratelimit())
                         LOG_WARN("delay_queue: queue is full."
-                                 " Queue total: %u Dropped: %u\n", 
+                                 " Queue total: %u Dropped: %u"
+                                 " Expired: %u\n", 
                                  queue_total,
-                                 queue_dropped);
+                                 queue_dropped,
+                                 queue_expired);
 #endif
 		goto err_out_drop;
 	}        
 
+        de->ds = __delay_service_get(srvid);
+
+        if (!de->ds) {
+                ret = -ENOMEM;
+                goto err_out_drop;
+        }
+
+        if (de->ds->limit && de->ds->len >= de->ds->limit) {
+                ret = -ENOSPC;
+                LOG_DBG("delay_queue: service queue is full (%u)\n",
+                        de->ds->len);
+                goto err_out_drop;
+        }
+
+        de->id = queue_id++;
+        de->expires = jiffies + de->ds->timeout;
+
         memset(&cmd, 0, sizeof(cmd));
         cmd.cmh.type = CTRLMSG_TYPE_DELAY_NOTIFY;
         cmd.cmh.len = sizeof(cmd);
@@ -158,6 +457,8 @@ int delay_queue_skb(struct sk_buff *skb, struct service_id *srvid)
         return 0;
 
  err_out_drop:
+        if (de->ds)
+                __delay_service_put(de->ds);
         spin_unlock_bh(&queue_lock);
         kfree_skb(skb);
         delay_entry_free(de);
@@ -165,24 +466,34 @@ int delay_queue_skb(struct sk_buff *skb, struct service_id *srvid)
         return ret;
 }
 
-int delay_queue_set_verdict(unsigned int pkt_id, 
-                            enum delay_verdict verdict,
-                            int pid)
+static int __delay_queue_check_peer(int pid)
 {
-        struct delay_entry *entry;
-        int ret = 0;
-
-        spin_lock_bh(&queue_lock);
-        
         if (peer_pid) {
                 if (peer_pid != pid) {
                         LOG_ERR("Verdict from wrong peer!\n");
-			spin_unlock_bh(&queue_lock);
 			return -EBUSY;
 		}
 	} else {
 		peer_pid = pid;
 	}
+        return 0;
+}
+
+int delay_queue_set_verdict(unsigned int pkt_id, 
+                            enum delay_verdict verdict,
+                            int pid)
+{
+        struct delay_entry *entry;
+        int ret;
+
+        spin_lock_bh(&queue_lock);
+        
+        ret = __delay_queue_check_peer(pid);
+
+        if (ret) {
+                spin_unlock_bh(&queue_lock);
+                return ret;
+        }
 
         entry = __delay_queue_find(pkt_id);
         
@@ -191,50 +502,105 @@ int delay_queue_set_verdict(unsigned int pkt_id,
                 return 0;
         }
 
-        list_del(&entry->lh);
-        queue_total--;
+        __delay_queue_remove(entry);
+        __delay_service_put(entry->ds);
 
-        switch (verdict) {
-        case DELAY_DROP:
-                LOG_DBG("Verdict for pkt %u is DROP\n");
-                kfree_skb(entry->skb);
-                queue_dropped++;
-                break;
-        case DELAY_RELEASE:
-                LOG_DBG("Verdict for pkt %u is RELEASE\n");
-                /* FIXME: 
-                   Here we need to be careful that the RELEASE does
-                   not cause the skb to be DELAYED again, which could
-                   cause a loop until the queue is full. This only
-                   happens with unbehaved apps though. We should
-                   figure out a way to ensure that a re-resolution
-                   does not hit a DELAY rule more than once.
-                */
-                if (entry->sk) {
-                        /* If the skb is owned by a socket, it means
-                           it was generated locally and was not
-                           received from the network */
-                        if (sock_flag(entry->sk, SOCK_DEAD)) {
-                                kfree_skb(entry->skb);
-                                queue_dropped++;
-                                LOG_DBG("Socket is DEAD, dropping pkt %u\n",
-                                        pkt_id);
-                        } else {
-                                serval_sal_xmit_skb(entry->skb);
-                                ret = 1;
-                        }
-                } else {
-                        /* Just reinject this packet as if received
-                           from the network */
-                        serval_sal_reresolve(entry->skb);
-                        ret = 1;
-                }
-                break;
+        spin_unlock_bh(&queue_lock);
+
+        return delay_entry_verdict(entry, verdict);
+}
+
+/* Give all packets queued for a service the same verdict. Returns
+   the number of packets released. */
+int delay_queue_set_service_verdict(struct service_id *srvid,
+                                    enum delay_verdict verdict,
+                                    int pid)
+{
+        struct delay_service *ds;
+        LIST_HEAD(head);
+        int ret;
+
+        spin_lock_bh(&queue_lock);
+        
+        ret = __delay_queue_check_peer(pid);
+
+        if (ret) {
+                spin_unlock_bh(&queue_lock);
+                return ret;
+        }
+
+        ds = __delay_service_find(srvid);
+
+        if (ds) {
+                __delay_service_splice(ds, &head);
+                __delay_service_put(ds);
         }
 
         spin_unlock_bh(&queue_lock);
+
+        return delay_list_verdict(&head, verdict);
+}
+
+int delay_queue_configure(struct service_id *srvid, 
+                          unsigned int limit,
+                          unsigned int timeout_ms,
+                          enum delay_verdict timeout_verdict,
+                          int pid)
+{
+        unsigned long timeout = 0;
+        struct delay_service *ds;
+        int ret = 0;
+
+        if (timeout_verdict != DELAY_RELEASE && 
+            timeout_verdict != DELAY_DROP)
+                return -EINVAL;
+
+        if (timeout_ms) {
+                timeout = msecs_to_jiffies(timeout_ms);
+
+                if (timeout == 0)
+                        timeout = 1;
+        }
+
+        spin_lock_bh(&queue_lock);
+
+        /* Only the peer that gives verdicts may configure the queue */
+        ret = __delay_queue_check_peer(pid);
+
+        if (ret)
+                goto out;
         
-        delay_entry_free(entry);
+        if (!srvid) {
+                delay_default.limit = limit;
+                delay_default.timeout = timeout;
+                delay_default.timeout_verdict = timeout_verdict;
+                goto out;
+        }
+        
+        ds = __delay_service_get(srvid);
+
+        if (!ds) {
+                ret = -ENOMEM;
+                goto out;
+        }
+        
+        ds->configured = 1;
+        ds->limit = limit;
+        ds->timeout_verdict = timeout_verdict;
+
+        /* Packets already queued now expire the new timeout after
+           they were queued */
+        if (ds->timeout != timeout) {
+                struct delay_entry *de;
+
+                list_for_each_entry(de, &ds->queue, lh) {
+                        de->expires = de->expires - ds->timeout + timeout;
+                }
+                ds->timeout = timeout;
+                __delay_timer_update();
+        }
+ out:
+        spin_unlock_bh(&queue_lock);
 
         return ret;
 }
@@ -246,10 +612,16 @@ static int delay_queue_rcv_nl_event(struct notifier_block *this,
 	struct netlink_notify *n = ptr;
 
 	if (event == NETLINK_URELEASE && n->protocol == NETLINK_SERVAL) {
+                LIST_HEAD(purged);
+
 		spin_lock_bh(&queue_lock);
-		if ((net_eq(n->net, &init_net)) && (n->portid == peer_pid))
-                        __delay_queue_reset();
+		if ((net_eq(n->net, &init_net)) && (n->portid == peer_pid)) {
+                        __delay_queue_purge_sock(NULL, &purged);
+                        peer_pid = 0;
+                }
 		spin_unlock_bh(&queue_lock);
+
+                delay_list_verdict(&purged, DELAY_DROP);
 	}
 	return NOTIFY_DONE;
 }
@@ -262,7 +634,18 @@ static struct notifier_block delay_queue_nl_notifier = {
 
 int delay_queue_init(void)
 {
+        unsigned int i;
+
         peer_pid = 0;
+
+        for (i = 0; i < DELAY_QUEUE_HASH_SIZE; i++)
+                INIT_HLIST_HEAD(&delay_hash[i]);
+
+        for (i = 0; i < DELAY_SERVICE_HASH_SIZE; i++)
+                INIT_HLIST_HEAD(&delay_service_hash[i]);
+
+        delay_service_seed = serval_random_u32();
+        setup_timer(&delay_timer, delay_timeout, 0);
 #if defined(OS_LINUX_KERNEL)
 	netlink_register_notifier(&delay_queue_nl_notifier);
 #endif
@@ -271,8 +654,22 @@ int delay_queue_init(void)
 
 void delay_queue_fini(void)
 {
-        __delay_queue_reset();
+        unsigned int i;
+
+        delay_queue_reset();
 #if defined(OS_LINUX_KERNEL)
 	netlink_unregister_notifier(&delay_queue_nl_notifier);
+        del_timer_sync(&delay_timer);
+#else
+        del_timer(&delay_timer);
 #endif
+        /* Only configured services are left */
+        for (i = 0; i < DELAY_SERVICE_HASH_SIZE; i++) {
+                struct hlist_node *pos, *tmp;
+
+                hlist_for_each_safe(pos, tmp, &delay_service_hash[i]) {
+                        hlist_del(pos);
+                        kfree(hlist_entry(pos, struct delay_service, node));
+                }
+        }
 }
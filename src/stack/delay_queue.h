@@ -17,6 +17,14 @@
 int delay_queue_set_verdict(unsigned int pkt_id, 
                             enum delay_verdict verdict,
                             int pid);
+int delay_queue_set_service_verdict(struct service_id *srvid,
+                                    enum delay_verdict verdict,
+                                    int pid);
+int delay_queue_configure(struct service_id *srvid, 
+                          unsigned int limit,
+                          unsigned int timeout_ms,
+                          enum delay_verdict timeout_verdict,
+                          int pid);
 int delay_queue_skb(struct sk_buff *skb, struct service_id *srvid);
 void delay_queue_purge_sock(struct sock *sk);
 
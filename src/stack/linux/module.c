@@ -41,6 +41,10 @@ unsigned int gso = 0;
 module_param(gso, uint, S_IRUGO|S_IWUSR);
 MODULE_PARM_DESC(debug, "Set generic segmentation offloading (0=off, 1=on)");
 
+unsigned int service_trie_stride = 0;
+module_param(service_trie_stride, uint, S_IRUGO);
+MODULE_PARM_DESC(service_trie_stride, "Service table trie stride (0=bitwise trie, 1-8=multibit trie)");
+
 static char *ifname = NULL;
 module_param(ifname, charp, S_IRUGO);
 MODULE_PARM_DESC(ifname, "Resolve only on this device");
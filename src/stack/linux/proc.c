@@ -19,6 +19,7 @@
 #define SERVAL_PROC_DBG "dbg"
 #define SERVAL_PROC_FILE_SERVICE_TBL "service_table"
 #define SERVAL_PROC_FILE_FLOW_TBL "flow_table"
+#define SERVAL_PROC_FILE_SERVICE_CACHE "service_cache"
 
 static struct proc_dir_entry *serval_dir = NULL;
 
@@ -146,6 +147,34 @@ static const struct file_operations flow_table_fops = {
         .release = seq_release_private,
 };
 
+static int service_cache_seq_show(struct seq_file *seq, void *v)
+{
+        char buf[1000];
+        int len;
+
+        len = service_cache_print(buf, sizeof(buf));
+
+        if (len > sizeof(buf) - 1)
+                len = sizeof(buf) - 1;
+
+        seq_write(seq, buf, len);
+
+        return 0;
+}
+
+static int service_cache_seq_open(struct inode *inode, struct file *file)
+{
+        return single_open(file, service_cache_seq_show, NULL);
+}
+
+static const struct file_operations service_cache_fops = {
+        .owner   = THIS_MODULE,
+        .open    = service_cache_seq_open,
+        .read    = seq_read,
+        .llseek  = seq_lseek,
+        .release = single_release,
+};
+
 /*
   Debug output through /proc/serval/dbg based on linux kernel
   /proc/kmsg
@@ -243,11 +272,21 @@ int proc_init(void)
 
         if (!proc)
                 goto fail_flow_tbl;
+
+        proc = proc_create(SERVAL_PROC_FILE_SERVICE_CACHE,
+                           S_IRUGO, 
+                           serval_dir, 
+                           &service_cache_fops);
+
+        if (!proc)
+                goto fail_service_cache;
         
         ret = 0;
 out:        
         return ret;
 
+fail_service_cache:
+        remove_proc_entry(SERVAL_PROC_FILE_FLOW_TBL, serval_dir);
 fail_flow_tbl:
         remove_proc_entry(SERVAL_PROC_FILE_SERVICE_TBL, serval_dir);
 fail_service_tbl:
@@ -264,6 +303,7 @@ void proc_fini(void)
 
         remove_proc_entry(SERVAL_PROC_FILE_SERVICE_TBL, serval_dir);
         remove_proc_entry(SERVAL_PROC_FILE_FLOW_TBL, serval_dir);
+        remove_proc_entry(SERVAL_PROC_FILE_SERVICE_CACHE, serval_dir);
         remove_proc_entry(SERVAL_PROC_DBG, serval_dir);
 	remove_proc_entry(SERVAL_PROC_DIR, proc_net);
 }
@@ -0,0 +1,82 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * Kernel helpers for socket buffers.
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License as
+ *	published by the Free Software Foundation; either version 2 of
+ *	the License, or (at your option) any later version.
+ */
+#include <linux/skbuff.h>
+#include <net/dst.h>
+#include <serval/skbuff.h>
+
+/**
+ *	skb_share_copy - copy headers and share the payload
+ *	@skb: buffer to copy
+ *	@hdr_len: bytes following skb->data to make private
+ *	@headroom: free bytes wanted in front of skb->data
+ *	@gfp_mask: allocation priority
+ *
+ *	Make a copy of an &sk_buff where everything from the network
+ *	header up to @hdr_len bytes past skb->data is private and may
+ *	be modified, while the rest of the data is shared with @skb
+ *	through a clone on the frag_list of the copy. Unlike
+ *	pskb_copy(), this also shares payload in the linear data area.
+ *
+ *	The shared payload must not be modified through either
+ *	buffer. Falls back to skb_copy() if the headers are not all
+ *	in the linear data area. Returns %NULL on failure.
+ */
+struct sk_buff *skb_share_copy(struct sk_buff *skb, unsigned int hdr_len,
+                               unsigned int headroom, gfp_t gfp_mask)
+{
+        int nh_off = skb->data - skb_network_header(skb);
+        struct sk_buff *n, *payload;
+
+        if (nh_off < 0 || hdr_len >= skb_headlen(skb) ||
+            (int)headroom < nh_off || skb_shinfo(skb)->frag_list ||
+            skb->ip_summed == CHECKSUM_PARTIAL)
+                return skb_copy(skb, gfp_mask);
+
+        payload = skb_clone(skb, gfp_mask);
+
+        if (!payload)
+                return NULL;
+
+        n = alloc_skb(headroom + hdr_len, gfp_mask);
+
+        if (!n) {
+                kfree_skb(payload);
+                return NULL;
+        }
+
+        skb_reserve(n, headroom - nh_off);
+        skb_copy_from_linear_data_offset(skb, -nh_off,
+                                         skb_put(n, nh_off + hdr_len),
+                                         nh_off + hdr_len);
+
+        /* The subset of the header that matters for forwarding */
+        n->dev = skb->dev;
+        n->protocol = skb->protocol;
+        n->pkt_type = skb->pkt_type;
+        n->priority = skb->priority;
+        n->mark = skb->mark;
+        n->tstamp = skb->tstamp;
+        n->ip_summed = CHECKSUM_NONE;
+        memcpy(n->cb, skb->cb, sizeof(skb->cb));
+        skb_dst_copy(n, skb);
+
+        skb_reset_network_header(n);
+        skb_reset_mac_header(n);
+        __skb_pull(n, nh_off);
+        skb_set_transport_header(n, skb_transport_header(skb) - skb->data);
+
+        __skb_pull(payload, hdr_len);
+        skb_shinfo(n)->frag_list = payload;
+        n->data_len = payload->len;
+        n->len += payload->len;
+        n->truesize += payload->truesize;
+
+        return n;
+}
@@ -28,6 +28,13 @@ extern void udp_encap_client_fini(void);
 extern void udp_encap_server_fini(void);
 extern int inet_to_serval_enable(void);
 extern void inet_to_serval_disable(void);
+extern int serval_tcp_set_default_congestion_control(const char *name);
+extern void serval_tcp_get_default_congestion_control(char *name);
+extern void serval_tcp_get_available_congestion_control(char *buf,
+                                                        size_t maxlen);
+
+#define SERVAL_TCP_CA_NAME_MAX 16
+#define SERVAL_TCP_CA_BUF_MAX 128
 
 static int proc_inet_to_serval(struct ctl_table *table, int write,
 			       void *buffer, size_t *lenp, loff_t *ppos)
@@ -91,6 +98,46 @@ static int proc_udp_encap_port(struct ctl_table *table, int write,
 	return err;
 }
 
+static int proc_tcp_congestion_control(struct ctl_table *ctl, int write,
+                                       void *buffer, size_t *lenp,
+                                       loff_t *ppos)
+{
+	char val[SERVAL_TCP_CA_NAME_MAX];
+	struct ctl_table tbl = {
+		.data = val,
+		.maxlen = SERVAL_TCP_CA_NAME_MAX,
+	};
+	int err;
+
+	serval_tcp_get_default_congestion_control(val);
+
+	err = proc_dostring(&tbl, write, buffer, lenp, ppos);
+
+	if (write && err == 0)
+		err = serval_tcp_set_default_congestion_control(val);
+
+	return err;
+}
+
+static int proc_tcp_available_congestion_control(struct ctl_table *ctl,
+                                                 int write, void *buffer,
+                                                 size_t *lenp, loff_t *ppos)
+{
+	struct ctl_table tbl = { .maxlen = SERVAL_TCP_CA_BUF_MAX, };
+	int err;
+
+	tbl.data = kmalloc(tbl.maxlen, GFP_USER);
+
+	if (!tbl.data)
+		return -ENOMEM;
+
+	serval_tcp_get_available_congestion_control(tbl.data, tbl.maxlen);
+	err = proc_dostring(&tbl, write, buffer, lenp, ppos);
+	kfree(tbl.data);
+
+	return err;
+}
+
 static ctl_table serval_table[] = {
         {   
                 .procname = "auto_migrate",
@@ -128,6 +175,15 @@ static ctl_table serval_table[] = {
                 .extra1 = &zero,
                 .extra2 = &one,
 	},
+	{
+		.procname = "sal_csum_verify",
+		.data = &net_serval.sysctl_sal_csum_verify,
+		.maxlen = sizeof(unsigned int),
+		.mode = 0644,
+		.proc_handler = proc_dointvec_minmax,
+                .extra1 = &zero,
+                .extra2 = &one,
+	},
 	{
 		.procname = "sal_max_retransmits",
 		.data = &net_serval.sysctl_sal_max_retransmits,
@@ -155,6 +211,18 @@ static ctl_table serval_table[] = {
                 .extra1 = &zero,
                 .extra2 = &one,
         },
+	{
+		.procname = "tcp_available_congestion_control",
+		.maxlen = SERVAL_TCP_CA_BUF_MAX,
+		.mode = 0444,
+		.proc_handler = proc_tcp_available_congestion_control,
+	},
+	{
+		.procname = "tcp_congestion_control",
+		.maxlen = SERVAL_TCP_CA_NAME_MAX,
+		.mode = 0644,
+		.proc_handler = proc_tcp_congestion_control,
+	},
 	{
 		.procname = "udp_encap_client_port",
 		.data = &net_serval.sysctl_udp_encap_client_port,
@@ -1300,6 +1300,9 @@ enum source_ext_res serval_sal_source_ext_check(struct sk_buff *skb,
    @ctx the serval header context for the incoming packet (note that
    this context may not point to the headers in in_skb as in_skb may
    be a clone or copy.
+
+   The SAL header checksum is updated incrementally, assuming it was
+   valid on input.
 */
 static int serval_sal_add_source_ext(struct sk_buff **in_skb,
                                      struct sal_context *ctx)
@@ -1309,7 +1312,9 @@ static int serval_sal_add_source_ext(struct sk_buff **in_skb,
         struct sal_hdr *sh;
         struct sal_source_ext *sxt = ctx ? ctx->src_ext : NULL;
         unsigned int size, extra_len = 0, sal_len = 0, ext_len = 0;
+        unsigned int ext_off = 0, ins_off;
         unsigned char *ptr;
+        __wsum csum;
 
         iph = ip_hdr(skb);
         sh = sal_hdr(skb);
@@ -1340,6 +1345,19 @@ static int serval_sal_add_source_ext(struct sk_buff **in_skb,
         sal_len = ctx->length + extra_len;
         size = (char *)sh - (char *)iph;
 
+        /* Remove the fields we are about to change from the
+           checksum. Everything after the insertion point moves by a
+           multiple of four bytes, so its contribution is unchanged. */
+        csum = ~csum_unfold((__force __sum16)sh->check);
+        csum = csum_sub(csum, csum_partial(&sh->shl, 2, 0));
+
+        if (ctx->src_ext) {
+                ext_off = (char *)ctx->src_ext - (char *)ctx->hdr;
+                csum = csum_block_sub(csum, 
+                                      csum_partial((char *)sh + ext_off, 
+                                                   2, 0), ext_off);
+        }
+
         /* Push back to IP header */
         skb_push(skb, size);
 
@@ -1374,13 +1392,14 @@ static int serval_sal_add_source_ext(struct sk_buff **in_skb,
                 /* No previous source extension. Append new header. */
                 ptr = ((unsigned char *)sh + ctx->length);
         }
+        
+        ins_off = ptr - (unsigned char *)sh;
 
-        /* Check if we need to linearize */
-        if (skb_is_nonlinear(skb)) {
-                if (skb_linearize(skb)) {
-                        LOG_ERR("Could not linearize skb\n");
-                        return -ENOMEM;
-                }
+        /* The headers we move must be linear, while the payload
+           may be shared with other copies of the packet */
+        if (!pskb_may_pull(skb, ptr - skb->data)) {
+                LOG_ERR("Could not linearize skb headers\n");
+                return -ENOMEM;
         }
 
         /* Move back everything from the point of insertion, making
@@ -1418,9 +1437,20 @@ static int serval_sal_add_source_ext(struct sk_buff **in_skb,
                        &iph->daddr, sizeof(iph->daddr));
         }
         
-        sh->check = 0;
         sh->shl = sal_len >> 2;
 
+        /* Add back the changed fields and the inserted bytes */
+        csum = csum_add(csum, csum_partial(&sh->shl, 2, 0));
+
+        if (ctx->src_ext)
+                csum = csum_block_add(csum, csum_partial(sxt, 2, 0), 
+                                      ext_off);
+
+        csum = csum_block_add(csum, csum_partial((unsigned char *)sh + 
+                                                 ins_off, extra_len, 0),
+                              ins_off);
+        sh->check = csum_fold(csum);
+
         LOG_DBG("New SAL hdr (old_len=%u new_len=%u): skb->len=%u %s\n",
                 ctx->length,
                 sal_len,
@@ -2085,8 +2115,7 @@ static struct sock * serval_sal_request_sock_handle(struct sock *sk,
 
                         serval_sock_set_state(nsk, SAL_RESPOND);
 
-                        memcpy(&nssk->local_flowid, &srsk->local_flowid, 
-                               sizeof(srsk->local_flowid));
+                        serval_sock_set_flowid(nsk, &srsk->local_flowid);
                         memcpy(&nssk->peer_flowid, &srsk->peer_flowid, 
                                sizeof(srsk->peer_flowid));
                         service_id_copy(&nssk->peer_srvid, &srsk->peer_srvid);
@@ -3033,8 +3062,7 @@ static int serval_sal_update_transport_csum(struct sk_buff *skb,
         switch (protocol) {
         case SERVAL_PROTO_TCP:
                 tcp_hdr(skb)->check = 0;
-                skb->csum = csum_partial(tcp_hdr(skb),
-                                         skb->len, 0);
+                skb->csum = skb_checksum(skb, 0, skb->len, 0);
                 tcp_hdr(skb)->check = 
                         csum_tcpudp_magic(iph->saddr, 
                                           iph->daddr, 
@@ -3044,8 +3072,7 @@ static int serval_sal_update_transport_csum(struct sk_buff *skb,
                 break;
         case SERVAL_PROTO_UDP:
                 udp_hdr(skb)->check = 0;
-                skb->csum = csum_partial(udp_hdr(skb),
-                                         skb->len, 0);
+                skb->csum = skb_checksum(skb, 0, skb->len, 0);
                 udp_hdr(skb)->check = 
                         csum_tcpudp_magic(iph->saddr, 
                                           iph->daddr, 
@@ -3063,6 +3090,64 @@ static int serval_sal_update_transport_csum(struct sk_buff *skb,
         return 0;
 }
 
+/* 
+   Adjust the transport checksum of a forwarded packet for the
+   rewritten destination address (RFC 1624), instead of recomputing
+   it over the whole payload. The transport header must be
+   reset. Packets with a partial checksum still need the full
+   computation.
+*/
+static void serval_sal_replace_transport_csum(struct sk_buff *skb,
+                                              int protocol,
+                                              __be32 old_daddr)
+{
+        struct iphdr *iph = ip_hdr(skb);
+        __sum16 *check;
+
+        if (skb->ip_summed == CHECKSUM_PARTIAL) {
+                serval_sal_update_transport_csum(skb, protocol);
+                return;
+        }
+
+        skb->ip_summed = CHECKSUM_NONE;
+
+        switch (protocol) {
+        case SERVAL_PROTO_TCP:
+                check = &tcp_hdr(skb)->check;
+                csum_replace4(check, old_daddr, iph->daddr);
+                break;
+        case SERVAL_PROTO_UDP:
+                check = &udp_hdr(skb)->check;
+
+                /* Zero means no checksum */
+                if (*check == 0)
+                        return;
+
+                csum_replace4(check, old_daddr, iph->daddr);
+
+                if (*check == 0)
+                        *check = CSUM_MANGLED_0;
+                break;
+        default:
+                LOG_INF("Unknown transport protocol %u, "
+                        "forgoing checksum calculation\n",
+                        protocol);
+                return;
+        }
+
+        if (net_serval.sysctl_sal_csum_verify) {
+                __sum16 incr = *check;
+                
+                serval_sal_update_transport_csum(skb, protocol);
+
+                if (incr != *check) {
+                        LOG_ERR("Transport checksum mismatch: "
+                                "incremental=%04x full=%04x\n",
+                                incr, *check);
+                }
+        }
+}
+
 #if defined(OS_LINUX_KERNEL)
 static int serval_sal_update_encap_csum(struct sk_buff *skb)
 {
@@ -3074,11 +3159,38 @@ static int serval_sal_update_encap_csum(struct sk_buff *skb)
                                       ip_hdr(skb)->daddr, 
                                       skb->len,
                                       IPPROTO_UDP,
-                                      csum_partial(uh, skb->len, 0));
+                                      skb_checksum(skb, 0, skb->len, 0));
         return 0;
 }
 #endif /* OS_LINUX_KERNEL */
 
+/* 
+   The length of the headers that are rewritten when forwarding,
+   i.e., the SAL header and the transport header that holds the
+   checksum. Copies for additional targets share everything after
+   it.
+*/
+static unsigned int serval_sal_forward_hdr_len(struct sk_buff *skb,
+                                               struct sal_context *ctx)
+{
+        unsigned int len = ctx->length;
+
+        switch (ctx->hdr->protocol) {
+        case SERVAL_PROTO_TCP:
+                if (pskb_may_pull(skb, len + sizeof(struct tcphdr)))
+                        len += ((struct tcphdr *)
+                                (skb->data + len))->doff << 2;
+                break;
+        case SERVAL_PROTO_UDP:
+                len += sizeof(struct udphdr);
+                break;
+        default:
+                break;
+        }
+
+        return len;
+}
+
 static int serval_sal_resolve_service(struct sk_buff *skb, 
                                       struct sal_context *ctx,
                                       struct service_id *srvid,
@@ -3087,9 +3199,10 @@ static int serval_sal_resolve_service(struct sk_buff *skb,
         struct service_entry* se = NULL;
         struct service_iter iter;
         struct target *target = NULL;
-        unsigned int hdr_len = ctx->length;
+        struct sk_buff_head fwd_queue;
+        struct sk_buff *cskb;
         unsigned int num_forward = 0;
-        unsigned int data_len = skb->len - hdr_len;
+        unsigned int data_len = skb->len - ctx->length;
         int err = SAL_RESOLVE_NO_MATCH;
 
         *sk = NULL;
@@ -3110,8 +3223,11 @@ static int serval_sal_resolve_service(struct sk_buff *skb,
                 return SAL_RESOLVE_NO_MATCH;
         }
         
-	if (service_iter_init(&iter, se, SERVICE_ITER_ANYCAST) < 0)
+	if (service_iter_init(&iter, se, SERVICE_ITER_ANYCAST) < 0) {
+                service_iter_destroy(&iter);
+                service_entry_put(se);
                 return SAL_RESOLVE_ERROR;
+        }
         
         /*
           Send to all targets listed for this service.
@@ -3127,14 +3243,19 @@ static int serval_sal_resolve_service(struct sk_buff *skb,
         }
 
         service_iter_inc_stats(&iter, 1, data_len);
+
+        /* Packets are queued here until all targets have been
+           resolved, and then forwarded in one go */
+        __skb_queue_head_init(&fwd_queue);
                 
         while (target) {
                 struct target *next_target;
-                struct sk_buff *cskb = NULL;
                 struct iphdr *iph;
-                unsigned int iph_len;
+                unsigned int iph_len, hdr_len;
                 unsigned int protocol = sal_hdr(skb)->protocol;
                 int ret = 0;
+
+                cskb = NULL;
                 
                 next_target = service_iter_next(&iter);
                 
@@ -3177,7 +3298,16 @@ static int serval_sal_resolve_service(struct sk_buff *skb,
                            returns). */
                         cskb = skb;
                 } else {
-                        cskb = skb_copy(skb, GFP_ATOMIC);
+                        /* Only the headers are rewritten, so
+                           share the payload with the original
+                           packet. Leave room for the source
+                           extension. */
+                        cskb = skb_share_copy(skb, 
+                                              serval_sal_forward_hdr_len(skb, 
+                                                                         ctx),
+                                              skb_headroom(skb) + 
+                                              SAL_SOURCE_EXT_LEN + 4,
+                                              GFP_ATOMIC);
                         
                         if (!cskb) {
                                 LOG_ERR("Skb allocation failed\n");
@@ -3214,26 +3344,34 @@ static int serval_sal_resolve_service(struct sk_buff *skb,
                         }
                         /* Try next target */
                 } else {
+                        __be32 old_daddr;
+
                         iph = ip_hdr(cskb);
-                        hdr_len += ret;
+                        hdr_len = ctx->length + ret;
                         
                         /* Update destination address */
+                        old_daddr = iph->daddr;
                         memcpy(&iph->daddr, target->dst, sizeof(iph->daddr));
                         
-                        /* Must recalculate transport checksum. Pull
+                        /* Must update transport checksum. Pull
                            to reveal transport header */
                         pskb_pull(cskb, hdr_len);
                         skb_reset_transport_header(cskb);
                         
-                        serval_sal_update_transport_csum(cskb,
-                                                         protocol);
+                        serval_sal_replace_transport_csum(cskb, protocol,
+                                                          old_daddr);
                         
                         /* Push back to Serval header */
                         skb_push(cskb, hdr_len);
                         skb_reset_transport_header(cskb);
                         
-                        /* Recalculate SAL checksum */
-                        serval_sal_send_check(sal_hdr(cskb));
+                        /* The SAL checksum was updated along with
+                           the source extension */
+                        if (net_serval.sysctl_sal_csum_verify &&
+                            serval_sal_csum(sal_hdr(cskb), hdr_len)) {
+                                LOG_ERR("SAL checksum mismatch\n");
+                                serval_sal_send_check(sal_hdr(cskb));
+                        }
 
 #if defined(OS_LINUX_KERNEL)
                         /* Packet is UDP encapsulated, push back UDP
@@ -3250,19 +3388,23 @@ static int serval_sal_resolve_service(struct sk_buff *skb,
 #endif
                         /* Push back to IP header */
                         skb_push(cskb, iph_len);
-                                                
-                        ret = serval_ipv4_forward_out(cskb);
-                        
-                        if (ret) {
-                                /* serval_ipv4_forward_out has taken
-                                   custody of packet, no need to
-                                   free. */
-                                LOG_ERR("Forwarding failed\n");
-                        } else 
-                                num_forward++;
+
+                        __skb_queue_tail(&fwd_queue, cskb);
                 }
                 target = next_target;
         }
+
+        /* The original packet, which the copies share payload with,
+           is always queued last, if at all */
+        while ((cskb = __skb_dequeue(&fwd_queue)) != NULL) {
+                if (serval_ipv4_forward_out(cskb)) {
+                        /* serval_ipv4_forward_out has taken
+                           custody of packet, no need to
+                           free. */
+                        LOG_ERR("Forwarding failed\n");
+                } else 
+                        num_forward++;
+        }
         
         if (num_forward == 0)
                 service_iter_inc_stats(&iter, -1, -data_len);
@@ -4053,6 +4195,8 @@ int serval_sal_transmit_skb(struct sock *sk, struct sk_buff *skb,
 
 	if (service_iter_init(&iter, se, 
                               net_serval.sysctl_resolution_mode) < 0) {
+                service_iter_destroy(&iter);
+                service_entry_put(se);
                 kfree_skb(skb);
                 LOG_ERR("Could not initialize service iterator\n");
                 return -1;
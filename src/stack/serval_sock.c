@@ -17,6 +17,8 @@
 #include <serval/lock.h>
 #include <serval/timer.h>
 #include <serval/netdevice.h>
+#include <serval/bitops.h>
+#include <serval/rcupdate.h>
 #include <netinet/serval.h>
 #include <serval_sock.h>
 #include <serval_tcp_sock.h>
@@ -24,9 +26,16 @@
 #include <service.h>
 #if defined(OS_LINUX_KERNEL)
 #include <linux/ip.h>
+#include <linux/random.h>
+#include <linux/vmalloc.h>
 #include <net/route.h>
 #else
 #include <netinet/ip.h>
+#include <serval/random.h>
+#include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <unistd.h>
 #if defined(OS_LINUX)
 #include <endian.h>
 #endif
@@ -40,9 +49,61 @@ static struct serval_table request_table;
 static struct list_head sock_list = { &sock_list, &sock_list };
 static DEFINE_RWLOCK(sock_list_lock);
 
+/* 
+   Where the last chunk of a flow table dump ended, so that the next
+   chunk can continue from there instead of searching the sock list
+   from the head. Protected by sock_list_lock.
+*/
+static struct {
+        u32 after; /* The last flowID dumped */
+        struct serval_sock *next; /* The first flow not dumped, or NULL */
+        int valid;
+} flow_dump_pos;
+
 /* The number of (prefix) bytes to hash on in the serviceID */
 #define SERVICE_KEY_LEN (8)
 
+static inline u32 sock_flowid(struct sock *sk)
+{
+        return ntohl(serval_sk(sk)->local_flowid.s_id32);
+}
+
+/* 
+   The sock list is kept sorted by local flowID, so that the flow
+   table can be dumped in order. New flowIDs are usually the largest,
+   so the place of a socket is searched for from the tail.
+*/
+static void __sock_list_add(struct serval_sock *ssk)
+{
+        u32 id = sock_flowid((struct sock *)ssk);
+        struct list_head *pos = sock_list.prev;
+
+        while (pos != &sock_list && 
+               sock_flowid((struct sock *)list_entry(pos, struct serval_sock,
+                                                     sock_node)) > id)
+                pos = pos->prev;
+
+        list_add(&ssk->sock_node, pos);
+
+        if (flow_dump_pos.valid && id > flow_dump_pos.after &&
+            (!flow_dump_pos.next || 
+             id < sock_flowid((struct sock *)flow_dump_pos.next)))
+                flow_dump_pos.next = ssk;
+}
+
+static void __sock_list_del(struct serval_sock *ssk)
+{
+        if (flow_dump_pos.next == ssk) {
+                if (ssk->sock_node.next == &sock_list)
+                        flow_dump_pos.next = NULL;
+                else
+                        flow_dump_pos.next = 
+                                list_entry(ssk->sock_node.next, 
+                                           struct serval_sock, sock_node);
+        }
+        list_del(&ssk->sock_node);
+}
+
 static const char *sock_state_str[] = {
         [ SAL_INIT ]      = "INIT",
         [ SAL_CONNECTED ] = "CONNECTED",
@@ -67,154 +128,441 @@ static const char *sock_sal_state_str[] = {
 
 static void serval_sock_destruct(struct sock *sk);
 
+static struct serval_hbuckets *serval_hbuckets_alloc(unsigned int size,
+                                                     unsigned int gen)
+{
+        struct serval_hbuckets *b;
+        size_t sz = sizeof(*b) + size * sizeof(struct hlist_nulls_head);
+        unsigned int i;
+
+#if defined(OS_LINUX_KERNEL)
+        if (sz > PAGE_SIZE)
+                b = vmalloc(sz);
+        else
+#endif
+                b = kmalloc(sz, GFP_KERNEL);
+
+        if (!b)
+                return NULL;
+
+        b->mask = size - 1;
+        b->gen = gen;
+
+        for (i = 0; i < size; i++)
+                INIT_HLIST_NULLS_HEAD(&b->head[i], (i << 1) | (gen & 1));
+
+        return b;
+}
+
+static void serval_hbuckets_free(struct serval_hbuckets *b)
+{
+#if defined(OS_LINUX_KERNEL)
+        if (is_vmalloc_addr(b)) {
+                vfree(b);
+                return;
+        }
+#endif
+        kfree(b);
+}
+
+/* The nulls value that terminates a chain in a given array */
+static inline unsigned long serval_hbuckets_nulls(struct serval_hbuckets *b,
+                                                  unsigned int slot)
+{
+        return (slot << 1) | (b->gen & 1);
+}
+
+/* Returns the bucket array size that suits the current number of
+   sockets in the table, or zero if the table should stay as it is. */
+static unsigned int serval_table_new_size(struct serval_table *table)
+{
+        struct serval_hbuckets *b;
+        unsigned int count = atomic_read(&table->count);
+        unsigned int size, new_size;
+
+        rcu_read_lock();
+        b = rcu_dereference(table->buckets);
+        size = new_size = b->mask + 1;
+        rcu_read_unlock();
+
+        while (count > new_size && new_size < SERVAL_HTABLE_SIZE_MAX)
+                new_size <<= 1;
+
+        while (count < new_size / 4 && new_size > SERVAL_HTABLE_SIZE_MIN)
+                new_size >>= 1;
+
+        return new_size == size ? 0 : new_size;
+}
+
+/*
+  Move all sockets into a new bucket array. Readers and writers keep
+  going while the sockets are moved, one bucket at a time under the
+  bucket's lock. Writers always insert into the current array, while
+  readers search both arrays until the old one is retired.
+*/
+static int serval_table_resize(struct serval_table *table)
+{
+        struct serval_hbuckets *cur, *nb;
+        unsigned int size, i;
+
+        size = serval_table_new_size(table);
+
+        if (size == 0)
+                return -1;
+
+        cur = rcu_dereference_protected(table->buckets, 1);
+        nb = serval_hbuckets_alloc(size, cur->gen + 1);
+
+        if (!nb) {
+                LOG_ERR("could not allocate %u buckets\n", size);
+                return -1;
+        }
+
+        rcu_assign_pointer(table->old, cur);
+        /* Readers check the old array after the new one, so the new
+           array must be visible before sockets start moving */
+        rcu_assign_pointer(table->buckets, nb);
+
+        for (i = 0; i <= cur->mask; i++) {
+                spinlock_t *lock = serval_table_lock(table, i);
+
+                spin_lock_bh(lock);
+
+                if (!hlist_nulls_empty(&cur->head[i])) {
+                        /* Tell readers that a miss might be due to
+                           a socket being in flight between arrays */
+                        table->resize_seq++;
+                        smp_wmb();
+
+                        while (!hlist_nulls_empty(&cur->head[i])) {
+                                struct sock *sk;
+
+                                sk = hlist_nulls_entry(cur->head[i].first,
+                                                       struct sock,
+                                                       sk_nulls_node);
+                                hlist_nulls_del_rcu(&sk->sk_nulls_node);
+                                hlist_nulls_add_head_rcu(&sk->sk_nulls_node,
+                                                         &nb->head[sk->sk_hash &
+                                                                   nb->mask]);
+                        }
+                        smp_wmb();
+                        table->resize_seq++;
+                }
+                spin_unlock_bh(lock);
+#if defined(OS_LINUX_KERNEL)
+                cond_resched();
+#endif
+        }
+
+        rcu_assign_pointer(table->old, NULL);
+        synchronize_rcu();
+
+        LOG_DBG("resized flow table from %u to %u buckets\n",
+                cur->mask + 1, size);
+
+        serval_hbuckets_free(cur);
+
+        return 0;
+}
+
+static void serval_table_resize_all(struct serval_table *table)
+{
+        do {
+                while (serval_table_resize(table) == 0)
+                        ;
+                clear_bit(SERVAL_TABLE_RESIZING, &table->flags);
+                smp_mb();
+                /* Sockets may have come or gone after our last
+                   check, while others saw the flag set */
+        } while (serval_table_new_size(table) != 0 &&
+                 !test_and_set_bit(SERVAL_TABLE_RESIZING, &table->flags));
+}
+
+#if defined(OS_LINUX_KERNEL)
+static void serval_table_resize_work(struct work_struct *work)
+{
+        struct serval_table *table =
+                container_of(work, struct serval_table, resize_work);
+
+        serval_table_resize_all(table);
+}
+#else
+static void *serval_table_resize_thread(void *arg)
+{
+        serval_table_resize_all((struct serval_table *)arg);
+
+        return NULL;
+}
+#endif
+
+/* Called after inserting or removing a socket. The resize itself
+   runs in process context outside the caller's locks. */
+static void serval_table_check_size(struct serval_table *table)
+{
+        if (serval_table_new_size(table) == 0 ||
+            test_and_set_bit(SERVAL_TABLE_RESIZING, &table->flags))
+                return;
+
+#if defined(OS_LINUX_KERNEL)
+        schedule_work(&table->resize_work);
+#else
+        {
+                pthread_t thr;
+                int ret;
+
+                ret = pthread_create(&thr, NULL,
+                                     serval_table_resize_thread, table);
+
+                if (ret != 0) {
+                        LOG_ERR("could not start resize thread: %s\n",
+                                strerror(ret));
+                        clear_bit(SERVAL_TABLE_RESIZING, &table->flags);
+                        return;
+                }
+                pthread_detach(thr);
+        }
+#endif
+}
+
+static u32 serval_table_seed(void)
+{
+        u32 seed = 0;
+#if defined(OS_LINUX_KERNEL)
+        get_random_bytes(&seed, sizeof(seed));
+#else
+        int fd = open("/dev/urandom", O_RDONLY);
+
+        if (fd != -1) {
+                if (read(fd, &seed, sizeof(seed)) != sizeof(seed))
+                        seed = 0;
+                close(fd);
+        }
+
+        if (seed == 0)
+                seed = serval_random_u32();
+#endif
+        return seed;
+}
+
 int serval_table_init(struct serval_table *table,
                       unsigned int (*hashfn)(struct serval_table *tbl, 
                                              struct sock *sk),
-                      struct serval_hslot *(*hashslot)(struct serval_table *tbl,
-                                                       struct net *net,
-                                                       void *key,
-                                                       size_t keylen),
                       const char *name)
 {
 	unsigned int i;
 
-	table->hash = kmalloc(SERVAL_HTABLE_SIZE_MIN * 
-                              sizeof(struct serval_hslot), GFP_KERNEL);
+        table->buckets = serval_hbuckets_alloc(SERVAL_HTABLE_SIZE_MIN, 0);
 
-	if (!table->hash) {
+	if (!table->buckets) {
 		/* panic(name); */
 		return -1;
 	}
 
-	table->mask = SERVAL_HTABLE_SIZE_MIN - 1;
+        table->old = NULL;
         table->hashfn = hashfn;
-        table->hashslot = hashslot;
-
-	for (i = 0; i <= table->mask; i++) {
-		INIT_HLIST_HEAD(&table->hash[i].head);
-		table->hash[i].count = 0;
-		spin_lock_init(&table->hash[i].lock);
-	}
+        table->seed = serval_table_seed();
+        table->flags = 0;
+        table->resize_seq = 0;
+        atomic_set(&table->count, 0);
+#if defined(OS_LINUX_KERNEL)
+        INIT_WORK(&table->resize_work, serval_table_resize_work);
+#endif
+	for (i = 0; i < SERVAL_HTABLE_LOCKS; i++)
+		spin_lock_init(&table->locks[i]);
 
 	return 0;
 }
 
+/*
+  Call func on every socket in the table with the lock of the
+  socket's bucket held. The table may be resized concurrently, so
+  buckets are visited per lock, covering both bucket arrays.
+*/
+static void serval_table_for_each(struct serval_table *table,
+                                  void (*func)(struct sock *sk, void *arg),
+                                  void *arg)
+{
+        unsigned int l;
+
+        for (l = 0; l < SERVAL_HTABLE_LOCKS; l++) {
+                struct serval_hbuckets *arrs[2];
+                unsigned int a;
+
+                spin_lock_bh(&table->locks[l]);
+                rcu_read_lock();
+
+                /* Buckets covered by this lock cannot be migrated
+                   while we hold it. Read the current array first,
+                   since it is published after the old one. */
+                arrs[0] = rcu_dereference(table->buckets);
+                smp_rmb();
+                arrs[1] = rcu_dereference(table->old);
+
+                for (a = 0; a < 2; a++) {
+                        struct serval_hbuckets *b = arrs[a];
+                        unsigned int i;
+
+                        if (!b || (a == 1 && b == arrs[0]))
+                                continue;
+
+                        for (i = l; i <= b->mask; i += SERVAL_HTABLE_LOCKS) {
+                                struct hlist_nulls_node *walk;
+                                struct sock *sk;
+
+                                hlist_nulls_for_each_entry(sk, walk,
+                                                           &b->head[i],
+                                                           sk_nulls_node) {
+                                        func(sk, arg);
+                                }
+                        }
+                }
+                rcu_read_unlock();
+                spin_unlock_bh(&table->locks[l]);
+        }
+}
+
 void serval_table_fini(struct serval_table *table)
 {
+        struct serval_hbuckets *b;
         unsigned int i;
 
-        for (i = 0; i <= table->mask; i++) {
-                spin_lock_bh(&table->hash[i].lock);
+        /* Wait for, and prevent, resizes, so that all sockets are in
+           the current bucket array */
+#if defined(OS_LINUX_KERNEL)
+        set_bit(SERVAL_TABLE_RESIZING, &table->flags);
+        cancel_work_sync(&table->resize_work);
+#else
+        while (test_and_set_bit(SERVAL_TABLE_RESIZING, &table->flags))
+                sched_yield();
+#endif
+        b = rcu_dereference_protected(table->buckets, 1);
+
+        for (i = 0; i <= b->mask; i++) {
+                spinlock_t *lock = serval_table_lock(table, i);
+
+                spin_lock_bh(lock);
                         
-                while (!hlist_empty(&table->hash[i].head)) {
+                while (!hlist_nulls_empty(&b->head[i])) {
                         struct sock *sk;
 
-                        sk = hlist_entry(table->hash[i].head.first, 
-                                         struct sock, sk_node);
+                        sk = hlist_nulls_entry(b->head[i].first,
+                                               struct sock, sk_nulls_node);
                         LOG_SSK(sk, "unhashing socket %p\n", sk);
-                        hlist_del_init(&sk->sk_node);
-                        table->hash[i].count--;
+                        hlist_nulls_del_init_rcu(&sk->sk_nulls_node);
+                        atomic_dec(&table->count);
                         serval_sock_done(sk);
                 }
-                spin_unlock_bh(&table->hash[i].lock);           
+                spin_unlock_bh(lock);
 	}
 
-        FREE(table->hash);
+        synchronize_rcu();
+        serval_hbuckets_free(b);
 }
 
-void serval_sock_migrate_iface(int old_dev, int new_dev)
-{
-        struct hlist_node *walk;
-        struct sock *sk = NULL;
-        int i, n = 0;
+struct migrate_ctx {
+        int old_dev, new_dev, n;
+};
 
-        for (i = 0; i < SERVAL_HTABLE_SIZE_MIN; i++) {
-                struct serval_hslot *slot;
-                
-                slot = &established_table.hash[i];
+static void serval_sock_migrate_one(struct sock *sk, void *arg)
+{
+        struct migrate_ctx *ctx = (struct migrate_ctx *)arg;
+        int should_migrate = 0;
+
+        if (ctx->old_dev > 0 && ctx->new_dev > 0) {
+                if (ctx->old_dev == ctx->new_dev) {
+                        /* An existing interface changed its address,
+                         * i.e., physical mobility. */
+                        should_migrate = 1;
+                } else {
+                        /* We were told which
+                         * interface to migrate, but
+                         * we need to check that this
+                         * sock matches. */
+                        should_migrate = sk->sk_bound_dev_if == ctx->old_dev;
+                }
+        } else if (ctx->old_dev <= 0) {
+                /* A new interface came up, migrate all flows
+                 * with a DOWN interface to this new
+                 * interface. */
+                struct net_device *i = dev_get_by_index(sock_net(sk), 
+                                                        sk->sk_bound_dev_if);
                 
-                local_bh_disable();
-                spin_lock(&slot->lock);
-                                
-                hlist_for_each_entry_compat(sk, walk, &slot->head, sk_node) {
-                        int should_migrate = 0;
-
-                        if (old_dev > 0 && new_dev > 0) {
-                                if (old_dev == new_dev) {
-                                        /* An existing interface changed its address,
-                                         * i.e., physical mobility. */
-                                        should_migrate = 1;
-                                } else {
-                                        /* We were told which
-                                         * interface to migrate, but
-                                         * we need to check that this
-                                         * sock matches. */
-                                        should_migrate = sk->sk_bound_dev_if == old_dev;
-                                }
-                        } else if (old_dev <= 0) {
-                                /* A new interface came up, migrate all flows
-                                 * with a DOWN interface to this new
-                                 * interface. */
-                                struct net_device *i = dev_get_by_index(sock_net(sk), 
-                                                                        sk->sk_bound_dev_if);
-                                
-                                if (i) {
-                                        /* If this interface is down, then
-                                         * migrate its flows. */
-                                        if (!(i->flags & IFF_UP))
-                                                should_migrate = 1;
-                                        dev_put(i);
-                                }
-                        } else if (new_dev <= 0 && old_dev == sk->sk_bound_dev_if) {
-                                /* An interface went down, and we
-                                 * need to figure out a new target
-                                 * dev. */
+                if (i) {
+                        /* If this interface is down, then
+                         * migrate its flows. */
+                        if (!(i->flags & IFF_UP))
+                                should_migrate = 1;
+                        dev_put(i);
+                }
+        } else if (ctx->new_dev <= 0 && ctx->old_dev == sk->sk_bound_dev_if) {
+                /* An interface went down, and we
+                 * need to figure out a new target
+                 * dev. */
 #if defined(OS_LINUX_KERNEL)
-                                struct rtable *rt;
-                                
-                                rt = serval_ip_route_output(sock_net(sk),
-                                                            inet_sk(sk)->inet_daddr,
-                                                            0, 0, 0);
-                                
-                                if (rt) {
-                                        should_migrate = 1;
-                                        new_dev = rt->rt_iif;
-                                        LOG_SSK(sk, "Found new output dev %d\n", new_dev);
-                                        ip_rt_put(rt);
-                                } else {
-                                        LOG_SSK(sk, "socket not routable\n");
-                                } 
+                struct rtable *rt;
+                
+                rt = serval_ip_route_output(sock_net(sk),
+                                            inet_sk(sk)->inet_daddr,
+                                            0, 0, 0);
+                
+                if (rt) {
+                        should_migrate = 1;
+                        ctx->new_dev = rt->rt_iif;
+                        LOG_SSK(sk, "Found new output dev %d\n", ctx->new_dev);
+                        ip_rt_put(rt);
+                } else {
+                        LOG_SSK(sk, "socket not routable\n");
+                } 
 #endif /* OS_LINUX_KERNEL */
-                        }
-                        
-                        if (should_migrate) {
+        }
+        
+        if (should_migrate) {
 #if defined(ENABLE_DEBUG)
-                                struct net_device *dev1 = dev_get_by_index(sock_net(sk), 
-                                                                           old_dev);
-                                struct net_device *dev2 = dev_get_by_index(sock_net(sk), 
-                                                                           new_dev);
-                                if (dev1) {
-                                        if (dev2) {
-                                                LOG_SSK(sk, "migrating from dev %s to %s\n", 
-                                                        dev1, dev2);
-                                                
-                                                dev_put(dev2);
-                                        }
-                                        dev_put(dev1);
-                                }
-#endif
-                                bh_lock_sock(sk);
-                                serval_sock_set_mig_dev(sk, new_dev);
-                                serval_sal_migrate(sk);
-                                bh_unlock_sock(sk);
-                                n++;
-                        }                       
+                struct net_device *dev1 = dev_get_by_index(sock_net(sk), 
+                                                           ctx->old_dev);
+                struct net_device *dev2 = dev_get_by_index(sock_net(sk), 
+                                                           ctx->new_dev);
+                if (dev1) {
+                        if (dev2) {
+                                LOG_SSK(sk, "migrating from dev %s to %s\n", 
+                                        dev1, dev2);
+                                
+                                dev_put(dev2);
+                        }
+                        dev_put(dev1);
                 }
-                spin_unlock(&slot->lock);
-                local_bh_enable();
+#endif
+                bh_lock_sock(sk);
+                serval_sock_set_mig_dev(sk, ctx->new_dev);
+                serval_sal_migrate(sk);
+                bh_unlock_sock(sk);
+                ctx->n++;
         }
+}
+
+void serval_sock_migrate_iface(int old_dev, int new_dev)
+{
+        struct migrate_ctx ctx = { old_dev, new_dev, 0 };
 
-        LOG_DBG("Migrated %d flows\n", n);
+        serval_table_for_each(&established_table, 
+                              serval_sock_migrate_one, &ctx);
+
+        LOG_DBG("Migrated %d flows\n", ctx.n);
+}
+
+static void serval_sock_freeze_one(struct sock *sk, void *arg)
+{
+        struct net_device *dev = (struct net_device *)arg;
+        struct serval_sock *ssk = serval_sk(sk);                       
+                        
+        if (sk->sk_bound_dev_if > 0 && 
+            sk->sk_bound_dev_if == dev->ifindex) {
+                if (ssk->af_ops->freeze_flow) {
+                        bh_lock_sock(sk);
+                        ssk->af_ops->freeze_flow(sk);
+                        bh_unlock_sock(sk);
+                }
+        }
 }
 
 /*
@@ -222,31 +570,8 @@ void serval_sock_migrate_iface(int old_dev, int new_dev)
 */
 void serval_sock_freeze_flows(struct net_device *dev)
 {
-        int i;
-
-        for (i = 0; i < SERVAL_HTABLE_SIZE_MIN; i++) {
-                struct serval_hslot *slot;
-                struct hlist_node *walk;
-                struct sock *sk;                
-                
-                slot = &established_table.hash[i];
-                
-                spin_lock_bh(&slot->lock);
-                                
-                hlist_for_each_entry_compat(sk, walk, &slot->head, sk_node) {          
-                        struct serval_sock *ssk = serval_sk(sk);                       
-                        
-                        if (sk->sk_bound_dev_if > 0 && 
-                            sk->sk_bound_dev_if == dev->ifindex) {
-                                if (ssk->af_ops->freeze_flow) {
-                                        bh_lock_sock(sk);
-                                        ssk->af_ops->freeze_flow(sk);
-                                        bh_unlock_sock(sk);
-                                }
-                        }
-                }
-                spin_unlock_bh(&slot->lock);
-        }
+        serval_table_for_each(&established_table, 
+                              serval_sock_freeze_one, dev);
 }
 
 void serval_sock_migrate_flow(struct flow_id *old_flow, int new_dev)
@@ -313,6 +638,8 @@ struct flow_info *serval_sock_stats_flow(struct flow_id *flow,
                         st->snd_nxt = tsk->snd_nxt;
                         st->rcv_wnd = tsk->rcv_wnd;
                         st->rcv_nxt = tsk->rcv_nxt;      
+                        st->migrations = tsk->mig_count;
+                        st->mig_retrans = tsk->mig_retrans;
                 } else {
                         info_size += sizeof(struct stats_proto_base);
                         ret = kmalloc(info_size, GFP_KERNEL);
@@ -332,34 +659,85 @@ struct flow_info *serval_sock_stats_flow(struct flow_id *flow,
         return ret;
 }
 
+static inline int serval_sock_match(struct sock *sk, u32 hash,
+                                    const void *key, size_t keylen)
+{
+        struct serval_sock *ssk = serval_sk(sk);
+
+        return sk->sk_hash == hash &&
+                ssk->hash_key_len == keylen &&
+                memcmp(key, ssk->hash_key, keylen) == 0;
+}
+
+/*
+  Lockless lookup. A socket may be freed and reused (kernel), or
+  moved to another bucket array by a resize, while we look at it, so
+  we match again after taking a reference and restart the lookup if
+  we end up in the wrong chain or race with a resize on a miss.
+*/
 static struct sock *serval_sock_lookup(struct serval_table *table,
                                        struct net *net, void *key, 
                                        size_t keylen)
 {
-        struct serval_hslot *slot;
-        struct hlist_node *walk;
-        struct sock *sk = NULL;
+        struct serval_hbuckets *arrs[2];
+        struct hlist_nulls_node *walk;
+        struct sock *sk;
+        unsigned int seq, a;
+        u32 hash;
 
         if (!key)
                 return NULL;
 
-        slot = table->hashslot(table, net, key, keylen);
+        hash = serval_hashfn(table, key, keylen);
 
-        if (!slot)
-                return NULL;
+        rcu_read_lock();
+begin:
+        seq = ACCESS_ONCE(table->resize_seq);
+        smp_rmb();
+        arrs[0] = rcu_dereference(table->buckets);
+        smp_rmb();
+        arrs[1] = rcu_dereference(table->old);
 
-        spin_lock_bh(&slot->lock);
-        
-        hlist_for_each_entry_compat(sk, walk, &slot->head, sk_node) {
-                struct serval_sock *ssk = serval_sk(sk);
-                if (memcmp(key, ssk->hash_key, keylen) == 0) {
-                        sock_hold(sk);
+        for (a = 0; a < 2; a++) {
+                struct serval_hbuckets *b = arrs[a];
+                unsigned int slot;
+
+                if (!b || (a == 1 && b == arrs[0]))
+                        continue;
+
+                slot = hash & b->mask;
+
+                hlist_nulls_for_each_entry_rcu(sk, walk, &b->head[slot], 
+                                               sk_nulls_node) {
+                        if (!serval_sock_match(sk, hash, key, keylen))
+                                continue;
+
+                        if (unlikely(!atomic_inc_not_zero(&sk->sk_refcnt)))
+                                goto begin;
+
+                        if (unlikely(!serval_sock_match(sk, hash, 
+                                                        key, keylen))) {
+                                sock_put(sk);
+                                goto begin;
+                        }
                         goto out;
                 }
+
+                /* The socket we were looking at moved to another
+                   chain */
+                if (get_nulls_value(walk) != 
+                    serval_hbuckets_nulls(b, slot))
+                        goto begin;
         }
+
+        smp_rmb();
+
+        if (unlikely((seq & 1) || ACCESS_ONCE(table->resize_seq) != seq))
+                goto begin;
+
         sk = NULL;
 out:
-        spin_unlock_bh(&slot->lock);
+        rcu_read_unlock();
         
         return sk;
 }
@@ -378,24 +756,28 @@ struct sock *serval_sock_lookup_service(struct service_id *srvid, int protocol)
 static inline unsigned int serval_sock_ehash(struct serval_table *table,
                                              struct sock *sk)
 {
-        return serval_hashfn(sock_net(sk), 
+        return serval_hashfn(table,
                              serval_sk(sk)->hash_key,
-                             serval_sk(sk)->hash_key_len,
-                             table->mask);
+                             serval_sk(sk)->hash_key_len);
 }
 
 static void __serval_table_hash(struct serval_table *table, struct sock *sk)
 {
-        struct serval_hslot *slot;
+        struct serval_hbuckets *b;
+        spinlock_t *lock;
 
         sk->sk_hash = table->hashfn(table, sk);
 
-        slot = &table->hash[sk->sk_hash];
+        lock = serval_table_lock(table, sk->sk_hash);
         
         /* Bottom halfs already disabled here */
-        spin_lock(&slot->lock);
-        slot->count++;
-        hlist_add_head(&sk->sk_node, &slot->head);
+        spin_lock(lock);
+        /* Read under the lock, so that we never insert into an
+           array that a resize has already emptied */
+        b = rcu_dereference_protected(table->buckets, 1);
+        hlist_nulls_add_head_rcu(&sk->sk_nulls_node, 
+                                 &b->head[sk->sk_hash & b->mask]);
+        atomic_inc(&table->count);
 #if defined(OS_LINUX_KERNEL)
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,25)
 	sock_prot_inuse_add(sock_net(sk), sk->sk_prot, 1);
@@ -403,14 +785,16 @@ static void __serval_table_hash(struct serval_table *table, struct sock *sk)
         sock_prot_inc_use(sk->sk_prot);
 #endif
 #endif
-        spin_unlock(&slot->lock);     
+        spin_unlock(lock);
+
+        serval_table_check_size(table);
 }
 
 static void __serval_sock_hash(struct sock *sk)
 {
         struct serval_sock *ssk = serval_sk(sk);
  
-        if (!hlist_unhashed(&sk->sk_node)) {
+        if (!hlist_nulls_unhashed(&sk->sk_nulls_node)) {
                 LOG_ERR("socket %p already hashed\n", sk);
         }
         
@@ -479,7 +863,6 @@ void serval_sock_hash(struct sock *sk)
 void serval_sock_unhash(struct sock *sk)
 {
         struct serval_sock *ssk = serval_sk(sk);
-        struct net *net = sock_net(sk);
         spinlock_t *lock;
 
         if (ssk->hash_key_len == 0)
@@ -509,13 +892,12 @@ void serval_sock_unhash(struct sock *sk)
 
         LOG_SSK(sk, "unhashing socket %p\n", sk);
 
-        lock = &established_table.hashslot(&established_table,
-                                           net, &ssk->local_flowid, 
-                                           ssk->hash_key_len)->lock;       
+        lock = serval_table_lock(&established_table, sk->sk_hash);
 
-        if (!hlist_unhashed(&sk->sk_node)) {
+        if (!hlist_nulls_unhashed(&sk->sk_nulls_node)) {
                 spin_lock_bh(lock);
-                hlist_del_init(&sk->sk_node);
+                hlist_nulls_del_init_rcu(&sk->sk_nulls_node);
+                atomic_dec(&established_table.count);
 #if defined(OS_LINUX_KERNEL)
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,25)
                 sock_prot_inuse_add(sock_net(sk), sk->sk_prot, -1);
@@ -526,6 +908,7 @@ void serval_sock_unhash(struct sock *sk)
                 serval_sock_reset_flag(ssk, SSK_FLAG_HASHED);
                 ssk->hash_key_len = 0;        
                 spin_unlock_bh(lock);
+                serval_table_check_size(&established_table);
         }
 }
 
@@ -535,7 +918,6 @@ int serval_sock_tables_init(void)
 
         ret = serval_table_init(&request_table,
                                 serval_sock_ehash, 
-                                serval_hashslot,
                                 "REQUEST");
 
         if (ret < 0)
@@ -543,7 +925,6 @@ int serval_sock_tables_init(void)
         
         ret = serval_table_init(&established_table, 
                                 serval_sock_ehash,
-                                serval_hashslot,
                                 "ESTABLISHED");
 
 fail_table:
@@ -666,7 +1047,23 @@ void serval_sock_init(struct sock *sk)
         ssk->rto = SAL_TIMEOUT_INIT;
 
         write_lock_bh(&sock_list_lock);
-        list_add_tail(&ssk->sock_node, &sock_list);
+        __sock_list_add(ssk);
+        write_unlock_bh(&sock_list_lock);
+}
+
+/* 
+   Give a socket that is already on the sock list a new local
+   flowID, e.g., a child socket that takes over the flowID of its
+   request sock.
+*/
+void serval_sock_set_flowid(struct sock *sk, const struct flow_id *flowid)
+{
+        struct serval_sock *ssk = serval_sk(sk);
+
+        write_lock_bh(&sock_list_lock);
+        __sock_list_del(ssk);
+        memcpy(&ssk->local_flowid, flowid, sizeof(ssk->local_flowid));
+        __sock_list_add(ssk);
         write_unlock_bh(&sock_list_lock);
 }
 
@@ -789,7 +1186,7 @@ void serval_sock_destruct(struct sock *sk)
 	atomic_dec(&serval_nr_socks);
 
         write_lock_bh(&sock_list_lock);
-        list_del(&serval_sk(sk)->sock_node);
+        __sock_list_del(serval_sk(sk));
         write_unlock_bh(&sock_list_lock);
 
 	LOG_SSK(sk, "SERVAL socket %p destroyed, %d are still alive.\n", 
@@ -1046,6 +1443,84 @@ int serval_sock_flow_print(struct sock *sk, char *buf, size_t buflen)
         return len;
 }
 
+static void serval_sock_flow_info(struct sock *sk, struct flow_entry_info *fi)
+{
+        struct serval_sock *ssk = serval_sk(sk);
+
+        memset(fi, 0, sizeof(*fi));
+        memcpy(&fi->src_flowid, &ssk->local_flowid, sizeof(fi->src_flowid));
+        memcpy(&fi->dst_flowid, &ssk->peer_flowid, sizeof(fi->dst_flowid));
+        fi->src_address.s_addr = inet_sk(sk)->inet_saddr;
+        fi->dst_address.s_addr = inet_sk(sk)->inet_daddr;
+        fi->if_index = sk->sk_bound_dev_if;
+        fi->state = sk->sk_state;
+        fi->protocol = sk->sk_protocol;
+}
+
+/*
+  Dump the flow table in chunks, ordered by local flowID. Each call
+  fills 'fi' with at most 'max' flows following the cursor and moves
+  the cursor to the last flow dumped. Since the sock list is sorted,
+  a chunk is a run of the list; it starts where the previous chunk
+  ended, if that chunk was the last one dumped, or else is searched
+  for.
+
+  Returns the number of flows dumped.
+*/
+int flow_table_dump(struct flow_dump_cursor *cursor, 
+                    struct flow_entry_info *fi, unsigned int max)
+{
+        u32 from = ntohl(cursor->flowid.s_id32);
+        struct list_head *pos;
+        unsigned int count = 0;
+
+        cursor->more = 0;
+
+        if (max == 0)
+                return 0;
+
+        /* Taken for writing, as the dump position is updated */
+        write_lock_bh(&sock_list_lock);
+
+        if (!cursor->valid) {
+                pos = sock_list.next;
+        } else if (flow_dump_pos.valid && flow_dump_pos.after == from) {
+                pos = flow_dump_pos.next ? 
+                        &flow_dump_pos.next->sock_node : &sock_list;
+        } else {
+                list_for_each(pos, &sock_list) {
+                        struct sock *sk = (struct sock *)
+                                list_entry(pos, struct serval_sock, 
+                                           sock_node);
+                        
+                        if (sock_flowid(sk) > from)
+                                break;
+                }
+        }
+
+        for (; pos != &sock_list && count < max; pos = pos->next) {
+                struct sock *sk = (struct sock *)
+                        list_entry(pos, struct serval_sock, sock_node);
+
+                serval_sock_flow_info(sk, &fi[count++]);
+        }
+
+        if (count > 0) {
+                memcpy(&cursor->flowid, &fi[count - 1].src_flowid, 
+                       sizeof(cursor->flowid));
+                cursor->valid = 1;
+                cursor->more = pos != &sock_list;
+                flow_dump_pos.after = ntohl(cursor->flowid.s_id32);
+                flow_dump_pos.next = cursor->more ? 
+                        list_entry(pos, struct serval_sock, sock_node) : NULL;
+                flow_dump_pos.valid = 1;
+        }
+
+        write_unlock_bh(&sock_list_lock);
+
+        return count;
+}
+
 /*
   If this function is called with buflen < 0, the buffer size required
   for fitting the entire table will be returned. In that case, any
@@ -7,6 +7,7 @@
 #include <serval/list.h>
 #include <serval/lock.h>
 #include <serval/hash.h>
+#include <serval/rcupdate.h>
 #include <serval/sock.h>
 #include <serval/dst.h>
 #include <serval/inet_sock.h>
@@ -18,6 +19,7 @@
 #endif
 #if defined(OS_LINUX_KERNEL)
 #include <net/tcp_states.h>
+#include <linux/workqueue.h>
 #endif
 
 /*
@@ -199,21 +201,39 @@ struct serval_sock {
 
 /* Should be power of two */
 #define SERVAL_HTABLE_SIZE_MIN 256
+#define SERVAL_HTABLE_SIZE_MAX (1 << 20)
+/* Number of bucket locks, independent of the table size */
+#define SERVAL_HTABLE_LOCKS 256
+
+/* A bucket array. Each chain ends in a 'nulls' marker that encodes
+ * the bucket index and the array generation, so that lockless
+ * readers can tell when a socket they were traversing moved to
+ * another chain. */
+struct serval_hbuckets {
+        unsigned int            mask;
+        unsigned int            gen;
+        struct hlist_nulls_head head[0];
+};
 
-struct serval_hslot {
-	struct hlist_head head;
-	int               count;
-	spinlock_t        lock;
+enum {
+        SERVAL_TABLE_RESIZING = 0,
 };
 
 struct serval_table {
-	struct serval_hslot *hash;
+        /* New entries go into 'buckets'. During a resize, 'old'
+         * points to the array whose sockets are being moved over. */
+        struct serval_hbuckets __rcu *buckets;
+        struct serval_hbuckets __rcu *old;
+        spinlock_t              locks[SERVAL_HTABLE_LOCKS];
+        atomic_t                count;
+        u32                     seed;
+        unsigned long           flags;
+        /* Odd while sockets are moved between bucket arrays */
+        unsigned int            resize_seq;
+#if defined(OS_LINUX_KERNEL)
+        struct work_struct      resize_work;
+#endif
         unsigned int (*hashfn)(struct serval_table *tbl, struct sock *sk);
-        struct serval_hslot *(*hashslot)(struct serval_table *tbl,
-                                         struct net *net,
-                                         void *key,
-                                         size_t keylen);
-	unsigned int mask;
 };
 
 static inline int serval_sock_is_master(struct sock *sk)
@@ -222,24 +242,26 @@ static inline int serval_sock_is_master(struct sock *sk)
 }
 
 int serval_sock_get_flowid(struct flow_id *sid);
+void serval_sock_set_flowid(struct sock *sk, const struct flow_id *flowid);
 
-static inline unsigned int serval_hashfn(struct net *net, 
-                                         void *key,
-                                         size_t keylen,
-                                         unsigned int mask)
+/* Returns the full 32-bit hash of a key. The per-table random seed
+ * keeps remote peers from picking flow IDs that collide. */
+static inline u32 serval_hashfn(struct serval_table *table,
+                                const void *key,
+                                size_t keylen)
 {
-        return full_bitstring_hash(key, keylen) & mask;
+        if (keylen == sizeof(u32)) {
+                u32 k;
+                memcpy(&k, key, sizeof(k));
+                return jhash_1word(k, table->seed);
+        }
+        return jhash(key, keylen, table->seed);
 }
 
-extern struct serval_table serval_table;
-
-static inline 
-struct serval_hslot *serval_hashslot(struct serval_table *table,
-                                     struct net *net, 
-                                     void *key,
-                                     size_t keylen)
+static inline spinlock_t *serval_table_lock(struct serval_table *table,
+                                            u32 hash)
 {
-	return &table->hash[serval_hashfn(net, key, keylen, table->mask)];
+        return &table->locks[hash & (SERVAL_HTABLE_LOCKS - 1)];
 }
 
 struct flow_info *serval_sock_stats_flow(struct flow_id *flow, 
@@ -361,6 +383,16 @@ struct sock *sock_list_iterator_next(struct sock_list_iterator *iter);
 int serval_sock_flow_print_header(char *buf, size_t buflen);
 int serval_sock_flow_print(struct sock *sk, char *buf, size_t buflen);
 
+/* Position in a chunked dump of the flow table */
+struct flow_dump_cursor {
+        struct flow_id flowid;
+        int valid; /* Zero to start from the first flow */
+        int more; /* Set if flows remain after the last chunk */
+};
+
+int flow_table_dump(struct flow_dump_cursor *cursor, 
+                    struct flow_entry_info *fi, unsigned int max);
+
 void flow_table_read_lock(void);
 void flow_table_read_unlock(void);
 int __flow_table_print(char *buf, size_t buflen);
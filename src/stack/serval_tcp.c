@@ -77,6 +77,8 @@ static int serval_tcp_disconnect(struct sock *sk, int flags)
 	tp->bytes_acked = 0;
 	tp->window_clamp = 0;
         tp->snd_mig_last = 0;
+        tp->mig_count = 0;
+        tp->mig_retrans = 0;
 	serval_tcp_set_ca_state(sk, TCP_CA_Open);
 	serval_tcp_clear_retrans(tp);
 	serval_tsk_delack_init(sk);
@@ -412,6 +414,9 @@ void serval_tcp_init(void)
         sysctl_serval_tcp_rmem[0] = SK_MEM_QUANTUM;
         sysctl_serval_tcp_rmem[1] = 87380;
         sysctl_serval_tcp_rmem[2] = max(87380, max_rshare);
+
+        if (serval_tcp_cong_init() != 0)
+                LOG_ERR("Could not register congestion control algorithms\n");
 }
 
 static int serval_tcp_connection_close(struct sock *sk)
@@ -544,6 +549,12 @@ static inline int select_size(struct sock *sk, int sg)
 	struct serval_tcp_sock *tp = serval_tcp_sk(sk);
 	int tmp = tp->mss_cache;
 
+#if defined(OS_USER)
+	/* There are no paged fragments at user level, so a segment
+	   that software GSO will split needs all its data in the head */
+	if (sk_can_gso(sk) && gso)
+		return tmp * max_t(u16, tp->xmit_size_goal_segs, 1);
+#endif
 	if (sg) {
 		if (sk_can_gso(sk) && gso)
 			tmp = 0;
@@ -2156,8 +2167,9 @@ void __serval_tcp_v4_send_check(struct sk_buff *skb,
 	struct tcphdr *th = tcp_hdr(skb);
         unsigned long len = skb_tail_pointer(skb) - skb_transport_header(skb);
 
-        if (!checksum_mode) {
-                /* Force checksum calculation in software */
+        if (!checksum_mode && !skb_is_gso(skb)) {
+                /* Force checksum calculation in software. Segments
+                   of a GSO packet get theirs when it is split. */
                 skb->ip_summed = CHECKSUM_NONE;
                 th->check = serval_tcp_v4_check(len, saddr, daddr,
                                                 csum_partial(th, len, 0));
@@ -2197,7 +2209,6 @@ static int serval_do_tcp_setsockopt(struct sock *sk, int level,
 
 	/* These are data/string values, all the others are ints */
 	switch (optname) {
-                /*
 	case TCP_CONGESTION: {
 		char name[TCP_CA_NAME_MAX];
 
@@ -2215,7 +2226,6 @@ static int serval_do_tcp_setsockopt(struct sock *sk, int level,
 		release_sock(sk);
 		return err;
 	}
-                */
 #if 0
 	case TCP_COOKIE_TRANSACTIONS: {
 		struct tcp_cookie_transactions ctd;
@@ -2547,17 +2557,15 @@ static int serval_do_tcp_getsockopt(struct sock *sk, int level,
 	case TCP_QUICKACK:
 		val = !tp->tp_ack.pingpong;
 		break;
-                /*
 	case TCP_CONGESTION:
 		if (get_user(len, optlen))
 			return -EFAULT;
 		len = min_t(unsigned int, len, TCP_CA_NAME_MAX);
 		if (put_user(len, optlen))
 			return -EFAULT;
-		if (copy_to_user(optval, icsk->icsk_ca_ops->name, len))
+		if (copy_to_user(optval, tp->ca_ops->name, len))
 			return -EFAULT;
 		return 0;
-                */
                 /*
 	case TCP_COOKIE_TRANSACTIONS: {
 		struct tcp_cookie_transactions ctd;
@@ -2725,7 +2733,6 @@ static int serval_tcp_freeze_flow(struct sock *sk)
 static int serval_tcp_migration_completed(struct sock *sk)
 {
         struct serval_tcp_sock *tp = serval_tcp_sk(sk);
-        unsigned long t = jiffies;
 
         LOG_SSK(sk, "Unfreezing TCP flow %s\n", 
                 flow_id_to_str(&serval_sk(sk)->local_flowid));
@@ -2733,13 +2740,29 @@ static int serval_tcp_migration_completed(struct sock *sk)
         LOG_SSK(sk, "Last sequence number on old link: %lu\n", 
                 tp->snd_mig_last, tp->snd_nxt);
 
-        /* Restart retransmission timer */
+        tp->mig_count++;
+        tp->mig_retrans = 0;
+
+        /* The congestion window and RTT estimates describe the old
+           path. Save them for if the flow comes back, and continue
+           with what we know about the new path, or from the initial
+           window if nothing. */
+        serval_tcp_path_save(sk);
+
         if (tp->packets_out) {
-                t = 1; //tp->rto;
+                /* Whatever was in flight on the old path is presumed
+                   lost. Mark it so, but leave the window to the new
+                   path, rather than to a timeout that would size it
+                   from the old one. */
+                serval_tcp_enter_loss(sk, 1);
+        }
 
-                LOG_SSK(sk, "Resetting rexmit timer to %lu\n", t);
-                
-                serval_tsk_reset_xmit_timer(sk, STSK_TIME_RETRANS, t,
+        serval_tcp_path_switch(sk);
+
+        if (tp->packets_out) {
+                LOG_SSK(sk, "Retransmitting, rto=%u\n", tp->rto);
+                serval_tcp_xmit_retransmit_queue(sk);
+                serval_tsk_reset_xmit_timer(sk, STSK_TIME_RETRANS, tp->rto,
                                             SERVAL_TCP_RTO_MAX);
         }
 
@@ -2843,6 +2866,8 @@ static struct sock *serval_tcp_create_openreq_child(struct sock *sk,
         newtp->sacked_out = 0;
         newtp->fackets_out = 0;
         newtp->snd_mig_last = 0;
+        newtp->mig_count = 0;
+        newtp->mig_retrans = 0;
         newtp->snd_ssthresh = SERVAL_TCP_INFINITE_SSTHRESH;
         
         /* So many TCP implementations out there (incorrectly) count the
@@ -2857,7 +2882,10 @@ static struct sock *serval_tcp_create_openreq_child(struct sock *sk,
         newtp->frto_counter = 0;
         newtp->frto_highmark = 0;
         
-        newtp->ca_ops = &serval_tcp_init_congestion_ops;
+        /* The child inherits the listener's choice of congestion
+           control, which is initialized once the child is
+           established */
+        newtp->ca_ops = oldtp->ca_ops;
         
         serval_tcp_set_ca_state(newsk, TCP_CA_Open);
         serval_tcp_init_xmit_timers(newsk);
@@ -2988,6 +3016,9 @@ int serval_tcp_syn_recv_sock(struct sock *sk,
         newtp->advmss = dst_metric_advmss(dst);
 #endif
 #else
+        /* The caps are set up on the first transmit, in
+           serval_ipv4_xmit() */
+        newsk->sk_gso_type = gso ? SKB_GSO_TCPV4 : 0;
         serval_tcp_sync_mss(newsk, SERVAL_TCP_MSS_DEFAULT);
 	newtp->advmss = SERVAL_TCP_MSS_DEFAULT;
 #endif
@@ -3038,6 +3069,8 @@ static int serval_tcp_init_sock(struct sock *sk)
 	tp->snd_ssthresh = SERVAL_TCP_INFINITE_SSTHRESH;
 	tp->snd_cwnd_clamp = ~0;
         tp->snd_mig_last = 0;
+        tp->mig_count = 0;
+        tp->mig_retrans = 0;
 	tp->mss_cache = SERVAL_TCP_MSS_DEFAULT;
 
 	tp->reordering = sysctl_serval_tcp_reordering;
@@ -3157,5 +3190,8 @@ struct proto serval_tcp_proto = {
 #endif
 	.max_header		= MAX_SERVAL_TCP_HEADER,
 	.obj_size		= sizeof(struct serval_tcp_sock),
+#if defined(OS_LINUX_KERNEL)
+        .slab_flags             = SLAB_DESTROY_BY_RCU,
+#endif
 	.rsk_prot		= &serval_tcp_request_sock_ops,
 };
@@ -909,9 +909,58 @@ static inline int serval_tcp_prequeue(struct sock *sk, struct sk_buff *skb)
 extern void serval_tcp_init_congestion_control(struct sock *sk);
 void serval_tcp_cleanup_congestion_control(struct sock *sk);
 extern struct tcp_congestion_ops serval_tcp_init_congestion_ops;
+extern struct tcp_congestion_ops serval_tcp_reno;
+int serval_tcp_register_congestion_control(struct tcp_congestion_ops *ca);
+void serval_tcp_unregister_congestion_control(struct tcp_congestion_ops *ca);
+int serval_tcp_set_default_congestion_control(const char *name);
+void serval_tcp_get_default_congestion_control(char *name);
+void serval_tcp_get_available_congestion_control(char *buf, size_t maxlen);
+int serval_tcp_set_congestion_control(struct sock *sk, const char *name);
+int serval_tcp_cong_init(void);
+void serval_tcp_cong_fini(void);
+
+/* The algorithm sets the pacing rate itself */
+#define SERVAL_TCP_CONG_PACING 0x80
+
+/* Pacing rates relative to the current rate (cwnd/srtt), in percent,
+   in slow start and congestion avoidance */
+#define SERVAL_TCP_PACING_SS_RATIO 200
+#define SERVAL_TCP_PACING_CA_RATIO 120
+
+/*
+  Set the rate (bytes per second, zero for none) at which the packets
+  of the socket are released to the network. The user-level stack
+  enforces it in the device's fair queue scheduler, and so does the
+  fq qdisc for the kernel version.
+*/
+static inline void serval_tcp_set_pacing_rate(struct sock *sk, u64 rate)
+{
+#if defined(OS_USER) || (LINUX_VERSION_CODE >= KERNEL_VERSION(3,12,0))
+	sk->sk_pacing_rate = min_t(u64, rate, ~0U);
+#endif
+}
+
+static inline u64 serval_tcp_pacing_rate(const struct sock *sk)
+{
+#if defined(OS_USER) || (LINUX_VERSION_CODE >= KERNEL_VERSION(3,12,0))
+	return sk->sk_pacing_rate;
+#else
+	return 0;
+#endif
+}
+
+void serval_tcp_update_pacing_rate(struct sock *sk);
+void serval_tcp_slow_start(struct serval_tcp_sock *tp);
+void serval_tcp_cong_avoid_ai(struct serval_tcp_sock *tp, u32 w);
+void serval_tcp_reno_cong_avoid(struct sock *sk, u32 ack, u32 in_flight);
+u32 serval_tcp_reno_ssthresh(struct sock *sk);
+u32 serval_tcp_reno_min_cwnd(const struct sock *sk);
 
 void serval_tcp_update_metrics(struct sock *sk);
 void serval_tcp_init_metrics(struct sock *sk);
+void serval_tcp_path_init(struct sock *sk);
+void serval_tcp_path_save(struct sock *sk);
+int serval_tcp_path_switch(struct sock *sk);
 
 int serval_tcp_trim_head(struct sock *sk, struct sk_buff *skb, u32 len);
 int serval_tcp_fragment(struct sock *sk, struct sk_buff *skb, u32 len,
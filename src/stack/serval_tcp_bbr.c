@@ -0,0 +1,557 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*- */
+/*
+ * BBR (Bottleneck Bandwidth and RTT) congestion control, after
+ * N. Cardwell, Y. Cheng, C. S. Gunn, S. H. Yeganeh and V. Jacobson,
+ *  "BBR: Congestion-Based Congestion Control", ACM Queue, Oct. 2016.
+ *
+ * BBR builds a model of the path from the maximum delivery rate
+ * (bottleneck bandwidth) seen over the last ten round trips and the
+ * minimum RTT seen over the last ten seconds, and keeps the amount
+ * of data in flight close to their product (the BDP), instead of
+ * reacting to loss.
+ *
+ * Serval TCP has no per-packet delivery rate sampling, and pacing
+ * is only enforced where a scheduler honors the socket's pacing rate
+ * (the user-level stack's fair queue scheduler, or the fq qdisc), so
+ * this version differs from the Linux one (net/ipv4/tcp_bbr.c):
+ *
+ *  - The delivery rate is sampled once per round trip, as the
+ *    packets cumulatively ACKed during the round divided by the
+ *    length of the round.
+ *  - The gain cycle of PROBE_BW is applied to the congestion window
+ *    as well as to the pacing rate, so that it also works without
+ *    pacing. In DRAIN, the window is held at one BDP until the queue
+ *    built in STARTUP has drained.
+ */
+#include <serval/platform.h>
+#include <serval/debug.h>
+#include <serval/sock.h>
+#include <serval/ktime.h>
+#include <serval/random.h>
+#include <serval_tcp_sock.h>
+#include <serval_tcp.h>
+
+#if defined(OS_LINUX_KERNEL)
+#include <linux/math64.h>
+#endif
+
+/* Scale factor for rate in pkt/uSec unit to avoid truncation in
+ * bandwidth estimation.
+ */
+#define BW_SCALE 24
+#define BW_UNIT (1 << BW_SCALE)
+
+/* Scale factor for fractions (gains) */
+#define BBR_SCALE 8
+#define BBR_UNIT (1 << BBR_SCALE)
+
+enum bbr_mode {
+	BBR_STARTUP,	/* ramp up sending rate rapidly to fill pipe */
+	BBR_DRAIN,	/* drain any queue created during startup */
+	BBR_PROBE_BW,	/* discover, share bw: cycle the gain */
+	BBR_PROBE_RTT,	/* cut inflight to min to probe min_rtt */
+};
+
+/* Window length of bw filter (in rounds) */
+#define BBR_BW_RTTS		10
+/* Window length of min_rtt filter (in sec) */
+#define BBR_MIN_RTT_WIN_SEC	10
+/* Minimum time (in ms) spent at BBR_MIN_CWND in BBR_PROBE_RTT mode */
+#define BBR_PROBE_RTT_MODE_MS	200
+/* Window needed to keep ACKs flowing, also the floor in PROBE_RTT */
+#define BBR_MIN_CWND		4
+/* Extra packets allowed in flight beyond the target, for delayed
+ * and stretched ACKs */
+#define BBR_CWND_HEADROOM	3
+/* The number of phases in the PROBE_BW gain cycle */
+#define BBR_CYCLE_LEN		8
+/* The rate must grow by this much to count as still filling the
+ * pipe in STARTUP... */
+#define BBR_FULL_BW_THRESH	(BBR_UNIT * 5 / 4)
+/* ...for this many rounds in a row */
+#define BBR_FULL_BW_CNT		3
+
+/* The gain that doubles the sending rate per round trip in STARTUP,
+ * 2/ln(2) */
+static const int bbr_high_gain = BBR_UNIT * 2885 / 1000 + 1;
+/* The pacing gain that drains the queue built in STARTUP in one
+ * round */
+static const int bbr_drain_gain = BBR_UNIT * 1000 / 2885;
+/* Pace slightly below the estimated rate, to keep queues short */
+#define BBR_PACING_MARGIN_PERCENT 1
+/* The gain cycle of PROBE_BW: probe for more bandwidth, drain the
+ * queue that probing may have built, then cruise */
+static const int bbr_cycle_gain[BBR_CYCLE_LEN] = {
+	BBR_UNIT * 5 / 4,
+	BBR_UNIT * 3 / 4,
+	BBR_UNIT, BBR_UNIT, BBR_UNIT,
+	BBR_UNIT, BBR_UNIT, BBR_UNIT,
+};
+
+/* A sample for the windowed max filter */
+struct bbr_sample {
+	u32 t;		/* round of the sample */
+	u32 v;		/* bandwidth, pkts/uS << BW_SCALE */
+};
+
+struct bbr {
+	u32	min_rtt_us;		/* min RTT in BBR_MIN_RTT_WIN_SEC */
+	u32	min_rtt_stamp;		/* timestamp of min_rtt_us */
+	u32	probe_rtt_done_stamp;	/* end time for PROBE_RTT mode */
+	struct bbr_sample bw[3];	/* max bw over last BBR_BW_RTTS */
+	u32	rtt_cnt;		/* count of packet-timed rounds */
+	u32	next_round_seq;		/* snd_nxt at start of round */
+	u32	round_start_us;		/* time at start of round */
+	u32	round_delivered;	/* delivered at start of round */
+	u32	delivered;		/* packets delivered so far */
+	u32	acked;			/* packets ACKed by the last ACK */
+	u32	prior_cwnd;		/* prior cwnd upon entering loss */
+	u32	full_bw;		/* recent bw, to estimate if pipe is full */
+	u32	cycle_stamp_us;		/* time of this cycle phase start */
+	u8	mode;			/* current bbr_mode */
+	u8	cycle_idx;		/* current index in bbr_cycle_gain */
+	u8	full_bw_cnt;		/* rounds without large bw gains */
+	u8	full_bw_reached:1,	/* reached full bw in STARTUP? */
+		round_start:1,		/* start of packet-timed round? */
+		probe_rtt_round_done:1,	/* a BBR_PROBE_RTT round at 4 pkts? */
+		unused:5;
+	u32	probe_rtt_round;	/* round at which PROBE_RTT ends */
+};
+
+/* The delivery rate is computed over fractions of a millisecond, so
+ * use a microsecond clock rather than jiffies */
+static inline u32 bbr_clock_us(void)
+{
+	return (u32)ktime_to_us(ktime_get_real());
+}
+
+/* Windowed max filter, keeping the best, second best and third best
+ * samples in successive thirds of the window (Kathleen Nichols'
+ * algorithm, as in the Linux lib/win_minmax.c).
+ */
+static u32 bbr_max_filter(struct bbr_sample *s, u32 win, u32 t, u32 v)
+{
+	struct bbr_sample val = { .t = t, .v = v };
+	u32 dt;
+
+	if (v >= s[0].v || t - s[2].t > win) {
+		/* New maximum, or nothing left in the window */
+		s[2] = s[1] = s[0] = val;
+		return s[0].v;
+	}
+
+	if (v >= s[1].v)
+		s[2] = s[1] = val;
+	else if (v >= s[2].v)
+		s[2] = val;
+
+	dt = t - s[0].t;
+
+	if (dt > win) {
+		/* The best sample has expired, promote the others */
+		s[0] = s[1];
+		s[1] = s[2];
+		s[2] = val;
+
+		if (t - s[0].t > win) {
+			s[0] = s[1];
+			s[1] = s[2];
+			s[2] = val;
+		}
+	} else if (s[1].t == s[0].t && dt > win / 4) {
+		/* A quarter of the window has passed without a second
+		 * best, take one from the second quarter */
+		s[2] = s[1] = val;
+	} else if (s[2].t == s[1].t && dt > win / 2) {
+		s[2] = val;
+	}
+
+	return s[0].v;
+}
+
+static inline u32 bbr_max_bw(const struct bbr *bbr)
+{
+	return bbr->bw[0].v;
+}
+
+/* Congestion window target for a given gain, zero if there is no
+ * model of the path yet */
+static u32 bbr_target_cwnd(const struct bbr *bbr, int gain)
+{
+	u64 w;
+
+	if (bbr->min_rtt_us == ~0U || bbr_max_bw(bbr) == 0)
+		return 0;
+
+	w = (u64)bbr_max_bw(bbr) * bbr->min_rtt_us;
+	/* Round up, so that small BDPs do not truncate to zero */
+	w = (((w * gain) >> BBR_SCALE) + BW_UNIT - 1) >> BW_SCALE;
+
+	return max_t(u32, (u32)w + BBR_CWND_HEADROOM, BBR_MIN_CWND);
+}
+
+static int bbr_gain(const struct bbr *bbr)
+{
+	switch (bbr->mode) {
+	case BBR_STARTUP:
+		return bbr_high_gain;
+	case BBR_PROBE_BW:
+		return bbr_cycle_gain[bbr->cycle_idx];
+	default:
+		return BBR_UNIT;
+	}
+}
+
+static void bbr_advance_cycle_phase(struct bbr *bbr, u32 now)
+{
+	bbr->cycle_idx = (bbr->cycle_idx + 1) & (BBR_CYCLE_LEN - 1);
+	bbr->cycle_stamp_us = now;
+}
+
+/* Gain cycling: cycle gain to converge to fair share of
+ * available bw */
+static void bbr_update_cycle_phase(struct sock *sk, u32 in_flight, u32 now)
+{
+	struct serval_tcp_sock *tp = serval_tcp_sk(sk);
+	struct bbr *bbr = serval_tcp_ca(sk);
+	int gain = bbr_cycle_gain[bbr->cycle_idx];
+	int is_full_length = (now - bbr->cycle_stamp_us) > bbr->min_rtt_us;
+
+	if (bbr->mode != BBR_PROBE_BW)
+		return;
+
+	if (gain == BBR_UNIT) {
+		if (!is_full_length)
+			return;
+	} else if (gain > BBR_UNIT) {
+		/* A probe only ends once it has pushed enough data into
+		 * the path, or lost some */
+		if (!is_full_length ||
+		    (in_flight < bbr_target_cwnd(bbr, gain) &&
+		     tp->ca_state == TCP_CA_Open))
+			return;
+	} else {
+		/* Drain early once the queue is gone */
+		if (!is_full_length &&
+		    in_flight > bbr_target_cwnd(bbr, BBR_UNIT))
+			return;
+	}
+
+	bbr_advance_cycle_phase(bbr, now);
+}
+
+static void bbr_reset_probe_bw_mode(struct bbr *bbr, u32 now)
+{
+	bbr->mode = BBR_PROBE_BW;
+	/* Start at a random phase, but not the draining one, so that
+	 * flows do not synchronize */
+	bbr->cycle_idx = BBR_CYCLE_LEN - 1 - serval_random_u32() %
+		(BBR_CYCLE_LEN - 1);
+	bbr_advance_cycle_phase(bbr, now);
+}
+
+static void bbr_reset_startup_mode(struct bbr *bbr)
+{
+	bbr->mode = BBR_STARTUP;
+}
+
+/* Estimate when the pipe is full, using the change in delivery rate:
+ * BBR estimates that STARTUP filled the pipe if the estimated bw
+ * hasn't changed by at least BBR_FULL_BW_THRESH after
+ * BBR_FULL_BW_CNT rounds.
+ */
+static void bbr_check_full_bw_reached(struct bbr *bbr)
+{
+	u32 bw_thresh;
+
+	if (bbr->full_bw_reached || !bbr->round_start)
+		return;
+
+	bw_thresh = (u64)bbr->full_bw * BBR_FULL_BW_THRESH >> BBR_SCALE;
+
+	if (bbr_max_bw(bbr) >= bw_thresh) {
+		bbr->full_bw = bbr_max_bw(bbr);
+		bbr->full_bw_cnt = 0;
+		return;
+	}
+
+	if (++bbr->full_bw_cnt >= BBR_FULL_BW_CNT)
+		bbr->full_bw_reached = 1;
+}
+
+/* If pipe is probably full, drain the queue and then enter steady
+ * state. */
+static void bbr_check_drain(struct sock *sk, u32 in_flight, u32 now)
+{
+	struct bbr *bbr = serval_tcp_ca(sk);
+
+	if (bbr->mode == BBR_STARTUP && bbr->full_bw_reached)
+		bbr->mode = BBR_DRAIN;	/* drain queue we created */
+
+	if (bbr->mode == BBR_DRAIN &&
+	    in_flight <= bbr_target_cwnd(bbr, BBR_UNIT))
+		bbr_reset_probe_bw_mode(bbr, now);  /* we estimate queue is drained */
+}
+
+/* Take a delivery rate sample at the end of each round, that is,
+ * when the data that was outstanding at the start of the round has
+ * been ACKed */
+static void bbr_update_bw(struct sock *sk, u32 ack, u32 now)
+{
+	struct serval_tcp_sock *tp = serval_tcp_sk(sk);
+	struct bbr *bbr = serval_tcp_ca(sk);
+	u32 interval_us;
+	u64 bw;
+
+	bbr->round_start = 0;
+	bbr->delivered += bbr->acked;
+	bbr->acked = 0;
+
+	if (before(ack, bbr->next_round_seq))
+		return;
+
+	/* A round that ends right after the sender was idle may span
+	 * much less than a round trip, which would overestimate the
+	 * rate. Like Linux, never sample over less than min_rtt. */
+	interval_us = max(now - bbr->round_start_us, bbr->min_rtt_us);
+
+	if (bbr->next_round_seq != 0 && bbr->min_rtt_us != ~0U) {
+		bw = (u64)(bbr->delivered - bbr->round_delivered) << BW_SCALE;
+		bw = div64_u64(bw, interval_us);
+		bbr_max_filter(bbr->bw, BBR_BW_RTTS, bbr->rtt_cnt,
+			       (u32)min_t(u64, bw, ~0U));
+	}
+
+	bbr->rtt_cnt++;
+	bbr->round_start = 1;
+	bbr->next_round_seq = tp->snd_nxt;
+	bbr->round_start_us = now;
+	bbr->round_delivered = bbr->delivered;
+}
+
+/* Whether more than delta jiffies have passed since the stamp. The
+ * stamps are 32-bit snapshots of jiffies, so they are compared in 32
+ * bits, as jiffies passes 2^32 soon after boot on 64-bit hosts. */
+static inline int bbr_stamp_expired(u32 stamp, u32 delta)
+{
+	return (s32)((u32)jiffies - stamp) > (s32)delta;
+}
+
+/* The goal of PROBE_RTT mode is to have BBR flows cooperatively and
+ * periodically drain the bottleneck queue, to converge to measure the
+ * true min_rtt (unloaded propagation delay). Flows enter it when
+ * their min_rtt estimate has not been refreshed for
+ * BBR_MIN_RTT_WIN_SEC, hold the window at BBR_MIN_CWND for at least
+ * BBR_PROBE_RTT_MODE_MS and one round, and then go back to where
+ * they were.
+ */
+static void bbr_update_min_rtt(struct sock *sk, u32 in_flight, u32 now)
+{
+	struct serval_tcp_sock *tp = serval_tcp_sk(sk);
+	struct bbr *bbr = serval_tcp_ca(sk);
+	int filter_expired;
+
+	filter_expired = bbr_stamp_expired(bbr->min_rtt_stamp,
+					   BBR_MIN_RTT_WIN_SEC * HZ);
+
+	if (filter_expired && bbr->mode != BBR_PROBE_RTT) {
+		bbr->mode = BBR_PROBE_RTT;  /* dip, drain queue */
+		bbr->prior_cwnd = max(bbr->prior_cwnd, tp->snd_cwnd);
+		bbr->probe_rtt_done_stamp = 0;
+	}
+
+	if (bbr->mode != BBR_PROBE_RTT)
+		return;
+
+	if (!bbr->probe_rtt_done_stamp && in_flight <= BBR_MIN_CWND) {
+		bbr->probe_rtt_done_stamp = jiffies +
+			msecs_to_jiffies(BBR_PROBE_RTT_MODE_MS);
+		bbr->probe_rtt_round_done = 0;
+		bbr->probe_rtt_round = bbr->rtt_cnt + 1;
+	} else if (bbr->probe_rtt_done_stamp) {
+		if (bbr->round_start && bbr->rtt_cnt >= bbr->probe_rtt_round)
+			bbr->probe_rtt_round_done = 1;
+
+		if (bbr->probe_rtt_round_done &&
+		    bbr_stamp_expired(bbr->probe_rtt_done_stamp, 0)) {
+			bbr->min_rtt_stamp = jiffies;
+			tp->snd_cwnd = max(tp->snd_cwnd, bbr->prior_cwnd);
+			bbr->prior_cwnd = 0;
+
+			if (bbr->full_bw_reached)
+				bbr_reset_probe_bw_mode(bbr, now);
+			else
+				bbr_reset_startup_mode(bbr);
+		}
+	}
+}
+
+static void bbr_set_cwnd(struct sock *sk, u32 acked)
+{
+	struct serval_tcp_sock *tp = serval_tcp_sk(sk);
+	struct bbr *bbr = serval_tcp_ca(sk);
+	u32 cwnd = tp->snd_cwnd;
+	u32 target = bbr_target_cwnd(bbr, bbr_gain(bbr));
+
+	/* Grow by what was ACKed, which doubles the window per round
+	 * without a model, and cut straight to the target with one */
+	if (bbr->full_bw_reached && target)
+		cwnd = min(cwnd + acked, target);
+	else if (cwnd < target || target == 0)
+		cwnd = cwnd + acked;
+
+	cwnd = max_t(u32, cwnd, BBR_MIN_CWND);
+
+	if (bbr->mode == BBR_PROBE_RTT)
+		cwnd = min_t(u32, cwnd, BBR_MIN_CWND);
+
+	tp->snd_cwnd = min(cwnd, tp->snd_cwnd_clamp);
+}
+
+static int bbr_pacing_gain(const struct bbr *bbr)
+{
+	if (bbr->mode == BBR_DRAIN)
+		return bbr_drain_gain;
+
+	return bbr_gain(bbr);
+}
+
+/* Pace at the estimated bottleneck rate times the gain of the current
+ * mode. Before there is an estimate, pace the initial window over the
+ * RTT seen so far, if any. */
+static void bbr_set_pacing_rate(struct sock *sk)
+{
+	struct serval_tcp_sock *tp = serval_tcp_sk(sk);
+	struct bbr *bbr = serval_tcp_ca(sk);
+	u64 rate;
+
+	if (bbr_max_bw(bbr)) {
+		rate = (u64)bbr_max_bw(bbr) * tp->mss_cache * USEC_PER_SEC;
+		rate >>= BW_SCALE;
+	} else if (bbr->min_rtt_us != ~0U) {
+		rate = (u64)tp->snd_cwnd * tp->mss_cache * USEC_PER_SEC;
+		rate = div64_u64(rate, bbr->min_rtt_us);
+	} else {
+		return;
+	}
+
+	rate = (rate * bbr_pacing_gain(bbr)) >> BBR_SCALE;
+	rate = div64_u64(rate * (100 - BBR_PACING_MARGIN_PERCENT), 100);
+
+	/* Until the pipe is full, only ever raise the rate */
+	if (bbr->full_bw_reached || rate > serval_tcp_pacing_rate(sk))
+		serval_tcp_set_pacing_rate(sk, rate);
+}
+
+static void bbr_cong_avoid(struct sock *sk, u32 ack, u32 in_flight)
+{
+	struct bbr *bbr = serval_tcp_ca(sk);
+	u32 acked = bbr->acked;
+	u32 now = bbr_clock_us();
+
+	bbr_update_bw(sk, ack, now);
+	bbr_update_cycle_phase(sk, in_flight, now);
+	bbr_check_full_bw_reached(bbr);
+	bbr_check_drain(sk, in_flight, now);
+	bbr_update_min_rtt(sk, in_flight, now);
+	bbr_set_cwnd(sk, acked);
+	bbr_set_pacing_rate(sk);
+}
+
+static void bbr_pkts_acked(struct sock *sk, u32 num_acked, s32 rtt_us)
+{
+	struct bbr *bbr = serval_tcp_ca(sk);
+
+	bbr->acked += num_acked;
+
+	if (rtt_us < 0)
+		return;
+
+	if (rtt_us == 0)
+		rtt_us = 1;
+
+	/* Take any lower sample, and any sample once the filter has
+	 * expired, which PROBE_RTT then tries to make a good one */
+	if ((u32)rtt_us < bbr->min_rtt_us ||
+	    bbr_stamp_expired(bbr->min_rtt_stamp, BBR_MIN_RTT_WIN_SEC * HZ)) {
+		bbr->min_rtt_us = rtt_us;
+		bbr->min_rtt_stamp = jiffies;
+	}
+}
+
+/* BBR does not take loss as a signal of congestion, so the slow
+ * start threshold is the model's window rather than a fraction of
+ * the current one. Without a model yet, behave like Reno. */
+static u32 bbr_ssthresh(struct sock *sk)
+{
+	struct serval_tcp_sock *tp = serval_tcp_sk(sk);
+	struct bbr *bbr = serval_tcp_ca(sk);
+	u32 target = bbr_target_cwnd(bbr, BBR_UNIT);
+
+	bbr->prior_cwnd = tp->snd_cwnd;
+
+	if (target == 0)
+		return serval_tcp_reno_ssthresh(sk);
+
+	return target;
+}
+
+/* Do not let loss recovery take the window below the model's BDP */
+static u32 bbr_min_cwnd(const struct sock *sk)
+{
+	const struct bbr *bbr = serval_tcp_ca(sk);
+	u32 target = bbr_target_cwnd(bbr, BBR_UNIT);
+
+	return target ? target : serval_tcp_reno_min_cwnd(sk);
+}
+
+static u32 bbr_undo_cwnd(struct sock *sk)
+{
+	struct bbr *bbr = serval_tcp_ca(sk);
+
+	return max(serval_tcp_sk(sk)->snd_cwnd, bbr->prior_cwnd);
+}
+
+static void bbr_set_state(struct sock *sk, u8 new_state)
+{
+	struct bbr *bbr = serval_tcp_ca(sk);
+
+	if (new_state == TCP_CA_Loss) {
+		/* After a timeout, the window restarts from one packet
+		 * and grows back by what is ACKed. Treat the next ACK
+		 * as the start of a new round. */
+		bbr->full_bw = 0;
+		bbr->round_start = 1;
+	}
+}
+
+static void bbr_init(struct sock *sk)
+{
+	struct serval_tcp_sock *tp = serval_tcp_sk(sk);
+	struct bbr *bbr = serval_tcp_ca(sk);
+
+	BUG_ON(sizeof(struct bbr) > SERVAL_TCP_CA_PRIV_SIZE);
+
+	memset(bbr, 0, sizeof(*bbr));
+	bbr->min_rtt_us = ~0U;
+	bbr->min_rtt_stamp = jiffies;
+	bbr->next_round_seq = 0;
+	bbr->round_start_us = bbr_clock_us();
+	/* The model governs the window, not the slow start threshold */
+	tp->snd_ssthresh = SERVAL_TCP_INFINITE_SSTHRESH;
+	serval_tcp_set_pacing_rate(sk, 0);
+	bbr_reset_startup_mode(bbr);
+}
+
+struct tcp_congestion_ops serval_tcp_bbr = {
+	.flags		= TCP_CONG_RTT_STAMP | SERVAL_TCP_CONG_PACING,
+	.init		= bbr_init,
+	.ssthresh	= bbr_ssthresh,
+	.min_cwnd	= bbr_min_cwnd,
+	.cong_avoid	= bbr_cong_avoid,
+	.set_state	= bbr_set_state,
+	.undo_cwnd	= bbr_undo_cwnd,
+	.pkts_acked	= bbr_pkts_acked,
+	.owner		= THIS_MODULE,
+	.name		= "bbr",
+};
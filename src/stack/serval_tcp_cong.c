@@ -14,13 +14,83 @@
 
 int sysctl_serval_tcp_max_ssthresh = 0;
 
+/*
+  Registered congestion control algorithms. The first one is the
+  default for new sockets. Writers hold the lock, while lookups only
+  need RCU, since algorithms are never unregistered while sockets
+  may use them (they are all built into the stack).
+*/
+static DEFINE_SPINLOCK(serval_tcp_cong_list_lock);
+static LIST_HEAD(serval_tcp_cong_list);
+
+/* Simple linear search, don't expect many entries! */
+static struct tcp_congestion_ops *serval_tcp_ca_find(const char *name)
+{
+	struct tcp_congestion_ops *e;
+
+	list_for_each_entry_rcu(e, &serval_tcp_cong_list, list) {
+		if (strcmp(e->name, name) == 0)
+			return e;
+	}
+
+	return NULL;
+}
+
+/*
+ * Attach new congestion control algorithm to the list
+ * of available options.
+ */
+int serval_tcp_register_congestion_control(struct tcp_congestion_ops *ca)
+{
+	int ret = 0;
+
+	/* all algorithms must implement ssthresh and cong_avoid ops */
+	if (!ca->ssthresh || !ca->cong_avoid) {
+		LOG_ERR("%s does not implement required ops\n", ca->name);
+		return -EINVAL;
+	}
+
+	spin_lock(&serval_tcp_cong_list_lock);
+	if (serval_tcp_ca_find(ca->name)) {
+		LOG_ERR("%s already registered\n", ca->name);
+		ret = -EEXIST;
+	} else {
+		list_add_tail_rcu(&ca->list, &serval_tcp_cong_list);
+		LOG_DBG("%s registered\n", ca->name);
+	}
+	spin_unlock(&serval_tcp_cong_list_lock);
+
+	return ret;
+}
+
+/*
+ * Remove congestion control algorithm, called from
+ * the stack's exit path. Sockets must no longer be using it.
+ */
+void serval_tcp_unregister_congestion_control(struct tcp_congestion_ops *ca)
+{
+	spin_lock(&serval_tcp_cong_list_lock);
+	list_del_rcu(&ca->list);
+	spin_unlock(&serval_tcp_cong_list_lock);
+}
+
 /* Assign choice of congestion control. */
 void serval_tcp_init_congestion_control(struct sock *sk)
 {
 	struct serval_tcp_sock *tp = serval_tcp_sk(sk);
-	
+	struct tcp_congestion_ops *ca;
+
 	/* if no choice made yet assign the current value set as default */
-        tp->ca_ops = &serval_tcp_init_congestion_ops;
+	if (tp->ca_ops == &serval_tcp_init_congestion_ops) {
+		rcu_read_lock();
+		list_for_each_entry_rcu(ca, &serval_tcp_cong_list, list) {
+			tp->ca_ops = ca;
+			break;
+		}
+		rcu_read_unlock();
+	}
+
+	memset(tp->ca_priv, 0, sizeof(tp->ca_priv));
 
 	if (tp->ca_ops->init)
 		tp->ca_ops->init(sk);
@@ -37,6 +107,94 @@ void serval_tcp_cleanup_congestion_control(struct sock *sk)
 	//module_put(tp->ca_ops->owner);
 }
 
+/* Used by sysctl to change default congestion control */
+int serval_tcp_set_default_congestion_control(const char *name)
+{
+	struct tcp_congestion_ops *ca;
+	int ret = -ENOENT;
+
+	spin_lock(&serval_tcp_cong_list_lock);
+	ca = serval_tcp_ca_find(name);
+
+	if (ca) {
+		list_move(&ca->list, &serval_tcp_cong_list);
+		ret = 0;
+	}
+	spin_unlock(&serval_tcp_cong_list_lock);
+
+	return ret;
+}
+
+/* Build string with list of available congestion control values */
+void serval_tcp_get_available_congestion_control(char *buf, size_t maxlen)
+{
+	struct tcp_congestion_ops *ca;
+	size_t offs = 0;
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(ca, &serval_tcp_cong_list, list) {
+		offs += snprintf(buf + offs, maxlen - offs,
+				 "%s%s",
+				 offs == 0 ? "" : " ", ca->name);
+
+		if (offs >= maxlen)
+			break;
+	}
+	rcu_read_unlock();
+}
+
+/* Get current default congestion control */
+void serval_tcp_get_default_congestion_control(char *name)
+{
+	struct tcp_congestion_ops *ca;
+
+	/* We will always have reno... */
+	BUG_ON(list_empty(&serval_tcp_cong_list));
+
+	rcu_read_lock();
+	ca = list_entry(serval_tcp_cong_list.next, 
+			struct tcp_congestion_ops, list);
+	strncpy(name, ca->name, TCP_CA_NAME_MAX);
+	rcu_read_unlock();
+}
+
+/* Change congestion control for socket */
+int serval_tcp_set_congestion_control(struct sock *sk, const char *name)
+{
+	struct serval_tcp_sock *tp = serval_tcp_sk(sk);
+	struct tcp_congestion_ops *ca;
+	int err = 0;
+
+	rcu_read_lock();
+	ca = serval_tcp_ca_find(name);
+
+	/* no change asking for existing value */
+	if (ca == tp->ca_ops)
+		goto out;
+
+	if (!ca)
+		err = -ENOENT;
+	else {
+		/* Only reinitialize once the connection is up, the
+		   new algorithm is otherwise initialized when the
+		   connection is established */
+		if (sk->sk_state == TCP_ESTABLISHED ||
+		    sk->sk_state == TCP_CLOSE_WAIT) {
+			serval_tcp_cleanup_congestion_control(sk);
+			tp->ca_ops = ca;
+			memset(tp->ca_priv, 0, sizeof(tp->ca_priv));
+
+			if (ca->init)
+				ca->init(sk);
+		} else {
+			tp->ca_ops = ca;
+		}
+	}
+ out:
+	rcu_read_unlock();
+	return err;
+}
+
 /* RFC2861 Check whether we are limited by application or congestion window
  * This is the inverse of cwnd check in tcp_tso_should_defer
  */
@@ -157,6 +315,18 @@ u32 serval_tcp_reno_min_cwnd(const struct sock *sk)
 	return tp->snd_ssthresh/2;
 }
 
+struct tcp_congestion_ops serval_tcp_reno = {
+	.name		= "reno",
+	.owner		= THIS_MODULE,
+	.ssthresh	= serval_tcp_reno_ssthresh,
+	.cong_avoid	= serval_tcp_reno_cong_avoid,
+	.min_cwnd	= serval_tcp_reno_min_cwnd,
+};
+
+/* Initial congestion control used (until SYN)
+ * really reno under another name so we can tell difference
+ * during tcp_set_default_congestion_control
+ */
 struct tcp_congestion_ops serval_tcp_init_congestion_ops  = {
 	.name		= "",
 	.owner		= THIS_MODULE,
@@ -164,3 +334,42 @@ struct tcp_congestion_ops serval_tcp_init_congestion_ops  = {
 	.cong_avoid	= serval_tcp_reno_cong_avoid,
 	.min_cwnd	= serval_tcp_reno_min_cwnd,
 };
+
+extern struct tcp_congestion_ops serval_tcp_cubic;
+extern struct tcp_congestion_ops serval_tcp_bbr;
+
+/* Register the built-in algorithms, Reno first so that it stays
+   the default until told otherwise */
+int serval_tcp_cong_init(void)
+{
+	int err;
+
+	err = serval_tcp_register_congestion_control(&serval_tcp_reno);
+
+	if (err)
+		return err;
+
+	err = serval_tcp_register_congestion_control(&serval_tcp_cubic);
+
+	if (err)
+		goto fail_cubic;
+
+	err = serval_tcp_register_congestion_control(&serval_tcp_bbr);
+
+	if (err)
+		goto fail_bbr;
+
+	return 0;
+ fail_bbr:
+	serval_tcp_unregister_congestion_control(&serval_tcp_cubic);
+ fail_cubic:
+	serval_tcp_unregister_congestion_control(&serval_tcp_reno);
+	return err;
+}
+
+void serval_tcp_cong_fini(void)
+{
+	serval_tcp_unregister_congestion_control(&serval_tcp_bbr);
+	serval_tcp_unregister_congestion_control(&serval_tcp_cubic);
+	serval_tcp_unregister_congestion_control(&serval_tcp_reno);
+}
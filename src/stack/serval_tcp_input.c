@@ -12,6 +12,7 @@
 #if defined(OS_LINUX_KERNEL)
 #include <asm/unaligned.h>
 #include <net/netdma.h>
+#include <linux/math64.h>
 #endif
 #if defined(OS_USER)
 #define NR_FILE 1 /* TODO: set appropriate value */
@@ -1710,24 +1711,22 @@ static void serval_tcp_valid_rtt_meas(struct sock *sk, u32 seq_rtt)
 static u32 serval_tcp_tso_acked(struct sock *sk, struct sk_buff *skb)
 {
 	struct serval_tcp_sock *tp = serval_tcp_sk(sk);
-        struct tcphdr *th = tcp_hdr(skb);
 	u32 packets_acked;
-        u32 seq, end_seq;
-
-        seq = ntohl(th->seq);
-        end_seq = (seq + th->syn + th->fin +
-                   skb->len - th->doff * 4);
 
 	BUG_ON(!after(TCP_SKB_CB(skb)->end_seq, tp->snd_una));
 
+	/* Queued segments have no header, so go by the control
+	   block */
 	packets_acked = serval_tcp_skb_pcount(skb);
-	if (serval_tcp_trim_head(sk, skb, tp->snd_una - seq))
+	if (serval_tcp_trim_head(sk, skb, 
+                                 tp->snd_una - TCP_SKB_CB(skb)->seq))
 		return 0;
 	packets_acked -= tcp_skb_pcount(skb);
 
 	if (packets_acked) {
 		BUG_ON(tcp_skb_pcount(skb) == 0);
-		BUG_ON(!before(seq, end_seq));
+		BUG_ON(!before(TCP_SKB_CB(skb)->seq, 
+                               TCP_SKB_CB(skb)->end_seq));
 	}
 
 	return packets_acked;
@@ -2057,6 +2056,34 @@ static int serval_tcp_clean_rtx_queue(struct sock *sk,
 	return flag;
 }
 
+/* Pace at a multiple of the current rate, cwnd/srtt, so that slow
+   start can still double the rate per RTT, as in Linux. Algorithms
+   with a rate model of their own set the pacing rate themselves. */
+void serval_tcp_update_pacing_rate(struct sock *sk)
+{
+	const struct serval_tcp_sock *tp = serval_tcp_sk(sk);
+	u64 rate;
+
+	if (tp->ca_ops->flags & SERVAL_TCP_CONG_PACING)
+		return;
+
+	if (!tp->srtt) {
+		serval_tcp_set_pacing_rate(sk, 0);
+		return;
+	}
+
+	/* srtt is in jiffies, left shifted by 3 */
+	rate = (u64)tp->mss_cache * (HZ << 3) *
+		max(tp->snd_cwnd, tp->packets_out);
+
+	if (tp->snd_cwnd < tp->snd_ssthresh / 2)
+		rate *= SERVAL_TCP_PACING_SS_RATIO;
+	else
+		rate *= SERVAL_TCP_PACING_CA_RATIO;
+
+	serval_tcp_set_pacing_rate(sk, div64_u64(rate, (u64)tp->srtt * 100));
+}
+
 static void serval_tcp_cong_avoid(struct sock *sk, u32 ack, u32 in_flight)
 {
 	struct serval_tcp_sock *tp = serval_tcp_sk(sk);
@@ -2169,6 +2196,8 @@ static int serval_tcp_ack(struct sock *sk, struct sk_buff *skb, int flag)
 			serval_tcp_cong_avoid(sk, ack, prior_in_flight);
 	}
 
+	serval_tcp_update_pacing_rate(sk);
+
 #if defined(OS_LINUX_KERNEL)
 
 	if ((flag & FLAG_FORWARD_PROGRESS) || !(flag & FLAG_NOT_DUP)) {
@@ -3849,6 +3878,7 @@ int serval_tcp_syn_recv_state_process(struct sock *sk, struct sk_buff *skb)
                 serval_sk(sk)->af_ops->rebuild_header(sk);
                 
                 serval_tcp_init_metrics(sk);
+                serval_tcp_path_init(sk);
                 
                 serval_tcp_init_congestion_control(sk);
                 
@@ -3956,6 +3986,7 @@ int serval_tcp_syn_sent_state_process(struct sock *sk, struct sk_buff *skb)
 		serval_sk(sk)->af_ops->rebuild_header(sk);
 
 		serval_tcp_init_metrics(sk);
+		serval_tcp_path_init(sk);
 
 		serval_tcp_init_congestion_control(sk);
 
@@ -21,6 +21,7 @@
 #include <net/dst.h>
 #include <net/tcp.h>
 #endif
+#include <serval/hash.h>
 #include <serval_tcp.h>
 #include <serval_tcp_sock.h>
 
@@ -930,3 +931,141 @@ reset:
 }
 
 #endif /* OS_USER */
+
+/*
+  Congestion and RTT state of the paths a flow has used, keyed by
+  the local and peer address. When a flow migrates, the state
+  learned on the old path is saved here, and the flow starts from
+  what is known about the new path, instead of sending a window sized
+  for the old path into it.
+
+  The cache is direct mapped: a path simply replaces whatever path
+  hashed to the same slot.
+*/
+#define SERVAL_TCP_PATH_HASH_BITS 6
+#define SERVAL_TCP_PATH_HASH_SIZE (1 << SERVAL_TCP_PATH_HASH_BITS)
+#define SERVAL_TCP_PATH_TIMEOUT (10 * 60 * HZ)
+
+struct serval_tcp_path {
+        u32 saddr;
+        u32 daddr;
+        unsigned long stamp;
+        u32 srtt;
+        u32 mdev;
+        u32 ssthresh;
+        u32 cwnd;
+};
+
+static struct serval_tcp_path serval_tcp_path_cache[SERVAL_TCP_PATH_HASH_SIZE];
+static DEFINE_SPINLOCK(serval_tcp_path_lock);
+
+static inline struct serval_tcp_path *serval_tcp_path_slot(u32 saddr, 
+                                                           u32 daddr)
+{
+        return &serval_tcp_path_cache[jhash_2words(saddr, daddr, 0) & 
+                                      (SERVAL_TCP_PATH_HASH_SIZE - 1)];
+}
+
+/* Remember the path the flow uses when it is established */
+void serval_tcp_path_init(struct sock *sk)
+{
+        struct serval_tcp_sock *tp = serval_tcp_sk(sk);
+
+        tp->path_saddr = inet_sk(sk)->inet_saddr;
+        tp->path_daddr = inet_sk(sk)->inet_daddr;
+}
+
+/* Save the state of the path the flow used until now */
+void serval_tcp_path_save(struct sock *sk)
+{
+        struct serval_tcp_sock *tp = serval_tcp_sk(sk);
+        struct serval_tcp_path *p;
+
+        /* Nothing learned, or nothing worth keeping */
+        if (sysctl_serval_tcp_nometrics_save || 
+            tp->path_daddr == 0 || tp->backoff || !tp->srtt)
+                return;
+
+        p = serval_tcp_path_slot(tp->path_saddr, tp->path_daddr);
+
+        spin_lock_bh(&serval_tcp_path_lock);
+        p->saddr = tp->path_saddr;
+        p->daddr = tp->path_daddr;
+        p->stamp = jiffies;
+        p->srtt = tp->srtt;
+        p->mdev = tp->mdev;
+        p->ssthresh = serval_tcp_current_ssthresh(sk);
+
+        /* Outside congestion avoidance, the window is not a reliable
+           estimate of the path's capacity */
+        if (tp->ca_state == TCP_CA_Open)
+                p->cwnd = tp->snd_cwnd;
+        else
+                p->cwnd = min(tp->snd_cwnd, tp->snd_ssthresh);
+        spin_unlock_bh(&serval_tcp_path_lock);
+}
+
+/*
+  Switch the congestion and RTT state to the path the flow now uses.
+  Returns 1 if the path was known, or 0 if the flow restarts from the
+  initial window and RTO, just like a new connection.
+*/
+int serval_tcp_path_switch(struct sock *sk)
+{
+        struct serval_tcp_sock *tp = serval_tcp_sk(sk);
+        struct serval_tcp_path *p, path;
+        int known = 0;
+
+        serval_tcp_path_init(sk);
+
+        p = serval_tcp_path_slot(tp->path_saddr, tp->path_daddr);
+
+        spin_lock_bh(&serval_tcp_path_lock);
+        path = *p;
+        spin_unlock_bh(&serval_tcp_path_lock);
+
+        if (path.saddr == tp->path_saddr && 
+            path.daddr == tp->path_daddr &&
+            path.srtt &&
+            time_before(jiffies, path.stamp + SERVAL_TCP_PATH_TIMEOUT))
+                known = 1;
+
+        /* Whatever the congestion control algorithm learned is about
+           the old path */
+        serval_tcp_cleanup_congestion_control(sk);
+        serval_tcp_init_congestion_control(sk);
+
+        tp->backoff = 0;
+        tp->snd_cwnd_cnt = 0;
+        tp->bytes_acked = 0;
+        tp->prior_ssthresh = 0;
+        tp->undo_marker = 0;
+
+        if (known) {
+                tp->srtt = path.srtt;
+                tp->mdev = path.mdev;
+                tp->mdev_max = tp->rttvar = max(tp->mdev, 
+                                                serval_tcp_rto_min(sk));
+                tp->rtt_seq = tp->snd_nxt;
+                serval_tcp_set_rto(sk);
+                tp->snd_ssthresh = min(path.ssthresh, tp->snd_cwnd_clamp);
+                tp->snd_cwnd = min(path.cwnd, tp->snd_cwnd_clamp);
+        } else {
+                tp->srtt = 0;
+                tp->mdev = tp->mdev_max = tp->rttvar = 
+                        SERVAL_TCP_TIMEOUT_INIT;
+                tp->rto = SERVAL_TCP_TIMEOUT_INIT;
+                tp->snd_ssthresh = SERVAL_TCP_INFINITE_SSTHRESH;
+                tp->snd_cwnd = serval_tcp_init_cwnd(tp, __sk_dst_get(sk));
+        }
+
+        tp->snd_cwnd = max_t(u32, tp->snd_cwnd, 1);
+        tp->snd_cwnd_stamp = tcp_time_stamp;
+        serval_tcp_update_pacing_rate(sk);
+
+        LOG_SSK(sk, "%s path: srtt=%u snd_ssthresh=%u snd_cwnd=%u\n",
+                known ? "Known" : "New", tp->srtt, 
+                tp->snd_ssthresh, tp->snd_cwnd);
+
+        return known;
+}
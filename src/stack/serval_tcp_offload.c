@@ -2,16 +2,26 @@
 /*
  * Generic segmentation offloading for Serval.
  *
- * NOTE: This code is experimental and is currently not in a working state.
+ * In the kernel, these are offload callbacks for the IP layer.
+ * NOTE: The kernel code is experimental and is currently not in a
+ * working state.
+ *
+ * At user level, the device thread uses them to split TCP
+ * super-segments before transmission, and to merge consecutive
+ * received segments of a flow before they are passed up the stack.
  */
+#if defined(OS_LINUX_KERNEL)
 #include <linux/skbuff.h>
 #include <net/protocol.h>
 #include <net/tcp.h>
 #include <net/ip.h>
+#endif
 #include <netinet/serval.h>
 #include <serval_tcp.h>
 #include <serval_sal.h>
 
+#if defined(OS_LINUX_KERNEL)
+
 struct sk_buff *serval_tcp4_tso_segment(struct sk_buff *skb,
 				       netdev_features_t features)
 {
@@ -252,3 +262,307 @@ void __exit serval_tcp_offload_fini(void)
         inet_del_offload(&serval_tcp_offload, IPPROTO_SERVAL);
 }
 
+#elif defined(OS_USER)
+#include <netinet/ip.h>
+#include <serval/netdevice.h>
+
+/* State of a received packet that is held for merging */
+struct serval_tcp_gro_cb {
+        u32 end_seq; /* Sequence number that continues the packet */
+        u16 mss;     /* Payload of the first segment */
+        u16 count;   /* Number of segments merged */
+        u8 flush;    /* Nothing more may be merged */
+};
+
+#define SERVAL_TCP_GRO_CB(skb) ((struct serval_tcp_gro_cb *)&((skb)->cb[0]))
+
+/* TCP flags that end up in no super-segment */
+#define SERVAL_TCP_GRO_FLAGS_BAD (TCP_FLAG_CWR | TCP_FLAG_ECE |        \
+                                  TCP_FLAG_URG | TCP_FLAG_RST |        \
+                                  TCP_FLAG_SYN | TCP_FLAG_FIN)
+
+/* Find the TCP header of an IP packet at skb->data, or return NULL
+   if it is not a well-formed Serval TCP packet */
+static struct tcphdr *serval_tcp4_offload_hdr(struct sk_buff *skb)
+{
+        struct iphdr *iph = (struct iphdr *)skb->data;
+        struct sal_hdr *sh;
+        struct tcphdr *th;
+        unsigned int off;
+
+        if (skb_headlen(skb) < sizeof(*iph) + SAL_HEADER_LEN ||
+            iph->protocol != IPPROTO_SERVAL)
+                return NULL;
+
+        off = iph->ihl << 2;
+        sh = (struct sal_hdr *)(skb->data + off);
+        off += sh->shl << 2;
+
+        if (sh->protocol != SERVAL_PROTO_TCP ||
+            (sh->shl << 2) < SAL_HEADER_LEN ||
+            off + sizeof(*th) > skb_headlen(skb))
+                return NULL;
+
+        th = (struct tcphdr *)(skb->data + off);
+
+        if (th->doff < 5 || off + (th->doff << 2) > skb_headlen(skb))
+                return NULL;
+
+        return th;
+}
+
+/**
+ *	serval_tcp4_gso_segment - split a TCP super-segment
+ *	@skb: IP packet at skb->data, with gso_size set
+ *
+ *	Returns a list, linked through ->next, of packets that each
+ *	carry gso_size bytes of payload, except the last one. They
+ *	copy the headers of @skb and share its payload. The TCP
+ *	checksum of each is computed in full, since the SAL header
+ *	leaves nothing to offload it to. The SAL header is simply
+ *	duplicated, like in the kernel version. Returns %NULL on
+ *	failure. The caller frees @skb in either case.
+ */
+struct sk_buff *serval_tcp4_gso_segment(struct sk_buff *skb)
+{
+        unsigned int mss = skb_shinfo(skb)->gso_size;
+        struct sk_buff *segs = NULL, **next = &segs;
+        unsigned int hdr_len, thlen, offset;
+        struct tcphdr *th;
+        u32 seq;
+
+        if (skb_is_nonlinear(skb) && skb_linearize(skb))
+                return NULL;
+
+        th = serval_tcp4_offload_hdr(skb);
+
+        if (!th || !mss)
+                return NULL;
+
+        thlen = th->doff << 2;
+        hdr_len = (unsigned char *)th + thlen - skb->data;
+        seq = ntohl(th->seq);
+
+        for (offset = hdr_len; offset < skb->len; offset += mss) {
+                unsigned int len = min_t(unsigned int, mss, 
+                                         skb->len - offset);
+                struct sk_buff *nskb, *payload;
+                struct iphdr *iph;
+                struct tcphdr *nth;
+                __wsum csum;
+
+                nskb = alloc_skb(LL_MAX_HEADER + hdr_len, GFP_ATOMIC);
+
+                if (!nskb)
+                        goto fail;
+
+                payload = skb_clone(skb, GFP_ATOMIC);
+
+                if (!payload) {
+                        kfree_skb(nskb);
+                        goto fail;
+                }
+
+                skb_reserve(nskb, LL_MAX_HEADER);
+                skb_copy_from_linear_data(skb, skb_put(nskb, hdr_len), 
+                                          hdr_len);
+                skb_reset_network_header(nskb);
+                skb_set_transport_header(nskb, (unsigned char *)th - 
+                                         skb->data);
+                nskb->dev = skb->dev;
+                nskb->protocol = skb->protocol;
+                nskb->priority = skb->priority;
+                nskb->mark = skb->mark;
+
+                __skb_pull(payload, offset);
+                __skb_trim(payload, len);
+                csum = csum_partial(payload->data, len, 0);
+                skb_shinfo(nskb)->frag_list = payload;
+                nskb->data_len = len;
+                nskb->len += len;
+                nskb->truesize += payload->truesize;
+
+                iph = ip_hdr(nskb);
+#if defined(OS_BSD)
+                /* Host byte order on raw sockets, see
+                   serval_ipv4_xmit() */
+                iph->tot_len = nskb->len;
+#else
+                iph->tot_len = htons(nskb->len);
+#endif
+                iph->check = 0;
+                iph->check = ip_fast_csum((unsigned char *)iph, iph->ihl);
+
+                /* PSH and FIN belong on the last segment, CWR on the
+                   first one */
+                nth = tcp_hdr(nskb);
+                nth->seq = htonl(seq);
+
+                if (offset + len < skb->len)
+                        serval_tcp_flag_word(nth) &= 
+                                ~(TCP_FLAG_PSH | TCP_FLAG_FIN);
+
+                if (offset != hdr_len)
+                        serval_tcp_flag_word(nth) &= ~TCP_FLAG_CWR;
+
+                nth->check = 0;
+                nth->check = serval_tcp_v4_check(thlen + len, 
+                                                 iph->saddr, iph->daddr,
+                                                 csum_partial(nth, thlen, 
+                                                              csum));
+                seq += len;
+                *next = nskb;
+                next = &nskb->next;
+        }
+
+        return segs;
+fail:
+        while (segs) {
+                struct sk_buff *nskb = segs->next;
+                kfree_skb(segs);
+                segs = nskb;
+        }
+        return NULL;
+}
+
+/**
+ *	serval_tcp4_gro_prepare - check if a received packet can be merged
+ *	@skb: IP packet at skb->data
+ *
+ *	Only in-order data segments with nothing but ACK and PSH set,
+ *	and no SAL extensions, are merged. Their TCP checksum is
+ *	verified here, as it is not valid for the merged packet.
+ *	Returns 0 if @skb can be held or merged, or -1 if it should
+ *	go up the stack as is.
+ */
+int serval_tcp4_gro_prepare(struct sk_buff *skb)
+{
+        struct serval_tcp_gro_cb *cb = SERVAL_TCP_GRO_CB(skb);
+        struct iphdr *iph = (struct iphdr *)skb->data;
+        struct tcphdr *th;
+        unsigned int len, tcp_len;
+
+        if (skb_is_nonlinear(skb))
+                return -1;
+
+        th = serval_tcp4_offload_hdr(skb);
+
+        if (!th || iph->ihl != 5 || 
+            ((struct sal_hdr *)(iph + 1))->shl << 2 != SAL_HEADER_LEN ||
+            ntohs(iph->tot_len) != skb->len ||
+            (iph->frag_off & htons(IP_MF | IP_OFFMASK)) ||
+            !(serval_tcp_flag_word(th) & TCP_FLAG_ACK) ||
+            (serval_tcp_flag_word(th) & SERVAL_TCP_GRO_FLAGS_BAD))
+                return -1;
+
+        tcp_len = skb->len - ((unsigned char *)th - skb->data);
+        len = tcp_len - (th->doff << 2);
+
+        if (len == 0)
+                return -1;
+
+        /* Leave bad packets to TCP, which counts them */
+        if (serval_tcp_v4_check(tcp_len, iph->saddr, iph->daddr,
+                                csum_partial(th, tcp_len, 0)))
+                return -1;
+
+        skb->ip_summed = CHECKSUM_UNNECESSARY;
+        cb->end_seq = ntohl(th->seq) + len;
+        cb->mss = len;
+        cb->count = 1;
+        cb->flush = th->psh;
+
+        return 0;
+}
+
+/**
+ *	serval_tcp4_gro_receive - merge a received packet into a held one
+ *	@p: held packet
+ *	@skb: packet accepted by serval_tcp4_gro_prepare()
+ *
+ *	Returns 0 if the payload of @skb was appended to @p, in which
+ *	case the caller frees @skb, 1 if @skb is of the same flow but
+ *	cannot be merged, so that @p must go up the stack before it,
+ *	or -1 if @skb is of another flow.
+ */
+int serval_tcp4_gro_receive(struct sk_buff *p, struct sk_buff *skb)
+{
+        struct serval_tcp_gro_cb *pcb = SERVAL_TCP_GRO_CB(p);
+        struct iphdr *iph = (struct iphdr *)skb->data;
+        struct iphdr *piph = (struct iphdr *)p->data;
+        unsigned int off = sizeof(*iph) + SAL_HEADER_LEN;
+        struct tcphdr *th, *pth;
+        unsigned int thlen, len;
+
+        /* Both have the base SAL header only, which identifies the
+           flow */
+        if (iph->saddr != piph->saddr || iph->daddr != piph->daddr ||
+            memcmp(iph + 1, piph + 1, SAL_HEADER_LEN))
+                return -1;
+
+        th = (struct tcphdr *)(skb->data + off);
+        pth = (struct tcphdr *)(p->data + off);
+        thlen = th->doff << 2;
+        len = skb->len - off - thlen;
+
+        /* The same header but for PSH and the sequence number, which
+           must continue the held packet. Compare the options too,
+           like the kernel, so timestamps stay right; the header
+           lengths are checked first, as the options are compared at
+           the length of the new one. */
+        if (pcb->flush ||
+            th->source != pth->source || th->dest != pth->dest ||
+            th->ack_seq != pth->ack_seq || th->doff != pth->doff ||
+            ((serval_tcp_flag_word(th) ^ serval_tcp_flag_word(pth)) &
+             ~TCP_FLAG_PSH) ||
+            memcmp(th + 1, pth + 1, thlen - sizeof(*th)) ||
+            ntohl(th->seq) != pcb->end_seq ||
+            len > pcb->mss || p->len + len >= GSO_MAX_SIZE)
+                return 1;
+
+        if (skb_tailroom(p) < (int)len &&
+            pskb_expand_head(p, 0, GSO_MAX_SIZE - p->len - 
+                             skb_tailroom(p), GFP_ATOMIC))
+                return 1;
+
+        memcpy(skb_put(p, len), skb->data + off + thlen, len);
+
+        if (th->psh) {
+                pth = (struct tcphdr *)(p->data + off);
+                pth->psh = 1;
+        }
+
+        pcb->end_seq += len;
+        pcb->count++;
+
+        if (len < pcb->mss || th->psh)
+                pcb->flush = 1;
+
+        return 0;
+}
+
+/**
+ *	serval_tcp4_gro_complete - finish a held packet
+ *	@skb: packet accepted by serval_tcp4_gro_prepare()
+ *
+ *	Makes the IP header cover the merged payload and sets the
+ *	segment size, before the packet goes up the stack.
+ */
+void serval_tcp4_gro_complete(struct sk_buff *skb)
+{
+        struct serval_tcp_gro_cb *cb = SERVAL_TCP_GRO_CB(skb);
+        struct iphdr *iph = (struct iphdr *)skb->data;
+
+        if (cb->count > 1) {
+                iph->tot_len = htons(skb->len);
+                iph->check = 0;
+                iph->check = ip_fast_csum((unsigned char *)iph, iph->ihl);
+                skb_shinfo(skb)->gso_size = cb->mss;
+                skb_shinfo(skb)->gso_segs = cb->count;
+                skb_shinfo(skb)->gso_type = SKB_GSO_TCPV4;
+        }
+
+        memset(skb->cb, 0, sizeof(skb->cb));
+}
+
+#endif /* OS_USER */
@@ -1325,6 +1325,7 @@ int serval_tcp_retransmit_skb(struct sock *sk, struct sk_buff *skb)
 		//TCP_INC_STATS(sock_net(sk), TCP_MIB_RETRANSSEGS);
 
 		tp->total_retrans++;
+		tp->mig_retrans++;
 
                 if (!tp->retrans_out)
 			tp->lost_retrans_low = tp->snd_nxt;
@@ -8,6 +8,9 @@
 
 struct tcp_congestion_ops;
 
+/* Room for the private state of a congestion control algorithm */
+#define SERVAL_TCP_CA_PRIV_SIZE	(16 * sizeof(u64))
+
 /* for TCP_COOKIE_TRANSACTIONS (TCPCT) socket option */
 #define TCP_COOKIE_MIN		 8		/*  64-bits */
 #define TCP_COOKIE_MAX		16		/* 128-bits */
@@ -122,6 +125,7 @@ struct serval_tcp_sock {
  */
 	struct serval_tcp_options_received rx_opt;
 	const struct tcp_congestion_ops *ca_ops;
+	u64 ca_priv[SERVAL_TCP_CA_PRIV_SIZE / sizeof(u64)];
 /*
  *	Slow start and congestion control (see also Nagle, and Karn & Partridge)
  */
@@ -230,6 +234,12 @@ struct serval_tcp_sock {
 
     /* Store the first seq # send on new link after migration */
     u32 snd_mig_last;
+    /* The path (local and peer address) that the congestion state
+       describes */
+    u32 path_saddr;
+    u32 path_daddr;
+    u32 mig_count;   /* Completed migrations */
+    u32 mig_retrans; /* Retransmits since the last migration */
 
 	struct serval_tcp_cookie_values  *cookie_values;
 };
@@ -239,6 +249,11 @@ static inline struct serval_tcp_sock *serval_tcp_sk(const struct sock *sk)
 	return (struct serval_tcp_sock *)sk;
 }
 
+static inline void *serval_tcp_ca(const struct sock *sk)
+{
+	return (void *)serval_tcp_sk(sk)->ca_priv;
+}
+
 /* urg_data states */
 #define TCP_URG_VALID	0x0100
 #define TCP_URG_NOTYET	0x0200
@@ -904,5 +904,8 @@ struct proto serval_udp_proto = {
         .unhash                 = serval_sock_unhash,
 	.max_header		= MAX_SERVAL_UDP_HDR,
 	.obj_size		= sizeof(struct serval_udp_sock),
+#if defined(OS_LINUX_KERNEL)
+        .slab_flags             = SLAB_DESTROY_BY_RCU,
+#endif
 	.rsk_prot		= &udp_request_sock_ops,
 };
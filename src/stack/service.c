@@ -17,7 +17,11 @@
 #include <serval/debug.h>
 #include <serval/list.h>
 #include <serval/lock.h>
+#include <serval/rcupdate.h>
+#include <serval/random.h>
 #include <serval/dst.h>
+#include <serval/hash.h>
+#include <serval/percpu.h>
 #include <netinet/serval.h>
 #if defined(OS_USER)
 #include <stdlib.h>
@@ -33,14 +37,43 @@
 #define find_service_entry(tbl, prefix, bits)                           \
         get_service(bst_find_longest_prefix(tbl->tree, prefix, bits))
 
+/* Number of slots in each per-CPU resolution cache (power of two) */
+#define SERVICE_CACHE_SIZE 256
+
+/*
+  A slot caches the result of one (serviceID, prefix, match)
+  lookup. The slot does not hold a reference to the entry; the entry
+  is only valid as long as the table generation has not changed since
+  the slot was filled.
+*/
+struct service_cache_slot {
+        struct service_id srvid;
+        struct service_entry *se;
+        unsigned int gen;
+        uint16_t prefix;
+        uint16_t match;
+};
+
+struct service_cache {
+        spinlock_t lock;
+        unsigned long hits;
+        unsigned long misses;
+        struct service_cache_slot slot[SERVICE_CACHE_SIZE];
+};
+
 struct service_table {
         struct bst tree;
         struct bst_node_ops srv_ops;
         uint32_t services;
-        atomic_t bytes_resolved;
-        atomic_t packets_resolved;
-        atomic_t bytes_dropped;
-        atomic_t packets_dropped;
+        struct service_stats __percpu *stats;
+        struct service_cache __percpu *cache;
+        /* Bumped after every change to the table. Cache slots
+         * filled in an earlier generation are stale. */
+        atomic_t gen;
+        /* Number of changes in progress. Nothing is cached while
+         * nonzero. */
+        atomic_t writers;
+        uint32_t cache_seed;
         rwlock_t lock;
 };
 
@@ -50,6 +83,47 @@ static void service_entry_destroy(struct bst_node *n);
 static struct service_table srvtable;
 static struct service_id default_service;
 
+/*
+  Resolution cache.
+
+  Each CPU has a direct-mapped cache of recent lookups in front of the
+  trie. Instead of tracking which entries a change affects, any change
+  to the table invalidates all caches by bumping the table
+  generation. Changes are bracketed by service_table_update_begin()
+  and service_table_update_end(), and nothing is cached while a change
+  is in progress, so a cached entry cannot have been released before
+  the generation it was cached in ended. Lookups run under
+  rcu_read_lock(), so an entry that was valid when the generation was
+  read is not freed before the lookup is done.
+*/
+static void service_table_update_begin(struct service_table *tbl)
+{
+        atomic_inc(&tbl->writers);
+        smp_mb();
+}
+
+static void service_table_update_end(struct service_table *tbl)
+{
+        smp_mb();
+        atomic_inc(&tbl->gen);
+        smp_mb();
+        atomic_dec(&tbl->writers);
+}
+
+/* Returns the current generation, or zero if the table is being
+ * changed. */
+static unsigned int service_table_gen(struct service_table *tbl)
+{
+        if (atomic_read(&tbl->writers))
+                return 0;
+        smp_rmb();
+        return atomic_read(&tbl->gen);
+}
+
+/* Stride of the service table trie. Zero selects the plain bitwise
+ * trie. Set as module parameter or command line option. */
+extern unsigned int service_trie_stride;
+
 static const char *rule_str[] = {
         [SERVICE_RULE_UNDEFINED] = "UDF",
         [SERVICE_RULE_FORWARD] = "FWD",
@@ -82,6 +156,124 @@ static const char *protocol_to_str(int protocol)
         return buf;
 }
 
+/*
+  Counters of targets, entries and the table are per CPU. Targets and
+  entries are created under the table lock, and kernels before 3.18
+  may sleep when allocating per-CPU memory, so there the counters are
+  a single set shared by all CPUs, updated atomically.
+
+  In the kernel, each set costs one copy per possible CPU, i.e., 32
+  bytes times num_possible_cpus(). The user-level emulation keeps one
+  cache line per configured CPU.
+*/
+static struct service_stats __percpu *service_stats_alloc(gfp_t alloc)
+{
+#if defined(HAVE_ALLOC_PERCPU_GFP)
+        return alloc_percpu_gfp(struct service_stats, alloc);
+#else
+        return (struct service_stats __percpu *)
+                kzalloc(sizeof(struct service_stats), alloc);
+#endif
+}
+
+static void service_stats_free(struct service_stats __percpu *stats)
+{
+#if defined(HAVE_ALLOC_PERCPU_GFP)
+        free_percpu(stats);
+#else
+        kfree((void *)stats);
+#endif
+}
+
+#if !defined(HAVE_ALLOC_PERCPU_GFP)
+static inline void service_stat_add(uint64_t *v, long n)
+{
+        atomic64_add(n, (atomic64_t *)v);
+}
+#endif
+
+/*
+  Account packets to a set of counters. A positive packet count means
+  resolved packets, a negative one dropped packets.
+*/
+static void service_stats_add(struct service_stats __percpu *stats,
+                              int packets, int bytes)
+{
+        if (bytes < 0)
+                bytes = -bytes;
+#if defined(OS_LINUX_KERNEL) && !defined(HAVE_ALLOC_PERCPU_GFP)
+        {
+                struct service_stats *s = (struct service_stats *)stats;
+
+                if (packets > 0) {
+                        service_stat_add(&s->packets_resolved, packets);
+                        service_stat_add(&s->bytes_resolved, bytes);
+                } else {
+                        service_stat_add(&s->packets_dropped, -packets);
+                        service_stat_add(&s->bytes_dropped, bytes);
+                }
+        }
+#elif defined(OS_LINUX_KERNEL)
+        if (packets > 0) {
+                this_cpu_add(stats->packets_resolved, packets);
+                this_cpu_add(stats->bytes_resolved, bytes);
+        } else {
+                this_cpu_add(stats->packets_dropped, -packets);
+                this_cpu_add(stats->bytes_dropped, bytes);
+        }
+#else
+        {
+                /* Other threads may share our copy */
+                struct service_stats *s = this_cpu_ptr(stats);
+                
+                if (packets > 0) {
+                        __sync_fetch_and_add(&s->packets_resolved, packets);
+                        __sync_fetch_and_add(&s->bytes_resolved, bytes);
+                } else {
+                        __sync_fetch_and_add(&s->packets_dropped, -packets);
+                        __sync_fetch_and_add(&s->bytes_dropped, bytes);
+                }
+        }
+#endif
+}
+
+static void service_stats_read(struct service_stats __percpu *stats,
+                               struct service_stats *sum)
+{
+#if defined(HAVE_ALLOC_PERCPU_GFP)
+        int cpu;
+
+        memset(sum, 0, sizeof(*sum));
+
+        for_each_possible_cpu(cpu) {
+                const struct service_stats *s = per_cpu_ptr(stats, cpu);
+
+                sum->packets_resolved += ACCESS_ONCE(s->packets_resolved);
+                sum->bytes_resolved += ACCESS_ONCE(s->bytes_resolved);
+                sum->packets_dropped += ACCESS_ONCE(s->packets_dropped);
+                sum->bytes_dropped += ACCESS_ONCE(s->bytes_dropped);
+        }
+#else
+        struct service_stats *s = (struct service_stats *)stats;
+
+        sum->packets_resolved = atomic64_read((atomic64_t *)&s->packets_resolved);
+        sum->bytes_resolved = atomic64_read((atomic64_t *)&s->bytes_resolved);
+        sum->packets_dropped = atomic64_read((atomic64_t *)&s->packets_dropped);
+        sum->bytes_dropped = atomic64_read((atomic64_t *)&s->bytes_dropped);
+#endif
+}
+
+/* Carry the counters over to a set that nobody else sees yet */
+static void service_stats_copy(struct service_stats __percpu *from,
+                               struct service_stats __percpu *to)
+{
+#if defined(HAVE_ALLOC_PERCPU_GFP)
+        service_stats_read(from, per_cpu_ptr(to, 0));
+#else
+        service_stats_read(from, (struct service_stats *)to);
+#endif
+}
+
 static struct target *target_create(service_rule_type_t type,
                                     const void *dst, int dstlen,
                                     const union target_out out, 
@@ -99,6 +291,14 @@ static struct target *target_create(service_rule_type_t type,
                 return NULL;
 
         memset(t, 0, sizeof(*t) + dstlen);
+
+        t->stats = service_stats_alloc(alloc);
+
+        if (!t->stats) {
+                kfree(t);
+                return NULL;
+        }
+
         t->type = type;
         t->weight = weight;
         t->dstlen = dstlen;
@@ -126,9 +326,146 @@ static void target_free(struct target *t)
                 dev_put(t->out.dev);
         else if (is_sock_target(t) && t->out.sk)
                 sock_put(t->out.sk);
+        service_stats_free(t->stats);
         kfree(t);
 }
 
+static void target_free_rcu(struct rcu_head *head)
+{
+        target_free(container_of(head, struct target, rcu));
+}
+
+/* 
+   Free a target that has been unlinked from a live service entry
+   once all concurrent readers are done with it.
+*/
+static void target_release(struct target *t)
+{
+        call_rcu(&t->rcu, target_free_rcu);
+}
+
+/*
+  Alias table for O(1) weighted sampling of a target in a set
+  (Vose's alias method). A slot is picked uniformly at random and
+  then either the slot's own target is returned, with probability
+  prob/2^32, or its alias. The table is rebuilt whenever the targets
+  or weights of a set change, and replaced using RCU so that lookups
+  never see a partially built table.
+*/
+struct target_alias {
+        struct rcu_head rcu;
+        unsigned int count;
+        struct {
+                uint32_t prob;
+                struct target *target;
+                struct target *alias; /* NULL if never aliased */
+        } slot[0];
+};
+
+static void target_alias_free_rcu(struct rcu_head *head)
+{
+        kfree(container_of(head, struct target_alias, rcu));
+}
+
+static struct target_alias *target_alias_build(struct target_set *set,
+                                               gfp_t alloc)
+{
+        struct target_alias *a;
+        struct target *t;
+        uint64_t total = set->normalizer;
+        uint64_t *scaled;
+        unsigned int *work;
+        unsigned int n = set->count, i = 0, nsmall = 0, nlarge = 0;
+
+        if (n == 0 || total == 0)
+                return NULL;
+
+        a = (struct target_alias *)kmalloc(sizeof(*a) + 
+                                           n * sizeof(a->slot[0]), alloc);
+
+        if (!a)
+                return NULL;
+
+        /* Scaled weights, followed by a work list that holds "small"
+           slots from the front and "large" slots from the back */
+        scaled = (uint64_t *)kmalloc(n * (sizeof(*scaled) + 
+                                          sizeof(*work)), alloc);
+
+        if (!scaled) {
+                kfree(a);
+                return NULL;
+        }
+
+        work = (unsigned int *)(scaled + n);
+        a->count = n;
+
+        list_for_each_entry(t, &set->list, lh) {
+                if (i == n)
+                        break;
+
+                a->slot[i].prob = 0;
+                a->slot[i].target = t;
+                a->slot[i].alias = NULL;
+                scaled[i] = (uint64_t)t->weight * n;
+
+                if (scaled[i] < total)
+                        work[nsmall++] = i;
+                else
+                        work[n - ++nlarge] = i;
+                i++;
+        }
+
+        while (nsmall > 0 && nlarge > 0) {
+                unsigned int sm = work[--nsmall];
+                unsigned int lg = work[n - nlarge];
+
+                /* scaled[sm] < total <= UINT32_MAX, so no overflow */
+                a->slot[sm].prob = (uint32_t)((scaled[sm] << 32) / total);
+                a->slot[sm].alias = a->slot[lg].target;
+                scaled[lg] -= total - scaled[sm];
+
+                if (scaled[lg] < total) {
+                        nlarge--;
+                        work[nsmall++] = lg;
+                }
+        }
+
+        /* Remaining slots (only left over due to rounding) always
+           return their own target */
+        kfree(scaled);
+
+        return a;
+}
+
+static struct target *target_alias_sample(struct target_alias *a)
+{
+        unsigned int i;
+
+        i = (unsigned int)(((uint64_t)serval_random_u32() * a->count) >> 32);
+
+        if (a->slot[i].alias && serval_random_u32() >= a->slot[i].prob)
+                return a->slot[i].alias;
+
+        return a->slot[i].target;
+}
+
+/*
+  Must be called with the service entry write lock held whenever
+  the targets or weights of a set change.
+*/
+static void target_set_update_alias(struct target_set *set)
+{
+        struct target_alias *old = set->alias;
+
+        /* If the allocation fails, lookups fall back to a linear
+           walk of the set */
+        rcu_assign_pointer(set->alias, 
+                           target_alias_build(set, GFP_ATOMIC));
+
+        if (old)
+                call_rcu(&old->rcu, target_alias_free_rcu);
+}
+
 static struct target_set *target_set_create(uint16_t flags, 
                                             uint32_t priority, 
                                             gfp_t alloc) {
@@ -158,17 +495,29 @@ static void target_set_free(struct target_set *set)
                 list_del(&t->lh);
                 target_free(t);
         }
+        if (set->alias)
+                kfree(set->alias);
         kfree(set);
 }
 
+static void target_set_free_rcu(struct rcu_head *head)
+{
+        target_set_free(container_of(head, struct target_set, rcu));
+}
+
+static void target_set_release(struct target_set *set)
+{
+        call_rcu(&set->rcu, target_set_free_rcu);
+}
+
 static struct target *__service_entry_get_dev(struct service_entry *se, 
                                               const char *ifname) 
 {
         struct target *t;
         struct target_set* set = NULL;
         
-        list_for_each_entry(set, &se->target_set, lh) {
-                list_for_each_entry(t, &set->list, lh) {
+        list_for_each_entry_rcu(set, &se->target_set, lh) {
+                list_for_each_entry_rcu(t, &set->list, lh) {
                         if (!is_sock_target(t) && t->out.dev && 
                             strcmp(t->out.dev->name, ifname) == 0) {
                                 return t;
@@ -218,8 +567,8 @@ static struct target * __service_entry_get_target(struct service_entry *se,
         struct target *t = NULL;
         struct target_set* set = NULL;
 
-        list_for_each_entry(set, &se->target_set, lh) {
-                list_for_each_entry(t, &set->list, lh) {
+        list_for_each_entry_rcu(set, &se->target_set, lh) {
+                list_for_each_entry_rcu(t, &set->list, lh) {
                         if (t->type != type )
                                 continue;
 
@@ -253,25 +602,29 @@ struct net_device *service_entry_get_dev(struct service_entry *se,
                                          const char *ifname) 
 {
         struct target *t = NULL;
+        struct net_device *dev = NULL;
 
-        read_lock_bh(&se->lock);
+        rcu_read_lock();
 
         t = __service_entry_get_dev(se, ifname);
 
-        if (t)
-                dev_hold(t->out.dev);
+        if (t) {
+                dev = t->out.dev;
+                dev_hold(dev);
+        }
 
-        read_unlock_bh(&se->lock);
+        rcu_read_unlock();
 
-        return t ? t->out.dev : NULL;
+        return dev;
 }
 
 static void target_set_add_target(struct target_set *set, 
                                   struct target *t) 
 {
-        list_add_tail(&t->lh, &set->list);
+        list_add_tail_rcu(&t->lh, &set->list);
         set->normalizer += t->weight;
         set->count++;
+        target_set_update_alias(set);
 }
 
 static void service_entry_insert_target_set(struct service_entry *se, 
@@ -281,11 +634,11 @@ static void service_entry_insert_target_set(struct service_entry *se,
         struct target_set *pos = NULL;
         list_for_each_entry(pos, &se->target_set, lh) {
                 if (pos->priority < set->priority) {
-                        list_add_tail(&set->lh, &pos->lh);
+                        list_add_tail_rcu(&set->lh, &pos->lh);
                         return;
                 }
         }
-        list_add_tail(&set->lh, &se->target_set);
+        list_add_tail_rcu(&set->lh, &se->target_set);
 }
 
 static struct target_set *
@@ -302,11 +655,17 @@ __service_entry_get_target_set(struct service_entry *se,
         return NULL;
 }
 
+/*
+  Add a target to an entry. If prealloc points to a target created
+  with the same arguments, that target is used (and prealloc cleared)
+  instead of allocating a new one.
+*/
 static int __service_entry_add_target(struct service_entry *se, 
                                       service_rule_type_t type,
                                       uint16_t flags, uint32_t priority,
                                       uint32_t weight, const void *dst, 
                                       int dstlen, const union target_out out, 
+                                      struct target **prealloc,
                                       gfp_t alloc) 
 {
         struct target_set *set = NULL;
@@ -326,7 +685,12 @@ static int __service_entry_add_target(struct service_entry *se,
                 return 0;
         }
         
-        t = target_create(type, dst, dstlen, out, weight, alloc);
+        if (prealloc && *prealloc) {
+                t = *prealloc;
+                *prealloc = NULL;
+        } else {
+                t = target_create(type, dst, dstlen, out, weight, alloc);
+        }
 
         if (!t)
                 return -ENOMEM;
@@ -358,6 +722,7 @@ int service_entry_add_target(struct service_entry *se,
 {
         int ret = 0;
 
+        service_table_update_begin(&srvtable);
         write_lock_bh(&se->lock);
         /* 
            NOTE: we ignore the alloc argument here and always use
@@ -367,8 +732,9 @@ int service_entry_add_target(struct service_entry *se,
         */
         ret = __service_entry_add_target(se, type, flags, priority, 
                                          weight, dst, dstlen, 
-                                         out, GFP_ATOMIC);
+                                         out, NULL, GFP_ATOMIC);
         write_unlock_bh(&se->lock);
+        service_table_update_end(&srvtable);
 
         return ret;
 }
@@ -376,8 +742,9 @@ int service_entry_add_target(struct service_entry *se,
 static void target_set_remove_target(struct target_set *set, struct target* t) 
 {
         set->normalizer -= t->weight;
-        list_del(&t->lh);
+        list_del_rcu(&t->lh);
         set->count--;
+        target_set_update_alias(set);
 }
 
 static int __service_entry_modify_target(struct service_entry *se,
@@ -392,7 +759,7 @@ static int __service_entry_modify_target(struct service_entry *se,
                                          gfp_t alloc) 
 {
         struct target_set *set = NULL;
-        struct target *t;
+        struct target *t, *nt;
 
         if (type == SERVICE_RULE_DEMUX || dstlen == 0) {
                 LOG_ERR("Cannot modify socket entry\n");
@@ -428,9 +795,27 @@ static int __service_entry_modify_target(struct service_entry *se,
                         return 0;
         }
 #endif
-
-        if (new_dstlen == t->dstlen && new_dst)
-                memcpy(t->dst, new_dst, new_dstlen);
+        nt = t;
+
+        if ((new_dst && new_dstlen == t->dstlen) ||
+            set->priority != priority) {
+                /* Readers may be traversing the target concurrently,
+                   so we cannot change its address or move it to
+                   another set in place. Instead, publish an updated
+                   copy and release the old target once readers are
+                   done with it. */
+                nt = target_create(t->type, 
+                                   (new_dst && new_dstlen == t->dstlen) ?
+                                   new_dst : t->dst, 
+                                   t->dstlen, t->out, weight, alloc);
+                
+                if (!nt)
+                        return -ENOMEM;
+                
+                /* The copy is not yet visible, so just carry over
+                   the counters */
+                service_stats_copy(t->stats, nt->stats);
+        }
 
         if (set->priority != priority) {
                 struct target_set *nset;
@@ -443,28 +828,37 @@ static int __service_entry_modify_target(struct service_entry *se,
                 if (!nset) {
                         nset = target_set_create(flags, priority, alloc);
 
-                        if (!nset)
+                        if (!nset) {
+                                target_free(nt);
                                 return -ENOMEM;
+                        }
 
                         service_entry_insert_target_set(se, nset);
                 }
 
                 target_set_remove_target(set, t);
+                target_release(t);
 
                 if (set->count == 0) {
-                        list_del(&set->lh);
-                        target_set_free(set);
+                        list_del_rcu(&set->lh);
+                        target_set_release(set);
                 }
 
-                t->weight = weight;
-                target_set_add_target(nset, t);
+                target_set_add_target(nset, nt);
                 nset->flags = flags;
         } else {
                 /*adjust the normalizer*/
                 set->normalizer -= t->weight;
-                t->weight = weight;
-                set->normalizer += t->weight;
+
+                if (nt != t) {
+                        list_replace_rcu(&t->lh, &nt->lh);
+                        target_release(t);
+                } else {
+                        t->weight = weight;
+                }
+                set->normalizer += nt->weight;
                 set->flags = flags;
+                target_set_update_alias(set);
         }
 
         return 1;
@@ -483,12 +877,14 @@ int service_entry_modify_target(struct service_entry *se,
 {
         int ret = 0;
         
+        service_table_update_begin(&srvtable);
         write_lock_bh(&se->lock);
         ret = __service_entry_modify_target(se, type, flags, priority, 
                                             weight, dst, dstlen, 
                                             new_dst, new_dstlen,
                                             out, alloc);
         write_unlock_bh(&se->lock);
+        service_table_update_end(&srvtable);
 
         return ret;
 }
@@ -507,37 +903,20 @@ static void __service_entry_inc_target_stats(struct service_entry *se,
         if (!t)
                 return;
 
-        if (packets > 0) {
-                atomic_add(packets, &t->packets_resolved);
-                atomic_add(bytes, &t->bytes_resolved);
-
-                atomic_add(packets, &se->packets_resolved);
-                atomic_add(bytes, &se->bytes_resolved);
-
-                atomic_add(packets, &srvtable.packets_resolved);
-                atomic_add(bytes, &srvtable.bytes_resolved);
-        } else {
-                atomic_add(-packets, &t->packets_dropped);
-                atomic_add(-bytes, &t->bytes_dropped);
-
-                atomic_add(-packets, &se->packets_dropped);
-                atomic_add(-bytes, &se->bytes_dropped);
-
-                atomic_add(-packets, &srvtable.packets_dropped);
-                atomic_add(-bytes, &srvtable.bytes_dropped);
-        }
-
+        service_stats_add(t->stats, packets, bytes);
+        service_stats_add(se->stats, packets, bytes);
+        service_stats_add(srvtable.stats, packets, bytes);
 }
 void service_entry_inc_target_stats(struct service_entry *se,
                                     service_rule_type_t type,
                                     const void* dst, int dstlen, 
                                     int packets, int bytes) 
 {
-        /* using a read lock since we are atomically updating stats and
+        /* no lock needed since we are atomically updating stats and
            not modifying the set/target itself */
-        read_lock_bh(&se->lock);
+        rcu_read_lock();
         __service_entry_inc_target_stats(se, type, dst, dstlen, packets, bytes);
-        read_unlock_bh(&se->lock);
+        rcu_read_unlock();
 }
 
 int __service_entry_remove_target_by_dev(struct service_entry *se, 
@@ -554,11 +933,11 @@ int __service_entry_remove_target_by_dev(struct service_entry *se,
                         if (t->type == SERVICE_RULE_FORWARD && t->out.dev && 
                             strcmp(t->out.dev->name, ifname) == 0) {
                                 target_set_remove_target(set, t);
-                                target_free(t);
+                                target_release(t);
 
                                 if (set->count == 0) {
-                                        list_del(&set->lh);
-                                        target_set_free(set);
+                                        list_del_rcu(&set->lh);
+                                        target_set_release(set);
                                 }
                                 se->count--;
                                 count++;
@@ -574,6 +953,7 @@ int service_entry_remove_target_by_dev(struct service_entry *se,
         int ret;
 
         service_entry_hold(se);
+        service_table_update_begin(&srvtable);
 
         write_lock_bh(&se->lock);
         
@@ -590,6 +970,7 @@ int service_entry_remove_target_by_dev(struct service_entry *se,
 
         write_unlock_bh(&se->lock);
 
+        service_table_update_end(&srvtable);
         service_entry_put(se);
 
         return ret;
@@ -612,17 +993,20 @@ int __service_entry_remove_target(struct service_entry *se,
                                 target_set_remove_target(set, t);
                                 
                                 if (stats) {
-                                        stats->packets_resolved = atomic_read(&t->packets_resolved);
-                                        stats->bytes_resolved = atomic_read(&t->bytes_resolved);
-                                        stats->packets_dropped = atomic_read(&t->packets_dropped);
-                                        stats->bytes_dropped = atomic_read(&t->bytes_dropped);
+                                        struct service_stats sum;
+
+                                        service_stats_read(t->stats, &sum);
+                                        stats->packets_resolved = sum.packets_resolved;
+                                        stats->bytes_resolved = sum.bytes_resolved;
+                                        stats->packets_dropped = sum.packets_dropped;
+                                        stats->bytes_dropped = sum.bytes_dropped;
                                 }
                                 
-                                target_free(t);
+                                target_release(t);
                                 
                                 if (set->count == 0) {
-                                        list_del(&set->lh);
-                                        target_set_free(set);
+                                        list_del_rcu(&set->lh);
+                                        target_set_release(set);
                                 }
                                 se->count--;
                                 return 1;
@@ -640,6 +1024,7 @@ int service_entry_remove_target(struct service_entry *se,
         int ret;
 
         service_entry_hold(se);
+        service_table_update_begin(&srvtable);
 
         write_lock_bh(&se->lock);
 
@@ -657,6 +1042,7 @@ int service_entry_remove_target(struct service_entry *se,
         }
         write_unlock_bh(&se->lock);
 
+        service_table_update_end(&srvtable);
         service_entry_put(se);
 
         return ret;
@@ -672,6 +1058,14 @@ static struct service_entry *service_entry_create(gfp_t alloc)
                 return NULL;
 
         memset(se, 0, sizeof(*se));
+
+        se->stats = service_stats_alloc(alloc);
+
+        if (!se->stats) {
+                kfree(se);
+                return NULL;
+        }
+
         INIT_LIST_HEAD(&se->target_set);
         rwlock_init(&se->lock);
         atomic_set(&se->refcnt, 1);
@@ -696,9 +1090,15 @@ void __service_entry_free(struct service_entry *se)
         }
 
         rwlock_destroy(&se->lock);
+        service_stats_free(se->stats);
         kfree(se);
 }
 
+static void service_entry_free_rcu(struct rcu_head *head)
+{
+        __service_entry_free(container_of(head, struct service_entry, rcu));
+}
+
 void service_entry_hold(struct service_entry *se) 
 {
         atomic_inc(&se->refcnt);
@@ -706,8 +1106,11 @@ void service_entry_hold(struct service_entry *se)
 
 void service_entry_put(struct service_entry *se) 
 {
+        /* Lookups may still be referencing the entry without
+           holding a reference, so defer the free until they are
+           done. */
         if (atomic_dec_and_test(&se->refcnt))
-                __service_entry_free(se);
+                call_rcu(&se->rcu, service_entry_free_rcu);
 }
 
 void service_entry_destroy(struct bst_node *n) 
@@ -719,22 +1122,23 @@ int service_iter_init(struct service_iter *iter,
                       struct service_entry *se,
                       iter_mode_t mode) 
 {
-        /* lock the service entry, take the top priority entry and
-         * determine the extent of iteration */
+        /* enter a read-side critical section, take the top priority
+         * entry and determine the extent of iteration. The iterator
+         * must be destroyed even if initialization fails. */
         struct target_set *set;
 
         memset(iter, 0, sizeof(*iter));
         
         iter->mode = mode;
         iter->entry = se;
-        read_lock_bh(&se->lock);
+        rcu_read_lock();
 
-        if (se->count == 0 || list_empty(&se->target_set))
+        if (se->count == 0)
                 return -1;
 
-        set = list_first_entry(&se->target_set, struct target_set, lh);
+        set = list_entry_rcu(se->target_set.next, struct target_set, lh);
         
-        if (!set)
+        if (&set->lh == &se->target_set)
                 return -1;
         
         if (mode == SERVICE_ITER_ANYCAST &&
@@ -745,31 +1149,32 @@ int service_iter_init(struct service_iter *iter,
         if (mode == SERVICE_ITER_ALL ||
             mode == SERVICE_ITER_DEMUX ||
             mode == SERVICE_ITER_FORWARD) {
-                iter->pos = set->list.next;
+                iter->pos = rcu_dereference(set->list.next);
                 iter->set = set;
         } else {
 #define SAMPLE_SHIFT 32
-                struct target *t = NULL;
+                struct target_alias *alias;
+                struct target *t = NULL, *last = NULL;
                 uint64_t sample, sumweight = 0;
-#if defined(OS_LINUX_KERNEL)
-                uint32_t rand;
-                unsigned long rem;
-                get_random_bytes(&rand, sizeof(rand));
-                sample = rand;
-                sample = sample << SAMPLE_SHIFT;
-                rem = 0xffffffff;
-                rem = do_div(sample, rem);
-#else
-                sample = random();
-                sample = (sample << SAMPLE_SHIFT) / RAND_MAX;
-#endif
+
+                alias = rcu_dereference(set->alias);
+
+                if (alias) {
+                        t = target_alias_sample(alias);
+                        iter->pos = &t->lh;
+                        iter->set = NULL;
+                        return 0;
+                }
+
+                /* No alias table, fall back to walking the set */
+                sample = serval_random_u32();
                 sample = sample * set->normalizer;
 
                 /*
                   LOG_DBG("sample=%llu normalizer=%u\n", 
                   sample, set->normalizer);
                 */
-                list_for_each_entry(t, &set->list, lh) {
+                list_for_each_entry_rcu(t, &set->list, lh) {
                         uint64_t weight = t->weight;
                         
                         sumweight += (weight << SAMPLE_SHIFT);
@@ -779,10 +1184,11 @@ int service_iter_init(struct service_iter *iter,
                                 iter->set = NULL;
                                 return 0;
                         }
+                        last = t;
                 }
                 
-                if (t) {
-                        iter->pos = &t->lh;
+                if (last) {
+                        iter->pos = &last->lh;
                         iter->set = NULL;
                 }
         }
@@ -793,7 +1199,7 @@ void service_iter_destroy(struct service_iter *iter)
 {
         iter->pos = NULL;
         iter->set = NULL;
-        read_unlock_bh(&iter->entry->lock);
+        rcu_read_unlock();
 }
 
 struct target *service_iter_next(struct service_iter *iter)
@@ -814,7 +1220,7 @@ struct target *service_iter_next(struct service_iter *iter)
                                 t = NULL;
                                 break;
                         } else {
-                                iter->pos = t->lh.next;
+                                iter->pos = rcu_dereference(t->lh.next);
                                 
                                 if (iter->mode == SERVICE_ITER_ALL)
                                         break;
@@ -842,34 +1248,15 @@ void service_iter_inc_stats(struct service_iter *iter,
         if (iter == NULL)
                 return;
 
-        if (packets > 0) {
-                if (iter->last_pos == NULL)
-                        return;
-
+        if (iter->last_pos != NULL) {
                 dst = list_entry(iter->last_pos, struct target, lh);
-
-                atomic_add(packets, &dst->packets_resolved);
-                atomic_add(bytes, &dst->bytes_resolved);
-
-                atomic_add(packets, &iter->entry->packets_resolved);
-                atomic_add(bytes, &iter->entry->bytes_resolved);
-
-                atomic_add(packets, &srvtable.packets_resolved);
-                atomic_add(bytes, &srvtable.bytes_resolved);
-
-        } else {
-                if (iter->last_pos != NULL) {
-                        dst = list_entry(iter->last_pos, struct target, lh);
-                        atomic_add(-packets, &dst->packets_dropped);
-                        atomic_add(-bytes, &dst->bytes_dropped);
-                }
-
-                atomic_add(-packets, &iter->entry->packets_dropped);
-                atomic_add(-bytes, &iter->entry->bytes_dropped);
-
-                atomic_add(-packets, &srvtable.packets_dropped);
-                atomic_add(-bytes, &srvtable.bytes_dropped);
+                service_stats_add(dst->stats, packets, bytes);
+        } else if (packets > 0) {
+                return;
         }
+
+        service_stats_add(iter->entry->stats, packets, bytes);
+        service_stats_add(srvtable.stats, packets, bytes);
 }
 
 int service_iter_get_priority(struct service_iter* iter) 
@@ -915,16 +1302,20 @@ static int __service_entry_print(struct bst_node *n, char *buf,
 
         list_for_each_entry(set, &se->target_set, lh) {
                 list_for_each_entry(t, &set->list, lh) {
+                        struct service_stats stats;
+
+                        service_stats_read(t->stats, &stats);
+
                         len = snprintf(buf + tot_len, buflen, 
-                                       "%-64s %-4u %-4s %-5u %-6u %-6u %-8u %-7u ", 
+                                       "%-64s %-4u %-4s %-5u %-6u %-6u %-8llu %-7llu ", 
                                        prefix,
                                        bits,
                                        rule_to_str(t->type),
                                        set->flags, 
                                        set->priority, 
                                        t->weight,
-                                       atomic_read(&t->packets_resolved),
-                                       atomic_read(&t->packets_dropped));
+                                       (unsigned long long)stats.packets_resolved,
+                                       (unsigned long long)stats.packets_dropped);
 
                         tot_len += len;
 
@@ -988,14 +1379,18 @@ int __service_table_print(char *buf, size_t buflen)
         int len = 0, tot_len = 0;
 
 #if defined(OS_USER)
+        struct service_stats stats;
+
+        service_stats_read(srvtable.stats, &stats);
+
         /* Adding this stuff prints garbage in the kernel */
         len = snprintf(buf, buflen, "bytes resolved: "
-                       "%i packets resolved: %i bytes dropped: "
-                       "%i packets dropped %i\n",
-                       atomic_read(&srvtable.bytes_resolved),
-                       atomic_read(&srvtable.packets_resolved),
-                       atomic_read(&srvtable.bytes_dropped),
-                       atomic_read(&srvtable.packets_dropped));
+                       "%llu packets resolved: %llu bytes dropped: "
+                       "%llu packets dropped %llu\n",
+                       (unsigned long long)stats.bytes_resolved,
+                       (unsigned long long)stats.packets_resolved,
+                       (unsigned long long)stats.bytes_dropped,
+                       (unsigned long long)stats.packets_dropped);
         
         tot_len += len;
         
@@ -1095,11 +1490,337 @@ int service_table_print(char *buf, size_t buflen)
         return tot_len;
 }
 
+static void target_to_service_info(struct service_entry *se,
+                                   struct target_set *set,
+                                   struct target *t,
+                                   struct service_info *si)
+{
+        memset(si, 0, sizeof(*si));
+        service_get_id(se, &si->srvid);
+        si->srvid_prefix_bits = service_get_prefix_bits(se);
+        si->srvid_flags = set->flags;
+        si->type = t->type;
+        si->priority = set->priority;
+        si->weight = t->weight;
+
+        if (!is_sock_target(t)) {
+                if (t->out.dev)
+                        si->if_index = t->out.dev->ifindex;
+                
+                if (t->dstlen >= (int)sizeof(si->address))
+                        memcpy(&si->address, t->dst, sizeof(si->address));
+        }
+}
+
+/*
+  Dump the targets of an entry, skipping the first '*next' of them,
+  into at most 'max' slots. '*next' is moved past the last target
+  dumped, or reset to zero if the entry was dumped to its end. Returns
+  the number of targets dumped.
+*/
+static unsigned int service_entry_dump(struct service_entry *se,
+                                       unsigned int *next,
+                                       struct service_info *si,
+                                       unsigned int max)
+{
+        unsigned int i = 0, count = 0;
+        struct target_set *set;
+        struct target *t;
+
+        read_lock(&se->lock);
+
+        list_for_each_entry(set, &se->target_set, lh) {
+                list_for_each_entry(t, &set->list, lh) {
+                        if (i++ < *next)
+                                continue;
+
+                        if (count == max) {
+                                *next = i - 1;
+                                goto out;
+                        }
+                        target_to_service_info(se, set, t, &si[count++]);
+                }
+        }
+        *next = 0;
+ out:
+        read_unlock(&se->lock);
+
+        return count;
+}
+
+/*
+  Dump the service table in chunks. Each call fills 'si' with the
+  targets of entries that follow the cursor in prefix order, at most
+  'max' of them, and advances the cursor to the last entry
+  dumped. The table is only locked for the duration of a call, and
+  since the cursor is a prefix, a dump can continue across changes
+  to the table. The walk starts at the cursor, so a chunk costs the
+  same wherever it is in the table.
+
+  An entry's targets are never split over two chunks, unless they do
+  not fit in one. In that case, the cursor also records how many of
+  the entry's targets were dumped, and the next chunk continues with
+  the rest.
+
+  Returns the number of targets dumped, or a negative error code.
+*/
+static int service_table_dump(struct service_table *tbl,
+                              struct service_dump_cursor *cursor,
+                              struct service_info *si,
+                              unsigned int max,
+                              gfp_t alloc)
+{
+        struct bst_node **nodes;
+        unsigned int i, num, want, count = 0;
+
+        cursor->more = 0;
+
+        if (max == 0)
+                return 0;
+
+        /* Look up one extra entry to find out whether there is more */
+        nodes = kmalloc(sizeof(*nodes) * (max + 1), alloc);
+
+        if (!nodes)
+                return -ENOMEM;
+
+        read_lock_bh(&tbl->lock);
+
+        if (!cursor->valid)
+                cursor->target = 0;
+
+        if (cursor->target > 0) {
+                /* Finish the entry the last chunk stopped in */
+                struct bst_node *n = 
+                        bst_find_longest_prefix(&tbl->tree, &cursor->srvid,
+                                                cursor->prefix_bits);
+
+                if (n && get_service(n) &&
+                    bst_node_get_prefix_bits(n) == cursor->prefix_bits)
+                        count = service_entry_dump(get_service(n), 
+                                                   &cursor->target, 
+                                                   si, max);
+                else
+                        cursor->target = 0;
+
+                if (cursor->target > 0) {
+                        cursor->more = 1;
+                        goto out;
+                }
+        }
+        
+        want = max - count + 1;
+        num = bst_find_next(&tbl->tree, 
+                            cursor->valid ? &cursor->srvid : NULL,
+                            cursor->prefix_bits, nodes, want);
+
+        for (i = 0; i < num; i++) {
+                struct service_entry *se = get_service(nodes[i]);
+
+                if (count == max || (count > 0 && count + se->count > max)) {
+                        cursor->more = 1;
+                        break;
+                }
+
+                count += service_entry_dump(se, &cursor->target, 
+                                            &si[count], max - count);
+
+                service_get_id(se, &cursor->srvid);
+                cursor->prefix_bits = bst_node_get_prefix_bits(se->node);
+                cursor->valid = 1;
+
+                if (cursor->target > 0) {
+                        cursor->more = 1;
+                        break;
+                }
+        }
+
+        /* Entries without targets may have used up the lookahead */
+        if (i == num && num == want)
+                cursor->more = 1;
+ out:
+        read_unlock_bh(&tbl->lock);
+
+        kfree(nodes);
+
+        return count;
+}
+
+int service_dump(struct service_dump_cursor *cursor, 
+                 struct service_info *si, unsigned int max, 
+                 gfp_t alloc)
+{
+        return service_table_dump(&srvtable, cursor, si, max, alloc);
+}
+
+static inline 
+struct service_cache_slot *service_cache_slot(struct service_table *tbl,
+                                              struct service_cache *c,
+                                              struct service_id *srvid,
+                                              int prefix, 
+                                              rule_match_t match)
+{
+        uint32_t hash = jhash(srvid, sizeof(*srvid), 
+                              tbl->cache_seed ^ (prefix << 8) ^ match);
+        
+        return &c->slot[hash & (SERVICE_CACHE_SIZE - 1)];
+}
+
+/* Look up a cached entry and take a reference to it. Writes the
+ * generation the result of a miss may be cached under to gen. */
+static struct service_entry *service_cache_find(struct service_table *tbl,
+                                                struct service_id *srvid,
+                                                int prefix, 
+                                                rule_match_t match,
+                                                unsigned int *gen)
+{
+        struct service_entry *se = NULL;
+        struct service_cache *c;
+        struct service_cache_slot *s;
+
+        *gen = service_table_gen(tbl);
+
+        local_bh_disable();
+        c = this_cpu_ptr(tbl->cache);
+        s = service_cache_slot(tbl, c, srvid, prefix, match);
+
+        spin_lock(&c->lock);
+        
+        if (*gen && s->gen == *gen && s->prefix == prefix && 
+            s->match == match &&
+            memcmp(&s->srvid, srvid, sizeof(*srvid)) == 0) {
+                se = s->se;
+
+                if (!atomic_inc_not_zero(&se->refcnt))
+                        se = NULL;
+        }
+
+        if (se)
+                c->hits++;
+        else
+                c->misses++;
+
+        spin_unlock(&c->lock);
+        local_bh_enable();
+
+        return se;
+}
+
+static void service_cache_insert(struct service_table *tbl,
+                                 struct service_id *srvid,
+                                 int prefix, rule_match_t match,
+                                 struct service_entry *se,
+                                 unsigned int gen)
+{
+        struct service_cache *c;
+        struct service_cache_slot *s;
+
+        /* Do not cache if the table changed during the lookup */
+        smp_rmb();
+
+        if (gen == 0 || service_table_gen(tbl) != gen)
+                return;
+
+        local_bh_disable();
+        c = this_cpu_ptr(tbl->cache);
+        s = service_cache_slot(tbl, c, srvid, prefix, match);
+
+        spin_lock(&c->lock);
+        memcpy(&s->srvid, srvid, sizeof(*srvid));
+        s->prefix = prefix;
+        s->match = match;
+        s->se = se;
+        s->gen = gen;
+        spin_unlock(&c->lock);
+        local_bh_enable();
+}
+
+static int service_table_cache_init(struct service_table *tbl)
+{
+        int cpu;
+
+        tbl->cache = alloc_percpu(struct service_cache);
+
+        if (!tbl->cache)
+                return -ENOMEM;
+
+        for_each_possible_cpu(cpu) {
+                struct service_cache *c = per_cpu_ptr(tbl->cache, cpu);
+                spin_lock_init(&c->lock);
+        }
+        
+        tbl->cache_seed = serval_random_u32();
+        /* Zeroed slots must never match */
+        atomic_set(&tbl->gen, 1);
+        atomic_set(&tbl->writers, 0);
+
+        return 0;
+}
+
+static void service_table_cache_fini(struct service_table *tbl)
+{
+        int cpu;
+
+        if (!tbl->cache)
+                return;
+
+        for_each_possible_cpu(cpu) {
+                struct service_cache *c = per_cpu_ptr(tbl->cache, cpu);
+                spin_lock_destroy(&c->lock);
+        }
+
+        free_percpu(tbl->cache);
+        tbl->cache = NULL;
+}
+
+#define service_cache_snprintf(buf, buflen, tot_len, fmt, ...)          \
+        snprintf((buf) + (tot_len),                                     \
+                 (size_t)(tot_len) < (buflen) ? (buflen) - (tot_len) : 0, \
+                 fmt, ##__VA_ARGS__)
+
+int service_cache_print(char *buf, size_t buflen)
+{
+        unsigned long hits = 0, misses = 0;
+        int cpu, tot_len = 0;
+
+        tot_len += service_cache_snprintf(buf, buflen, tot_len, 
+                                          "%-6s %-12s %-12s\n",
+                                          "cpu", "hits", "misses");
+
+        for_each_possible_cpu(cpu) {
+                struct service_cache *c = per_cpu_ptr(srvtable.cache, cpu);
+                unsigned long h = ACCESS_ONCE(c->hits);
+                unsigned long m = ACCESS_ONCE(c->misses);
+
+                hits += h;
+                misses += m;
+
+                if (h == 0 && m == 0)
+                        continue;
+
+                tot_len += service_cache_snprintf(buf, buflen, tot_len, 
+                                                  "%-6d %-12lu %-12lu\n",
+                                                  cpu, h, m);
+        }
+
+        tot_len += service_cache_snprintf(buf, buflen, tot_len, 
+                                          "%-6s %-12lu %-12lu\n"
+                                          "generation %d, %d slots per cpu\n",
+                                          "total", hits, misses,
+                                          atomic_read(&srvtable.gen),
+                                          SERVICE_CACHE_SIZE);
+        return tot_len;
+}
+
 static int service_entry_local_match(struct bst_node *n)
 {
         struct service_entry *se = get_service(n);
         struct target *t;
 
+        /* The node may have been released concurrently */
+        if (!se)
+                return 0;
+
         t = __service_entry_get_target(se, SERVICE_RULE_DEMUX, 
                                        NULL, 0, 
                                        make_target(NULL), NULL, 
@@ -1116,6 +1837,9 @@ static int service_entry_global_match(struct bst_node *n)
         struct service_entry *se = get_service(n);        
         struct target *t;
 
+        if (!se)
+                return 0;
+
         t = __service_entry_get_target(se, SERVICE_RULE_FORWARD, 
                                        NULL, 0, 
                                        make_target(NULL), NULL, 
@@ -1141,10 +1865,16 @@ static struct service_entry *__service_table_find(struct service_table *tbl,
         struct service_entry *se = NULL;
         struct bst_node *n;
         int (*func)(struct bst_node *) = NULL;
+        unsigned int gen;
 
         if (!srvid)
                 return NULL;
         
+        se = service_cache_find(tbl, srvid, prefix, match, &gen);
+
+        if (se)
+                return se;
+
         LOG_DBG("service find %s:%d\n",
                 service_id_to_str(srvid), prefix);
 
@@ -1167,10 +1897,17 @@ static struct service_entry *__service_table_find(struct service_table *tbl,
                 if (match != RULE_MATCH_EXACT ||
                     bst_node_get_prefix_bits(n) == prefix) {
                         se = get_service(n);
-                        service_entry_hold(se);
+
+                        /* The entry may be on its way out, in which
+                           case we must not revive it */
+                        if (se && !atomic_inc_not_zero(&se->refcnt))
+                                se = NULL;
                 }
         }
 
+        if (se)
+                service_cache_insert(tbl, srvid, prefix, match, se, gen);
+
         return se;
 }
 
@@ -1181,11 +1918,11 @@ static struct service_entry *service_table_find(struct service_table *tbl,
 {
         struct service_entry *se = NULL;
 
-        read_lock_bh(&tbl->lock);
+        rcu_read_lock();
 
         se = __service_table_find(tbl, srvid, prefix, match);
 
-        read_unlock_bh(&tbl->lock);
+        rcu_read_unlock();
 
         return se;        
 }
@@ -1200,7 +1937,7 @@ static struct sock* service_table_find_sock(struct service_table *tbl,
         if (!srvid)
                 return NULL;
         
-        read_lock_bh(&tbl->lock);
+        rcu_read_lock();
 
         se = __service_table_find(tbl, srvid, prefix, RULE_MATCH_LOCAL);
         
@@ -1217,7 +1954,7 @@ static struct sock* service_table_find_sock(struct service_table *tbl,
                 service_entry_put(se);
         }
         
-        read_unlock_bh(&tbl->lock);
+        rcu_read_unlock();
 
         return sk;
 }
@@ -1225,6 +1962,7 @@ static struct sock* service_table_find_sock(struct service_table *tbl,
 static void service_table_get_stats(struct service_table *tbl, 
                                     struct table_stats *tstats) 
 {
+        struct service_stats stats;
         
         /* TODO - not sure if the read lock here should be bh, since
          * this function will generally be called from a user-process
@@ -1232,12 +1970,13 @@ static void service_table_get_stats(struct service_table *tbl,
          */
         read_lock_bh(&tbl->lock);
         tstats->services = tbl->services;
-        tstats->bytes_resolved = atomic_read(&tbl->bytes_resolved);
-        tstats->packets_resolved = atomic_read(&tbl->packets_resolved);
-        tstats->bytes_dropped = atomic_read(&tbl->bytes_dropped);
-        tstats->packets_dropped = atomic_read(&tbl->packets_dropped);
         read_unlock_bh(&tbl->lock);
 
+        service_stats_read(tbl->stats, &stats);
+        tstats->bytes_resolved = stats.bytes_resolved;
+        tstats->packets_resolved = stats.packets_resolved;
+        tstats->bytes_dropped = stats.bytes_dropped;
+        tstats->packets_dropped = stats.packets_dropped;
 }
 
 int service_get_id(const struct service_entry *se, struct service_id *srvid)
@@ -1333,24 +2072,9 @@ int service_modify(struct service_id *srvid,
                                     out);
 }
 
-static int service_table_add(struct service_table *tbl,
-                             struct service_id *srvid,
-                             uint16_t prefix_bits, 
-                             service_rule_type_t type,
-                             uint16_t flags, 
-                             uint32_t priority, 
-                             uint32_t weight, 
-                             const void *dst,
-                             int dstlen, 
-                             const union target_out out, 
-                             gfp_t alloc) {
-        struct service_entry *se;
-        struct bst_node *n;
-        int ret = 0;
-        
-        if (!srvid)
-                return -EINVAL;
-
+static int service_rule_check(service_rule_type_t type,
+                              const void *dst, int dstlen)
+{
         switch (type) {
         case SERVICE_RULE_UNDEFINED:
                 return -EINVAL;
@@ -1365,13 +2089,37 @@ static int service_table_add(struct service_table *tbl,
         case SERVICE_RULE_DELAY:
         case SERVICE_RULE_DROP:
                 break;
+        default:
+                return -EINVAL;
         }
+        return 0;
+}
+
+/*
+  Add a rule with the table write locked. If new_se and new_t point
+  to a preallocated entry and target, these are used (and cleared)
+  when needed instead of allocating with the lock held.
+*/
+static int __service_table_add(struct service_table *tbl,
+                               struct service_id *srvid,
+                               uint16_t prefix_bits, 
+                               service_rule_type_t type,
+                               uint16_t flags, 
+                               uint32_t priority, 
+                               uint32_t weight, 
+                               const void *dst,
+                               int dstlen, 
+                               const union target_out out,
+                               struct service_entry **new_se,
+                               struct target **new_t)
+{
+        struct service_entry *se;
+        struct bst_node *n;
+        int ret = 0;
 
         if (memcmp(srvid, &default_service, sizeof(default_service)) == 0)
                 prefix_bits = 0;
 
-        write_lock_bh(&tbl->lock);
-
         n = bst_find_longest_prefix(&tbl->tree, srvid, prefix_bits);
 
         if (n && bst_node_get_prefix_bits(n) >= prefix_bits) {
@@ -1379,6 +2127,9 @@ static int service_table_add(struct service_table *tbl,
                 struct target *target;
 
                 se = get_service(n);
+
+                write_lock_bh(&se->lock);
+
                 service_iter_init(&iter, se, SERVICE_ITER_ALL);                
                 target = service_iter_next(&iter);
 
@@ -1389,8 +2140,8 @@ static int service_table_add(struct service_table *tbl,
                             target->type == SERVICE_RULE_DROP || 
                             target->type == SERVICE_RULE_DELAY) {
                                 service_iter_destroy(&iter);
-                                ret = -EEXIST;
-                                goto out;
+                                write_unlock_bh(&se->lock);
+                                return -EEXIST;
                         }
                         target = service_iter_next(&iter);
                 }
@@ -1410,28 +2161,30 @@ static int service_table_add(struct service_table *tbl,
                                                          type,
                                                          flags, priority, 
                                                          weight, dst, dstlen,
-                                                         out, GFP_ATOMIC);
+                                                         out, new_t, 
+                                                         GFP_ATOMIC);
                 }
-                goto out;
+                write_unlock_bh(&se->lock);
+                return ret;
         }
         
-        se = service_entry_create(GFP_ATOMIC);
-
-        if (!se) {
-                ret = -ENOMEM;
-                goto out;
+        if (new_se && *new_se) {
+                se = *new_se;
+                *new_se = NULL;
+        } else {
+                se = service_entry_create(GFP_ATOMIC);
+                
+                if (!se)
+                        return -ENOMEM;
         }
-
         
         ret = __service_entry_add_target(se, type, flags, priority, 
                                          weight, dst, dstlen, out,
-                                         GFP_ATOMIC);
+                                         new_t, GFP_ATOMIC);
         
         if (ret < 0) {
                 service_entry_put(se);
-                ret = -ENOMEM;
-                goto out;
-                
+                return -ENOMEM;
         }
 
         se->node = bst_insert_prefix(&tbl->tree, &tbl->srv_ops, 
@@ -1444,8 +2197,39 @@ static int service_table_add(struct service_table *tbl,
                 tbl->services++;
         }
 
- out: 
+        return ret;
+}
+
+static int service_table_add(struct service_table *tbl,
+                             struct service_id *srvid,
+                             uint16_t prefix_bits, 
+                             service_rule_type_t type,
+                             uint16_t flags, 
+                             uint32_t priority, 
+                             uint32_t weight, 
+                             const void *dst,
+                             int dstlen, 
+                             const union target_out out, 
+                             gfp_t alloc) {
+        int ret;
+        
+        if (!srvid)
+                return -EINVAL;
+
+        ret = service_rule_check(type, dst, dstlen);
+
+        if (ret < 0)
+                return ret;
+
+        service_table_update_begin(tbl);
+        write_lock_bh(&tbl->lock);
+
+        ret = __service_table_add(tbl, srvid, prefix_bits, type, flags,
+                                  priority, weight, dst, dstlen, out,
+                                  NULL, NULL);
+
         write_unlock_bh(&tbl->lock);
+        service_table_update_end(tbl);
         
         return ret;
 }
@@ -1453,10 +2237,8 @@ static int service_table_add(struct service_table *tbl,
 void service_inc_stats(int packets, int bytes) 
 {
         /*only for drops*/
-        if (packets < 0) {
-                atomic_add(-packets, &srvtable.packets_dropped);
-                atomic_add(-bytes, &srvtable.bytes_dropped);
-        }
+        if (packets < 0)
+                service_stats_add(srvtable.stats, packets, bytes);
 }
 
 int service_add(struct service_id *srvid, 
@@ -1482,6 +2264,7 @@ static void service_table_del(struct service_table *tbl,
 {
         int ret;
 
+        service_table_update_begin(tbl);
         write_lock_bh(&tbl->lock);
         
         ret = bst_remove_prefix(&tbl->tree, srvid, prefix_bits);
@@ -1489,6 +2272,7 @@ static void service_table_del(struct service_table *tbl,
         if (ret > 0)
                 tbl->services--;
         write_unlock_bh(&tbl->lock);
+        service_table_update_end(tbl);
 }
 
 void service_del(struct service_id *srvid, uint16_t prefix_bits) 
@@ -1496,26 +2280,25 @@ void service_del(struct service_id *srvid, uint16_t prefix_bits)
         return service_table_del(&srvtable, srvid, prefix_bits);
 }
 
-static void service_table_del_target(struct service_table *tbl, 
-                                     struct service_id *srvid,
-                                     uint16_t prefix_bits,
-                                     service_rule_type_t type,
-                                     const void *dst, 
-                                     int dstlen, 
-                                     struct target_stats* stats) {
+static int __service_table_del_target(struct service_table *tbl, 
+                                      struct service_id *srvid,
+                                      uint16_t prefix_bits,
+                                      service_rule_type_t type,
+                                      const void *dst, 
+                                      int dstlen, 
+                                      struct target_stats* stats) 
+{
         struct bst_node *n;
-
-        write_lock_bh(&tbl->lock);
+        int ret = 0;
 
         n = bst_find_longest_prefix(&tbl->tree, srvid, prefix_bits);
 
         if (n) {
                 struct service_entry *se = get_service(n);
-                int ret;
 
                 service_entry_hold(se);
 
-                write_lock(&se->lock);
+                write_lock_bh(&se->lock);
                 ret = __service_entry_remove_target(se, type,
                                                     dst, dstlen, stats);
 
@@ -1524,12 +2307,28 @@ static void service_table_del_target(struct service_table *tbl,
                         tbl->services--;
                 }
 
-                write_unlock(&se->lock);
+                write_unlock_bh(&se->lock);
 
                 service_entry_put(se);
         }
 
+        return ret;
+}
+
+static void service_table_del_target(struct service_table *tbl, 
+                                     struct service_id *srvid,
+                                     uint16_t prefix_bits,
+                                     service_rule_type_t type,
+                                     const void *dst, 
+                                     int dstlen, 
+                                     struct target_stats* stats) 
+{
+        service_table_update_begin(tbl);
+        write_lock_bh(&tbl->lock);
+        __service_table_del_target(tbl, srvid, prefix_bits, type, 
+                                   dst, dstlen, stats);
         write_unlock_bh(&tbl->lock);
+        service_table_update_end(tbl);
 }
 
 void service_del_target(struct service_id *srvid, 
@@ -1542,6 +2341,157 @@ void service_del_target(struct service_id *srvid,
                                         dst, dstlen, stats);
 }
 
+static int __service_table_modify(struct service_table *tbl,
+                                  struct service_update *u)
+{
+        uint16_t prefix_bits = u->prefix_bits;
+        struct service_entry *se;
+        struct bst_node *n;
+        int ret;
+
+        if (memcmp(u->srvid, &default_service, sizeof(default_service)) == 0)
+                prefix_bits = 0;
+
+        n = bst_find_longest_prefix(&tbl->tree, u->srvid, prefix_bits);
+        
+        if (!n || bst_node_get_prefix_bits(n) < prefix_bits)
+                return 0;
+
+        se = get_service(n);
+
+        write_lock_bh(&se->lock);
+        ret = __service_entry_modify_target(se, u->type, u->flags, 
+                                            u->priority, u->weight, 
+                                            u->dst, u->dstlen,
+                                            u->new_dst, u->new_dstlen,
+                                            u->out, GFP_ATOMIC);
+        write_unlock_bh(&se->lock);
+
+        return ret;
+}
+
+/*
+  Apply a set of updates as one change to the table. Entries and
+  targets for additions are allocated before the table is locked, and
+  the table lock is taken only once for the whole set, which also
+  means that the resolution caches are invalidated only once.
+
+  Each update's result is stored in its err field: positive on
+  success, zero if there was nothing to do (e.g., the rule did not
+  exist or was already there), and a negative error code
+  otherwise. Updates without a serviceID, or that already carry a
+  negative error code (e.g., set by the caller after validating the
+  request), are skipped. Returns the number of successful updates.
+*/
+static int service_table_update_batch(struct service_table *tbl,
+                                      struct service_update *upd,
+                                      unsigned int num, gfp_t alloc)
+{
+        struct bst_node *n;
+        unsigned int i;
+        int count = 0;
+
+        for (i = 0; i < num; i++) {
+                struct service_update *u = &upd[i];
+
+                u->se = NULL;
+                u->target = NULL;
+
+                if (u->err < 0)
+                        continue;
+
+                u->err = 0;
+
+                if (!u->srvid || u->op != SERVICE_UPDATE_ADD)
+                        continue;
+
+                u->err = service_rule_check(u->type, u->dst, u->dstlen);
+                
+                if (u->err < 0)
+                        continue;
+
+                if (u->weight == 0)
+                        u->weight = 1;
+
+                u->se = service_entry_create(alloc);
+                u->target = target_create(u->type, u->dst, u->dstlen, 
+                                          u->out, u->weight, alloc);
+                
+                if (!u->se || !u->target)
+                        u->err = -ENOMEM;
+        }
+
+        service_table_update_begin(tbl);
+        write_lock_bh(&tbl->lock);
+
+        for (i = 0; i < num; i++) {
+                struct service_update *u = &upd[i];
+
+                if (!u->srvid || u->err < 0)
+                        continue;
+
+                switch (u->op) {
+                case SERVICE_UPDATE_ADD:
+                        u->err = __service_table_add(tbl, u->srvid, 
+                                                     u->prefix_bits,
+                                                     u->type, u->flags,
+                                                     u->priority, u->weight,
+                                                     u->dst, u->dstlen,
+                                                     u->out, &u->se, 
+                                                     &u->target);
+                        break;
+                case SERVICE_UPDATE_DEL:
+                        n = bst_find_longest_prefix(&tbl->tree, u->srvid,
+                                                    u->prefix_bits);
+
+                        /* Only delete from the exact prefix */
+                        if (!n || bst_node_get_prefix_bits(n) != 
+                            u->prefix_bits)
+                                break;
+
+                        u->err = __service_table_del_target(tbl, u->srvid, 
+                                                            u->prefix_bits,
+                                                            u->type, 
+                                                            u->dst, 
+                                                            u->dstlen,
+                                                            NULL);
+                        break;
+                case SERVICE_UPDATE_MOD:
+                        if (u->weight == 0)
+                                u->weight = 1;
+                        u->err = __service_table_modify(tbl, u);
+                        break;
+                default:
+                        u->err = -EINVAL;
+                        break;
+                }
+
+                if (u->err > 0)
+                        count++;
+        }
+
+        write_unlock_bh(&tbl->lock);
+        service_table_update_end(tbl);
+
+        /* Free what was allocated but not needed */
+        for (i = 0; i < num; i++) {
+                if (upd[i].target)
+                        target_free(upd[i].target);
+                if (upd[i].se)
+                        service_entry_put(upd[i].se);
+                upd[i].target = NULL;
+                upd[i].se = NULL;
+        }
+        
+        return count;
+}
+
+int service_update_batch(struct service_update *upd, unsigned int num,
+                         gfp_t alloc)
+{
+        return service_table_update_batch(&srvtable, upd, num, alloc);
+}
+
 static int del_dev_func(struct bst_node *n, void *arg) 
 {
         struct service_entry *se = get_service(n);
@@ -1571,12 +2521,11 @@ static int service_table_del_dev_all(struct service_table *tbl,
 {
         int ret = 0;
         
+        service_table_update_begin(tbl);
         write_lock_bh(&tbl->lock);
-        
-        if (tbl->tree.root)
-                ret = bst_subtree_func(tbl->tree.root, del_dev_func, 
-                                       (void *) devname);
+        ret = bst_tree_func(&tbl->tree, del_dev_func, (void *) devname);
         write_unlock_bh(&tbl->lock);
+        service_table_update_end(tbl);
 
         return ret;
 }
@@ -1626,12 +2575,11 @@ static int service_table_del_target_all(struct service_table *tbl,
                 int d_len;
         } d = { type, dst, dstlen };
         
+        service_table_update_begin(tbl);
         write_lock_bh(&tbl->lock);
-
-        if (tbl->tree.root)
-                ret = bst_subtree_func(tbl->tree.root, del_target_func, &d);
-
+        ret = bst_tree_func(&tbl->tree, del_target_func, &d);
         write_unlock_bh(&tbl->lock);
+        service_table_update_end(tbl);
 
         return ret;
 }
@@ -1649,34 +2597,47 @@ void __service_table_destroy(struct service_table *tbl)
 
 void service_table_destroy(struct service_table *tbl) 
 {
+        service_table_update_begin(tbl);
         write_lock_bh(&tbl->lock);
         __service_table_destroy(tbl);
         write_unlock_bh(&tbl->lock);
+        service_table_update_end(tbl);
 }
 
-void service_table_init(struct service_table *tbl) 
+int service_table_init(struct service_table *tbl) 
 {
         memset(&default_service, 0, sizeof(default_service));
-        bst_init(&tbl->tree);
+
+        if (service_trie_stride == 0 ||
+            bst_init_multibit(&tbl->tree, service_trie_stride) == -1)
+                bst_init(&tbl->tree);
         tbl->srv_ops.init = service_entry_init;
         tbl->srv_ops.destroy = service_entry_destroy;
         tbl->srv_ops.print = __service_entry_print;
         tbl->services = 0;
-        atomic_set(&tbl->packets_resolved, 0);
-        atomic_set(&tbl->bytes_resolved, 0);
-        atomic_set(&tbl->packets_dropped, 0);
-        atomic_set(&tbl->bytes_dropped, 0);
+        tbl->stats = service_stats_alloc(GFP_KERNEL);
+
+        if (!tbl->stats)
+                return -ENOMEM;
+
+        if (service_table_cache_init(tbl) < 0) {
+                service_stats_free(tbl->stats);
+                return -ENOMEM;
+        }
+
         rwlock_init(&tbl->lock);
+
+        return 0;
 }
 
 int service_init(void) 
 {
-        service_table_init(&srvtable);
-
-        return 0;
+        return service_table_init(&srvtable);
 }
 
 void service_fini(void) 
 {
         service_table_destroy(&srvtable);
+        service_table_cache_fini(&srvtable);
+        service_stats_free(srvtable.stats);
 }
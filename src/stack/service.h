@@ -9,6 +9,8 @@
 #include <serval/dst.h>
 #include <serval/sock.h>
 #include <serval/ctrlmsg.h>
+#include <serval/rcupdate.h>
+#include <serval/percpu.h>
 #include "bst.h"
 
 #define LOCAL_SERVICE_DEFAULT_PRIORITY 32000
@@ -19,6 +21,18 @@
 
 struct service_id;
 
+/**
+   Resolution counters, kept per CPU (per thread at user level) so
+   that the resolution path does not contend on shared cache
+   lines. Sum over all CPUs to read them.
+*/
+struct service_stats {
+        uint64_t packets_resolved;
+        uint64_t bytes_resolved;
+        uint64_t packets_dropped;
+        uint64_t bytes_dropped;
+};
+
 /** 
     The service entry contains a list of sets of destinations.
     Each set contains destinations with the same priority.
@@ -27,12 +41,10 @@ struct service_entry {
         struct bst_node *node;
         struct list_head target_set;
         unsigned int count;
-        atomic_t packets_resolved;
-        atomic_t bytes_resolved;
-        atomic_t bytes_dropped;
-        atomic_t packets_dropped;
+        struct service_stats __percpu *stats;
         rwlock_t lock;
         atomic_t refcnt;
+        struct rcu_head rcu;
 };
 
 typedef enum {
@@ -47,6 +59,11 @@ typedef enum {
 
    Iterates through all destinations in all sets, or only one set with
    a particular priority.
+
+   The iterator runs within an RCU read-side critical section, which
+   is entered by service_iter_init() and left by
+   service_iter_destroy(). Hence, service_iter_destroy() must be
+   called also when service_iter_init() fails.
 */
 struct service_iter {
         struct service_entry *entry;
@@ -59,10 +76,10 @@ struct service_iter {
 struct table_stats {
         uint32_t instances;
         uint32_t services;
-        uint32_t packets_resolved;
-        uint32_t bytes_resolved;
-        uint32_t packets_dropped;
-        uint32_t bytes_dropped;
+        uint64_t packets_resolved;
+        uint64_t bytes_resolved;
+        uint64_t packets_dropped;
+        uint64_t bytes_dropped;
 };
 
 /**
@@ -71,22 +88,26 @@ struct table_stats {
 struct target_stats {
         uint32_t duration_sec;
         uint32_t duration_nsec;
-        uint32_t packets_resolved;
-        uint32_t bytes_resolved;
-        uint32_t packets_dropped;
-        uint32_t bytes_dropped;
+        uint64_t packets_resolved;
+        uint64_t bytes_resolved;
+        uint64_t packets_dropped;
+        uint64_t bytes_dropped;
 };
 
+struct target_alias;
+
 /**
    A set of destinations sharing the same priority.
 */
 struct target_set {
         struct list_head lh;
         struct list_head list;
+        struct target_alias *alias; /* For weighted sampling */
         uint32_t normalizer;
         uint32_t priority;
         uint16_t flags;
         uint16_t count;
+        struct rcu_head rcu;
 };
 
 #define is_sock_target(target)                          \
@@ -115,11 +136,9 @@ struct target {
         service_rule_type_t type;
         struct list_head lh;
         uint32_t weight;
-        atomic_t packets_resolved;
-        atomic_t bytes_resolved;
-        atomic_t bytes_dropped;
-        atomic_t packets_dropped;
+        struct service_stats __percpu *stats;
         union target_out out;
+        struct rcu_head rcu;
         int dstlen;
         unsigned char dst[0]; /* Must be last */
 };
@@ -206,6 +225,29 @@ void service_del_target(struct service_id *srvid,
                         const void *dst, int dstlen, 
                         struct target_stats *stats);
 
+/* A single rule update in a batch, see service_update_batch() */
+struct service_update {
+        int op; /* SERVICE_UPDATE_ADD, SERVICE_UPDATE_DEL or SERVICE_UPDATE_MOD */
+        struct service_id *srvid;
+        uint16_t prefix_bits;
+        service_rule_type_t type;
+        uint16_t flags;
+        uint32_t priority;
+        uint32_t weight;
+        const void *dst;
+        int dstlen;
+        const void *new_dst; /* Modify only */
+        int new_dstlen;
+        union target_out out;
+        int err; /* Result of the update */
+        /* Private */
+        struct service_entry *se;
+        struct target *target;
+};
+
+int service_update_batch(struct service_update *upd, unsigned int num,
+                         gfp_t alloc);
+
 int service_del_target_all(service_rule_type_t type, 
                            const void *dst, int dstlen);
 int service_del_dev_all(const char *devname);
@@ -236,6 +278,19 @@ void service_entry_put(struct service_entry *se);
 int service_entry_print(struct service_entry *se, char *buf, size_t buflen);
 int service_table_print_header(char *buf, size_t buflen);
 
+/* Position in a chunked dump of the service table */
+struct service_dump_cursor {
+        struct service_id srvid;
+        unsigned int prefix_bits;
+        unsigned int target; /* Targets of the entry already dumped */
+        int valid; /* Zero to start from the first entry */
+        int more; /* Set if entries remain after the last chunk */
+};
+
+int service_dump(struct service_dump_cursor *cursor, 
+                 struct service_info *si, unsigned int max, 
+                 gfp_t alloc);
+
 typedef struct bst_iterator service_table_iterator_t;
 void service_table_iterator_init(service_table_iterator_t *iter);
 void service_table_iterator_destroy(service_table_iterator_t *iter);
@@ -244,5 +299,6 @@ void service_table_read_lock(void);
 void service_table_read_unlock(void);
 int __service_table_print(char *buf, size_t buflen);
 int service_table_print(char *buf, size_t buflen);
+int service_cache_print(char *buf, size_t buflen);
 
 #endif /* _SERVICE_H_ */
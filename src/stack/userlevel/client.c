@@ -4,7 +4,9 @@
  * interact with the stack via IPC. For every application that
  * connects to the stack, there will be a corresponding client thread
  * running in the stack that deals with dispatching packets and
- * communicating with the application.
+ * communicating with the application. Alternatively, a small pool of
+ * worker threads serves all clients as their IPC sockets become
+ * readable, see client_reactor_start().
  *
  * Authors: Erik Nordström <enordstr@cs.princeton.edu>
  * 
@@ -33,8 +35,13 @@
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
+#if defined(OS_LINUX)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
 #include <userlevel/client.h>
 #include <userlevel/client_msg.h>
+#include <userlevel/client_shm.h>
 
 struct client {
 	client_type_t type;
@@ -54,8 +61,62 @@ struct client {
 	struct list_head link;
         atomic_t refcnt;
         pthread_mutex_t lock;
+        /* Event-driven mode, protected by the lock */
+        int reactor;
+        unsigned int pending;
+        int busy;
+        int queued;
+        struct list_head ready;
+        pthread_cond_t cond;
+        /* Shared memory data path, if the application asked for
+           it */
+        struct client_shm *shm;
+        /* Blocking receive requests waiting for data, oldest
+           first */
+        struct list_head recv_queue;
+        unsigned int recv_pending;
+        /* An accept or connect request that waits for the socket,
+           if parked is set */
+        union {
+                struct client_msg msghdr;
+                struct client_msg_accept_req accept;
+                struct client_msg_connect_req connect;
+        } parked_req;
+        int parked;
+        /* A send that waits for buffer space, and how much of it
+           went out. The client takes no more messages until it is
+           done. */
+        struct client_msg_send_req *send_req;
+        unsigned int send_sent;
+};
+
+/* A receive request that waits for data. One that must be filled
+   completely (MSG_WAITALL) keeps the data it got so far. */
+struct client_recv {
+        struct list_head link;
+        struct client_msg_recv_req req;
+        struct client_msg_recv_rsp *rsp;
+        unsigned int copied;
 };
 
+/* Events of a client in event-driven mode */
+enum {
+        CLIENT_EV_DATA = 1 << 0,
+        CLIENT_EV_SOCK = 1 << 1,
+        CLIENT_EV_SHM = 1 << 2,
+        CLIENT_EV_WRITE = 1 << 3,
+};
+
+static int client_reactor_add(struct client *c);
+static int client_reactor_add_shm(struct client *c);
+static void client_reactor_schedule(struct client *c, unsigned int events);
+static void client_reactor_resume(struct client *c);
+static int client_reactor_enabled(void);
+static unsigned int client_recv_queue_run(struct client *c);
+static int client_parked_run(struct client *c);
+static void client_send_parked_run(struct client *c);
+static int client_write_have_data_msg(struct client *c);
+
 static pthread_key_t client_key;
 static pthread_once_t key_once = PTHREAD_ONCE_INIT;
 extern atomic_t num_clients;
@@ -98,6 +159,8 @@ static int client_handle_clear_data_msg(struct client *c,
                                         struct client_msg *msg);
 static int client_handle_have_data_msg(struct client *c, 
                                        struct client_msg *msg);
+static int client_handle_shm_req_msg(struct client *c, 
+                                     struct client_msg *msg);
 
 msg_handler_t msg_handlers[] = {
 	[MSG_UNKNOWN] = dummy_msg_handler,
@@ -119,7 +182,9 @@ msg_handler_t msg_handlers[] = {
 	[MSG_CLOSE_RSP] = dummy_msg_handler,
 	[MSG_RECVMESG] = dummy_msg_handler, 
 	[MSG_CLEAR_DATA] = client_handle_clear_data_msg,
-	[MSG_HAVE_DATA] = client_handle_have_data_msg
+	[MSG_HAVE_DATA] = client_handle_have_data_msg,
+	[MSG_SHM_REQ] = client_handle_shm_req_msg,
+	[MSG_SHM_RSP] = dummy_msg_handler
 };
 	
 static void dummy_timer_callback(unsigned long data)
@@ -147,8 +212,9 @@ static inline int client_type_to_prot_type(client_type_t type)
   Create client.
 
   We use a pipe to signal to clients when to exit. A pipe is useful,
-  because we can "sleep" on it in a select()/poll().
-
+  because we can "sleep" on it in a select()/poll(). In event-driven
+  mode, there is no data pipe, as data signals are queued to the
+  workers directly.
 */
 struct client *client_create(client_type_t type, 
 			     int sock, unsigned int id, 
@@ -196,7 +262,10 @@ struct client *client_create(client_type_t type,
 		return NULL;
 	}
 
-	if (pipe(c->data_pipe) != 0) {
+        c->reactor = client_reactor_enabled();
+        c->data_pipe[0] = c->data_pipe[1] = -1;
+
+	if (!c->reactor && pipe(c->data_pipe) != 0) {
 		LOG_ERR("could not open client data pipe : %s\n",
 			strerror(errno));
                 close(c->exit_pipe[0]);
@@ -208,7 +277,9 @@ struct client *client_create(client_type_t type,
         /* Set non-blocking so that we can lower signal without
          * blocking */
         fcntl(c->exit_pipe[0], F_SETFL, O_NONBLOCK);
-        fcntl(c->data_pipe[0], F_SETFL, O_NONBLOCK);
+
+        if (!c->reactor)
+                fcntl(c->data_pipe[0], F_SETFL, O_NONBLOCK);
 
 	/* Init a timer for test purposes. */
 	c->timer.function = dummy_timer_callback;
@@ -216,7 +287,10 @@ struct client *client_create(client_type_t type,
 	c->timer.data = (unsigned long)c;
 
 	INIT_LIST_HEAD(&c->link);
+	INIT_LIST_HEAD(&c->ready);
+	INIT_LIST_HEAD(&c->recv_queue);
         pthread_mutex_init(&c->lock, NULL);
+        pthread_cond_init(&c->cond, NULL);
         atomic_set(&c->refcnt, 1);
 
 	return c;
@@ -243,9 +317,12 @@ void client_unlock(struct client *c)
         pthread_mutex_unlock(&c->lock);
 }
 
+/* Whether the application knows that there is data to read, such
+   that there is no need to signal new data. Waiting receive requests
+   must always hear about it. */
 int client_has_data(struct client *c)
 {
-        return c->has_data;
+        return c->has_data && !c->recv_pending;
 }
 
 client_type_t client_get_type(struct client *c)
@@ -328,6 +405,24 @@ static int client_close(struct client *c)
 void client_destroy(struct client *c)
 {
         client_close(c);
+
+        /* Kept until here, as a worker may still get a kick from
+           the application after the client closed */
+        if (c->shm)
+                client_shm_destroy(c->shm);
+
+        while (!list_empty(&c->recv_queue)) {
+                struct client_recv *r = 
+                        list_first_entry(&c->recv_queue, 
+                                         struct client_recv, link);
+                list_del(&r->link);
+                free(r->rsp);
+                free(r);
+        }
+
+        free(c->send_req);
+
+        pthread_cond_destroy(&c->cond);
         pthread_mutex_destroy(&c->lock);
 	free(c);
 }
@@ -356,14 +451,47 @@ int client_signal_raise(struct client *c, enum client_signal s)
         
         if (s == CLIENT_SIG_EXIT)
                 return write(c->exit_pipe[1], &sig, sizeof(sig));
+
+        /* State changes only matter to the shared memory data path
+           and to waiting requests, which must see, e.g., the end of
+           the stream or a new connection */
+        if (s == CLIENT_SIG_STATE && !c->shm && !c->recv_pending &&
+            !c->parked && !c->send_req)
+                return 0;
+
+        /* Room to send only matters to the shared memory data path,
+           whose sends never block, and to a parked send */
+        if (s == CLIENT_SIG_WRITE && !c->shm && !c->send_req)
+                return 0;
+
+        if (c->reactor) {
+                if (s == CLIENT_SIG_READ || s == CLIENT_SIG_STATE)
+                        client_reactor_schedule(c, CLIENT_EV_DATA);
+                else if (s == CLIENT_SIG_WRITE)
+                        client_reactor_schedule(c, CLIENT_EV_WRITE);
+                return 1;
+        }
         
         return write(c->data_pipe[1], &sig, sizeof(sig));
 }
 
 int client_signal_exit(struct client *c)
 {
+        int ret;
+
         c->should_exit = 1;
-        return client_signal_raise(c, CLIENT_SIG_EXIT);
+        ret = client_signal_raise(c, CLIENT_SIG_EXIT);
+
+        if (c->reactor) {
+                /* Make the IPC socket readable, so that the worker
+                   that gets the event closes the client */
+                pthread_mutex_lock(&c->lock);
+                
+                if (c->fd != -1)
+                        shutdown(c->fd, SHUT_RD);
+                pthread_mutex_unlock(&c->lock);
+        }
+        return ret;
 }
 
 enum client_signal client_signal_lower(int fd)
@@ -383,6 +511,77 @@ enum client_signal client_signal_lower(int fd)
         return (enum client_signal) (sz == -1 ? -1 : sig);
 }
 
+/* Serve the shared memory data path of a client. The has_data flag
+   suppresses read signals while the RX ring is full, and is
+   cleared first so that no signal is lost while serving. The
+   application still hears about data with HAVE_DATA, so that it can
+   select() on the socket. */
+static void client_shm_service(struct client *c)
+{
+        /* Signals may still come in after the socket was released */
+        if (!c->sock || !c->sock->sk)
+                return;
+
+        c->has_data = 0;
+        c->has_data = client_shm_process(c->shm, c->sock);
+
+        if (client_shm_have_data(c->shm))
+                client_write_have_data_msg(c);
+}
+
+/* The socket of a client is readable, or changed state. Waiting
+   requests get the data first, and the application hears about
+   whatever they leave. */
+static void client_data_ready(struct client *c)
+{
+        if (c->parked)
+                client_parked_run(c);
+
+        /* E.g., a send that waits for the connection */
+        if (c->send_req)
+                client_send_parked_run(c);
+
+        if (c->shm) {
+                client_shm_service(c);
+        } else if (c->recv_pending) {
+                if (client_recv_queue_run(c) == 0 && c->sock->sk &&
+                    !skb_queue_empty(&c->sock->sk->sk_receive_queue))
+                        client_send_have_data_msg(c);
+        } else if (c->sock->sk &&
+                   !skb_queue_empty(&c->sock->sk->sk_receive_queue)) {
+                client_send_have_data_msg(c);
+        }
+}
+
+/* The socket of a client has room to send again */
+static void client_write_ready(struct client *c)
+{
+        if (c->send_req)
+                client_send_parked_run(c);
+
+        if (c->shm)
+                client_shm_service(c);
+}
+
+/* Park a request that cannot complete yet, until the socket is
+   ready. There is at most one, as the application waits for its
+   response. */
+static int client_park(struct client *c, struct client_msg *msg,
+                       size_t len)
+{
+        memcpy(&c->parked_req, msg, len);
+        c->parked = 1;
+
+        LOG_DBG("Client %u %s id=%u waits for the socket\n",
+                c->id, client_msg_to_typestr(msg), msg->id);
+
+        /* The socket may have become ready after the request was
+           tried, but before signals were let through */
+        client_parked_run(c);
+
+        return 1;
+}
+
 int client_handle_bind_req_msg(struct client *c, struct client_msg *msg)
 {
         struct client_msg_bind_req *req = (struct client_msg_bind_req *)msg;
@@ -402,7 +601,7 @@ int client_handle_bind_req_msg(struct client *c, struct client_msg *msg)
 
         ret = sock->ops->bind(sock, (struct sockaddr *)&saddr, sizeof(saddr));
 
-        client_msg_hdr_init(&rsp.msghdr, MSG_BIND_RSP);
+        client_msg_rsp_init(&rsp.msghdr, MSG_BIND_RSP, msg);
         memcpy(&rsp.srvid, &req->srvid, sizeof(req->srvid));
 
         if (ret < 0) {
@@ -418,25 +617,31 @@ int client_handle_bind_req_msg(struct client *c, struct client_msg *msg)
         return client_msg_write(c->fd, &rsp.msghdr);
 }
 
-int client_handle_connect_req_msg(struct client *c, struct client_msg *msg)
+/*
+  Connect and respond once the connection is established or
+  failed. The socket does not block; while the handshake is in
+  progress, -EAGAIN is returned without responding, and the request
+  is tried again when the socket changes state.
+ */
+static int client_connect(struct client *c,
+                          struct client_msg_connect_req *req)
 {
-        struct client_msg_connect_req *req = 
-                (struct client_msg_connect_req *)msg;
         struct client_msg_connect_rsp rsp;
         struct sockaddr_sv addr;
         int err;
 
-        LOG_DBG("Client %u connect request for service id %s\n", c->id,
-                service_id_to_str(&req->srvid));
-
         memset(&addr, 0, sizeof(addr));
         addr.sv_family = AF_SERVAL;
         memcpy(&addr.sv_srvid, &req->srvid, sizeof(req->srvid));
 
         err = c->sock->ops->connect(c->sock, (struct sockaddr *)&addr, 
-                                    sizeof(addr), req->flags); 
+                                    sizeof(addr), req->flags | O_NONBLOCK); 
+
+        if (err == -EINPROGRESS || err == -EALREADY)
+                return -EAGAIN;
 
-        client_msg_hdr_init(&rsp.msghdr, MSG_CONNECT_RSP);
+        memset(&rsp, 0, sizeof(rsp));
+        client_msg_rsp_init(&rsp.msghdr, MSG_CONNECT_RSP, &req->msghdr);
         memcpy(&rsp.srvid, &req->srvid, sizeof(req->srvid));
 
         if (err < 0) {
@@ -447,6 +652,23 @@ int client_handle_connect_req_msg(struct client *c, struct client_msg *msg)
         return client_msg_write(c->fd, &rsp.msghdr);
 }
 
+int client_handle_connect_req_msg(struct client *c, struct client_msg *msg)
+{
+        struct client_msg_connect_req *req = 
+                (struct client_msg_connect_req *)msg;
+        int ret;
+
+        LOG_DBG("Client %u connect request for service id %s\n", c->id,
+                service_id_to_str(&req->srvid));
+
+        ret = client_connect(c, req);
+
+        if (ret == -EAGAIN)
+                return client_park(c, msg, sizeof(*req));
+
+        return ret;
+}
+
 int client_handle_listen_req_msg(struct client *c, struct client_msg *msg)
 {
         struct client_msg_listen_req *req = (struct client_msg_listen_req *)msg;
@@ -457,7 +679,7 @@ int client_handle_listen_req_msg(struct client *c, struct client_msg *msg)
 
         err = c->sock->ops->listen(c->sock, req->backlog); 
 
-        client_msg_hdr_init(&rsp.msghdr, MSG_LISTEN_RSP);
+        client_msg_rsp_init(&rsp.msghdr, MSG_LISTEN_RSP, msg);
 
         if (err < 0) {
                 LOG_ERR("listen failed: %s\n", KERN_STRERROR(err));
@@ -467,34 +689,29 @@ int client_handle_listen_req_msg(struct client *c, struct client_msg *msg)
         return client_msg_write(c->fd, &rsp.msghdr);
 }
 
-/* 
-   This function is called on the parent thread, i.e., the socket that
-   is listening. We wait to be woken up, i.e., we wake when there is a
-   new client socket in the accept queue.
-
-   We respond to the application, which in turn creates a new client
-   by opening a new IPC socket. This client is hooked up with the
-   socket in the accept queue by calling accept2 below on the new
-   client thread.
-*/
-int client_handle_accept_req_msg(struct client *c, struct client_msg *msg)
+/*
+  Respond to an accept request once there is a new client socket in
+  the accept queue. While the queue is empty, -EAGAIN is returned
+  without responding, and the request is tried again when the
+  listening socket is woken up.
+ */
+static int client_accept(struct client *c, struct client_msg *msg)
 {
         struct client_msg_accept_rsp rsp;
-        struct serval_sock *ssk = serval_sk(c->sock->sk);
-        int err = 0;
-
-        client_msg_hdr_init(&rsp.msghdr, MSG_ACCEPT_RSP);
+        struct sock *sk = c->sock->sk;
+        struct serval_sock *ssk = serval_sk(sk);
 
-        LOG_DBG("Client %u waiting for incoming request sleep=%p\n", c->id,
-                sk_sleep(c->sock->sk));
+        if (list_empty(&ssk->accept_queue)) {
+                if (sk->sk_state == SAL_LISTEN)
+                        return -EAGAIN;
+        }
 
-        err = wait_event_interruptible(*sk_sleep(c->sock->sk), 
-                                       !list_empty(&ssk->accept_queue));
+        memset(&rsp, 0, sizeof(rsp));
+        client_msg_rsp_init(&rsp.msghdr, MSG_ACCEPT_RSP, msg);
 
-        if (err < 0) {
-                LOG_ERR("wait returned %d - %s\n", 
-                        err, strerror(KERN_ERR(err)));
-                rsp.error = KERN_ERR(err);
+        if (list_empty(&ssk->accept_queue)) {
+                /* No longer listening */
+                rsp.error = EINVAL;
                 goto out;
         }
 
@@ -509,6 +726,31 @@ int client_handle_accept_req_msg(struct client *c, struct client_msg *msg)
  out:
         return client_msg_write(c->fd, &rsp.msghdr);
 }
+
+/* 
+   This function is called on the parent client, i.e., the socket
+   that is listening. The request waits until there is a new client
+   socket in the accept queue.
+
+   We respond to the application, which in turn creates a new client
+   by opening a new IPC socket. This client is hooked up with the
+   socket in the accept queue by calling accept2 below on the new
+   client.
+*/
+int client_handle_accept_req_msg(struct client *c, struct client_msg *msg)
+{
+        int ret;
+
+        LOG_DBG("Client %u waiting for incoming request\n", c->id);
+
+        ret = client_accept(c, msg);
+
+        if (ret == -EAGAIN)
+                return client_park(c, msg, 
+                                   sizeof(struct client_msg_accept_req));
+
+        return ret;
+}
 /* 
    Accept2 is called on the child thread, i.e., corresponding to the
    socket returned from accept().
@@ -527,7 +769,7 @@ int client_handle_accept2_req_msg(struct client *c, struct client_msg *msg)
         LOG_DBG("Client %u accept2 request service id=%s\n", c->id,
                 service_id_to_str(&req->srvid));
 
-        client_msg_hdr_init(&rsp.msghdr, MSG_ACCEPT2_RSP);
+        client_msg_rsp_init(&rsp.msghdr, MSG_ACCEPT2_RSP, msg);
 
         /* Find parent sock */
         psk = serval_sock_lookup_service(&req->srvid, 
@@ -558,13 +800,25 @@ int client_handle_accept2_req_msg(struct client *c, struct client_msg *msg)
         }
         sock_put(psk);
  out:
-        return client_msg_write(c->fd, &rsp.msghdr);
+        err = client_msg_write(c->fd, &rsp.msghdr);
+
+        /* Data that arrived while the socket was in the accept
+           queue went unsignalled */
+        if (err > 0 && !rsp.error)
+                client_data_ready(c);
+
+        return err;
 }
 
-int client_handle_send_req_msg(struct client *c, struct client_msg *msg)
+/*
+  Send the data of a send request from *sent on, and respond. A
+  request that may wait does not block: if the socket is full, -EAGAIN
+  is returned without responding, and *sent tells how much went out.
+ */
+static int client_send(struct client *c, struct client_msg_send_req *req,
+                       unsigned int *sent, int may_wait)
 {
-        struct client_msg_send_req *req = (struct client_msg_send_req *)msg;
-        DEFINE_CLIENT_RESPONSE(rsp, MSG_SEND_RSP);
+        DEFINE_CLIENT_RESPONSE(rsp, MSG_SEND_RSP, &req->msghdr);
         struct socket *sock = c->sock;
         struct msghdr mh;
         struct iovec iov;
@@ -585,40 +839,123 @@ int client_handle_send_req_msg(struct client *c, struct client_msg *msg)
                        sizeof(req->ipaddr));
                 addrlen = sizeof(addr);
         }
-        memset(&mh, 0, sizeof(mh));
-        mh.msg_name = &addr;
-        mh.msg_namelen = addrlen;
-        mh.msg_iov = &iov;
-        mh.msg_iovlen = 1;
-        
-        iov.iov_base = req->data;
-        iov.iov_len = req->data_len;
         
 #if defined(ENABLE_DEBUG)
         {
                 struct in_addr ip;
                 ip.s_addr = req->ipaddr;
                 
-                LOG_DBG("Client %u data_len=%u dest: %s @ %s\n", 
-                        c->id, req->data_len, 
+                LOG_DBG("Client %u data_len=%u sent=%u dest: %s @ %s\n", 
+                        c->id, req->data_len, *sent,
                         service_id_to_str(&req->srvid), 
                         inet_ntoa(ip));
         }
 #endif
-        ret = sock->ops->sendmsg(NULL, sock, &mh, req->data_len);
+        do {
+                memset(&mh, 0, sizeof(mh));
+                mh.msg_name = &addr;
+                mh.msg_namelen = addrlen;
+                mh.msg_iov = &iov;
+                mh.msg_iovlen = 1;
+
+                if (may_wait)
+                        mh.msg_flags |= MSG_DONTWAIT;
+
+                iov.iov_base = req->data + *sent;
+                iov.iov_len = req->data_len - *sent;
+
+                ret = sock->ops->sendmsg(NULL, sock, &mh, iov.iov_len);
+
+                if (ret > 0)
+                        *sent += ret;
+        } while (may_wait && ret > 0 && *sent < req->data_len);
+
+        if (may_wait && (ret == -EAGAIN || ret == -EWOULDBLOCK))
+                return -EAGAIN;
         
         if (ret < 0) {
                 rsp.error = KERN_ERR(ret);
                 LOG_ERR("sendmsg: %s\n", KERN_STRERROR(ret));
+        } else if (req->msghdr.id == 0) {
+                /* The application does not wait for a response; it
+                   only hears about errors, asynchronously */
+                return 1;
         }
         
 	return client_msg_write(c->fd, &rsp.msghdr);
 }
 
-int client_handle_recv_req_msg(struct client *c, struct client_msg *msg)
+/* Try the parked send again. Once it is done, the client takes
+   messages again. */
+static void client_send_parked_run(struct client *c)
 {
-	struct client_msg_recv_req *req = (struct client_msg_recv_req *)msg;
-        struct client_msg_recv_rsp *rsp;
+        if (client_send(c, c->send_req, &c->send_sent, 1) == -EAGAIN)
+                return;
+
+        free(c->send_req);
+        c->send_req = NULL;
+        client_reactor_resume(c);
+}
+
+int client_handle_send_req_msg(struct client *c, struct client_msg *msg)
+{
+        struct client_msg_send_req *req = (struct client_msg_send_req *)msg;
+        size_t len = CLIENT_MSG_SEND_REQ_LEN + req->data_len;
+        unsigned int sent = 0;
+        int ret;
+
+        /* Waiting for buffer space blocks the worker. When the pool
+           cannot spare it, the send is parked instead, until the
+           socket has room. */
+        if (client_worker_may_block())
+                return client_send(c, req, &sent, 0);
+
+        ret = client_send(c, req, &sent, 1);
+
+        if (ret != -EAGAIN)
+                return ret;
+
+        c->send_req = (struct client_msg_send_req *)malloc(len);
+
+        if (!c->send_req)
+                return -1;
+
+        memcpy(c->send_req, req, len);
+        c->send_sent = sent;
+
+        LOG_DBG("Client %u send id=%u waits for buffer space (%u/%u sent)\n",
+                c->id, msg->id, sent, req->data_len);
+
+        /* The socket may have got room after the send was tried,
+           but before signals were let through */
+        if (client_send(c, c->send_req, &c->send_sent, 1) != -EAGAIN) {
+                free(c->send_req);
+                c->send_req = NULL;
+        }
+        return 1;
+}
+
+/* Blocking requests wait for data in the stack rather than block
+   the client, so that the application may send while it
+   receives. Requests that must be filled completely still block,
+   see client_handle_recv_req_msg(). */
+static inline int client_recv_may_wait(struct client_msg_recv_req *req)
+{
+        return !(req->flags & (MSG_DONTWAIT | MSG_WAITALL));
+}
+
+/*
+  Receive data and respond to a receive request. A request that may
+  wait does not block: if there is no data, -EAGAIN is returned
+  without responding. A MSG_WAITALL request that waits keeps what
+  data there is in r, and returns -EAGAIN until it is filled, or the
+  stream ends or fails.
+ */
+static int client_recv(struct client *c, struct client_recv *r,
+                       int may_wait)
+{
+        struct client_msg_recv_req *req = &r->req;
+        struct client_msg_recv_rsp *rsp = r->rsp;
 	struct socket *sock = c->sock;
         struct msghdr mh;
         struct iovec iov;
@@ -626,59 +963,223 @@ int client_handle_recv_req_msg(struct client *c, struct client_msg *msg)
                 struct sockaddr_sv serv;
                 struct sockaddr_in addr;
         } saddr;
-        int ret;
-	
-	rsp = malloc(CLIENT_MSG_RECV_RSP_LEN + req->data_len);
+        int ret, flags = req->flags;
+        int waitall = may_wait && (req->flags & MSG_WAITALL);
 
-	if (!rsp)
-		return -ENOMEM;
-	
-        memset(rsp, 0, CLIENT_MSG_RECV_RSP_LEN + req->data_len);
-        memset(&saddr, 0, sizeof(saddr));
-        client_msg_hdr_init(&rsp->msghdr, MSG_RECV_RSP);
-        memset(&mh, 0, sizeof(mh));
-        memset(&iov, 0, sizeof(iov));
-        memset(&saddr, 0, sizeof(saddr));
-        mh.msg_name = &saddr;
-        mh.msg_namelen = sizeof(saddr);
-        mh.msg_iov = &iov;
-        mh.msg_iovlen = 1;
-	
-        iov.iov_base = rsp->data;
-        iov.iov_len = req->data_len;
+        if (!rsp) {
+                rsp = malloc(CLIENT_MSG_RECV_RSP_LEN + req->data_len);
 
-        LOG_DBG("Client %u data_len=%u flags=%u\n", 
-                c->id, req->data_len, req->flags);
-        
-        ret = sock->ops->recvmsg(NULL, sock, &mh, req->data_len, req->flags);
-        
-        if (ret < 0) {
+                if (!rsp)
+                        return -ENOMEM;
+
+                memset(rsp, 0, CLIENT_MSG_RECV_RSP_LEN + req->data_len);
+                client_msg_rsp_init(&rsp->msghdr, MSG_RECV_RSP, 
+                                    &req->msghdr);
+                r->rsp = rsp;
+                r->copied = 0;
+        }
+
+        if (may_wait)
+                flags = (flags & ~MSG_WAITALL) | MSG_DONTWAIT;
+
+        LOG_DBG("Client %u id=%u data_len=%u flags=%u\n",
+                c->id, req->msghdr.id, req->data_len, req->flags);
+
+        do {
+                memset(&mh, 0, sizeof(mh));
+                memset(&iov, 0, sizeof(iov));
+                memset(&saddr, 0, sizeof(saddr));
+                mh.msg_name = &saddr;
+                mh.msg_namelen = sizeof(saddr);
+                mh.msg_iov = &iov;
+                mh.msg_iovlen = 1;
+
+                iov.iov_base = rsp->data + r->copied;
+                iov.iov_len = req->data_len - r->copied;
+
+                ret = sock->ops->recvmsg(NULL, sock, &mh, iov.iov_len, 
+                                         flags);
+
+                if (ret > 0)
+                        r->copied += ret;
+        } while (waitall && ret > 0 && r->copied < req->data_len);
+
+        if (may_wait && (ret == -EAGAIN || ret == -EWOULDBLOCK) &&
+            (waitall || r->copied == 0))
+                return -EAGAIN;
+
+        if (ret < 0 && r->copied == 0) {
                 rsp->error = KERN_ERR(ret);
                 LOG_ERR("recvmsg: %s\n", KERN_STRERROR(ret));
         } else {
-                memcpy(&rsp->srvid, &saddr.serv.sv_srvid, 
+                memcpy(&rsp->srvid, &saddr.serv.sv_srvid,
                        sizeof(saddr.serv.sv_srvid));
                 rsp->ipaddr = saddr.addr.sin_addr.s_addr;
-                rsp->data_len = ret;
-                rsp->msghdr.payload_length += ret;
-                rsp->data[ret] = '\0';
+                rsp->data_len = r->copied;
+                rsp->msghdr.payload_length += r->copied;
+                rsp->data[r->copied] = '\0';
         }
-        
-        LOG_DBG("Client %u recv len=%u\n", ret);
+
+        LOG_DBG("Client %u recv len=%u\n", c->id, r->copied);
 
         ret = client_msg_write(c->fd, &rsp->msghdr);
-        
+
 	free(rsp);
-	
+        r->rsp = NULL;
+
         return ret;
 }
 
+/* Respond to waiting receive requests, oldest first, for as long as
+   there is data. Returns the number of requests left waiting. */
+static unsigned int client_recv_queue_run(struct client *c)
+{
+        while (!list_empty(&c->recv_queue)) {
+                struct client_recv *r =
+                        list_first_entry(&c->recv_queue,
+                                         struct client_recv, link);
+
+                if (client_recv(c, r, 1) == -EAGAIN)
+                        break;
+
+                list_del(&r->link);
+                c->recv_pending--;
+                free(r);
+        }
+        return c->recv_pending;
+}
+
+/* Fail the receive requests that still wait, e.g., when the socket
+   closes */
+static void client_recv_queue_abort(struct client *c, int err)
+{
+        while (!list_empty(&c->recv_queue)) {
+                struct client_recv *r =
+                        list_first_entry(&c->recv_queue,
+                                         struct client_recv, link);
+                struct client_msg_recv_rsp rsp;
+
+                memset(&rsp, 0, sizeof(rsp));
+                client_msg_rsp_init(&rsp.msghdr, MSG_RECV_RSP,
+                                    &r->req.msghdr);
+                rsp.error = err;
+                client_msg_write(c->fd, &rsp.msghdr);
+                list_del(&r->link);
+                c->recv_pending--;
+                free(r->rsp);
+                free(r);
+        }
+}
+
+/* Try the parked request again, and respond if it is done. Returns
+   whether it still waits. */
+static int client_parked_run(struct client *c)
+{
+        int ret;
+
+        switch (c->parked_req.msghdr.type) {
+        case MSG_ACCEPT_REQ:
+                ret = client_accept(c, &c->parked_req.msghdr);
+                break;
+        case MSG_CONNECT_REQ:
+                ret = client_connect(c, &c->parked_req.connect);
+                break;
+        default:
+                ret = -EINVAL;
+                break;
+        }
+
+        if (ret != -EAGAIN)
+                c->parked = 0;
+
+        return c->parked;
+}
+
+/* Fail the parked request, e.g., when the socket closes */
+static void client_parked_abort(struct client *c, int err)
+{
+        struct client_msg_connect_rsp crsp;
+        struct client_msg_accept_rsp arsp;
+
+        if (!c->parked)
+                return;
+
+        c->parked = 0;
+
+        if (c->parked_req.msghdr.type == MSG_CONNECT_REQ) {
+                memset(&crsp, 0, sizeof(crsp));
+                client_msg_rsp_init(&crsp.msghdr, MSG_CONNECT_RSP,
+                                    &c->parked_req.msghdr);
+                memcpy(&crsp.srvid, &c->parked_req.connect.srvid, 
+                       sizeof(crsp.srvid));
+                crsp.error = err;
+                client_msg_write(c->fd, &crsp.msghdr);
+        } else {
+                memset(&arsp, 0, sizeof(arsp));
+                client_msg_rsp_init(&arsp.msghdr, MSG_ACCEPT_RSP,
+                                    &c->parked_req.msghdr);
+                arsp.error = err;
+                client_msg_write(c->fd, &arsp.msghdr);
+        }
+}
+
+int client_handle_recv_req_msg(struct client *c, struct client_msg *msg)
+{
+	struct client_msg_recv_req *req = (struct client_msg_recv_req *)msg;
+        struct client_recv now, *r;
+        int ret;
+
+        memcpy(&now.req, req, sizeof(*req));
+        now.rsp = NULL;
+        now.copied = 0;
+
+        /* A request that must be filled completely blocks the
+           worker, unless the pool cannot spare it; it then waits
+           like any other request, until it is filled */
+        if (!client_recv_may_wait(req) && 
+            ((req->flags & MSG_DONTWAIT) || client_worker_may_block()))
+                return client_recv(c, &now, 0);
+
+        /* Requests get data in the order they were sent */
+        if (client_recv_queue_run(c) == 0) {
+                ret = client_recv(c, &now, 1);
+
+                if (ret != -EAGAIN)
+                        return ret;
+        }
+
+        r = (struct client_recv *)malloc(sizeof(*r));
+
+        if (!r) {
+                free(now.rsp);
+                return -1;
+        }
+
+        memcpy(r, &now, sizeof(*r));
+        list_add_tail(&r->link, &c->recv_queue);
+        c->recv_pending++;
+
+        LOG_DBG("Client %u recv id=%u waits for data (%u waiting)\n",
+                c->id, req->msghdr.id, c->recv_pending);
+
+        return 1;
+}
+
 int client_handle_close_req_msg(struct client *c, struct client_msg *msg)
 {        
-        DEFINE_CLIENT_RESPONSE(rsp, MSG_CLOSE_RSP);
+        DEFINE_CLIENT_RESPONSE(rsp, MSG_CLOSE_RSP, msg);
         int ret;
         
         LOG_DBG("Client %u closing socket %d\n", c->id, c->sock);
+
+        /* The application may have queued data just before
+           closing */
+        if (c->shm)
+                client_shm_flush(c->shm, c->sock);
+
+        client_recv_queue_abort(c, EBADF);
+        client_parked_abort(c, EBADF);
+
         ret = c->sock->ops->release(c->sock);
 
         if (ret < 0) {
@@ -696,7 +1197,21 @@ int client_handle_close_req_msg(struct client *c, struct client_msg *msg)
 int client_handle_clear_data_msg(struct client *c, struct client_msg *msg)
 {
         LOG_DBG("Client %u clearing has data: %i\n", c->id, c->has_data);
+
+        /* The application drained the RX ring; the has_data flag
+           belongs to the channel */
+        if (c->shm) {
+                client_shm_clear_data(c->shm);
+                client_shm_service(c);
+                return 1;
+        }
+
         c->has_data = 0;
+
+        /* Data that came while the flag was set went unsignalled */
+        if (c->recv_pending)
+                client_recv_queue_run(c);
+
         /* TODO - kludge to prevent client_thread from thinking no
            response data was written and should close */
         return 1;
@@ -709,20 +1224,86 @@ int client_handle_have_data_msg(struct client *c, struct client_msg *msg)
         return 0;
 }
 
-int client_send_have_data_msg(struct client *c)
+static int client_write_have_data_msg(struct client *c)
 {
         struct client_msg_have_data hd;
 
+        LOG_DBG("Client %u sending have data msg to application\n", c->id);
+
+        memset(&hd, 0, sizeof(hd));
+        client_msg_hdr_init(&hd.msghdr, MSG_HAVE_DATA);
+        return client_msg_write(c->fd, &hd.msghdr);
+}
+
+int client_send_have_data_msg(struct client *c)
+{
         if (c->has_data)
                 return 0;
         
         c->has_data = 1;
 
-        LOG_DBG("Client %u sending have data msg to application\n", c->id);
+        return client_write_have_data_msg(c);
+}
 
-        memset(&hd, 0, sizeof(hd));
-        client_msg_hdr_init(&hd.msghdr, MSG_HAVE_DATA);
-        return client_msg_write(c->fd, &hd.msghdr);
+/*
+  Set up the shared memory data path of a client. The channel is
+  passed in the response, after which data moves through the rings
+  rather than through messages.
+ */
+int client_handle_shm_req_msg(struct client *c, struct client_msg *msg)
+{
+        struct client_msg_shm_req *req = (struct client_msg_shm_req *)msg;
+        struct client_msg_shm_rsp rsp;
+        int fds[CLIENT_MSG_SHM_NUM_FDS];
+        int memfd = -1, ret;
+
+        memset(&rsp, 0, sizeof(rsp));
+        client_msg_rsp_init(&rsp.msghdr, MSG_SHM_RSP, msg);
+
+        if (c->shm) {
+                rsp.error = EEXIST;
+        } else if (c->type != CLIENT_TYPE_TCP) {
+                rsp.error = EOPNOTSUPP;
+        } else {
+                c->shm = client_shm_create(req->ring_size, &memfd);
+                
+                if (!c->shm)
+                        rsp.error = errno ? errno : ENOMEM;
+        }
+
+        if (rsp.error) {
+                LOG_DBG("Client %u no shared memory: %s\n", 
+                        c->id, strerror(rsp.error));
+                return client_msg_write(c->fd, &rsp.msghdr);
+        }
+        
+        rsp.ring_size = client_shm_ring_size(c->shm);
+        fds[0] = memfd;
+        fds[1] = client_shm_kick_fd(c->shm);
+        fds[2] = client_shm_notify_fd(c->shm);
+
+        ret = client_msg_write_fds(c->fd, &rsp.msghdr, fds, 
+                                   CLIENT_MSG_SHM_NUM_FDS);
+        
+        /* The application has its own reference now */
+        close(memfd);
+
+        if (ret <= 0) {
+                client_shm_destroy(c->shm);
+                c->shm = NULL;
+                return ret;
+        }
+
+        LOG_DBG("Client %u shared memory rings of %u bytes\n", 
+                c->id, rsp.ring_size);
+
+        if (c->reactor && client_reactor_add_shm(c) == -1)
+                return -1;
+
+        /* Move data that arrived before the channel */
+        client_shm_service(c);
+
+        return ret;
 }
 
 static int client_handle_msg(struct client *c)
@@ -804,6 +1385,11 @@ static void *client_thread(void *arg)
                         maxfd = MAX(maxfd, c->fd);
                 }
 
+                if (c->shm) {
+                        FD_SET(client_shm_kick_fd(c->shm), &readfds);
+                        maxfd = MAX(maxfd, client_shm_kick_fd(c->shm));
+                }
+
 		ret = select(maxfd + 1, &readfds, NULL, NULL, NULL);
 
 		if (ret == -1) {
@@ -841,15 +1427,21 @@ static void *client_thread(void *arg)
 
 				switch (csig) {
                                 case CLIENT_SIG_READ:
-                                        client_send_have_data_msg(c);
+                                case CLIENT_SIG_STATE:
+                                        client_data_ready(c);
                                         break;
                                 case CLIENT_SIG_WRITE:
+                                        client_write_ready(c);
                                         break;
                                 default:
                                         break;
 				}
                         }
 		
+                        if (c->shm && 
+                            FD_ISSET(client_shm_kick_fd(c->shm), &readfds))
+                                client_shm_service(c);
+
 			if (FD_ISSET(c->fd, &readfds)) {
 				/* Socket readable */
 				ret = client_handle_msg(c);
@@ -886,6 +1478,12 @@ int client_start(struct client *c)
 {
 	int ret;
 
+        if (c->reactor) {
+                c->state = CLIENT_STATE_RUNNING;
+                LOG_DBG("Client %u running\n", c->id);
+                return client_reactor_add(c);
+        }
+
 	ret = pthread_create(&c->thr, NULL, client_thread, c);
         
         if (ret != 0) {
@@ -895,6 +1493,25 @@ int client_start(struct client *c)
 	return ret;
 }
 
+/*
+  Wait for a client to exit, after client_signal_exit() or once it
+  is garbage. Returns 0, or the error of pthread_join().
+ */
+int client_join(struct client *c)
+{
+        if (!c->reactor)
+                return pthread_join(c->thr, NULL);
+
+        pthread_mutex_lock(&c->lock);
+
+        while (c->state == CLIENT_STATE_RUNNING)
+                pthread_cond_wait(&c->cond, &c->lock);
+        
+        pthread_mutex_unlock(&c->lock);
+
+        return 0;
+}
+
 struct client *client_get_by_socket(struct socket *sock, 
                                     struct client_list *list)
 {
@@ -972,3 +1589,589 @@ int test_client_start(struct client *c)
 
 	return ret;
 }
+
+/*
+  Event-driven mode.
+
+  Instead of a thread per client, a pool of worker threads waits on
+  an epoll set that holds the IPC socket of every client. A client's
+  socket is registered with EPOLLONESHOT, so one worker at a time
+  handles its messages, and it is rearmed once the message is
+  handled. Data signals from the stack are queued on a ready list,
+  and an eventfd counts the queued clients.
+
+  Events of a client that is already being served are marked as
+  pending, and handled by the worker that serves it. Only the worker
+  that handles socket events closes the client, which is why
+  client_signal_exit() makes the socket readable.
+
+  Message handlers must not block the worker for long. Accept,
+  connect and receive requests that cannot complete are parked on
+  the client, and tried again when the socket signals that it is
+  ready. Only receives that must be filled completely (MSG_WAITALL)
+  and sends that wait for buffer space still block. A worker that
+  blocks in schedule_timeout() starts another worker if none is
+  left to wait for events, and extra workers exit once they are no
+  longer needed.
+
+  The pool is capped at CLIENT_REACTOR_MAX_THREADS. So that blocked
+  handlers never leave it without a worker to serve events, the last
+  worker that may still block does not: handlers check
+  client_worker_may_block(), and then park those requests too. A
+  MSG_WAITALL receive collects data until it is filled. A send keeps
+  going as the socket gets room, and until it is done the client's
+  socket is only watched for hangups, so that the client takes no
+  further messages, as if the worker had blocked.
+*/
+#if defined(OS_LINUX)
+
+#define CLIENT_REACTOR_MAX_THREADS 1024
+
+static struct {
+        int epfd;
+        int readyfd;
+        unsigned int nr_workers; /* Size of the pool */
+        unsigned int nr_threads; /* Workers running */
+        unsigned int nr_blocked; /* Workers blocked in a handler */
+        int should_exit;
+        struct list_head ready;
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+} reactor = {
+        .epfd = -1,
+        .readyfd = -1,
+        .ready = { &reactor.ready, &reactor.ready },
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .cond = PTHREAD_COND_INITIALIZER,
+};
+
+static __thread int client_worker_thread;
+
+static int client_reactor_enabled(void)
+{
+        return reactor.epfd != -1;
+}
+
+/* While a send is parked, the client's socket is only watched for
+   the application hanging up */
+static int client_reactor_arm(struct client *c, int op)
+{
+        struct epoll_event ev;
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events = (c->send_req ? EPOLLRDHUP : EPOLLIN) | EPOLLONESHOT;
+        ev.data.ptr = c;
+
+        return epoll_ctl(reactor.epfd, op, c->fd, &ev);
+}
+
+/* The epoll data of a client's shared memory doorbell is the client
+   pointer with the low bit set, which is free as clients are
+   malloc()ed */
+#define CLIENT_REACTOR_SHM 1UL
+
+static int client_reactor_arm_shm(struct client *c, int op)
+{
+        struct epoll_event ev;
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLONESHOT;
+        ev.data.ptr = (void *)((uintptr_t)c | CLIENT_REACTOR_SHM);
+
+        return epoll_ctl(reactor.epfd, op, client_shm_kick_fd(c->shm), &ev);
+}
+
+static int client_reactor_add(struct client *c)
+{
+        /* Held by the registration, until the client closes */
+        client_hold(c);
+
+        if (client_reactor_arm(c, EPOLL_CTL_ADD) == -1) {
+                LOG_ERR("Client %u could not be added: %s\n", 
+                        c->id, strerror(errno));
+                c->state = CLIENT_STATE_NOT_RUNNING;
+                client_put(c);
+                return -1;
+        }
+        return 0;
+}
+
+/*
+  Register the doorbell of a client's shared memory channel, which
+  holds a reference like the socket. As the application keeps the
+  doorbell open, closing it does not remove it from the epoll set, so
+  the reference is instead dropped by the first kick seen after the
+  client closed, see client_reactor_close().
+ */
+static int client_reactor_add_shm(struct client *c)
+{
+        client_hold(c);
+
+        if (client_reactor_arm_shm(c, EPOLL_CTL_ADD) == -1) {
+                LOG_ERR("Client %u doorbell could not be added: %s\n", 
+                        c->id, strerror(errno));
+                c->should_exit = 1;
+                client_put(c);
+                return -1;
+        }
+        return 0;
+}
+
+static void client_reactor_schedule(struct client *c, unsigned int events)
+{
+        uint64_t val = 1;
+        int queue = 0;
+
+        pthread_mutex_lock(&c->lock);
+        c->pending |= events;
+
+        if (!c->busy && !c->queued) {
+                c->queued = 1;
+                client_hold(c);
+                pthread_mutex_lock(&reactor.lock);
+                list_add_tail(&c->ready, &reactor.ready);
+                pthread_mutex_unlock(&reactor.lock);
+                queue = 1;
+        }
+        pthread_mutex_unlock(&c->lock);
+
+        if (queue && write(reactor.readyfd, &val, sizeof(val)) == -1)
+                LOG_ERR("could not signal workers: %s\n", strerror(errno));
+}
+
+/* Take messages again, after a parked send is done */
+static void client_reactor_resume(struct client *c)
+{
+        if (c->reactor && c->fd != -1 &&
+            client_reactor_arm(c, EPOLL_CTL_MOD) == -1)
+                LOG_ERR("Client %u could not be rearmed: %s\n", 
+                        c->id, strerror(errno));
+}
+
+static struct client *client_reactor_dequeue(void)
+{
+        struct client *c = NULL;
+        uint64_t val;
+
+        /* The eventfd is a semaphore, so each read takes one
+           client, if any */
+        if (read(reactor.readyfd, &val, sizeof(val)) == -1)
+                return NULL;
+        
+        pthread_mutex_lock(&reactor.lock);
+
+        if (!list_empty(&reactor.ready)) {
+                c = list_first_entry(&reactor.ready, struct client, ready);
+                list_del_init(&c->ready);
+        }
+        pthread_mutex_unlock(&reactor.lock);
+
+        return c;
+}
+
+static void client_reactor_close(struct client *c)
+{
+        int fd;
+
+	LOG_DBG("Client %u exiting\n", c->id);
+
+        /* Closing the socket removes it from the epoll set */
+        pthread_mutex_lock(&c->lock);
+        fd = c->fd;
+        c->fd = -1;
+        pthread_mutex_unlock(&c->lock);
+
+        close(fd);
+	client_close(c);
+
+        /* Kick ourselves, so that the doorbell registration is
+           dropped */
+        if (c->shm) {
+                uint64_t val = 1;
+                
+                if (write(client_shm_kick_fd(c->shm), &val, sizeof(val)) == -1)
+                        LOG_ERR("Client %u could not kick doorbell: %s\n",
+                                c->id, strerror(errno));
+        }
+}
+
+/* Serve a kick of the shared memory doorbell. Returns 1 if the
+   doorbell registration is gone. */
+static int client_reactor_handle_shm(struct client *c)
+{
+        if (c->fd == -1)
+                return 1;
+
+        client_shm_service(c);
+
+        if (client_reactor_arm_shm(c, EPOLL_CTL_MOD) == -1) {
+                LOG_ERR("Client %u doorbell could not be rearmed: %s\n", 
+                        c->id, strerror(errno));
+                return 1;
+        }
+        return 0;
+}
+
+/* Handle a message on the client socket. Returns 1 if the client
+   should close. */
+static int client_reactor_handle_msg(struct client *c)
+{
+        int ret;
+
+        if (c->send_req) {
+                /* Armed for hangups only, see client_reactor_arm() */
+                LOG_DBG("Client %u hung up with a send parked\n", c->id);
+                c->should_exit = 1;
+        } else if (!c->should_exit) {
+                ret = client_handle_msg(c);
+                
+                if (ret == 0) {
+                        /* Client close */
+                        LOG_DBG("Client %u closed\n", c->id);
+                        c->should_exit = 1;
+                }
+        }
+
+        if (c->should_exit)
+                return 1;
+        
+        if (client_reactor_arm(c, EPOLL_CTL_MOD) == -1) {
+                LOG_ERR("Client %u could not be rearmed: %s\n", 
+                        c->id, strerror(errno));
+                c->should_exit = 1;
+                return 1;
+        }
+        return 0;
+}
+
+/* Handle the pending events of a client, unless another worker is
+   at it already */
+static void client_reactor_serve(struct client *c, unsigned int events, 
+                                 int dequeued)
+{
+        unsigned int ev;
+        int closed = 0, released = 0;
+
+        pthread_mutex_lock(&c->lock);
+        c->pending |= events;
+
+        if (dequeued)
+                c->queued = 0;
+
+        if (c->busy) {
+                pthread_mutex_unlock(&c->lock);
+                return;
+        }
+
+        c->busy = 1;
+        pthread_setspecific(client_key, c);
+        
+        while ((ev = c->pending)) {
+                c->pending = 0;
+                pthread_mutex_unlock(&c->lock);
+
+                if ((ev & CLIENT_EV_DATA) && c->fd != -1)
+                        client_data_ready(c);
+
+                if ((ev & CLIENT_EV_WRITE) && c->fd != -1)
+                        client_write_ready(c);
+
+                if ((ev & CLIENT_EV_SHM) && client_reactor_handle_shm(c))
+                        released = 1;
+
+                if ((ev & CLIENT_EV_SOCK) && 
+                    client_reactor_handle_msg(c)) {
+                        client_reactor_close(c);
+                        closed = 1;
+                }
+
+                pthread_mutex_lock(&c->lock);
+        }
+
+        c->busy = 0;
+        pthread_setspecific(client_key, NULL);
+
+        if (closed) {
+                c->state = CLIENT_STATE_GARBAGE;
+                pthread_cond_broadcast(&c->cond);
+        }
+        pthread_mutex_unlock(&c->lock);
+
+        /* Drop the references of the registrations */
+        if (released)
+                client_put(c);
+
+        if (closed)
+                client_put(c);
+}
+
+/* Must hold the reactor lock */
+static int client_reactor_should_retire(void)
+{
+        return reactor.should_exit ||
+                reactor.nr_threads - reactor.nr_blocked > reactor.nr_workers;
+}
+
+static void *client_worker(void *arg);
+
+/* Must hold the reactor lock */
+static int client_reactor_spawn(void)
+{
+        pthread_attr_t attr;
+        pthread_t thr;
+        int ret;
+
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        
+        ret = pthread_create(&thr, &attr, client_worker, NULL);
+
+        pthread_attr_destroy(&attr);
+
+        if (ret != 0) {
+                LOG_ERR("could not start client worker: %s\n", 
+                        strerror(ret));
+                return -1;
+        }
+        reactor.nr_threads++;
+
+        return 0;
+}
+
+static void *client_worker(void *arg)
+{
+        client_worker_thread = 1;
+
+        while (1) {
+                struct epoll_event ev;
+                struct client *c;
+                int ret;
+
+                pthread_mutex_lock(&reactor.lock);
+
+                if (client_reactor_should_retire()) {
+                        reactor.nr_threads--;
+                        pthread_cond_broadcast(&reactor.cond);
+                        pthread_mutex_unlock(&reactor.lock);
+                        break;
+                }
+                pthread_mutex_unlock(&reactor.lock);
+
+                ret = epoll_wait(reactor.epfd, &ev, 1, -1);
+                
+                if (ret == -1) {
+                        if (errno != EINTR)
+                                LOG_ERR("epoll_wait: %s\n", strerror(errno));
+                        continue;
+                } else if (ret == 0) {
+                        continue;
+                }
+                
+                if (ev.data.ptr == NULL) {
+                        c = client_reactor_dequeue();
+                        
+                        if (c) {
+                                client_reactor_serve(c, 0, 1);
+                                client_put(c);
+                        }
+                } else if ((uintptr_t)ev.data.ptr & CLIENT_REACTOR_SHM) {
+                        c = (struct client *)((uintptr_t)ev.data.ptr & 
+                                              ~CLIENT_REACTOR_SHM);
+                        client_reactor_serve(c, CLIENT_EV_SHM, 0);
+                } else {
+                        client_reactor_serve(ev.data.ptr, 
+                                             CLIENT_EV_SOCK, 0);
+                }
+        }
+
+        return NULL;
+}
+
+void client_worker_block(void)
+{
+        if (!client_worker_thread)
+                return;
+
+        pthread_mutex_lock(&reactor.lock);
+        reactor.nr_blocked++;
+
+        /* Keep a worker waiting for events */
+        if (reactor.nr_blocked == reactor.nr_threads && 
+            reactor.nr_threads < CLIENT_REACTOR_MAX_THREADS &&
+            !reactor.should_exit)
+                client_reactor_spawn();
+        
+        pthread_mutex_unlock(&reactor.lock);
+}
+
+int client_worker_may_block(void)
+{
+        int ret;
+
+        if (!client_worker_thread)
+                return 1;
+
+        pthread_mutex_lock(&reactor.lock);
+        ret = reactor.nr_threads < CLIENT_REACTOR_MAX_THREADS ||
+                reactor.nr_blocked + 1 < reactor.nr_threads;
+        pthread_mutex_unlock(&reactor.lock);
+
+        return ret;
+}
+
+void client_worker_unblock(void)
+{
+        if (!client_worker_thread)
+                return;
+
+        pthread_mutex_lock(&reactor.lock);
+        reactor.nr_blocked--;
+        pthread_mutex_unlock(&reactor.lock);
+}
+
+/*
+  Serve clients with a pool of worker threads, one per CPU if
+  workers is zero. Must be called before clients are created.
+ */
+int client_reactor_start(unsigned int workers)
+{
+	struct sigaction action;
+        struct epoll_event ev;
+        unsigned int i;
+
+        if (workers == 0) {
+                long n = sysconf(_SC_NPROCESSORS_ONLN);
+                workers = n > 0 ? n : 1;
+        }
+
+	pthread_once(&key_once, make_client_key);
+
+	memset(&action, 0, sizeof(struct sigaction));
+        action.sa_handler = signal_handler;
+	sigaction(SIGPIPE, &action, 0);
+
+        reactor.epfd = epoll_create(1024);
+
+        if (reactor.epfd == -1) {
+                LOG_ERR("epoll_create: %s\n", strerror(errno));
+                return -1;
+        }
+
+        reactor.readyfd = eventfd(0, EFD_NONBLOCK | EFD_SEMAPHORE);
+
+        if (reactor.readyfd == -1) {
+                LOG_ERR("eventfd: %s\n", strerror(errno));
+                goto fail;
+        }
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+
+        if (epoll_ctl(reactor.epfd, EPOLL_CTL_ADD, 
+                      reactor.readyfd, &ev) == -1) {
+                LOG_ERR("epoll_ctl: %s\n", strerror(errno));
+                goto fail;
+        }
+
+        pthread_mutex_lock(&reactor.lock);
+        reactor.nr_workers = workers;
+        reactor.should_exit = 0;
+
+        for (i = 0; i < workers; i++) {
+                if (client_reactor_spawn() == -1)
+                        break;
+        }
+        pthread_mutex_unlock(&reactor.lock);
+
+        if (i == 0) {
+                client_reactor_stop();
+                return -1;
+        }
+
+        LOG_INF("Serving clients with %u workers\n", i);
+
+        return 0;
+ fail:
+        client_reactor_stop();
+        return -1;
+}
+
+/* Stop the workers, once all clients have exited */
+void client_reactor_stop(void)
+{
+        uint64_t val = CLIENT_REACTOR_MAX_THREADS;
+
+        if (reactor.epfd == -1)
+                return;
+
+        pthread_mutex_lock(&reactor.lock);
+        reactor.should_exit = 1;
+
+        /* Wake up every worker */
+        if (reactor.readyfd != -1 && 
+            write(reactor.readyfd, &val, sizeof(val)) == -1)
+                LOG_ERR("could not signal workers: %s\n", strerror(errno));
+        
+        while (reactor.nr_threads > 0)
+                pthread_cond_wait(&reactor.cond, &reactor.lock);
+        
+        pthread_mutex_unlock(&reactor.lock);
+
+        if (reactor.readyfd != -1) {
+                close(reactor.readyfd);
+                reactor.readyfd = -1;
+        }
+        close(reactor.epfd);
+        reactor.epfd = -1;
+}
+
+#else /* OS_LINUX */
+
+static int client_reactor_enabled(void)
+{
+        return 0;
+}
+
+static int client_reactor_add(struct client *c)
+{
+        return -1;
+}
+
+static int client_reactor_add_shm(struct client *c)
+{
+        return -1;
+}
+
+static void client_reactor_schedule(struct client *c, unsigned int events)
+{
+}
+
+static void client_reactor_resume(struct client *c)
+{
+}
+
+void client_worker_block(void)
+{
+}
+
+int client_worker_may_block(void)
+{
+        return 1;
+}
+
+void client_worker_unblock(void)
+{
+}
+
+int client_reactor_start(unsigned int workers)
+{
+        LOG_ERR("Event-driven clients are not supported on this platform\n");
+        return -1;
+}
+
+void client_reactor_stop(void)
+{
+}
+
+#endif /* OS_LINUX */
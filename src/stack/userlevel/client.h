@@ -25,6 +25,7 @@ enum client_signal {
         CLIENT_SIG_EXIT  = 1,
         CLIENT_SIG_READ  = 2,
         CLIENT_SIG_WRITE = 3,
+        CLIENT_SIG_STATE = 4,
 };
 
 struct client_list {
@@ -57,6 +58,7 @@ int client_signal_raise(struct client *c, enum client_signal s);
 int client_signal_exit(struct client *c);
 enum client_signal client_signal_lower(int fd);
 int client_start(struct client *c);
+int client_join(struct client *c);
 struct client *client_get_by_socket(struct socket *sock, 
                                     struct client_list *list);
 void client_list_init(struct client_list *list);
@@ -69,6 +71,13 @@ void __client_list_del(struct client *c);
 void client_list_del(struct client *c, struct client_list *list);
 int test_client_start(struct client *c);
 int client_send_have_data_msg(struct client *c);
+int client_reactor_start(unsigned int workers);
+void client_reactor_stop(void);
+/* Called around blocking waits, see client_reactor_start() */
+void client_worker_block(void);
+void client_worker_unblock(void);
+/* Whether a message handler may block its worker */
+int client_worker_may_block(void);
 
 /**
   client_get_by_context:
@@ -28,6 +28,8 @@ static const char *client_msg_str[] = {
 	[MSG_RECVMESG] = "MSG_RECVMESG", 
 	[MSG_CLEAR_DATA] = "MSG_CLEAR_DATA", 
 	[MSG_HAVE_DATA] = "MSG_HAVE_DATA",
+	[MSG_SHM_REQ] = "MSG_SHM_REQ",
+	[MSG_SHM_RSP] = "MSG_SHM_RSP",
 	NULL
 };
 
@@ -51,7 +53,9 @@ unsigned int client_msg_lengths[] = {
 	[MSG_CLOSE_RSP] = CLIENT_MSG_CLOSE_RSP_LEN,
 	[MSG_RECVMESG] = CLIENT_MSG_RECVMSG_LEN,
 	[MSG_CLEAR_DATA] =CLIENT_MSG_CLEAR_DATA_LEN,
-	[MSG_HAVE_DATA] = CLIENT_MSG_HAVE_DATA_LEN
+	[MSG_HAVE_DATA] = CLIENT_MSG_HAVE_DATA_LEN,
+	[MSG_SHM_REQ] = CLIENT_MSG_SHM_REQ_LEN,
+	[MSG_SHM_RSP] = CLIENT_MSG_SHM_RSP_LEN
 };
 
 const char* client_msg_type_to_str(client_msg_type_t type)
@@ -109,10 +113,18 @@ int client_msg_read(int sock, struct client_msg **msg)
 		free(msg_tmp);
 		return -1;
 	}
+
+        if (msg_tmp->version != CLIENT_MSG_VERSION ||
+            msg_tmp->type >= MAX_CLIENT_MSG_TYPE) {
+                LOG_ERR("Bad message version=%u type=%u\n",
+                        msg_tmp->version, msg_tmp->type);
+		free(msg_tmp);
+		return -1;
+        }
 	
-	LOG_DBG("%s payload_length=%u\n", 
+	LOG_DBG("%s payload_length=%u id=%u\n", 
 		client_msg_to_typestr(msg_tmp), 
-                msg_tmp->payload_length);
+                msg_tmp->payload_length, msg_tmp->id);
         
 	msg_len = msg_tmp->payload_length + CLIENT_MSG_HDR_LEN;
 
@@ -180,6 +192,61 @@ int client_msg_write(int sock, struct client_msg *msg)
         return ret;
 }
 
+/* Write a message that passes file descriptors along */
+int client_msg_write_fds(int sock, struct client_msg *msg, 
+                         const int *fds, int num_fds)
+{
+        union {
+                struct cmsghdr cmh;
+                char buf[CMSG_SPACE(sizeof(int) * CLIENT_MSG_SHM_NUM_FDS)];
+        } control;
+        struct cmsghdr *cmh;
+        struct msghdr mh;
+        struct iovec iov;
+        int ret;
+
+        if (num_fds > CLIENT_MSG_SHM_NUM_FDS) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        LOG_DBG("%s msg payload=%u fds=%d\n", 
+                client_msg_str[msg->type],
+                msg->payload_length, num_fds);
+
+        iov.iov_base = msg;
+        iov.iov_len = CLIENT_MSG_HDR_LEN + msg->payload_length;
+
+        memset(&control, 0, sizeof(control));
+        memset(&mh, 0, sizeof(mh));
+        mh.msg_iov = &iov;
+        mh.msg_iovlen = 1;
+        mh.msg_control = control.buf;
+        mh.msg_controllen = CMSG_SPACE(sizeof(int) * num_fds);
+
+        cmh = CMSG_FIRSTHDR(&mh);
+        cmh->cmsg_level = SOL_SOCKET;
+        cmh->cmsg_type = SCM_RIGHTS;
+        cmh->cmsg_len = CMSG_LEN(sizeof(int) * num_fds);
+        memcpy(CMSG_DATA(cmh), fds, sizeof(int) * num_fds);
+
+        ret = sendmsg(sock, &mh, MSG_DONTWAIT);
+
+        if (ret == -1) {
+                switch (errno) {
+                case ECONNRESET:
+                case ENOTCONN:
+                case EPIPE:
+                        /* Client probably closed */
+                        ret = 0;
+                        break;
+                default:
+                        LOG_ERR("write error: %s\n", strerror(errno));
+                }
+        }
+        return ret;
+}
+
 void client_msg_hdr_init(struct client_msg *msg, client_msg_type_t type)
 {
         memset(msg, 0, client_msg_lengths[type]);
@@ -188,3 +255,11 @@ void client_msg_hdr_init(struct client_msg *msg, client_msg_type_t type)
 	msg->payload_length = client_msg_lengths[msg->type] - 
                 CLIENT_MSG_HDR_LEN;
 }
+
+/* Initialize the response to a request */
+void client_msg_rsp_init(struct client_msg *msg, client_msg_type_t type,
+                         const struct client_msg *req)
+{
+        client_msg_hdr_init(msg, type);
+        msg->id = req->id;
+}
@@ -25,20 +25,28 @@ typedef enum client_msg_type {
 	MSG_CLOSE_RSP,
 	MSG_RECVMESG, 
 	MSG_CLEAR_DATA, 
-	MSG_HAVE_DATA
+	MSG_HAVE_DATA,
+	MSG_SHM_REQ,
+	MSG_SHM_RSP
 } client_msg_type_t;
 
 extern unsigned int client_msg_lengths[];
 
-#define MAX_CLIENT_MSG_TYPE (MSG_HAVE_DATA + 1)
-#define CLIENT_MSG_VERSION 1
+#define MAX_CLIENT_MSG_TYPE (MSG_SHM_RSP + 1)
+#define CLIENT_MSG_VERSION 2
 
 typedef unsigned char bool_t;
 
+/* Requests carry an id that the stack echoes in the response, so
+   that the application can have several requests in flight on its
+   IPC socket. Id 0 marks messages that are not a response to
+   anything, e.g., HAVE_DATA, and send requests that want no
+   response. */
 struct client_msg {
 	unsigned char version;
 	unsigned char type;
 	uint16_t payload_length;
+	uint16_t id;
 	unsigned char payload[0];
 };
 
@@ -50,11 +58,12 @@ struct client_msg_rsp {
 
 #define CLIENT_MSG_HDR_LEN (sizeof(struct client_msg))
 
-#define DEFINE_CLIENT_RESPONSE(name, type) \
-        struct client_msg_rsp rsp =                                    \
+#define DEFINE_CLIENT_RESPONSE(name, type, req)                        \
+        struct client_msg_rsp name =                                   \
                 { { CLIENT_MSG_VERSION,                                \
                     type,                                              \
-                    client_msg_lengths[type] - CLIENT_MSG_HDR_LEN },   \
+                    client_msg_lengths[type] - CLIENT_MSG_HDR_LEN,     \
+                    (req)->id },                                       \
                   0 }
 
 /* Specific messages: */
@@ -222,12 +231,36 @@ struct client_msg_close_rsp {
 
 #define CLIENT_MSG_CLOSE_RSP_LEN (sizeof(struct client_msg_close_rsp))
 
+/* Shared memory messages. The response to a successful request
+   carries the shared memory and the kick and notify doorbells as
+   file descriptors, in that order. */
+struct client_msg_shm_req {
+	struct client_msg msghdr;
+        uint32_t ring_size;
+} __attribute__((packed));
+
+#define CLIENT_MSG_SHM_REQ_LEN (sizeof(struct client_msg_shm_req))
+
+struct client_msg_shm_rsp {
+	struct client_msg msghdr;
+        uint32_t ring_size;
+	uint8_t error;
+} __attribute__((packed));
+
+#define CLIENT_MSG_SHM_RSP_LEN (sizeof(struct client_msg_shm_rsp))
+
+#define CLIENT_MSG_SHM_NUM_FDS 3
+
 int client_msg_print(struct client_msg *msg, char *buf, int size);
 void client_msg_free(struct client_msg *msg);
 const char *client_msg_to_typestr(struct client_msg *msg);
 const char *client_client_msg_type_to_str(client_msg_type_t type);
 int client_msg_read(int sock, struct client_msg **msg);
 int client_msg_write(int sock, struct client_msg *msg);
+int client_msg_write_fds(int sock, struct client_msg *msg, 
+                         const int *fds, int num_fds);
 void client_msg_hdr_init(struct client_msg *msg, client_msg_type_t type);
+void client_msg_rsp_init(struct client_msg *msg, client_msg_type_t type,
+                         const struct client_msg *req);
 
 #endif /* _CLIENT_MSG_H_ */
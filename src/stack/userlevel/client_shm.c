@@ -0,0 +1,497 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * Shared memory data path between a client and its socket.
+ *
+ * Instead of carrying data in send and receive messages on the IPC
+ * socket, an application may ask for a channel (see
+ * <serval/shm_ring.h>). The stack then moves data directly between
+ * the rings and the socket: sendmsg() from the TX ring whenever the
+ * application kicks its doorbell, and recvmsg() into the RX ring
+ * whenever the socket becomes readable.
+ *
+ * The application may write anything to the mapping, so the stack
+ * keeps the ring pointers and its own indexes private, loads each
+ * index of the application once, and gives up on a channel whose
+ * indexes make no sense.
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License as
+ *	published by the Free Software Foundation; either version 2 of
+ *	the License, or (at your option) any later version.
+ */
+#define _GNU_SOURCE 1
+#include <serval/platform.h>
+#include <serval/debug.h>
+#include <serval/net.h>
+#include <serval/shm_ring.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "client_shm.h"
+
+#if defined(OS_LINUX)
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+
+struct client_shm {
+        struct shm_chan *chan;
+        struct shm_ring *tx;
+        struct shm_ring *rx;
+        uint32_t len;
+        uint32_t size;
+        uint32_t tx_head; /* Our copies of the indexes we advance */
+        uint32_t rx_tail;
+        int kick_fd;   /* Rung by the application */
+        int notify_fd; /* Rung by the stack */
+        int broken;    /* The application corrupted the channel */
+        int have_data; /* HAVE_DATA sent, until CLEAR_DATA */
+};
+
+static int client_shm_open(uint32_t len)
+{
+        int fd;
+
+#if defined(MFD_CLOEXEC)
+        fd = memfd_create("serval-shm", MFD_CLOEXEC);
+#else
+        char path[] = "/tmp/serval-shm-XXXXXX";
+
+        fd = mkstemp(path);
+
+        if (fd != -1)
+                unlink(path);
+#endif
+        if (fd == -1)
+                return -1;
+
+        if (ftruncate(fd, len) == -1) {
+                close(fd);
+                return -1;
+        }
+        return fd;
+}
+
+/*
+  Create a channel with rings of ring_size bytes, rounded to a power
+  of two within limits. The file descriptor of the shared memory is
+  returned in memfd, for the caller to pass to the application and
+  close.
+ */
+struct client_shm *client_shm_create(uint32_t ring_size, int *memfd)
+{
+        struct client_shm *shm;
+        uint32_t size = SHM_RING_SIZE_MIN;
+
+        if (ring_size == 0)
+                ring_size = SHM_RING_SIZE_DEFAULT;
+
+        while (size < ring_size && size < SHM_RING_SIZE_MAX)
+                size <<= 1;
+
+        shm = (struct client_shm *)malloc(sizeof(*shm));
+
+        if (!shm)
+                return NULL;
+
+        memset(shm, 0, sizeof(*shm));
+        shm->size = size;
+        shm->len = shm_chan_len(size);
+        shm->kick_fd = shm->notify_fd = -1;
+
+        *memfd = client_shm_open(shm->len);
+
+        if (*memfd == -1) {
+                LOG_ERR("could not create shared memory: %s\n",
+                        strerror(errno));
+                goto fail;
+        }
+
+        shm->chan = (struct shm_chan *)mmap(NULL, shm->len,
+                                            PROT_READ | PROT_WRITE,
+                                            MAP_SHARED, *memfd, 0);
+
+        if (shm->chan == MAP_FAILED) {
+                LOG_ERR("could not map shared memory: %s\n",
+                        strerror(errno));
+                shm->chan = NULL;
+                goto fail;
+        }
+
+        shm_chan_init(shm->chan, size);
+        shm->tx = (struct shm_ring *)((unsigned char *)shm->chan +
+                                      shm_chan_tx_offset());
+        shm->rx = (struct shm_ring *)((unsigned char *)shm->chan +
+                                      shm_chan_rx_offset(size));
+
+        shm->kick_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        shm->notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+        if (shm->kick_fd == -1 || shm->notify_fd == -1) {
+                LOG_ERR("could not create doorbells: %s\n",
+                        strerror(errno));
+                goto fail;
+        }
+
+        return shm;
+fail:
+        if (*memfd != -1) {
+                close(*memfd);
+                *memfd = -1;
+        }
+        client_shm_destroy(shm);
+
+        return NULL;
+}
+
+void client_shm_destroy(struct client_shm *shm)
+{
+        if (shm->chan)
+                munmap(shm->chan, shm->len);
+
+        if (shm->kick_fd != -1)
+                close(shm->kick_fd);
+
+        if (shm->notify_fd != -1)
+                close(shm->notify_fd);
+
+        free(shm);
+}
+
+uint32_t client_shm_ring_size(struct client_shm *shm)
+{
+        return shm->size;
+}
+
+int client_shm_kick_fd(struct client_shm *shm)
+{
+        return shm->kick_fd;
+}
+
+int client_shm_notify_fd(struct client_shm *shm)
+{
+        return shm->notify_fd;
+}
+
+static void client_shm_notify(struct client_shm *shm)
+{
+        uint64_t val = 1;
+
+        if (shm_chan_waiting(&shm->chan->app_wait) &&
+            write(shm->notify_fd, &val, sizeof(val)) == -1)
+                LOG_ERR("could not notify application: %s\n",
+                        strerror(errno));
+}
+
+static void client_shm_error(struct client_shm *shm, int err)
+{
+        if (!shm->chan->error)
+                __atomic_store_n(&shm->chan->error, err, __ATOMIC_RELEASE);
+}
+
+static void client_shm_break(struct client_shm *shm)
+{
+        LOG_ERR("application corrupted shared memory rings\n");
+        shm->broken = 1;
+        client_shm_error(shm, EPROTO);
+}
+
+/* Stop serving a broken channel. The application keeps its mapping,
+   and sees the error once it wakes up. */
+static void client_shm_teardown(struct client_shm *shm)
+{
+        uint64_t val = 1;
+
+        if (write(shm->notify_fd, &val, sizeof(val)) == -1)
+                LOG_ERR("could not notify application: %s\n",
+                        strerror(errno));
+
+        munmap(shm->chan, shm->len);
+        shm->chan = NULL;
+}
+
+/* Bytes the application has queued in the TX ring */
+static uint32_t client_shm_tx_readable(struct client_shm *shm)
+{
+        uint32_t len;
+
+        if (shm->broken)
+                return 0;
+
+        len = __atomic_load_n(&shm->tx->tail, __ATOMIC_ACQUIRE) - 
+                shm->tx_head;
+
+        if (len > shm->size) {
+                client_shm_break(shm);
+                return 0;
+        }
+        return len;
+}
+
+/* Bytes the application has not yet read from the RX ring */
+static uint32_t client_shm_rx_used(struct client_shm *shm)
+{
+        uint32_t len;
+
+        if (shm->broken)
+                return shm->size;
+
+        len = shm->rx_tail - 
+                __atomic_load_n(&shm->rx->head, __ATOMIC_ACQUIRE);
+
+        if (len > shm->size) {
+                client_shm_break(shm);
+                return shm->size;
+        }
+        return len;
+}
+
+static void client_shm_consume(struct client_shm *shm, uint32_t len)
+{
+        shm->tx_head += len;
+        __atomic_store_n(&shm->tx->head, shm->tx_head, __ATOMIC_RELEASE);
+}
+
+/* Send everything in the TX ring. After an error, the data is
+   dropped, as the application sees the error on its next send.
+   Returns -1 if the socket was full or sending was interrupted with
+   data left. */
+static int client_shm_tx(struct client_shm *shm, struct socket *sock,
+                         int flags)
+{
+        uint32_t len;
+        int moved = 0, ret = 0;
+
+        while ((len = client_shm_tx_readable(shm)) > 0) {
+                struct iovec iov[2];
+                struct msghdr mh;
+
+                if (shm->chan->error) {
+                        client_shm_consume(shm, len);
+                        moved = 1;
+                        break;
+                }
+
+                memset(&mh, 0, sizeof(mh));
+                mh.msg_iov = iov;
+                mh.msg_iovlen = shm_ring_iov(shm->tx, shm->size,
+                                             shm->tx_head, len, iov);
+                mh.msg_flags = flags;
+
+                ret = sock->ops->sendmsg(NULL, sock, &mh, len);
+
+                if (ret == -EINTR || ret == -EAGAIN) {
+                        ret = -1;
+                        break;
+                } else if (ret < 0) {
+                        LOG_DBG("sendmsg: %s\n", KERN_STRERROR(ret));
+                        client_shm_error(shm, KERN_ERR(ret));
+                        ret = 0;
+                        continue;
+                }
+                client_shm_consume(shm, ret);
+                moved = 1;
+                ret = 0;
+        }
+
+        if (moved)
+                client_shm_notify(shm);
+
+        return ret;
+}
+
+/* Move readable socket data into the RX ring. Returns 1 if the ring
+   is full, so that there may be more data to move once the
+   application has read some. */
+static int client_shm_rx(struct client_shm *shm, struct socket *sock)
+{
+        int moved = 0, full = 0;
+
+        while (!(shm->chan->flags & SHM_F_RX_EOF) && !shm->chan->error) {
+                uint32_t len = shm->size - client_shm_rx_used(shm);
+                struct iovec iov[2];
+                struct msghdr mh;
+                int ret;
+
+                if (len == 0) {
+                        full = !shm->broken;
+                        break;
+                }
+
+                memset(&mh, 0, sizeof(mh));
+                mh.msg_iov = iov;
+                mh.msg_iovlen = shm_ring_iov(shm->rx, shm->size, 
+                                             shm->rx_tail, len, iov);
+
+                ret = sock->ops->recvmsg(NULL, sock, &mh, len, MSG_DONTWAIT);
+
+                if (ret == -EAGAIN || ret == -EWOULDBLOCK) {
+                        break;
+                } else if (ret < 0) {
+                        LOG_DBG("recvmsg: %s\n", KERN_STRERROR(ret));
+                        client_shm_error(shm, KERN_ERR(ret));
+                } else if (ret == 0) {
+                        __atomic_or_fetch(&shm->chan->flags, SHM_F_RX_EOF,
+                                          __ATOMIC_RELEASE);
+                } else {
+                        shm->rx_tail += ret;
+                        __atomic_store_n(&shm->rx->tail, shm->rx_tail,
+                                         __ATOMIC_RELEASE);
+                }
+                moved = 1;
+        }
+
+        if (moved)
+                client_shm_notify(shm);
+
+        return full;
+}
+
+/*
+  Serve the channel after a kick from the application, or when the
+  socket is readable, has room to send, or changes state. Sending
+  never blocks, so that the RX ring is served while the socket is
+  full. Returns 1 if the RX ring is full, in which case the
+  application kicks the stack once it has made room.
+ */
+int client_shm_process(struct client_shm *shm, struct socket *sock)
+{
+        struct shm_chan *chan = shm->chan;
+        uint64_t val;
+        int stalled, full;
+
+        /* Reset the doorbell, as the rings are checked anyway */
+        if (read(shm->kick_fd, &val, sizeof(val)) == -1 && errno != EAGAIN)
+                LOG_ERR("doorbell read: %s\n", strerror(errno));
+
+        if (!chan)
+                return 0;
+
+        while (1) {
+                stalled = client_shm_tx(shm, sock, MSG_DONTWAIT);
+                full = client_shm_rx(shm, sock);
+
+                if (shm->broken) {
+                        client_shm_teardown(shm);
+                        return 0;
+                }
+
+                /* Tell the application to kick us, and check again
+                   in case it made progress before seeing the
+                   flags */
+                shm_chan_wait(&chan->tx_wait);
+
+                if (full)
+                        shm_chan_wait(&chan->rx_wait);
+
+                /* Sends that found the socket full resume when it
+                   has room again */
+                if (!stalled && client_shm_tx_readable(shm) > 0)
+                        continue;
+
+                /* A channel that broke while checking is torn down
+                   on the next round */
+                if (full && client_shm_rx_used(shm) < shm->size)
+                        continue;
+
+                if (shm->broken)
+                        continue;
+
+                return full;
+        }
+}
+
+/* Send what is left in the TX ring, e.g., before the socket
+   closes, waiting for room if need be */
+void client_shm_flush(struct client_shm *shm, struct socket *sock)
+{
+        if (!shm->chan)
+                return;
+
+        client_shm_tx(shm, sock, 0);
+
+        if (shm->broken)
+                client_shm_teardown(shm);
+}
+
+/*
+  Whether to tell the application that the socket is readable, which
+  it learns from HAVE_DATA messages also with a channel, e.g., for
+  select(). It is told once, until it clears the data after draining
+  the RX ring.
+ */
+int client_shm_have_data(struct client_shm *shm)
+{
+        if (!shm->chan || shm->have_data)
+                return 0;
+
+        if (client_shm_rx_used(shm) == 0 && !shm->chan->error &&
+            !(shm->chan->flags & SHM_F_RX_EOF))
+                return 0;
+
+        if (shm->broken)
+                return 0;
+
+        shm->have_data = 1;
+        __atomic_or_fetch(&shm->chan->flags, SHM_F_HAVE_DATA,
+                          __ATOMIC_RELEASE);
+        return 1;
+}
+
+void client_shm_clear_data(struct client_shm *shm)
+{
+        shm->have_data = 0;
+
+        if (shm->chan)
+                __atomic_and_fetch(&shm->chan->flags, ~SHM_F_HAVE_DATA,
+                                   __ATOMIC_RELEASE);
+}
+
+#else /* OS_LINUX */
+
+struct client_shm *client_shm_create(uint32_t ring_size, int *memfd)
+{
+        errno = EOPNOTSUPP;
+        return NULL;
+}
+
+void client_shm_destroy(struct client_shm *shm)
+{
+}
+
+uint32_t client_shm_ring_size(struct client_shm *shm)
+{
+        return 0;
+}
+
+int client_shm_kick_fd(struct client_shm *shm)
+{
+        return -1;
+}
+
+int client_shm_notify_fd(struct client_shm *shm)
+{
+        return -1;
+}
+
+int client_shm_process(struct client_shm *shm, struct socket *sock)
+{
+        return 0;
+}
+
+void client_shm_flush(struct client_shm *shm, struct socket *sock)
+{
+}
+
+int client_shm_have_data(struct client_shm *shm)
+{
+        return 0;
+}
+
+void client_shm_clear_data(struct client_shm *shm)
+{
+}
+
+#endif /* OS_LINUX */
@@ -0,0 +1,21 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*- */
+#ifndef _CLIENT_SHM_H_
+#define _CLIENT_SHM_H_
+
+#include <stdint.h>
+
+struct client_shm;
+struct socket;
+
+/* Shared memory data path of a client, see <serval/shm_ring.h> */
+struct client_shm *client_shm_create(uint32_t ring_size, int *memfd);
+void client_shm_destroy(struct client_shm *shm);
+uint32_t client_shm_ring_size(struct client_shm *shm);
+int client_shm_kick_fd(struct client_shm *shm);
+int client_shm_notify_fd(struct client_shm *shm);
+int client_shm_process(struct client_shm *shm, struct socket *sock);
+void client_shm_flush(struct client_shm *shm, struct socket *sock);
+int client_shm_have_data(struct client_shm *shm);
+void client_shm_clear_data(struct client_shm *shm);
+
+#endif /* _CLIENT_SHM_H_ */
@@ -1,10 +1,13 @@
 /* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*- */
+#define _GNU_SOURCE /* For ppoll */
 #include <serval/netdevice.h>
 #include <serval/debug.h>
 #include <serval/list.h>
 #include <serval/hash.h>
 #include <serval/net.h>
 #include <serval/skbuff.h>
+#include <serval/random.h>
+#include <serval/timer.h>
 #include <netinet/serval.h>
 #include <net/if.h>
 #include <sys/ioctl.h>
@@ -14,7 +17,11 @@
 #include <string.h>
 #include <pthread.h>
 #include <poll.h>
+#include <sched.h>
 #include <string.h>
+#if defined(OS_LINUX)
+#include <sys/eventfd.h>
+#endif
 #if defined(OS_BSD)
 #include <net/if_dl.h>
 #endif
@@ -36,6 +43,16 @@ struct list_head dev_base_head;
 struct hlist_head *dev_name_head = NULL;
 struct hlist_head *dev_index_head = NULL;
 static void *dev_thread(void *arg);
+void __free_netdev(struct net_device *dev);
+static struct dev_fq *dev_fq_alloc(void);
+static void dev_fq_free(struct dev_fq *fq);
+static void dev_fq_purge(struct net_device *dev);
+static void dev_gro_flush(struct net_device *dev);
+
+extern int serval_ipv4_rcv(struct sk_buff *skb);
+extern unsigned int gso;
+
+int dev_gro_enabled = 0;
 
 /* A (white) list of interfaces to use. If empty, use all detected */
 static struct list_head dev_list = { &dev_list , &dev_list };
@@ -104,6 +121,320 @@ const char *dev_list_find(const char *name)
         return NULL;
 }
 
+/* Receive batching settings, either defaults or for a named
+   device */
+static struct list_head dev_rx_conf_list = { &dev_rx_conf_list, 
+                                             &dev_rx_conf_list };
+static unsigned int dev_rx_batch_default = DEV_RX_BATCH_DEFAULT;
+static unsigned int dev_rx_ring_default = DEV_RX_RING_DEFAULT;
+
+struct dev_rx_conf {
+        struct list_head lh;
+        char name[IFNAMSIZ];
+        unsigned int batch;
+        unsigned int ring;
+};
+
+static struct dev_rx_conf *dev_rx_conf_find(const char *name)
+{
+        struct dev_rx_conf *rc;
+
+        list_for_each_entry(rc, &dev_rx_conf_list, lh) {
+                if (strcmp(name, rc->name) == 0)
+                        return rc;
+        }
+        return NULL;
+}
+
+/*
+  Set the receive batch size, or ring depth if 'ring' is non-zero,
+  from a string on the form [IFACE=]N. Without an interface name,
+  the value applies to all devices that have no setting of their
+  own.
+*/
+int dev_rx_conf_set(const char *arg, int ring)
+{
+        const char *val = strchr(arg, '=');
+        struct dev_rx_conf *rc;
+        char name[IFNAMSIZ];
+        unsigned long n;
+        char *p = NULL;
+
+        n = strtoul(val ? val + 1 : arg, &p, 10);
+
+        if (p == (val ? val + 1 : arg) || *p != '\0' ||
+            n == 0 || n > DEV_RX_BATCH_MAX)
+                return -1;
+        
+        if (!val) {
+                if (ring)
+                        dev_rx_ring_default = n;
+                else
+                        dev_rx_batch_default = n;
+                return 0;
+        }
+
+        if (val == arg || val - arg >= IFNAMSIZ)
+                return -1;
+
+        memset(name, 0, sizeof(name));
+        strncpy(name, arg, val - arg);
+
+        rc = dev_rx_conf_find(name);
+
+        if (!rc) {
+                rc = malloc(sizeof(*rc));
+                
+                if (!rc)
+                        return -1;
+                
+                memset(rc, 0, sizeof(*rc));
+                INIT_LIST_HEAD(&rc->lh);
+                strcpy(rc->name, name);
+                list_add_tail(&rc->lh, &dev_rx_conf_list);
+        }
+
+        if (ring)
+                rc->ring = n;
+        else
+                rc->batch = n;
+
+        return 0;
+}
+
+void dev_rx_conf_destroy(void)
+{
+        while (!list_empty(&dev_rx_conf_list)) {
+                struct dev_rx_conf *rc;
+
+                rc = list_first_entry(&dev_rx_conf_list, 
+                                      struct dev_rx_conf, lh);
+                list_del(&rc->lh);
+                free(rc);
+        }
+}
+
+static void dev_rx_conf_apply(struct net_device *dev)
+{
+        struct dev_rx_conf *rc = dev_rx_conf_find(dev->name);
+
+        dev->rx_batch = (rc && rc->batch) ? rc->batch : dev_rx_batch_default;
+        dev->rx_ring = (rc && rc->ring) ? rc->ring : dev_rx_ring_default;
+
+        /* The ring must hold at least one full batch */
+        if (dev->rx_ring < dev->rx_batch)
+                dev->rx_ring = dev->rx_batch;
+}
+
+/*
+  Link emulation settings, either defaults or for a named device, in
+  the style of the netem queueing discipline. Sent packets are held
+  back for a fixed delay, or dropped at random, before they reach
+  the device.
+*/
+static struct list_head dev_netem_conf_list = { &dev_netem_conf_list,
+                                                &dev_netem_conf_list };
+static unsigned int dev_netem_delay_default = 0;
+static unsigned int dev_netem_loss_default = 0;
+
+struct dev_netem_conf {
+        struct list_head lh;
+        char name[IFNAMSIZ];
+        unsigned int delay;
+        unsigned int loss;
+};
+
+static struct dev_netem_conf *dev_netem_conf_find(const char *name)
+{
+        struct dev_netem_conf *nc;
+
+        list_for_each_entry(nc, &dev_netem_conf_list, lh) {
+                if (strcmp(name, nc->name) == 0)
+                        return nc;
+        }
+        return NULL;
+}
+
+/*
+  Set the emulated delay and loss from a string on the form
+  [IFACE=]DELAY_MS[,LOSS_PCT], where the loss is a percentage with
+  up to two decimals. Without an interface name, the setting
+  applies to all devices that have no setting of their own.
+*/
+int dev_netem_conf_set(const char *arg)
+{
+        const char *val = strchr(arg, '=');
+        struct dev_netem_conf *nc;
+        char name[IFNAMSIZ];
+        unsigned long delay;
+        double loss = 0;
+        char *p = NULL;
+
+        delay = strtoul(val ? val + 1 : arg, &p, 10);
+
+        if (p == (val ? val + 1 : arg) || delay > DEV_NETEM_DELAY_MAX)
+                return -1;
+
+        if (*p == ',') {
+                const char *l = p + 1;
+
+                loss = strtod(l, &p);
+
+                if (p == l || loss < 0 || loss > 100)
+                        return -1;
+        }
+
+        if (*p != '\0')
+                return -1;
+
+        if (!val) {
+                dev_netem_delay_default = delay;
+                dev_netem_loss_default = loss * DEV_NETEM_LOSS_SCALE / 100;
+                return 0;
+        }
+
+        if (val == arg || val - arg >= IFNAMSIZ)
+                return -1;
+
+        memset(name, 0, sizeof(name));
+        strncpy(name, arg, val - arg);
+
+        nc = dev_netem_conf_find(name);
+
+        if (!nc) {
+                nc = malloc(sizeof(*nc));
+
+                if (!nc)
+                        return -1;
+
+                memset(nc, 0, sizeof(*nc));
+                INIT_LIST_HEAD(&nc->lh);
+                strcpy(nc->name, name);
+                list_add_tail(&nc->lh, &dev_netem_conf_list);
+        }
+
+        nc->delay = delay;
+        nc->loss = loss * DEV_NETEM_LOSS_SCALE / 100;
+
+        return 0;
+}
+
+void dev_netem_conf_destroy(void)
+{
+        while (!list_empty(&dev_netem_conf_list)) {
+                struct dev_netem_conf *nc;
+
+                nc = list_first_entry(&dev_netem_conf_list,
+                                      struct dev_netem_conf, lh);
+                list_del(&nc->lh);
+                free(nc);
+        }
+}
+
+static void dev_netem_conf_apply(struct net_device *dev)
+{
+        struct dev_netem_conf *nc = dev_netem_conf_find(dev->name);
+
+        if (nc) {
+                dev->netem_delay = nc->delay;
+                dev->netem_loss = nc->loss;
+        } else {
+                dev->netem_delay = dev_netem_delay_default;
+                dev->netem_loss = dev_netem_loss_default;
+        }
+}
+
+/*
+  Transmit ring. Any thread may queue packets, while only the device
+  thread dequeues them (multi-producer, single-consumer). Each slot
+  carries a sequence number that tells whether it is free for
+  producers or filled for the consumer (Vyukov's bounded queue), so
+  that producers only contend on the tail index.
+*/
+struct dev_tx_slot {
+        unsigned long seq;
+        struct sk_buff *skb;
+};
+
+struct dev_tx_ring {
+        unsigned long tail __attribute__((aligned(64)));
+        unsigned long head __attribute__((aligned(64)));
+        /* Set while a wakeup of the device thread is pending */
+        unsigned int doorbell __attribute__((aligned(64)));
+        unsigned long mask;
+        struct dev_tx_slot slot[0];
+};
+
+static struct dev_tx_ring *dev_tx_ring_alloc(unsigned long size)
+{
+        struct dev_tx_ring *ring;
+        unsigned long i;
+
+        ring = malloc(sizeof(*ring) + size * sizeof(struct dev_tx_slot));
+
+        if (!ring)
+                return NULL;
+
+        memset(ring, 0, sizeof(*ring));
+        ring->mask = size - 1;
+
+        for (i = 0; i < size; i++) {
+                ring->slot[i].seq = i;
+                ring->slot[i].skb = NULL;
+        }
+
+        return ring;
+}
+
+static int dev_tx_ring_enqueue(struct dev_tx_ring *ring, struct sk_buff *skb)
+{
+        unsigned long pos = ACCESS_ONCE(ring->tail);
+        struct dev_tx_slot *slot;
+
+        while (1) {
+                long diff;
+
+                slot = &ring->slot[pos & ring->mask];
+                diff = (long)ACCESS_ONCE(slot->seq) - (long)pos;
+
+                if (diff == 0) {
+                        if (__sync_bool_compare_and_swap(&ring->tail, 
+                                                         pos, pos + 1))
+                                break;
+                } else if (diff < 0) {
+                        /* Full */
+                        return -1;
+                } 
+                pos = ACCESS_ONCE(ring->tail);
+        }
+
+        slot->skb = skb;
+        smp_wmb();
+        ACCESS_ONCE(slot->seq) = pos + 1;
+
+        return 0;
+}
+
+static struct sk_buff *dev_tx_ring_dequeue(struct dev_tx_ring *ring)
+{
+        unsigned long pos = ring->head;
+        struct dev_tx_slot *slot = &ring->slot[pos & ring->mask];
+        struct sk_buff *skb;
+
+        if ((long)ACCESS_ONCE(slot->seq) - (long)(pos + 1) < 0)
+                return NULL;
+
+        smp_rmb();
+        skb = slot->skb;
+        slot->skb = NULL;
+        smp_mb();
+        /* Hand the slot back to producers for the next lap */
+        ACCESS_ONCE(slot->seq) = pos + ring->mask + 1;
+        ring->head = pos + 1;
+
+        return skb;
+}
+
 static inline struct hlist_head *dev_name_hash(struct net *net, 
                                                const char *name)
 {
@@ -205,15 +536,57 @@ struct net_device *alloc_netdev(int sizeof_priv, const char *name,
         if (pipe(dev->pipefd) == -1) {
                 LOG_ERR("pipe failure: %s\n", strerror(errno));
                 free(dev);
-                dev->pipefd[0] = -1;
-                dev->pipefd[1] = -1;
                 return NULL;
         }
+        
+        /* The doorbell that wakes the device thread when packets are
+           queued for transmission */
+#if defined(OS_LINUX)
+        dev->txfd[0] = dev->txfd[1] = eventfd(0, EFD_NONBLOCK);
+
+        if (dev->txfd[0] == -1) {
+#else
+        if (pipe(dev->txfd) == -1) {
+#endif
+                LOG_ERR("doorbell failure: %s\n", strerror(errno));
+                close(dev->pipefd[0]);
+                close(dev->pipefd[1]);
+                free(dev);
+                return NULL;
+        }
+
+        dev->tx_queue_len = DEV_TX_RING_SIZE;
+        dev->tx_ring = dev_tx_ring_alloc(dev->tx_queue_len);
+
+        if (!dev->tx_ring) {
+                __free_netdev(dev);
+                return NULL;
+        }
+
 	strcpy(dev->name, name);
         dev->ifindex = if_nametoindex(name);
 	atomic_set(&dev->refcnt, 1);
 	dev->dev_addr = dev->perm_addr;
-        dev->tx_queue_len = 1000;
+        dev_rx_conf_apply(dev);
+        dev_netem_conf_apply(dev);
+        skb_queue_head_init(&dev->netem_q);
+        skb_queue_head_init(&dev->gro_list);
+        dev->gso_max_size = GSO_MAX_SIZE;
+
+        if (gso)
+                dev->features |= NETIF_F_GSO;
+
+        if (dev_gro_enabled)
+                dev->features |= NETIF_F_GRO;
+
+        if (dev_fq_enabled) {
+                dev->fq = dev_fq_alloc();
+
+                if (!dev->fq) {
+                        __free_netdev(dev);
+                        return NULL;
+                }
+        }
         
         netdev_init_one_queue(dev, &dev->tx_queue, NULL);
 
@@ -237,6 +610,9 @@ static int init_netdev(struct net_device *dev)
 
 void __free_netdev(struct net_device *dev)
 {
+        if (dev->pack_ops && dev->pack_ops->destroy)
+                dev->pack_ops->destroy(dev);
+
         if (dev->pipefd[0] != -1) {
                 close(dev->pipefd[0]);
                 dev->pipefd[0] = -1;
@@ -245,6 +621,31 @@ void __free_netdev(struct net_device *dev)
                 close(dev->pipefd[1]);
                 dev->pipefd[1] = -1;
         }
+        if (dev->txfd[0] != -1) {
+                close(dev->txfd[0]);
+                if (dev->txfd[1] != dev->txfd[0])
+                        close(dev->txfd[1]);
+                dev->txfd[0] = dev->txfd[1] = -1;
+        }
+        if (dev->tx_ring) {
+                struct sk_buff *skb;
+
+                while ((skb = dev_tx_ring_dequeue(dev->tx_ring)))
+                        kfree_skb(skb);
+
+                free(dev->tx_ring);
+                dev->tx_ring = NULL;
+        }
+
+        skb_queue_purge(&dev->tx_queue.q);
+
+        if (dev->fq) {
+                dev_fq_free(dev->fq);
+                dev->fq = NULL;
+        }
+
+        __skb_queue_purge(&dev->netem_q);
+        __skb_queue_purge(&dev->gro_list);
 	free(dev);
 }
 
@@ -717,41 +1118,709 @@ enum signal_event dev_read_signal(struct net_device *dev)
         return (enum signal_event)s;
 }
 
+/* Ring the doorbell of the device thread, unless a ring is already
+   pending, so that a burst of packets causes only one wakeup */
+static void dev_tx_doorbell(struct net_device *dev)
+{
+        uint64_t val = 1;
+
+        if (__sync_lock_test_and_set(&dev->tx_ring->doorbell, 1))
+                return;
+
+        if (write(dev->txfd[1], &val, 
+                  dev->txfd[0] == dev->txfd[1] ? sizeof(val) : 1) == -1 &&
+            errno != EAGAIN) {
+                LOG_ERR("doorbell write: %s\n", strerror(errno));
+        }
+}
+
+static void dev_tx_doorbell_ack(struct net_device *dev)
+{
+        uint64_t val;
+
+        if (read(dev->txfd[0], &val, sizeof(val)) == -1 &&
+            errno != EAGAIN) {
+                LOG_ERR("doorbell read: %s\n", strerror(errno));
+        }
+        /* Producers that see the doorbell cleared will ring it
+           again. Anything they queued before that is picked up by
+           the flush that follows. */
+        __sync_lock_release(&dev->tx_ring->doorbell);
+        smp_mb();
+}
+
+/*
+  When the transmit ring is full, the queue is stopped and packets
+  wait on the backlog of the device queue instead, up to another
+  tx_queue_len of them, and the senders are told to back off with
+  NET_XMIT_CN. Returns the result for the sender.
+*/
+static int dev_tx_backlog(struct net_device *dev, struct sk_buff *skb)
+{
+        struct sk_buff_head *q = &dev->tx_queue.q;
+        int ret = NET_XMIT_CN;
+
+        spin_lock(&q->lock);
+
+        netif_tx_stop_queue(&dev->tx_queue);
+
+        if (skb_queue_len(q) >= dev->tx_queue_len) {
+                LOG_DBG("%s transmit backlog full, dropping packet\n", 
+                        dev->name);
+                kfree_skb(skb);
+                ret = NET_XMIT_DROP;
+        } else {
+                __skb_queue_tail(q, skb);
+        }
+        spin_unlock(&q->lock);
+
+        /* The device thread refills the ring from the backlog once it
+           has drained it */
+        dev_tx_doorbell(dev);
+
+        return ret;
+}
+
+/* Move backlogged packets into the transmit ring, and restart the
+   queue once the backlog is empty. Called on the device thread as it
+   drains the ring. Returns the number of packets moved. */
+static unsigned int dev_tx_backlog_refill(struct net_device *dev)
+{
+        struct sk_buff_head *q = &dev->tx_queue.q;
+        unsigned int n = 0;
+
+        if (!netif_tx_queue_stopped(&dev->tx_queue))
+                return 0;
+
+        spin_lock(&q->lock);
+
+        while (!skb_queue_empty(q)) {
+                if (dev_tx_ring_enqueue(dev->tx_ring, skb_peek(q)) == -1)
+                        break;
+                __skb_dequeue(q);
+                n++;
+        }
+
+        if (skb_queue_empty(q))
+                netif_tx_start_queue(&dev->tx_queue);
+
+        spin_unlock(&q->lock);
+
+        return n;
+}
+
 static inline void dev_queue_purge(struct net_device *dev)
 {
 	struct sk_buff *skb;
 
-	while ((skb = skb_dequeue(&dev->tx_queue.q)) != NULL) {
+	while ((skb = dev_tx_ring_dequeue(dev->tx_ring)) != NULL) {
 		LOG_DBG("Freeing skb %p\n", skb);
 		kfree_skb(skb);
 	}
+
+        skb_queue_purge(&dev->tx_queue.q);
+        netif_tx_start_queue(&dev->tx_queue);
+
+        if (dev->fq)
+                dev_fq_purge(dev);
+
+        __skb_queue_purge(&dev->netem_q);
+        __skb_queue_purge(&dev->gro_list);
+}
+
+/* Microsecond clock for link emulation and pacing */
+static unsigned long dev_now_us(void)
+{
+        struct timespec now;
+
+        gettime(&now);
+
+        return now.tv_sec * 1000000UL + now.tv_nsec / 1000;
+}
+
+/* Time at which a delayed packet is due, kept in the control
+   buffer, which nobody else uses once the packet is queued on the
+   device */
+struct dev_netem_skb_cb {
+        unsigned long due;
+};
+
+#define DEV_NETEM_SKB_CB(skb) ((struct dev_netem_skb_cb *)&((skb)->cb[0]))
+
+static inline int dev_netem_enabled(const struct net_device *dev)
+{
+        return dev->netem_delay || dev->netem_loss;
+}
+
+/* Drop the packet at random, or queue it until it is due. Since the
+   delay is fixed, the queue stays sorted by due time. */
+static void dev_netem_enqueue(struct net_device *dev, struct sk_buff *skb,
+                              unsigned long now)
+{
+        if (dev->netem_loss &&
+            serval_random_u32() % DEV_NETEM_LOSS_SCALE < dev->netem_loss) {
+                kfree_skb(skb);
+                return;
+        }
+
+        DEV_NETEM_SKB_CB(skb)->due = now + dev->netem_delay * 1000UL;
+        __skb_queue_tail(&dev->netem_q, skb);
+}
+
+/* Time at which the next delayed packet is due, or zero if there is
+   none */
+static unsigned long dev_netem_next(struct net_device *dev)
+{
+        struct sk_buff *skb = skb_peek(&dev->netem_q);
+
+        return skb ? DEV_NETEM_SKB_CB(skb)->due : 0;
 }
 
+/*
+  Fair queue scheduler, after the Linux fq queueing discipline.
+  Packets are queued per socket, and flows take turns sending a
+  quantum of bytes (deficit round robin). Flows that just became
+  active go first, so that short flows are not stuck behind bulk
+  ones. Packets of a socket with a pacing rate are spaced out so that
+  the socket does not exceed it: once a packet is sent, its flow is
+  put in a timer wheel until the next one is allowed to go, and the
+  device thread sleeps until the earliest slot in the wheel is due.
+  Packets without a socket, such as SAL control packets, bypass the
+  round robin and are never paced.
+*/
+int dev_fq_enabled = 0;
+
+struct dev_fq_flow {
+        struct hlist_node node; /* In the flow hash table */
+        struct list_head lh; /* In new, old or throttled flows */
+        const struct sock *sk;
+        struct sk_buff_head q;
+        int credit;
+        unsigned long time_next; /* Earliest time to send (us) */
+        unsigned long age; /* When the flow became idle (jiffies) */
+};
+
+struct dev_fq {
+        struct hlist_head hash[DEV_FQ_HASH_SIZE];
+        struct list_head new_flows;
+        struct list_head old_flows;
+        struct list_head wheel[DEV_FQ_WHEEL_SLOTS];
+        unsigned long wheel_tick; /* Last tick processed */
+        unsigned int throttled; /* Flows in the wheel */
+        unsigned int qlen;
+        unsigned int nflows;
+        struct sk_buff_head internal; /* Packets without socket */
+};
+
+static struct dev_fq *dev_fq_alloc(void)
+{
+        struct dev_fq *fq;
+        unsigned int i;
+
+        fq = malloc(sizeof(*fq));
+
+        if (!fq)
+                return NULL;
+
+        memset(fq, 0, sizeof(*fq));
+
+        for (i = 0; i < DEV_FQ_HASH_SIZE; i++)
+                INIT_HLIST_HEAD(&fq->hash[i]);
+
+        for (i = 0; i < DEV_FQ_WHEEL_SLOTS; i++)
+                INIT_LIST_HEAD(&fq->wheel[i]);
+
+        INIT_LIST_HEAD(&fq->new_flows);
+        INIT_LIST_HEAD(&fq->old_flows);
+        skb_queue_head_init(&fq->internal);
+        fq->wheel_tick = dev_now_us() / DEV_FQ_WHEEL_GRAN_US;
+
+        return fq;
+}
+
+static void dev_fq_free(struct dev_fq *fq)
+{
+        unsigned int i;
+
+        for (i = 0; i < DEV_FQ_HASH_SIZE; i++) {
+                while (!hlist_empty(&fq->hash[i])) {
+                        struct dev_fq_flow *f;
+
+                        f = hlist_entry(fq->hash[i].first, 
+                                        struct dev_fq_flow, node);
+                        hlist_del(&f->node);
+                        __skb_queue_purge(&f->q);
+                        free(f);
+                }
+        }
+        __skb_queue_purge(&fq->internal);
+        free(fq);
+}
+
+static inline int dev_fq_flow_detached(const struct dev_fq_flow *f)
+{
+        return list_empty(&f->lh);
+}
+
+static inline struct hlist_head *dev_fq_bucket(struct dev_fq *fq,
+                                               const struct sock *sk)
+{
+        return &fq->hash[hash_ptr((void *)sk, DEV_FQ_HASH_BITS)];
+}
+
+/* Find the flow of a socket, or make one. Idle flows found on the
+   way are freed, since their socket may be long gone. */
+static struct dev_fq_flow *dev_fq_classify(struct dev_fq *fq, 
+                                           const struct sock *sk)
+{
+        struct hlist_head *head = dev_fq_bucket(fq, sk);
+        struct hlist_node *pos, *tmp;
+        struct dev_fq_flow *f, *found = NULL;
+
+        hlist_for_each_safe(pos, tmp, head) {
+                f = hlist_entry(pos, struct dev_fq_flow, node);
+
+                if (f->sk == sk) {
+                        found = f;
+                } else if (dev_fq_flow_detached(f) && 
+                           time_after(jiffies, f->age + DEV_FQ_GC_AGE)) {
+                        hlist_del(&f->node);
+                        free(f);
+                        fq->nflows--;
+                }
+        }
+
+        if (found)
+                return found;
+
+        f = malloc(sizeof(*f));
+
+        if (!f)
+                return NULL;
+
+        memset(f, 0, sizeof(*f));
+        f->sk = sk;
+        f->credit = DEV_FQ_QUANTUM;
+        f->age = jiffies;
+        INIT_LIST_HEAD(&f->lh);
+        skb_queue_head_init(&f->q);
+        hlist_add_head(&f->node, head);
+        fq->nflows++;
+
+        return f;
+}
+
+static void dev_fq_enqueue(struct net_device *dev, struct sk_buff *skb)
+{
+        struct dev_fq *fq = dev->fq;
+        struct dev_fq_flow *f;
+
+        if (fq->qlen >= DEV_FQ_LIMIT) {
+                kfree_skb(skb);
+                return;
+        }
+
+        if (!skb->sk) {
+                __skb_queue_tail(&fq->internal, skb);
+                fq->qlen++;
+                return;
+        }
+
+        f = dev_fq_classify(fq, skb->sk);
+
+        if (!f || skb_queue_len(&f->q) >= DEV_FQ_FLOW_LIMIT) {
+                kfree_skb(skb);
+                return;
+        }
+
+        if (skb_queue_empty(&f->q) && dev_fq_flow_detached(f)) {
+                /* Give a flow that was idle for a while a fresh
+                   quantum */
+                if (time_after(jiffies, f->age + DEV_FQ_REFILL_DELAY))
+                        f->credit = max_t(int, f->credit, DEV_FQ_QUANTUM);
+                list_add_tail(&f->lh, &fq->new_flows);
+        }
+
+        __skb_queue_tail(&f->q, skb);
+        fq->qlen++;
+}
+
+static void dev_fq_throttle(struct dev_fq *fq, struct dev_fq_flow *f)
+{
+        unsigned long tick = f->time_next / DEV_FQ_WHEEL_GRAN_US;
+
+        list_move_tail(&f->lh, 
+                       &fq->wheel[tick & (DEV_FQ_WHEEL_SLOTS - 1)]);
+        fq->throttled++;
+}
+
+/* Move the flows that may send again from the wheel slots that have
+   passed back to the round robin */
+static void dev_fq_check_throttled(struct dev_fq *fq, unsigned long now)
+{
+        unsigned long tick = now / DEV_FQ_WHEEL_GRAN_US;
+        unsigned long t = fq->wheel_tick;
+
+        if (!fq->throttled) {
+                fq->wheel_tick = tick;
+                return;
+        }
+
+        /* After a full turn, every slot has been looked at */
+        if (tick - t > DEV_FQ_WHEEL_SLOTS)
+                t = tick - DEV_FQ_WHEEL_SLOTS;
+
+        for (; t != tick + 1; t++) {
+                struct list_head *slot = 
+                        &fq->wheel[t & (DEV_FQ_WHEEL_SLOTS - 1)];
+                struct dev_fq_flow *f, *tmp;
+
+                list_for_each_entry_safe(f, tmp, slot, lh) {
+                        if (time_after(f->time_next, now))
+                                continue;
+                        list_move_tail(&f->lh, &fq->old_flows);
+                        fq->throttled--;
+                }
+        }
+
+        /* The current slot may still hold flows due later in it */
+        fq->wheel_tick = tick - 1;
+}
+
+/* Time at which the next throttled flow may send, or zero if there
+   is none. This is the start of the first non-empty slot, which may
+   be early if the flows in it are due a turn of the wheel later. */
+static unsigned long dev_fq_next(struct dev_fq *fq)
+{
+        unsigned long t;
+
+        if (!fq->throttled)
+                return 0;
+
+        for (t = fq->wheel_tick + 1; 
+             t != fq->wheel_tick + 1 + DEV_FQ_WHEEL_SLOTS; t++) {
+                struct list_head *slot = 
+                        &fq->wheel[t & (DEV_FQ_WHEEL_SLOTS - 1)];
+                struct dev_fq_flow *f;
+
+                list_for_each_entry(f, slot, lh) {
+                        if (f->time_next / DEV_FQ_WHEEL_GRAN_US == t)
+                                return f->time_next;
+                }
+                if (!list_empty(slot))
+                        return t * DEV_FQ_WHEEL_GRAN_US;
+        }
+        return (fq->wheel_tick + 1 + DEV_FQ_WHEEL_SLOTS) * 
+                DEV_FQ_WHEEL_GRAN_US;
+}
+
+static struct sk_buff *dev_fq_dequeue(struct net_device *dev, 
+                                      unsigned long now)
+{
+        struct dev_fq *fq = dev->fq;
+        struct sk_buff *skb;
+
+        if (!fq->qlen)
+                return NULL;
+
+        skb = __skb_dequeue(&fq->internal);
+
+        if (skb) {
+                fq->qlen--;
+                return skb;
+        }
+
+        dev_fq_check_throttled(fq, now);
+
+        while (1) {
+                struct list_head *head = &fq->new_flows;
+                struct dev_fq_flow *f;
+                u32 rate;
+
+                if (list_empty(head)) {
+                        head = &fq->old_flows;
+
+                        if (list_empty(head))
+                                return NULL;
+                }
+
+                f = list_first_entry(head, struct dev_fq_flow, lh);
+
+                if (f->credit <= 0) {
+                        f->credit += DEV_FQ_QUANTUM;
+                        list_move_tail(&f->lh, &fq->old_flows);
+                        continue;
+                }
+
+                skb = skb_peek(&f->q);
+
+                if (!skb) {
+                        /* Let a new flow that went empty take its
+                           turn among the old ones, so that it
+                           cannot starve them by going idle and
+                           coming back */
+                        if (head == &fq->new_flows && 
+                            !list_empty(&fq->old_flows)) {
+                                list_move_tail(&f->lh, &fq->old_flows);
+                        } else {
+                                list_del_init(&f->lh);
+                                f->age = jiffies;
+                        }
+                        continue;
+                }
+
+                if (time_after(f->time_next, now)) {
+                        dev_fq_throttle(fq, f);
+                        continue;
+                }
+
+                __skb_unlink(skb, &f->q);
+                fq->qlen--;
+                f->credit -= skb->len;
+
+                /* The socket holds a reference for as long as it
+                   has packets in flight, so it is safe to look at */
+                rate = skb->sk->sk_pacing_rate;
+
+                if (rate) {
+                        unsigned long len = 
+                                (unsigned long)skb->len * 1000000UL / rate;
+
+                        /* Make up for a late wakeup of the device
+                           thread with a short burst, but do not let
+                           an idle period turn into a long one */
+                        if (time_after(now, f->time_next + 
+                                       DEV_FQ_SLACK_US))
+                                f->time_next = now;
+
+                        f->time_next += min_t(unsigned long, len, 
+                                              DEV_FQ_MAX_DELAY_US);
+                }
+                return skb;
+        }
+}
+
+static void dev_fq_purge(struct net_device *dev)
+{
+        struct dev_fq *fq = dev->fq;
+        unsigned int i;
+
+        for (i = 0; i < DEV_FQ_HASH_SIZE; i++) {
+                struct hlist_node *pos;
+
+                hlist_for_each(pos, &fq->hash[i]) {
+                        struct dev_fq_flow *f = 
+                                hlist_entry(pos, struct dev_fq_flow, node);
+
+                        __skb_queue_purge(&f->q);
+
+                        if (!dev_fq_flow_detached(f))
+                                list_del_init(&f->lh);
+                }
+        }
+        __skb_queue_purge(&fq->internal);
+        fq->qlen = fq->throttled = 0;
+}
+
+static void dev_xmit_burst(struct net_device *dev, 
+                           struct sk_buff **burst, unsigned int len)
+{
+        unsigned int i;
+
+        if (dev->pack_ops->xmit_batch) {
+                dev->pack_ops->xmit_batch(dev, burst, len);
+                return;
+        }
+        
+        for (i = 0; i < len; i++) {
+                if (dev->pack_ops->xmit(burst[i]) < 0) {
+                        LOG_ERR("tx failed\n");
+                }
+        }
+}
+
+static int __dev_xmit_out(struct net_device *dev, struct sk_buff **burst,
+                          unsigned int len, unsigned long now)
+{
+        unsigned int i;
+
+        if (!dev_netem_enabled(dev)) {
+                dev_xmit_burst(dev, burst, len);
+                return len;
+        }
+
+        for (i = 0; i < len; i++)
+                dev_netem_enqueue(dev, burst[i], now);
+
+        return 0;
+}
+
+/* Hand packets that left the scheduler to the device, or the link
+   emulation. Super-segments are split here, so that everything after
+   the scheduler sees packets that fit the link. */
+static int dev_xmit_out(struct net_device *dev, struct sk_buff **burst,
+                        unsigned int len, unsigned long now)
+{
+        struct sk_buff *out[DEV_TX_BURST];
+        unsigned int i, n = 0;
+        int sent = 0;
+
+        for (i = 0; i < len; i++) {
+                struct sk_buff *skb = burst[i], *segs = skb;
+
+                if (skb_is_gso(skb)) {
+                        segs = serval_tcp4_gso_segment(skb);
+                        kfree_skb(skb);
+
+                        if (!segs) {
+                                LOG_ERR("%s segmentation failed\n", 
+                                        dev->name);
+                                continue;
+                        }
+                } else {
+                        skb->next = NULL;
+                }
+
+                while (segs) {
+                        out[n++] = segs;
+                        segs = segs->next;
+                        out[n - 1]->next = NULL;
+
+                        if (n == DEV_TX_BURST) {
+                                sent += __dev_xmit_out(dev, out, n, now);
+                                n = 0;
+                        }
+                }
+        }
+
+        if (n > 0)
+                sent += __dev_xmit_out(dev, out, n, now);
+
+        return sent;
+}
+
+/* Transmit everything in the transmit ring, in bursts of up to
+   DEV_TX_BURST packets, or, with fair queueing or link emulation,
+   everything that is due. Must be called on the device thread. */
 int dev_xmit(struct net_device *dev)
 {
+        struct sk_buff *burst[DEV_TX_BURST];
+        unsigned long now = 0;
         int n = 0;
         
+        if (dev->fq || dev_netem_enabled(dev))
+                now = dev_now_us();
+
         while (1) {
-                struct sk_buff *skb = skb_dequeue(&dev->tx_queue.q);
-        
-                if (!skb)
+                unsigned int len = 0;
+
+                while (len < DEV_TX_BURST) {
+                        struct sk_buff *skb = 
+                                dev_tx_ring_dequeue(dev->tx_ring);
+
+                        if (!skb && dev_tx_backlog_refill(dev) > 0)
+                                skb = dev_tx_ring_dequeue(dev->tx_ring);
+
+                        if (!skb)
+                                break;
+
+                        if (dev->fq)
+                                dev_fq_enqueue(dev, skb);
+                        else
+                                burst[len++] = skb;
+                }
+
+                if (len == 0)
                         break;
-                
-                if (skb->dev) {
-                        if (skb->dev->pack_ops->xmit(skb) < 0) {
-                                LOG_ERR("tx failed\n");
+
+                n += dev_xmit_out(dev, burst, len, now);
+        }
+
+        if (dev->fq) {
+                while (1) {
+                        unsigned int len = 0;
+                        
+                        while (len < DEV_TX_BURST) {
+                                struct sk_buff *skb = 
+                                        dev_fq_dequeue(dev, now);
+                                
+                                if (!skb)
+                                        break;
+                                
+                                burst[len++] = skb;
                         }
-                } else {
-                        LOG_ERR("No device set in skb\n");
-                        kfree_skb(skb);
+                        
+                        if (len == 0)
+                                break;
+                        
+                        n += dev_xmit_out(dev, burst, len, now);
                 }
         }
 
+        while (!skb_queue_empty(&dev->netem_q)) {
+                unsigned int len = 0;
+
+                while (len < DEV_TX_BURST) {
+                        struct sk_buff *skb = skb_peek(&dev->netem_q);
+
+                        if (!skb || 
+                            time_after(DEV_NETEM_SKB_CB(skb)->due, now))
+                                break;
+
+                        burst[len++] = __skb_dequeue(&dev->netem_q);
+                }
+
+                if (len == 0)
+                        break;
+
+                n += len;
+                dev_xmit_burst(dev, burst, len);
+        }
+
         /* LOG_DBG("sent %d packets\n", n); */
         
         return n;
 }
 
+/* Time until the link emulation or the scheduler next has packets to
+   send, or NULL if they have nothing */
+static struct timespec *dev_xmit_timeout(struct net_device *dev,
+                                         struct timespec *ts)
+{
+        unsigned long next = dev_netem_next(dev);
+        unsigned long now;
+
+        if (dev->fq) {
+                unsigned long fq_next = dev_fq_next(dev->fq);
+
+                if (fq_next && (!next || time_before(fq_next, next)))
+                        next = fq_next;
+        }
+
+        if (!next)
+                return NULL;
+
+        now = dev_now_us();
+
+        if (time_after(now, next))
+                next = now;
+
+        ts->tv_sec = (next - now) / 1000000UL;
+        ts->tv_nsec = ((next - now) % 1000000UL) * 1000;
+
+        return ts;
+}
+
+/* Whether the link emulation or the scheduler has packets that are
+   due now */
+static int dev_xmit_due(struct net_device *dev)
+{
+        struct timespec ts;
+
+        return dev_xmit_timeout(dev, &ts) && 
+                ts.tv_sec == 0 && ts.tv_nsec == 0;
+}
+
 void *dev_thread(void *arg)
 {
         struct net_device *dev = (struct net_device *)arg;
@@ -759,8 +1828,11 @@ void *dev_thread(void *arg)
         
         LOG_DBG("Device thread '%s' running\n", dev->name);
 
+        dev->thr = pthread_self();
+
         while (!dev->should_exit) {
-                struct pollfd fds[2];
+                struct pollfd fds[3];
+                struct timespec ts;
                 
                 fds[0].fd = dev->fd;
                 fds[0].events = POLLIN | POLLHUP | POLLERR;
@@ -768,8 +1840,11 @@ void *dev_thread(void *arg)
                 fds[1].fd = dev->pipefd[0];
                 fds[1].events = POLLIN | POLLERR | POLLHUP;
                 fds[1].revents = 0;
+                fds[2].fd = dev->txfd[0];
+                fds[2].events = POLLIN;
+                fds[2].revents = 0;
 
-                ret = poll(fds, 2, -1);
+                ret = ppoll(fds, 3, dev_xmit_timeout(dev, &ts), NULL);
 
                 if (ret == -1) {
                         if (errno == EINTR)
@@ -778,7 +1853,8 @@ void *dev_thread(void *arg)
                         LOG_ERR("poll error: %s\n", strerror(errno));
                         dev->should_exit = 1;
                 } else if (ret == 0) {
-                        /* No timeout set, should not happen */
+                        /* Delayed or paced packets are due */
+                        dev_xmit(dev);
                 } else {
                         if (fds[1].revents & POLLIN) {
                                 enum signal_event s = dev_read_signal(dev);
@@ -802,11 +1878,22 @@ void *dev_thread(void *arg)
                         }
                         if (fds[0].revents & POLLIN) {
                                 ret = dev->pack_ops->recv(dev);
+                                dev_gro_flush(dev);
                         } else if (fds[0].revents & POLLHUP) {
                                 LOG_DBG("socket POLLHUP\n");
                         } else if (fds[0].revents & POLLERR) {
                                 LOG_ERR("socket error\n");
                         }
+                        if (fds[2].revents & POLLIN) {
+                                dev_tx_doorbell_ack(dev);
+                                dev_xmit(dev);
+                        }
+
+                        /* Under steady receive load the poll never
+                           times out, so send what is due after
+                           every wakeup */
+                        if (dev_xmit_due(dev))
+                                dev_xmit(dev);
                 }
         }
 
@@ -815,6 +1902,59 @@ void *dev_thread(void *arg)
         return NULL;
 }
 
+/* Pass a packet held for merging up the stack */
+static void dev_gro_complete(struct sk_buff *skb)
+{
+        serval_tcp4_gro_complete(skb);
+        serval_ipv4_rcv(skb);
+}
+
+/* Pass all held packets up the stack, oldest first. Called after
+   each read of the device. */
+static void dev_gro_flush(struct net_device *dev)
+{
+        struct sk_buff *skb;
+
+        while ((skb = __skb_dequeue(&dev->gro_list)))
+                dev_gro_complete(skb);
+}
+
+/*
+  Merge a received packet into a held packet of the same flow, or
+  hold it so that the packets that follow can be merged into it. A
+  packet that cannot be merged flushes the held ones first, so that
+  packets of a flow stay in order.
+*/
+int dev_gro_receive(struct net_device *dev, struct sk_buff *skb)
+{
+        struct sk_buff *p;
+
+        if (serval_tcp4_gro_prepare(skb)) {
+                dev_gro_flush(dev);
+                return serval_ipv4_rcv(skb);
+        }
+
+        skb_queue_walk(&dev->gro_list, p) {
+                int ret = serval_tcp4_gro_receive(p, skb);
+
+                if (ret == 0) {
+                        kfree_skb(skb);
+                        return NET_RX_SUCCESS;
+                } else if (ret == 1) {
+                        __skb_unlink(p, &dev->gro_list);
+                        dev_gro_complete(p);
+                        break;
+                }
+        }
+
+        if (skb_queue_len(&dev->gro_list) >= DEV_GRO_MAX_HELD)
+                dev_gro_complete(__skb_dequeue(&dev->gro_list));
+
+        __skb_queue_tail(&dev->gro_list, skb);
+
+        return NET_RX_SUCCESS;
+}
+
 /*
  * Invalidate hardware checksum when packet is to be mangled, and
  * complete checksum manually on outgoing path.
@@ -850,16 +1990,19 @@ static int skb_checksum_help(struct sk_buff *skb)
         return ret;
 }
 
-#define DIRECT_TX 1
+/* Define to transmit synchronously on the calling thread instead
+   of through the transmit ring */
+/* #define DIRECT_TX 1 */
 
 int dev_queue_xmit(struct sk_buff *skb)
 {
         struct net_device *dev = skb->dev;
 
         /*
-          Calculate final checksum if partial 
+          Calculate final checksum if partial. Super-segments get
+          theirs when they are split.
         */
-        if (skb->ip_summed == CHECKSUM_PARTIAL) {
+        if (skb->ip_summed == CHECKSUM_PARTIAL && !skb_is_gso(skb)) {
                 skb_set_transport_header(skb,
                                          skb_checksum_start_offset(skb));
                 if (skb_checksum_help(skb))
@@ -877,22 +2020,28 @@ int dev_queue_xmit(struct sk_buff *skb)
                 return -1;
         }
         
-        if (dev->tx_queue_len == dev->tx_queue.q.qlen) {
-                LOG_ERR("Max tx_queue_len reached, dropping packet\n");
-                kfree_skb(skb);
-                return 0;
+        /* While the queue is stopped, packets go to the backlog so
+           that they stay in order */
+        if (netif_tx_queue_stopped(&dev->tx_queue) ||
+            dev_tx_ring_enqueue(dev->tx_ring, skb) == -1) {
+                if (pthread_equal(dev->thr, pthread_self())) {
+                        /* We are the device thread, so nobody else
+                           will drain the ring */
+                        dev_xmit(dev);
+
+                        if (!netif_tx_queue_stopped(&dev->tx_queue) &&
+                            dev_tx_ring_enqueue(dev->tx_ring, skb) == 0)
+                                return NET_XMIT_SUCCESS;
+                }
+                /* Keep the packet, but let the caller know, so that,
+                   e.g., TCP reduces its window instead of going into
+                   loss recovery */
+                return dev_tx_backlog(dev, skb);
         }
-        
-        skb_queue_tail(&dev->tx_queue.q, skb);
-
-        /* TX immediately if we are on device thread */
-        /* 
-           if (pthread_equal(dev->thr, pthread_self()))
-                dev_xmit(dev);
-                else */
-        dev_signal(dev, SIGNAL_TXQUEUE);
+
+        dev_tx_doorbell(dev);
 #endif
-        return 0;
+        return NET_XMIT_SUCCESS;
  out_kfree_skb:
         kfree_skb(skb);
         return -1;
@@ -965,6 +2114,8 @@ void netdev_fini(void)
         }
         
         dev_list_destroy();
+        dev_rx_conf_destroy();
+        dev_netem_conf_destroy();
 
         if (dev_name_head) {
                 free(dev_name_head);
@@ -7,11 +7,87 @@
 
 #define SKB_HEADROOM_RESERVE (20+14)
 
+/* Number of packets to read per wakeup of the device thread, and
+   the number of preallocated receive buffers. A batch of one
+   disables batching. */
+#define DEV_RX_BATCH_DEFAULT 32
+#define DEV_RX_RING_DEFAULT  64
+#define DEV_RX_BATCH_MAX     1024
+
+/* Size of the transmit ring (power of two), and the max number of
+   packets handed to the device at once */
+#define DEV_TX_RING_SIZE     1024
+#define DEV_TX_BURST         32
+
+int dev_rx_conf_set(const char *arg, int ring);
+void dev_rx_conf_destroy(void);
+
+/* Emulation of a slow or lossy link on transmit */
+#define DEV_NETEM_DELAY_MAX  10000
+#define DEV_NETEM_LOSS_SCALE 10000
+
+int dev_netem_conf_set(const char *arg);
+void dev_netem_conf_destroy(void);
+
+/* Fair queue scheduler: flow hash table, timer wheel of paced flows
+   (slots of DEV_FQ_WHEEL_GRAN_US), bytes sent per flow and turn, and
+   queue limits */
+#define DEV_FQ_HASH_BITS     8
+#define DEV_FQ_HASH_SIZE     (1 << DEV_FQ_HASH_BITS)
+#define DEV_FQ_WHEEL_SLOTS   1024
+#define DEV_FQ_WHEEL_GRAN_US 64
+#define DEV_FQ_QUANTUM       (2 * 1514)
+#define DEV_FQ_LIMIT         10000
+#define DEV_FQ_FLOW_LIMIT    1000
+/* Longest gap between two packets of a paced flow, within one turn
+   of the wheel */
+#define DEV_FQ_MAX_DELAY_US  50000
+/* How late a paced flow may be, after a late wakeup of the device
+   thread, and still make up for it */
+#define DEV_FQ_SLACK_US      2000
+/* Idle time after which a flow gets a fresh quantum, or is freed */
+#define DEV_FQ_REFILL_DELAY  (HZ / 25)
+#define DEV_FQ_GC_AGE        (3 * HZ)
+
+extern int dev_fq_enabled;
+
+/* Software segmentation of TCP super-segments before transmission,
+   and merging of received segments, see serval_tcp_offload.c. At
+   most DEV_GRO_MAX_HELD received packets are held for merging. */
+#define DEV_GRO_MAX_HELD     8
+
+extern int dev_gro_enabled;
+
+struct sk_buff *serval_tcp4_gso_segment(struct sk_buff *skb);
+int serval_tcp4_gro_prepare(struct sk_buff *skb);
+int serval_tcp4_gro_receive(struct sk_buff *p, struct sk_buff *skb);
+void serval_tcp4_gro_complete(struct sk_buff *skb);
+int dev_gro_receive(struct net_device *dev, struct sk_buff *skb);
+
+/* Memory-mapped AF_PACKET rings instead of raw IP sockets */
+#if defined(OS_LINUX) && !defined(OS_ANDROID)
+#define HAVE_PACKET_MMAP 1
+#endif
+
+extern int packet_mmap_enabled;
+
+/* Pass a received IP packet of 'len' bytes at skb->data up the
+   stack */
+int packet_deliver(struct net_device *dev, struct sk_buff *skb, int len);
+
 struct packet_ops {
 	int (*init)(struct net_device *);
 	void (*destroy)(struct net_device *);
 	int (*xmit)(struct sk_buff *);
+	/* Optional, transmits several packets at once */
+	int (*xmit_batch)(struct net_device *, struct sk_buff **, 
+                          unsigned int);
 	int (*recv)(struct net_device *);
 };
 
+#if defined(HAVE_PACKET_MMAP)
+extern struct packet_ops packet_mmap_ops;
+extern const size_t packet_mmap_priv_size;
+#endif
+
 #endif /* _PACKET_H_ */
@@ -0,0 +1,661 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * Receive/send Serval packets through memory-mapped AF_PACKET
+ * (TPACKET_V3) rings.
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License as
+ *	published by the Free Software Foundation; either version 2 of
+ *	the License, or (at your option) any later version.
+ */
+#define _GNU_SOURCE 1
+#include <serval/netdevice.h>
+#include <serval/skbuff.h>
+#include <serval/debug.h>
+#include <serval/timer.h>
+#include "packet.h"
+
+#if defined(HAVE_PACKET_MMAP)
+#include <netinet/serval.h>
+#include <netinet/ip.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <net/ethernet.h>
+#include <net/if_arp.h>
+/* The ring definitions are only in the kernel header, which clashes
+   with <netpacket/packet.h> */
+#define sockaddr_ll __kernel_sockaddr_ll
+#define packet_mreq __kernel_packet_mreq
+#include <linux/if_packet.h>
+#undef sockaddr_ll
+#undef packet_mreq
+#include <linux/filter.h>
+
+#if !defined(PACKET_IGNORE_OUTGOING)
+#define PACKET_IGNORE_OUTGOING 23
+#endif
+
+/*
+   Ring geometry. The receive ring consists of blocks that the kernel
+   fills with variable sized frames, and hands over to us when full
+   or when the block timeout expires. The transmit ring consists of
+   fixed size frames.
+*/
+#define PACKET_MMAP_BLOCK_SIZE (1 << 18)
+#define PACKET_MMAP_RX_BLOCKS  16
+#define PACKET_MMAP_TX_BLOCKS  4
+#define PACKET_MMAP_FRAME_SIZE 2048
+#define PACKET_MMAP_BLOCK_TOV  2 /* Block timeout in ms */
+
+/* Offset of the packet data in a transmit frame */
+#define PACKET_MMAP_TX_DATA (TPACKET_ALIGN(sizeof(struct tpacket3_hdr)))
+
+/* Cache of link layer addresses of on-link neighbors */
+#define NEIGH_CACHE_SIZE     64 /* Must be a power of two */
+#define NEIGH_TIMEOUT        secs_to_jiffies(60)
+#define NEIGH_FAILED_TIMEOUT secs_to_jiffies(1)
+
+struct neigh_entry {
+        uint32_t addr;
+        int valid;
+        unsigned long expires;
+        unsigned char mac[ETH_ALEN];
+};
+
+struct packet_mmap_priv {
+        unsigned char *map;
+        size_t map_len;
+        unsigned int rx_block; /* Next receive block to read */
+        unsigned char *tx; /* NULL if there is no transmit ring */
+        unsigned int tx_frame; /* Next transmit frame to fill */
+        unsigned int tx_frame_nr;
+        unsigned int tx_pending; /* Frames filled but not kicked */
+        int loopback;
+        /* Raw IP socket used for packets we cannot address at the
+           link layer. It also keeps the kernel from answering Serval
+           packets with ICMP protocol unreachable. */
+        int rawfd;
+        struct neigh_entry neigh[NEIGH_CACHE_SIZE];
+};
+
+const size_t packet_mmap_priv_size = sizeof(struct packet_mmap_priv);
+
+#define get_priv(dev) ((struct packet_mmap_priv *)dev_get_priv(dev))
+
+/* Accept unfragmented Serval packets only */
+static struct sock_filter packet_mmap_filter[] = {
+        BPF_STMT(BPF_LD + BPF_H + BPF_ABS, 12),
+        BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K, ETH_P_IP, 0, 5),
+        BPF_STMT(BPF_LD + BPF_B + BPF_ABS, ETH_HLEN + 9),
+        BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K, IPPROTO_SERVAL, 0, 3),
+        BPF_STMT(BPF_LD + BPF_H + BPF_ABS, ETH_HLEN + 6),
+        BPF_JUMP(BPF_JMP + BPF_JSET + BPF_K, 0x3fff, 1, 0),
+        BPF_STMT(BPF_RET + BPF_K, 0xffffffff),
+        BPF_STMT(BPF_RET + BPF_K, 0),
+};
+
+/* Reject everything on the raw socket */
+static struct sock_filter packet_mmap_raw_filter[] = {
+        BPF_STMT(BPF_RET + BPF_K, 0),
+};
+
+static int attach_filter(int fd, struct sock_filter *filter,
+                         unsigned short len)
+{
+        struct sock_fprog prog = { .len = len, .filter = filter };
+
+        return setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER,
+                          &prog, sizeof(prog));
+}
+
+static int packet_mmap_raw_init(struct net_device *dev)
+{
+        struct packet_mmap_priv *priv = get_priv(dev);
+        struct ifreq ifr;
+        int val = 1;
+
+        priv->rawfd = socket(AF_INET, SOCK_RAW, IPPROTO_SERVAL);
+
+        if (priv->rawfd == -1) {
+                LOG_ERR("raw socket: %s\n", strerror(errno));
+                return -1;
+        }
+
+        if (attach_filter(priv->rawfd, packet_mmap_raw_filter,
+                          sizeof(packet_mmap_raw_filter) /
+                          sizeof(packet_mmap_raw_filter[0])) == -1 ||
+            setsockopt(priv->rawfd, IPPROTO_IP, IP_HDRINCL,
+                       &val, sizeof(val)) == -1 ||
+            setsockopt(priv->rawfd, SOL_SOCKET, SO_BROADCAST,
+                       &val, sizeof(val)) == -1 ||
+            setsockopt(priv->rawfd, SOL_SOCKET, SO_BINDTODEVICE,
+                       dev->name, strlen(dev->name)) == -1) {
+                LOG_ERR("raw socket setup failure: %s\n", strerror(errno));
+                return -1;
+        }
+
+        memset(&ifr, 0, sizeof(ifr));
+        memcpy(ifr.ifr_name, dev->name, IFNAMSIZ);
+
+        if (ioctl(priv->rawfd, SIOCGIFHWADDR, &ifr) == -1) {
+                LOG_ERR("SIOCGIFHWADDR %s: %s\n", dev->name, strerror(errno));
+                return -1;
+        }
+
+        switch (ifr.ifr_hwaddr.sa_family) {
+        case ARPHRD_ETHER:
+                break;
+        case ARPHRD_LOOPBACK:
+                priv->loopback = 1;
+                break;
+        default:
+                LOG_ERR("%s: unsupported link type %u\n",
+                        dev->name, ifr.ifr_hwaddr.sa_family);
+                return -1;
+        }
+
+        return 0;
+}
+
+static int packet_mmap_ring_init(struct net_device *dev)
+{
+        struct packet_mmap_priv *priv = get_priv(dev);
+        struct tpacket_req3 req;
+        size_t rx_len, tx_len = 0;
+        int val = TPACKET_V3;
+
+        if (setsockopt(dev->fd, SOL_PACKET, PACKET_VERSION,
+                       &val, sizeof(val)) == -1) {
+                LOG_ERR("PACKET_VERSION: %s\n", strerror(errno));
+                return -1;
+        }
+
+        memset(&req, 0, sizeof(req));
+        req.tp_block_size = PACKET_MMAP_BLOCK_SIZE;
+        req.tp_block_nr = PACKET_MMAP_RX_BLOCKS;
+        req.tp_frame_size = PACKET_MMAP_FRAME_SIZE;
+        req.tp_frame_nr = PACKET_MMAP_RX_BLOCKS *
+                (PACKET_MMAP_BLOCK_SIZE / PACKET_MMAP_FRAME_SIZE);
+        req.tp_retire_blk_tov = PACKET_MMAP_BLOCK_TOV;
+
+        if (setsockopt(dev->fd, SOL_PACKET, PACKET_RX_RING,
+                       &req, sizeof(req)) == -1) {
+                LOG_ERR("PACKET_RX_RING: %s\n", strerror(errno));
+                return -1;
+        }
+
+        rx_len = (size_t)req.tp_block_size * req.tp_block_nr;
+
+        /* Malformed frames are skipped rather than stalling the
+         * transmit ring */
+        val = 1;
+        setsockopt(dev->fd, SOL_PACKET, PACKET_LOSS, &val, sizeof(val));
+
+        /* Transmit rings require TPACKET_V3 support on the transmit
+         * side (Linux 4.11). Without it, packets are sent one by
+         * one. */
+        memset(&req, 0, sizeof(req));
+        req.tp_block_size = PACKET_MMAP_BLOCK_SIZE;
+        req.tp_block_nr = PACKET_MMAP_TX_BLOCKS;
+        req.tp_frame_size = PACKET_MMAP_FRAME_SIZE;
+        req.tp_frame_nr = PACKET_MMAP_TX_BLOCKS *
+                (PACKET_MMAP_BLOCK_SIZE / PACKET_MMAP_FRAME_SIZE);
+
+        if (setsockopt(dev->fd, SOL_PACKET, PACKET_TX_RING,
+                       &req, sizeof(req)) == -1) {
+                LOG_DBG("%s: no transmit ring: %s\n",
+                        dev->name, strerror(errno));
+        } else {
+                tx_len = (size_t)req.tp_block_size * req.tp_block_nr;
+                priv->tx_frame_nr = req.tp_frame_nr;
+        }
+
+        priv->map = mmap(NULL, rx_len + tx_len, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_LOCKED, dev->fd, 0);
+
+        if (priv->map == MAP_FAILED) {
+                /* Locking may fail due to RLIMIT_MEMLOCK */
+                priv->map = mmap(NULL, rx_len + tx_len,
+                                 PROT_READ | PROT_WRITE,
+                                 MAP_SHARED, dev->fd, 0);
+        }
+
+        if (priv->map == MAP_FAILED) {
+                LOG_ERR("mmap: %s\n", strerror(errno));
+                priv->map = NULL;
+                return -1;
+        }
+
+        priv->map_len = rx_len + tx_len;
+
+        if (tx_len)
+                priv->tx = priv->map + rx_len;
+
+        return 0;
+}
+
+static void packet_mmap_destroy(struct net_device *dev)
+{
+        struct packet_mmap_priv *priv = get_priv(dev);
+
+        if (priv->map) {
+                munmap(priv->map, priv->map_len);
+                priv->map = NULL;
+                priv->tx = NULL;
+        }
+	if (dev->fd != -1) {
+		close(dev->fd);
+		dev->fd = -1;
+	}
+        if (priv->rawfd != -1) {
+                close(priv->rawfd);
+                priv->rawfd = -1;
+        }
+}
+
+static int packet_mmap_init(struct net_device *dev)
+{
+        struct packet_mmap_priv *priv = get_priv(dev);
+        struct sockaddr_ll ll;
+        int val = 1;
+
+        priv->rawfd = -1;
+        dev->rx_batch = 1;
+
+        /* Do not bind to a protocol until the rings are set up */
+        dev->fd = socket(AF_PACKET, SOCK_RAW, 0);
+
+        if (dev->fd == -1) {
+                LOG_ERR("packet socket: %s\n", strerror(errno));
+                return -1;
+        }
+
+        if (packet_mmap_raw_init(dev) == -1)
+                goto fail;
+
+        if (attach_filter(dev->fd, packet_mmap_filter,
+                          sizeof(packet_mmap_filter) /
+                          sizeof(packet_mmap_filter[0])) == -1) {
+                LOG_ERR("SO_ATTACH_FILTER: %s\n", strerror(errno));
+                goto fail;
+        }
+
+        /* Our own packets are of no interest (Linux 4.20) */
+        setsockopt(dev->fd, SOL_PACKET, PACKET_IGNORE_OUTGOING,
+                   &val, sizeof(val));
+
+        if (packet_mmap_ring_init(dev) == -1)
+                goto fail;
+
+        memset(&ll, 0, sizeof(ll));
+        ll.sll_family = AF_PACKET;
+        ll.sll_protocol = htons(ETH_P_IP);
+        ll.sll_ifindex = dev->ifindex;
+
+        if (bind(dev->fd, (struct sockaddr *)&ll, sizeof(ll)) == -1) {
+                LOG_ERR("bind failure: %s\n", strerror(errno));
+                goto fail;
+        }
+
+        LOG_DBG("%s: %u KB receive ring, %u transmit frames\n",
+                dev->name,
+                (PACKET_MMAP_BLOCK_SIZE * PACKET_MMAP_RX_BLOCKS) / 1024,
+                priv->tx_frame_nr);
+
+        return 0;
+fail:
+        packet_mmap_destroy(dev);
+        return -1;
+}
+
+/* Neighbor cache, only accessed by the device thread */
+static inline struct neigh_entry *neigh_entry(struct packet_mmap_priv *priv,
+                                              uint32_t addr)
+{
+        return &priv->neigh[(addr ^ (addr >> 16)) & (NEIGH_CACHE_SIZE - 1)];
+}
+
+static inline int neigh_is_onlink(struct net_device *dev, uint32_t addr)
+{
+        return ((addr ^ dev->ipv4.addr) & dev->ipv4.netmask) == 0;
+}
+
+static void neigh_update(struct net_device *dev, uint32_t addr,
+                         const unsigned char *mac)
+{
+        struct neigh_entry *n;
+
+        if (!neigh_is_onlink(dev, addr))
+                return;
+
+        n = neigh_entry(get_priv(dev), addr);
+        n->addr = addr;
+        n->valid = 1;
+        n->expires = jiffies + NEIGH_TIMEOUT;
+        memcpy(n->mac, mac, ETH_ALEN);
+}
+
+/*
+   Find the link layer address of an on-link neighbor. Addresses are
+   learned from received packets, or looked up in the kernel's ARP
+   table. Returns -1 if the address is not known, in which case the
+   packet should go through the kernel's IP stack.
+*/
+static int neigh_lookup(struct net_device *dev, uint32_t addr,
+                        unsigned char *mac)
+{
+        struct packet_mmap_priv *priv = get_priv(dev);
+        struct neigh_entry *n;
+        struct arpreq req;
+        unsigned long now;
+
+        if (!neigh_is_onlink(dev, addr))
+                return -1;
+
+        n = neigh_entry(priv, addr);
+        now = jiffies;
+
+        if (n->addr == addr && time_before(now, n->expires)) {
+                if (!n->valid)
+                        return -1;
+                memcpy(mac, n->mac, ETH_ALEN);
+                return 0;
+        }
+
+        memset(&req, 0, sizeof(req));
+        req.arp_pa.sa_family = AF_INET;
+        memcpy(&((struct sockaddr_in *)&req.arp_pa)->sin_addr, &addr, 4);
+        memcpy(req.arp_dev, dev->name, IFNAMSIZ);
+
+        n->addr = addr;
+
+        if (ioctl(priv->rawfd, SIOCGARP, &req) == -1 ||
+            !(req.arp_flags & ATF_COM)) {
+                n->valid = 0;
+                n->expires = now + NEIGH_FAILED_TIMEOUT;
+                return -1;
+        }
+
+        n->valid = 1;
+        n->expires = now + NEIGH_TIMEOUT;
+        memcpy(n->mac, req.arp_ha.sa_data, ETH_ALEN);
+        memcpy(mac, n->mac, ETH_ALEN);
+
+        return 0;
+}
+
+/* Fill in the Ethernet header of an outgoing packet */
+static int packet_mmap_hard_header(struct net_device *dev,
+                                   struct sk_buff *skb,
+                                   struct ethhdr *eth)
+{
+        struct packet_mmap_priv *priv = get_priv(dev);
+        uint32_t daddr = ip_hdr(skb)->daddr;
+
+        if (priv->loopback) {
+                memset(eth->h_dest, 0, ETH_ALEN);
+        } else if (daddr == 0xffffffff || daddr == dev->ipv4.broadcast) {
+                memcpy(eth->h_dest, dev->broadcast, ETH_ALEN);
+        } else if (IN_MULTICAST(ntohl(daddr))) {
+                uint32_t a = ntohl(daddr);
+
+                eth->h_dest[0] = 0x01;
+                eth->h_dest[1] = 0x00;
+                eth->h_dest[2] = 0x5e;
+                eth->h_dest[3] = (a >> 16) & 0x7f;
+                eth->h_dest[4] = (a >> 8) & 0xff;
+                eth->h_dest[5] = a & 0xff;
+        } else if (neigh_lookup(dev, daddr, eth->h_dest) == -1) {
+                return -1;
+        }
+
+        memcpy(eth->h_source, dev->dev_addr, ETH_ALEN);
+        eth->h_proto = htons(ETH_P_IP);
+
+        return 0;
+}
+
+static int packet_mmap_recv_frame(struct net_device *dev,
+                                  struct tpacket3_hdr *hdr)
+{
+        struct sockaddr_ll *ll = (struct sockaddr_ll *)
+                ((unsigned char *)hdr +
+                 TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+        unsigned char *mac = (unsigned char *)hdr + hdr->tp_mac;
+        unsigned int maclen = hdr->tp_net - hdr->tp_mac;
+        unsigned int len = hdr->tp_snaplen - maclen;
+        struct sk_buff *skb;
+        struct iphdr *iph;
+
+        if (ll->sll_pkttype == PACKET_OUTGOING)
+                return 0;
+
+        if (hdr->tp_snaplen < hdr->tp_len ||
+            hdr->tp_snaplen < maclen ||
+            len < sizeof(struct iphdr)) {
+                LOG_DBG("bad frame len=%u snaplen=%u\n",
+                        hdr->tp_len, hdr->tp_snaplen);
+                return 0;
+        }
+
+        /* Copy the frame out of the ring so that the block can be
+           returned to the kernel as soon as it has been processed,
+           rather than when the last skb pointing into it is freed. */
+        skb = alloc_skb(maclen + len, 0);
+
+        if (!skb) {
+		LOG_ERR("could not allocate skb\n");
+                return -1;
+        }
+
+        skb_reserve(skb, maclen);
+        memcpy(skb->data - maclen, mac, maclen + len);
+        skb_set_mac_header(skb, -(int)maclen);
+        skb->tstamp = ktime_set(hdr->tp_sec, hdr->tp_nsec);
+
+        iph = (struct iphdr *)skb->data;
+
+        if (maclen == ETH_HLEN && !get_priv(dev)->loopback)
+                neigh_update(dev, iph->saddr,
+                             ((struct ethhdr *)mac)->h_source);
+
+        return packet_deliver(dev, skb, len);
+}
+
+/* Process all blocks the kernel has handed over to us */
+static int packet_mmap_recv(struct net_device *dev)
+{
+        struct packet_mmap_priv *priv = get_priv(dev);
+        int n = 0;
+
+        while (1) {
+                struct tpacket_block_desc *bd = (struct tpacket_block_desc *)
+                        (priv->map + priv->rx_block * PACKET_MMAP_BLOCK_SIZE);
+                struct tpacket3_hdr *hdr;
+                unsigned int i, num;
+
+                if (!(ACCESS_ONCE(bd->hdr.bh1.block_status) & TP_STATUS_USER))
+                        break;
+
+                smp_rmb();
+
+                num = bd->hdr.bh1.num_pkts;
+                hdr = (struct tpacket3_hdr *)
+                        ((unsigned char *)bd + bd->hdr.bh1.offset_to_first_pkt);
+
+                for (i = 0; i < num; i++) {
+                        packet_mmap_recv_frame(dev, hdr);
+                        hdr = (struct tpacket3_hdr *)
+                                ((unsigned char *)hdr + hdr->tp_next_offset);
+                }
+
+                /* Return the block to the kernel */
+                smp_mb();
+                bd->hdr.bh1.block_status = TP_STATUS_KERNEL;
+                priv->rx_block = (priv->rx_block + 1) % PACKET_MMAP_RX_BLOCKS;
+                n += num;
+        }
+
+        return n;
+}
+
+/* Have the kernel send all frames queued on the transmit ring */
+static void packet_mmap_kick(struct net_device *dev)
+{
+        struct packet_mmap_priv *priv = get_priv(dev);
+
+        if (priv->tx_pending == 0)
+                return;
+
+        if (sendto(dev->fd, NULL, 0, MSG_DONTWAIT, NULL, 0) == -1 &&
+            errno != EAGAIN && errno != ENOBUFS) {
+                LOG_ERR("send error: %s\n", strerror(errno));
+        }
+        priv->tx_pending = 0;
+}
+
+static int packet_mmap_xmit_raw(struct net_device *dev, struct sk_buff *skb)
+{
+        struct sockaddr_in addr;
+
+        if (skb_linearize(skb))
+                return NET_XMIT_DROP;
+
+	memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+	memcpy(&addr.sin_addr, &ip_hdr(skb)->daddr, sizeof(addr.sin_addr));
+
+	if (sendto(get_priv(dev)->rawfd, skb->data, skb->len, 0,
+                   (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		LOG_ERR("send error: %s\n", strerror(errno));
+                return NET_XMIT_DROP;
+        }
+
+        return NET_XMIT_SUCCESS;
+}
+
+/* Send a packet through the packet socket, without a transmit ring */
+static int packet_mmap_xmit_copy(struct net_device *dev, struct sk_buff *skb)
+{
+        struct ethhdr eth;
+        struct iovec iov[4];
+        struct msghdr msg;
+        int iovlen;
+
+        if (packet_mmap_hard_header(dev, skb, &eth) == -1)
+                return packet_mmap_xmit_raw(dev, skb);
+
+        iov[0].iov_base = &eth;
+        iov[0].iov_len = ETH_HLEN;
+        iovlen = skb_to_iovec(skb, &iov[1], 3);
+
+        if (iovlen == -1) {
+                if (skb_linearize(skb))
+                        return NET_XMIT_DROP;
+                iovlen = skb_to_iovec(skb, &iov[1], 3);
+        }
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = 1 + iovlen;
+
+        if (sendmsg(dev->fd, &msg, 0) == -1) {
+		LOG_ERR("send error: %s\n", strerror(errno));
+                return NET_XMIT_DROP;
+        }
+
+        return NET_XMIT_SUCCESS;
+}
+
+static inline struct tpacket3_hdr *tx_frame(struct packet_mmap_priv *priv)
+{
+        return (struct tpacket3_hdr *)
+                (priv->tx + priv->tx_frame * PACKET_MMAP_FRAME_SIZE);
+}
+
+/* Queue a packet on the transmit ring. The caller kicks the ring. */
+static int packet_mmap_xmit_one(struct net_device *dev, struct sk_buff *skb)
+{
+        struct packet_mmap_priv *priv = get_priv(dev);
+        struct tpacket3_hdr *hdr;
+        unsigned char *data;
+
+        if (!priv->tx ||
+            ETH_HLEN + skb->len > PACKET_MMAP_FRAME_SIZE - PACKET_MMAP_TX_DATA)
+                return packet_mmap_xmit_copy(dev, skb);
+
+        hdr = tx_frame(priv);
+
+        if (ACCESS_ONCE(hdr->tp_status) != TP_STATUS_AVAILABLE) {
+                /* Ring full, flush what we have and check again */
+                packet_mmap_kick(dev);
+
+                if (ACCESS_ONCE(hdr->tp_status) != TP_STATUS_AVAILABLE)
+                        return NET_XMIT_DROP;
+        }
+
+        smp_rmb();
+
+        data = (unsigned char *)hdr + PACKET_MMAP_TX_DATA;
+
+        if (packet_mmap_hard_header(dev, skb, (struct ethhdr *)data) == -1)
+                return packet_mmap_xmit_raw(dev, skb);
+
+        if (skb_copy_bits(skb, 0, data + ETH_HLEN, skb->len))
+                return NET_XMIT_DROP;
+
+        hdr->tp_len = ETH_HLEN + skb->len;
+        hdr->tp_snaplen = hdr->tp_len;
+        hdr->tp_next_offset = 0;
+
+        /* Hand the frame to the kernel */
+        smp_wmb();
+        hdr->tp_status = TP_STATUS_SEND_REQUEST;
+        priv->tx_frame = (priv->tx_frame + 1) % priv->tx_frame_nr;
+        priv->tx_pending++;
+
+        return NET_XMIT_SUCCESS;
+}
+
+static int packet_mmap_xmit(struct sk_buff *skb)
+{
+        struct net_device *dev = skb->dev;
+        int err;
+
+        err = packet_mmap_xmit_one(dev, skb);
+        packet_mmap_kick(dev);
+	kfree_skb(skb);
+
+        return err;
+}
+
+/* Fill the transmit ring with a burst and send it with a single
+ * system call */
+static int packet_mmap_xmit_batch(struct net_device *dev,
+                                  struct sk_buff **skbs,
+                                  unsigned int n)
+{
+        unsigned int i;
+
+        for (i = 0; i < n; i++)
+                packet_mmap_xmit_one(dev, skbs[i]);
+
+        packet_mmap_kick(dev);
+
+        for (i = 0; i < n; i++)
+                kfree_skb(skbs[i]);
+
+        return n;
+}
+
+struct packet_ops packet_mmap_ops = {
+	.init = packet_mmap_init,
+	.destroy = packet_mmap_destroy,
+	.recv = packet_mmap_recv,
+	.xmit = packet_mmap_xmit,
+        .xmit_batch = packet_mmap_xmit_batch,
+};
+
+#endif /* HAVE_PACKET_MMAP */
@@ -10,6 +10,7 @@
  *	published by the Free Software Foundation; either version 2 of
  *	the License, or (at your option) any later version.
  */
+#define _GNU_SOURCE 1
 #include <serval/netdevice.h>
 #include <serval/skbuff.h>
 #include <serval/debug.h>
@@ -22,6 +23,11 @@
 #endif
 #include "packet.h"
 
+/* recvmmsg() and sendmmsg() */
+#if defined(OS_LINUX) && !defined(OS_ANDROID)
+#define HAVE_RECVMMSG 1
+#endif
+
 extern int serval_ipv4_rcv(struct sk_buff *skb);
 
 #define RCVLEN (1500 + SKB_HEADROOM_RESERVE) /* Should be more than
@@ -29,6 +35,66 @@ extern int serval_ipv4_rcv(struct sk_buff *skb);
 					      * MTUs */
 #define get_priv(dev) ((struct packet_raw_priv *)dev_get_priv(dev))
 
+int packet_mmap_enabled = 0;
+
+struct packet_raw_priv {
+#if defined(HAVE_RECVMMSG)
+        /* Ring of preallocated receive buffers. Each batch is read
+           into the slots starting at 'head'. */
+        struct sk_buff **ring;
+        unsigned int head;
+        struct mmsghdr *msgs;
+        struct iovec *iov;
+#else
+        int unused;
+#endif
+};
+
+#if defined(HAVE_RECVMMSG)
+static void packet_raw_ring_free(struct net_device *dev)
+{
+        struct packet_raw_priv *priv = get_priv(dev);
+        unsigned int i;
+
+        if (priv->ring) {
+                for (i = 0; i < dev->rx_ring; i++) {
+                        if (priv->ring[i])
+                                __kfree_skb(priv->ring[i]);
+                }
+                free(priv->ring);
+                priv->ring = NULL;
+        }
+        if (priv->msgs) {
+                free(priv->msgs);
+                priv->msgs = NULL;
+        }
+        if (priv->iov) {
+                free(priv->iov);
+                priv->iov = NULL;
+        }
+}
+
+static int packet_raw_ring_alloc(struct net_device *dev)
+{
+        struct packet_raw_priv *priv = get_priv(dev);
+
+        priv->head = 0;
+        priv->ring = malloc(sizeof(struct sk_buff *) * dev->rx_ring);
+        priv->msgs = malloc(sizeof(struct mmsghdr) * dev->rx_batch);
+        priv->iov = malloc(sizeof(struct iovec) * dev->rx_batch);
+
+        if (!priv->ring || !priv->msgs || !priv->iov) {
+                packet_raw_ring_free(dev);
+                return -1;
+        }
+        
+        memset(priv->ring, 0, sizeof(struct sk_buff *) * dev->rx_ring);
+        memset(priv->msgs, 0, sizeof(struct mmsghdr) * dev->rx_batch);
+
+        return 0;
+}
+#endif /* HAVE_RECVMMSG */
+
 static int packet_raw_init(struct net_device *dev)
 {
         struct sockaddr_in addr;
@@ -92,7 +158,16 @@ static int packet_raw_init(struct net_device *dev)
 #elif defined(OS_BSD)
         /* TODO: add the BSD equivalent of SO_BINDTODEVICE */
 #endif
-
+#if defined(HAVE_RECVMMSG)
+        if (ret != -1 && dev->rx_batch > 1 &&
+            packet_raw_ring_alloc(dev) == -1) {
+                LOG_ERR("could not allocate receive ring, "
+                        "disabling batching on %s\n", dev->name);
+                dev->rx_batch = 1;
+        }
+#else
+        dev->rx_batch = 1;
+#endif
 	return ret;
 }
 
@@ -102,7 +177,119 @@ static void packet_raw_destroy(struct net_device *dev)
 		close(dev->fd);
 		dev->fd = -1;
 	}
+#if defined(HAVE_RECVMMSG)
+        packet_raw_ring_free(dev);
+#endif
+}
+
+/* Prepare a received packet and pass it up the stack */
+int packet_deliver(struct net_device *dev, struct sk_buff *skb, int len)
+{
+        skb->pkt_type = PACKET_OTHERHOST;
+        skb_put(skb, len);
+	skb->dev = dev;
+        /* Set network header offset */
+	skb_reset_network_header(skb);
+
+	/* Try to figure out what packet type this is by comparing the
+	 * incoming IP destination against the device's IP
+	 * configuration */
+        if (memcmp(&ip_hdr(skb)->daddr, 
+                   &dev->ipv4.addr, 
+                   sizeof(dev->ipv4.addr)) == 0) {
+                skb->pkt_type = PACKET_HOST;
+        } else if (memcmp(&ip_hdr(skb)->daddr, 
+                          &dev->ipv4.broadcast, 
+                          sizeof(dev->ipv4.broadcast)) == 0 || 
+                   ip_hdr(skb)->daddr == 0xffffffff) {
+                skb->pkt_type = PACKET_BROADCAST;
+        }
+                
+        /* skb->pkt_type = */
+	skb->protocol = IPPROTO_IP;
+
+        skb->csum = 0;
+        skb->ip_summed = CHECKSUM_NONE;
+
+	/* Packet should be freed by upper layers */
+        if (dev->features & NETIF_F_GRO)
+                return dev_gro_receive(dev, skb);
+
+	return serval_ipv4_rcv(skb);
+}
+
+#if defined(HAVE_RECVMMSG)
+/*
+  Read up to rx_batch packets with a single system call. The packets
+  are read into the next slots of the ring, which are refilled before
+  the next call. 
+*/
+static int packet_raw_recv_batch(struct net_device *dev)
+{
+        struct packet_raw_priv *priv = get_priv(dev);
+        unsigned int i, n = 0;
+        ktime_t now;
+	int ret;
+
+        /* Refill the slots of this batch */
+        for (i = 0; i < dev->rx_batch; i++) {
+                unsigned int slot = (priv->head + i) % dev->rx_ring;
+                struct sk_buff *skb = priv->ring[slot];
+
+                if (!skb) {
+                        skb = alloc_skb(RCVLEN, 0);
+
+                        if (!skb)
+                                break;
+
+                        priv->ring[slot] = skb;
+                }
+                
+                priv->iov[i].iov_base = skb->data;
+                priv->iov[i].iov_len = RCVLEN;
+                priv->msgs[i].msg_hdr.msg_iov = &priv->iov[i];
+                priv->msgs[i].msg_hdr.msg_iovlen = 1;
+                n++;
+        }
+
+        if (n == 0) {
+		LOG_ERR("could not allocate skb\n");
+		return -1;
+        }
+        
+        ret = recvmmsg(dev->fd, priv->msgs, n, MSG_DONTWAIT, NULL);
+
+        if (ret == -1) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                        return 0;
+		LOG_ERR("recvmmsg: %s\n", strerror(errno));
+                return -1;
+        }
+
+        /* One timestamp for the whole batch */
+        now = ktime_get_real();
+
+        for (i = 0; i < (unsigned int)ret; i++) {
+                unsigned int slot = priv->head;
+                struct sk_buff *skb = priv->ring[slot];
+
+                priv->ring[slot] = NULL;
+                priv->head = (priv->head + 1) % dev->rx_ring;
+
+                if (priv->msgs[i].msg_len == 0) {
+                        /* Should not happen */
+                        LOG_ERR("recv return 0\n");
+                        __kfree_skb(skb);
+                        continue;
+                }
+                
+                skb->tstamp = now;
+                packet_deliver(dev, skb, priv->msgs[i].msg_len);
+        }
+
+        return ret;
 }
+#endif /* HAVE_RECVMMSG */
 
 static int packet_raw_recv(struct net_device *dev)
 {
@@ -111,6 +298,10 @@ static int packet_raw_recv(struct net_device *dev)
         socklen_t addrlen = sizeof(addr);
 	int ret;
 
+#if defined(HAVE_RECVMMSG)
+        if (dev->rx_batch > 1)
+                return packet_raw_recv_batch(dev);
+#endif
 	skb = alloc_skb(RCVLEN, 0);
         
 	if (!skb) {
@@ -139,41 +330,20 @@ static int packet_raw_recv(struct net_device *dev)
                 ret, dev->name);
         */        
         __net_timestamp(skb);
-        skb->pkt_type = PACKET_OTHERHOST;
-        skb_put(skb, ret);
-	skb->dev = dev;
-        /* Set network header offset */
-	skb_reset_network_header(skb);
-
-	/* Try to figure out what packet type this is by comparing the
-	 * incoming IP destination against the device's IP
-	 * configuration */
-        if (memcmp(&ip_hdr(skb)->daddr, 
-                   &dev->ipv4.addr, 
-                   sizeof(dev->ipv4.addr)) == 0) {
-                skb->pkt_type = PACKET_HOST;
-        } else if (memcmp(&ip_hdr(skb)->daddr, 
-                          &dev->ipv4.broadcast, 
-                          sizeof(dev->ipv4.broadcast)) == 0 || 
-                   ip_hdr(skb)->daddr == 0xffffffff) {
-                skb->pkt_type = PACKET_BROADCAST;
-        }
-                
-        /* skb->pkt_type = */
-	skb->protocol = IPPROTO_IP;
-
-        skb->csum = 0;
-        skb->ip_summed = CHECKSUM_NONE;
 
-	/* Packet should be freed by upper layers */
-	return serval_ipv4_rcv(skb);
+	return packet_deliver(dev, skb, ret);
 }
 
+/* Maximum number of data segments of a transmitted packet */
+#define XMIT_MAX_IOV 4
+
 static int packet_raw_xmit(struct sk_buff *skb)
 {
 	struct iphdr *iph = ip_hdr(skb);
 	struct sockaddr_in addr;
-	int err;
+        struct iovec iov[XMIT_MAX_IOV];
+        struct msghdr msg;
+	int iovlen, err;
 
 	memset(&addr, 0, sizeof(addr));
         addr.sin_family = AF_INET;
@@ -189,8 +359,23 @@ static int packet_raw_xmit(struct sk_buff *skb)
                                   buf, 18));
         }
 #endif
-	err = sendto(skb->dev->fd, skb->data, skb->len, 0, 
-		     (struct sockaddr *)&addr, sizeof(addr));
+        iovlen = skb_to_iovec(skb, iov, XMIT_MAX_IOV);
+
+        if (iovlen == -1) {
+                if (skb_linearize(skb)) {
+                        kfree_skb(skb);
+                        return NET_XMIT_DROP;
+                }
+                iovlen = skb_to_iovec(skb, iov, XMIT_MAX_IOV);
+        }
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_name = &addr;
+        msg.msg_namelen = sizeof(addr);
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovlen;
+
+	err = sendmsg(skb->dev->fd, &msg, 0);
 
 	if (err == -1) {
 		LOG_ERR("send error: %s\n", 
@@ -205,21 +390,87 @@ static int packet_raw_xmit(struct sk_buff *skb)
 	return err;
 }
 
+#if defined(HAVE_RECVMMSG)
+/* Send a burst of packets with as few system calls as possible */
+static int packet_raw_xmit_batch(struct net_device *dev, 
+                                 struct sk_buff **skbs, 
+                                 unsigned int n)
+{
+        struct mmsghdr msgs[DEV_TX_BURST];
+        struct sockaddr_in addrs[DEV_TX_BURST];
+        struct iovec iov[DEV_TX_BURST][XMIT_MAX_IOV];
+        unsigned int i, sent = 0;
+        int iovlen;
+
+        if (n > DEV_TX_BURST)
+                n = DEV_TX_BURST;
+
+        memset(msgs, 0, sizeof(msgs[0]) * n);
+
+        for (i = 0; i < n; i++) {
+                memset(&addrs[i], 0, sizeof(addrs[i]));
+                addrs[i].sin_family = AF_INET;
+                memcpy(&addrs[i].sin_addr, &ip_hdr(skbs[i])->daddr, 
+                       sizeof(addrs[i].sin_addr));
+                msgs[i].msg_hdr.msg_name = &addrs[i];
+                msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+                msgs[i].msg_hdr.msg_iov = iov[i];
+                iovlen = skb_to_iovec(skbs[i], iov[i], XMIT_MAX_IOV);
+
+                /* If we cannot linearize, the empty message fails
+                   and is skipped below */
+                if (iovlen == -1)
+                        iovlen = skb_linearize(skbs[i]) ? 0 :
+                                skb_to_iovec(skbs[i], iov[i], XMIT_MAX_IOV);
+
+                msgs[i].msg_hdr.msg_iovlen = iovlen;
+        }
+
+        while (sent < n) {
+                int ret = sendmmsg(dev->fd, &msgs[sent], n - sent, 0);
+
+                if (ret == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        /* The error belongs to the first packet
+                           only, skip it and send the rest */
+                        LOG_ERR("send error: %s\n", strerror(errno));
+                        sent++;
+                        continue;
+                }
+                sent += ret;
+        }
+
+        for (i = 0; i < n; i++)
+                kfree_skb(skbs[i]);
+
+        return n;
+}
+#endif /* HAVE_RECVMMSG */
+
 static struct packet_ops pack_ops = {
 	.init = packet_raw_init,
 	.destroy = packet_raw_destroy,
 	.recv = packet_raw_recv,
-	.xmit = packet_raw_xmit
+	.xmit = packet_raw_xmit,
+#if defined(HAVE_RECVMMSG)
+        .xmit_batch = packet_raw_xmit_batch,
+#endif
 };
 
 static void dev_setup(struct net_device *dev)
 {
 	dev->pack_ops = &pack_ops;
+#if defined(HAVE_PACKET_MMAP)
+        if (packet_mmap_enabled)
+                dev->pack_ops = &packet_mmap_ops;
+#endif
 	ether_setup(dev);
 }
 
 int packet_init(void)
 {
+        size_t sizeof_priv = sizeof(struct packet_raw_priv);
         int ret;
 
         ret = netdev_init();
@@ -228,7 +479,11 @@ int packet_init(void)
                 return ret;
         }
 
-        ret = netdev_populate_table(0, dev_setup);
+#if defined(HAVE_PACKET_MMAP)
+        if (packet_mmap_enabled)
+                sizeof_priv = packet_mmap_priv_size;
+#endif
+        ret = netdev_populate_table(sizeof_priv, dev_setup);
 
         if (ret < 0)
                 netdev_fini();
@@ -0,0 +1,64 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * User-level emulation of per-CPU data.
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License as
+ *	published by the Free Software Foundation; either version 2 of
+ *	the License, or (at your option) any later version.
+ */
+#include <serval/platform.h>
+#include <serval/percpu.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+__thread int percpu_thread_cpu = -1;
+int percpu_nr_cpus = 0;
+static unsigned int percpu_next_cpu = 0;
+
+/* Find the number of copies to keep, which is fixed once per-CPU data
+ * has been allocated. Racing threads compute the same value. */
+int percpu_init_cpus(void)
+{
+        long n = sysconf(_SC_NPROCESSORS_CONF);
+
+        if (n < 1)
+                n = 1;
+        else if (n > NR_CPUS)
+                n = NR_CPUS;
+
+        percpu_nr_cpus = (int)n;
+
+        return percpu_nr_cpus;
+}
+
+/* Bind the calling thread to a copy, handing out copies round
+ * robin */
+int percpu_thread_bind(void)
+{
+        percpu_thread_cpu = __sync_fetch_and_add(&percpu_next_cpu, 1) %
+                nr_cpu_ids;
+        return percpu_thread_cpu;
+}
+
+void *__alloc_percpu(size_t size, size_t align)
+{
+        void *ptr;
+        size_t total = nr_cpu_ids * PERCPU_STRIDE(size);
+
+        if (align < PERCPU_CACHE_BYTES)
+                align = PERCPU_CACHE_BYTES;
+
+        if (posix_memalign(&ptr, align, total) != 0)
+                return NULL;
+
+        memset(ptr, 0, total);
+
+        return ptr;
+}
+
+void free_percpu(void *ptr)
+{
+        free(ptr);
+}
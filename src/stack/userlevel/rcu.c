@@ -0,0 +1,184 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * Epoch-based emulation of RCU for the user-level stack.
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License as
+ *	published by the Free Software Foundation; either version 2 of
+ *	the License, or (at your option) any later version.
+ */
+#include <serval/platform.h>
+#include <serval/debug.h>
+#include <serval/rcupdate.h>
+#include <pthread.h>
+#include <sched.h>
+#include <errno.h>
+
+unsigned long rcu_gp_ctr = 1;
+__thread struct rcu_reader *rcu_reader_self = NULL;
+
+static LIST_HEAD(rcu_readers);
+static pthread_mutex_t rcu_registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t rcu_gp_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t rcu_reader_key;
+static pthread_once_t rcu_key_once = PTHREAD_ONCE_INIT;
+
+/* Callback queue, serviced by the reclaimer thread */
+static struct rcu_head *rcu_cb_head = NULL, **rcu_cb_tail = &rcu_cb_head;
+static unsigned long rcu_cb_queued = 0, rcu_cb_done = 0;
+static pthread_mutex_t rcu_cb_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rcu_cb_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t rcu_cb_done_cond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t rcu_thread_once = PTHREAD_ONCE_INIT;
+static pthread_t rcu_thread;
+
+static void rcu_unregister_thread(void *arg)
+{
+        struct rcu_reader *r = (struct rcu_reader *)arg;
+
+        pthread_mutex_lock(&rcu_registry_lock);
+        list_del(&r->lh);
+        pthread_mutex_unlock(&rcu_registry_lock);
+        free(r);
+}
+
+static void rcu_key_init(void)
+{
+        pthread_key_create(&rcu_reader_key, rcu_unregister_thread);
+}
+
+struct rcu_reader *rcu_register_thread(void)
+{
+        struct rcu_reader *r;
+
+        pthread_once(&rcu_key_once, rcu_key_init);
+
+        if (posix_memalign((void **)&r, sizeof(*r), sizeof(*r)) != 0) {
+                LOG_CRIT("Could not allocate RCU reader\n");
+                abort();
+        }
+
+        memset(r, 0, sizeof(*r));
+        INIT_LIST_HEAD(&r->lh);
+
+        pthread_mutex_lock(&rcu_registry_lock);
+        list_add_tail(&r->lh, &rcu_readers);
+        pthread_mutex_unlock(&rcu_registry_lock);
+
+        /* Make sure the reader is unregistered on thread exit */
+        pthread_setspecific(rcu_reader_key, r);
+        rcu_reader_self = r;
+
+        return r;
+}
+
+void synchronize_rcu(void)
+{
+        struct rcu_reader *r;
+        unsigned long gp;
+
+        pthread_mutex_lock(&rcu_gp_lock);
+
+        __sync_synchronize();
+        gp = __sync_add_and_fetch(&rcu_gp_ctr, 1);
+
+        pthread_mutex_lock(&rcu_registry_lock);
+
+        /* Wait for all readers that entered a critical section
+         * before the new epoch started */
+        list_for_each_entry(r, &rcu_readers, lh) {
+                while (1) {
+                        unsigned long ctr = ACCESS_ONCE(r->ctr);
+
+                        if (ctr == 0 || (long)(ctr - gp) >= 0)
+                                break;
+                        sched_yield();
+                }
+        }
+
+        pthread_mutex_unlock(&rcu_registry_lock);
+
+        __sync_synchronize();
+
+        pthread_mutex_unlock(&rcu_gp_lock);
+}
+
+static void *rcu_reclaim_thread(void *arg)
+{
+        while (1) {
+                struct rcu_head *list;
+                unsigned long n = 0;
+
+                pthread_mutex_lock(&rcu_cb_lock);
+
+                while (rcu_cb_head == NULL)
+                        pthread_cond_wait(&rcu_cb_cond, &rcu_cb_lock);
+
+                list = rcu_cb_head;
+                rcu_cb_head = NULL;
+                rcu_cb_tail = &rcu_cb_head;
+
+                pthread_mutex_unlock(&rcu_cb_lock);
+
+                /* All callbacks in the batch were queued before
+                 * this grace period started */
+                synchronize_rcu();
+
+                while (list) {
+                        struct rcu_head *next = list->next;
+                        list->func(list);
+                        list = next;
+                        n++;
+                }
+
+                pthread_mutex_lock(&rcu_cb_lock);
+                rcu_cb_done += n;
+                pthread_cond_broadcast(&rcu_cb_done_cond);
+                pthread_mutex_unlock(&rcu_cb_lock);
+        }
+        return NULL;
+}
+
+static void rcu_thread_start(void)
+{
+        int ret;
+
+        ret = pthread_create(&rcu_thread, NULL, rcu_reclaim_thread, NULL);
+
+        if (ret != 0) {
+                LOG_CRIT("Could not start RCU reclaim thread: %s\n",
+                         strerror(ret));
+                abort();
+        }
+        pthread_detach(rcu_thread);
+}
+
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head))
+{
+        pthread_once(&rcu_thread_once, rcu_thread_start);
+
+        head->next = NULL;
+        head->func = func;
+
+        pthread_mutex_lock(&rcu_cb_lock);
+        *rcu_cb_tail = head;
+        rcu_cb_tail = &head->next;
+        rcu_cb_queued++;
+        pthread_cond_signal(&rcu_cb_cond);
+        pthread_mutex_unlock(&rcu_cb_lock);
+}
+
+/* Wait until all callbacks queued so far have been invoked */
+void rcu_barrier(void)
+{
+        unsigned long target;
+
+        pthread_mutex_lock(&rcu_cb_lock);
+
+        target = rcu_cb_queued;
+
+        while ((long)(rcu_cb_done - target) < 0)
+                pthread_cond_wait(&rcu_cb_done_cond, &rcu_cb_lock);
+
+        pthread_mutex_unlock(&rcu_cb_lock);
+}
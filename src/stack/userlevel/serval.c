@@ -33,6 +33,7 @@
 #include <serval/netdevice.h>
 #include <serval/timer.h>
 #include <af_serval.h>
+#include <bst.h>
 #include <userlevel/client.h>
 #include <ctrl.h>
 
@@ -40,10 +41,13 @@ struct client_list client_list;
 atomic_t num_clients = ATOMIC_INIT(0);
 static volatile int should_exit = 0;
 static char *progname = NULL;
+/* Number of client workers, or -1 for a thread per client */
+static int client_workers = -1;
 
 extern int telnet_init(void);
 extern void telnet_fini(void);
 unsigned int checksum_mode = 1;
+unsigned int service_trie_stride = 0;
 
 #define MAX(x, y) (x >= y ? x : y)
 
@@ -130,7 +134,7 @@ void garbage_collect_clients(unsigned long data)
 		if (client_get_state(c) == CLIENT_STATE_GARBAGE) {
 			LOG_INF("Garbage collecting client %u\n", client_get_id(c));
 			
-			if (pthread_join(client_get_thread(c), NULL) != 0) {
+			if (client_join(c) != 0) {
 				if (errno == EINVAL) {
 					LOG_DBG("Client %u probably detached\n", 
 						client_get_id(c));
@@ -194,6 +198,14 @@ static int server_run(void)
 	if (should_exit) {
                 goto out_close_pipe;
         }
+
+        /* Workers inherit the blocked signals */
+        if (client_workers >= 0 && 
+            client_reactor_start(client_workers) == -1) {
+                LOG_ERR("Could not start client workers\n");
+                ret = -1;
+                goto out_close_pipe;
+        }
         
 	for (i = 0; i < NUM_SERVER_SOCKS; i++) {
 		server_sock[i] = socket(AF_UNIX, SOCK_STREAM, 0);
@@ -385,7 +397,7 @@ static int server_run(void)
 		LOG_INF("Joining with client %u\n", client_get_id(c));
 		client_signal_exit(c);
 
-		if (pthread_join(client_get_thread(c), NULL) != 0) {
+		if (client_join(c) != 0) {
 			if (errno == EINVAL) {
 				LOG_DBG("Client %u probably detached\n", 
 					client_get_id(c));
@@ -400,17 +412,26 @@ static int server_run(void)
         client_list_unlock(&client_list);
 
 out_close_socks:
+
 	for (i = 0; i < NUM_SERVER_SOCKS; i++) {
 		close(server_sock[i]);
 		unlink(server_sock_path[i]);
 	}
 out_close_pipe:
+        client_reactor_stop();
         close(timer_list_signal[0]);
         close(timer_list_signal[1]);
 	return ret;
 }
 
 extern void dev_list_add(const char *name);
+extern int dev_rx_conf_set(const char *arg, int ring);
+extern int dev_netem_conf_set(const char *arg);
+extern int serval_tcp_set_default_congestion_control(const char *name);
+extern int packet_mmap_enabled;
+extern int dev_fq_enabled;
+extern int dev_gro_enabled;
+extern unsigned int gso;
 
 #define PID_FILE "/tmp/serval.pid"
 
@@ -509,13 +530,35 @@ static void print_usage()
                "-u, --udp-encap                   - Enable UDP encapsulation.\n"
                "-d, --daemon                      - Run in the background as a daemon.\n"
                "-l, --debug-level LEVEL           - Set the level of debug output.\n"
-               "-s, --sal-forward                 - Enable SAL forwarding.\n");
+               "-s, --sal-forward                 - Enable SAL forwarding.\n"
+               "-cv, --csum-verify                - Verify incremental checksum updates\n"
+               "                                    of forwarded packets.\n"
+               "-ts, --trie-stride STRIDE         - Use a multibit service table trie\n"
+               "                                    with STRIDE (1-8) bits per level.\n"
+               "-rb, --rx-batch [IFACE=]N         - Read up to N packets per system call\n"
+               "                                    (1 disables batching).\n"
+               "-rr, --rx-ring [IFACE=]N          - Preallocate N receive buffers.\n"
+               "-pm, --packet-mmap                - Use memory-mapped packet rings.\n"
+               "-fq, --fair-queue                 - Schedule sent packets fairly among\n"
+               "                                    sockets and enforce pacing rates.\n"
+               "-gso, --gso                       - Send TCP super-segments through the\n"
+               "                                    stack and split them in the device.\n"
+               "-gro, --gro                       - Merge received TCP segments before\n"
+               "                                    passing them up the stack.\n"
+               "-ne, --netem [IFACE=]MS[,LOSS]    - Delay sent packets by MS milliseconds\n"
+               "                                    and drop LOSS percent of them.\n"
+               "-cc, --congestion-control NAME    - Use TCP congestion control NAME\n"
+               "                                    (reno, cubic or bbr).\n"
+               "-cw, --client-workers [N]         - Serve all clients with N worker\n"
+               "                                    threads (default one per CPU)\n"
+               "                                    instead of a thread per client.\n");
 }
 
 int main(int argc, char **argv)
 {        
 	struct sigaction action;
         int daemon = 0;
+        const char *cong_ctl = NULL;
 	int ret;
         struct timeval now;
         
@@ -581,6 +624,100 @@ int main(int argc, char **argv)
                            strcmp(argv[0], "--sal-forward") == 0) {
                         LOG_DBG("Enabling SAL forwarding\n");
                         net_serval.sysctl_sal_forward = 1;
+                } else if (strcmp(argv[0], "-cv") == 0 ||
+                           strcmp(argv[0], "--csum-verify") == 0) {
+                        net_serval.sysctl_sal_csum_verify = 1;
+                } else if (strcmp(argv[0], "-ts") == 0 ||
+                           strcmp(argv[0], "--trie-stride") == 0) {
+                        char *p = NULL;
+                        unsigned int stride = 0;
+
+                        if (argc > 1)
+                                stride = strtoul(argv[1], &p, 10);
+                        
+                        if (argc > 1 && *argv[1] != '\0' && *p == '\0' && 
+                            stride <= BST_STRIDE_MAX) {
+                                argv++;
+                                argc--;
+                                service_trie_stride = stride;
+                        } else {
+                                fprintf(stderr, "Invalid trie stride %s\n",
+                                        argc > 1 ? argv[1] : "");
+                                print_usage();
+                                return -1;
+                        }
+                } else if (strcmp(argv[0], "-rb") == 0 ||
+                           strcmp(argv[0], "--rx-batch") == 0 ||
+                           strcmp(argv[0], "-rr") == 0 ||
+                           strcmp(argv[0], "--rx-ring") == 0) {
+                        int ring = strcmp(argv[0], "-rr") == 0 ||
+                                strcmp(argv[0], "--rx-ring") == 0;
+
+                        if (argc > 1 && dev_rx_conf_set(argv[1], ring) == 0) {
+                                argv++;
+                                argc--;
+                        } else {
+                                fprintf(stderr, "Invalid receive %s setting %s\n",
+                                        ring ? "ring" : "batch", 
+                                        argc > 1 ? argv[1] : "");
+                                print_usage();
+                                return -1;
+                        }
+                } else if (strcmp(argv[0], "-pm") == 0 ||
+                           strcmp(argv[0], "--packet-mmap") == 0) {
+#if defined(OS_LINUX) && !defined(OS_ANDROID)
+                        packet_mmap_enabled = 1;
+#else
+                        fprintf(stderr, "Packet rings are not supported "
+                                "on this platform\n");
+                        return -1;
+#endif
+                } else if (strcmp(argv[0], "-fq") == 0 ||
+                           strcmp(argv[0], "--fair-queue") == 0) {
+                        dev_fq_enabled = 1;
+                } else if (strcmp(argv[0], "-gso") == 0 ||
+                           strcmp(argv[0], "--gso") == 0) {
+                        gso = 1;
+                } else if (strcmp(argv[0], "-gro") == 0 ||
+                           strcmp(argv[0], "--gro") == 0) {
+                        dev_gro_enabled = 1;
+                } else if (strcmp(argv[0], "-ne") == 0 ||
+                           strcmp(argv[0], "--netem") == 0) {
+                        if (argc > 1 && dev_netem_conf_set(argv[1]) == 0) {
+                                argv++;
+                                argc--;
+                        } else {
+                                fprintf(stderr, "Invalid netem setting %s\n",
+                                        argc > 1 ? argv[1] : "");
+                                print_usage();
+                                return -1;
+                        }
+                } else if (strcmp(argv[0], "-cc") == 0 ||
+                           strcmp(argv[0], "--congestion-control") == 0) {
+                        if (argc > 1) {
+                                cong_ctl = argv[1];
+                                argv++;
+                                argc--;
+                        } else {
+                                print_usage();
+                                return -1;
+                        }
+                } else if (strcmp(argv[0], "-cw") == 0 ||
+                           strcmp(argv[0], "--client-workers") == 0) {
+                        char *p = NULL;
+                        unsigned long n;
+
+                        client_workers = 0;
+
+                        if (argc > 1 && *argv[1] != '\0') {
+                                n = strtoul(argv[1], &p, 10);
+                                
+                                if (*p == '\0') {
+                                        client_workers = n;
+                                        argv++;
+                                        argc--;
+                                }
+                        }
                 } else if (strcmp(argv[0], "-u") == 0 ||
                            strcmp(argv[0], "--udp-encap") == 0) {
                         net_serval.sysctl_udp_encap = 1;
@@ -627,6 +764,13 @@ int main(int argc, char **argv)
 		LOG_CRIT("Could not initialize af_serval\n");   
                 goto cleanup_pid;
 	}
+
+        if (cong_ctl && 
+            serval_tcp_set_default_congestion_control(cong_ctl) != 0) {
+                LOG_CRIT("Unknown congestion control %s\n", cong_ctl);
+                ret = -1;
+                goto cleanup_serval;
+        }
 	
 	ret = ctrl_init();
 	
@@ -1,5 +1,7 @@
 /* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*- */
 #include <string.h>
+#include <stdio.h>
+#include <pthread.h>
 #include <sys/uio.h>
 #include <serval/debug.h>
 #include <serval/platform.h>
@@ -12,6 +14,346 @@ atomic_t num_skb_alloc = ATOMIC_INIT(0);
 atomic_t num_skb_clone = ATOMIC_INIT(0);
 atomic_t num_skb_free = ATOMIC_INIT(0);
 
+/*
+  sk_buff pool.
+
+  Buffers for small and MTU-sized packets are allocated as a single
+  cache-aligned chunk, which holds the sk_buff followed by the data
+  area and the shared info:
+
+  | sk_buff | ... | skb_data_hdr | data ... | skb_shared_info |
+  ^ chunk                        ^ head (cache aligned)
+
+  Clones share the data area of the original, so the chunk is
+  reference counted and only recycled when both the original sk_buff
+  and the data area have been released. Clones get their sk_buff from
+  a separate class of bare shells. Larger data areas, and those
+  reallocated by pskb_expand_head(), are malloc'ed but carry the same
+  header.
+
+  Free chunks are cached per thread. Threads exchange chunks with a
+  shared depot in batches, so the depot lock is rarely taken.
+*/
+#define SKB_POOL_CACHE_MAX 64   /* Chunks cached per thread and class */
+#define SKB_POOL_BATCH     32   /* Chunks moved to/from the depot at once */
+#define SKB_POOL_DEPOT_MAX 4096 /* Chunks kept in the depot per class */
+
+enum skb_pool_class {
+        SKB_POOL_SHELL = 0,
+        SKB_POOL_SMALL,
+        SKB_POOL_MTU,
+        SKB_POOL_NR,
+        SKB_POOL_NONE = SKB_POOL_NR, /* Data area not pooled */
+};
+
+struct skb_data_hdr {
+        atomic_t refs; /* sk_buff and data area of a chunk */
+        unsigned int class;
+};
+
+#define SKB_CHUNK_DATA_OFF                                              \
+        SKB_DATA_ALIGN(sizeof(struct sk_buff) + sizeof(struct skb_data_hdr))
+#define SKB_CHUNK_SIZE(cap)                                             \
+        (SKB_CHUNK_DATA_OFF +                                           \
+         SKB_DATA_ALIGN((cap) + sizeof(struct skb_shared_info)))
+
+#define skb_data_hdr(head) ((struct skb_data_hdr *)(head) - 1)
+#define skb_chunk_hdr(skb)                                              \
+        skb_data_hdr((unsigned char *)(skb) + SKB_CHUNK_DATA_OFF)
+
+struct skb_pool_depot {
+        pthread_mutex_t lock;
+        void *head; /* Free chunks, linked through their first word */
+        unsigned int count;
+        unsigned int total; /* Chunks allocated from the system */
+        unsigned int peak;
+};
+
+static struct {
+        const char *name;
+        unsigned int capacity; /* Max data size */
+        size_t size;           /* Chunk size */
+} skb_pool_classes[SKB_POOL_NR] = {
+        [SKB_POOL_SHELL] = { "shell", 0, sizeof(struct sk_buff) },
+        [SKB_POOL_SMALL] = { "small", 256, SKB_CHUNK_SIZE(256) },
+        [SKB_POOL_MTU] = { "mtu", 2048, SKB_CHUNK_SIZE(2048) },
+};
+
+static struct skb_pool_depot skb_pool_depots[SKB_POOL_NR] = {
+        [0 ... SKB_POOL_NR - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER }
+};
+
+struct skb_pool_cache {
+        unsigned int count;
+        void *chunks[SKB_POOL_CACHE_MAX];
+        /* Only written by the owning thread */
+        unsigned long long hits, misses;
+};
+
+struct skb_pool_thread {
+        struct list_head lh;
+        struct skb_pool_cache cache[SKB_POOL_NR];
+};
+
+static __thread struct skb_pool_thread *skb_pool_self = NULL;
+static LIST_HEAD(skb_pool_threads);
+static pthread_mutex_t skb_pool_threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t skb_pool_key;
+static pthread_once_t skb_pool_key_once = PTHREAD_ONCE_INIT;
+/* Hits and misses of exited threads */
+static unsigned long long skb_pool_hits[SKB_POOL_NR];
+static unsigned long long skb_pool_misses[SKB_POOL_NR];
+static atomic_t skb_pool_oversize = ATOMIC_INIT(0);
+
+static void skb_pool_depot_put(unsigned int class, void **chunks,
+                               unsigned int n)
+{
+        struct skb_pool_depot *d = &skb_pool_depots[class];
+        unsigned int i = 0;
+
+        pthread_mutex_lock(&d->lock);
+
+        for (; i < n && d->count < SKB_POOL_DEPOT_MAX; i++) {
+                *(void **)chunks[i] = d->head;
+                d->head = chunks[i];
+                d->count++;
+        }
+
+        /* Return the excess to the system */
+        d->total -= n - i;
+
+        pthread_mutex_unlock(&d->lock);
+
+        for (; i < n; i++)
+                free(chunks[i]);
+}
+
+static unsigned int skb_pool_depot_get(unsigned int class, void **chunks,
+                                       unsigned int n)
+{
+        struct skb_pool_depot *d = &skb_pool_depots[class];
+        unsigned int i;
+
+        pthread_mutex_lock(&d->lock);
+
+        for (i = 0; i < n && d->head; i++) {
+                chunks[i] = d->head;
+                d->head = *(void **)d->head;
+                d->count--;
+        }
+
+        pthread_mutex_unlock(&d->lock);
+
+        return i;
+}
+
+static void skb_pool_thread_exit(void *arg)
+{
+        struct skb_pool_thread *t = (struct skb_pool_thread *)arg;
+        unsigned int i;
+
+        pthread_mutex_lock(&skb_pool_threads_lock);
+        list_del(&t->lh);
+
+        for (i = 0; i < SKB_POOL_NR; i++) {
+                skb_pool_hits[i] += t->cache[i].hits;
+                skb_pool_misses[i] += t->cache[i].misses;
+        }
+        pthread_mutex_unlock(&skb_pool_threads_lock);
+
+        for (i = 0; i < SKB_POOL_NR; i++)
+                skb_pool_depot_put(i, t->cache[i].chunks, t->cache[i].count);
+
+        skb_pool_self = NULL;
+        free(t);
+}
+
+static void skb_pool_key_init(void)
+{
+        pthread_key_create(&skb_pool_key, skb_pool_thread_exit);
+}
+
+static struct skb_pool_thread *skb_pool_thread_init(void)
+{
+        struct skb_pool_thread *t;
+
+        pthread_once(&skb_pool_key_once, skb_pool_key_init);
+
+        t = (struct skb_pool_thread *)malloc(sizeof(*t));
+
+        if (!t)
+                return NULL;
+
+        memset(t, 0, sizeof(*t));
+
+        pthread_mutex_lock(&skb_pool_threads_lock);
+        list_add_tail(&t->lh, &skb_pool_threads);
+        pthread_mutex_unlock(&skb_pool_threads_lock);
+
+        /* Flush the cache on thread exit */
+        pthread_setspecific(skb_pool_key, t);
+        skb_pool_self = t;
+
+        return t;
+}
+
+static void *skb_pool_alloc(unsigned int class)
+{
+        struct skb_pool_thread *t = skb_pool_self;
+        struct skb_pool_depot *d = &skb_pool_depots[class];
+        struct skb_pool_cache *c;
+        void *chunk;
+
+        if (unlikely(!t)) {
+                t = skb_pool_thread_init();
+
+                if (!t)
+                        return NULL;
+        }
+
+        c = &t->cache[class];
+
+        if (c->count == 0)
+                c->count = skb_pool_depot_get(class, c->chunks, 
+                                              SKB_POOL_BATCH);
+
+        if (c->count > 0) {
+                c->hits++;
+                return c->chunks[--c->count];
+        }
+
+        if (posix_memalign(&chunk, SMP_CACHE_BYTES,
+                           skb_pool_classes[class].size) != 0)
+                return NULL;
+
+        c->misses++;
+
+        pthread_mutex_lock(&d->lock);
+        if (++d->total > d->peak)
+                d->peak = d->total;
+        pthread_mutex_unlock(&d->lock);
+
+        return chunk;
+}
+
+static void skb_pool_free(unsigned int class, void *chunk)
+{
+        struct skb_pool_thread *t = skb_pool_self;
+        struct skb_pool_cache *c;
+
+        if (unlikely(!t)) {
+                t = skb_pool_thread_init();
+
+                if (!t) {
+                        skb_pool_depot_put(class, &chunk, 1);
+                        return;
+                }
+        }
+
+        c = &t->cache[class];
+
+        if (c->count == SKB_POOL_CACHE_MAX) {
+                c->count -= SKB_POOL_BATCH;
+                skb_pool_depot_put(class, &c->chunks[c->count], 
+                                   SKB_POOL_BATCH);
+        }
+        
+        c->chunks[c->count++] = chunk;
+}
+
+/* Drop a reference to a chunk, recycling it when it is no longer
+ * used */
+static void skb_chunk_put(struct skb_data_hdr *hdr)
+{
+        if (atomic_dec_and_test(&hdr->refs))
+                skb_pool_free(hdr->class, (unsigned char *)(hdr + 1) - 
+                              SKB_CHUNK_DATA_OFF);
+}
+
+static void skb_data_put(struct skb_data_hdr *hdr)
+{
+        if (hdr->class != SKB_POOL_NONE)
+                skb_chunk_put(hdr);
+        else if (atomic_dec_and_test(&hdr->refs))
+                free(hdr);
+}
+
+/* Allocate a data area that is not part of a chunk */
+static unsigned char *skb_data_alloc(unsigned int size)
+{
+        struct skb_data_hdr *hdr;
+
+        hdr = (struct skb_data_hdr *)malloc(sizeof(*hdr) + size + 
+                                            sizeof(struct skb_shared_info));
+
+        if (!hdr)
+                return NULL;
+
+        atomic_set(&hdr->refs, 1);
+        hdr->class = SKB_POOL_NONE;
+
+        return (unsigned char *)(hdr + 1);
+}
+
+static void skb_shell_free(struct sk_buff *skb)
+{
+        if (skb->chunk)
+                skb_chunk_put(skb_chunk_hdr(skb));
+        else
+                skb_pool_free(SKB_POOL_SHELL, skb);
+}
+
+int skb_pool_print(char *buf, size_t buflen)
+{
+        unsigned long long hits[SKB_POOL_NR], misses[SKB_POOL_NR];
+        unsigned int cached[SKB_POOL_NR];
+        struct skb_pool_thread *t;
+        int len = 0, i;
+
+        pthread_mutex_lock(&skb_pool_threads_lock);
+
+        for (i = 0; i < SKB_POOL_NR; i++) {
+                hits[i] = skb_pool_hits[i];
+                misses[i] = skb_pool_misses[i];
+                cached[i] = 0;
+        }
+
+        list_for_each_entry(t, &skb_pool_threads, lh) {
+                for (i = 0; i < SKB_POOL_NR; i++) {
+                        hits[i] += ACCESS_ONCE(t->cache[i].hits);
+                        misses[i] += ACCESS_ONCE(t->cache[i].misses);
+                        cached[i] += ACCESS_ONCE(t->cache[i].count);
+                }
+        }
+        pthread_mutex_unlock(&skb_pool_threads_lock);
+
+        len += snprintf(buf + len, buflen > len ? buflen - len : 0,
+                        "%-6s %6s %12s %10s %8s %8s %8s\n",
+                        "class", "size", "hits", "misses", 
+                        "total", "peak", "cached");
+
+        for (i = 0; i < SKB_POOL_NR; i++) {
+                struct skb_pool_depot *d = &skb_pool_depots[i];
+
+                len += snprintf(buf + len, buflen > len ? buflen - len : 0,
+                                "%-6s %6zu %12llu %10llu %8u %8u %8u\n",
+                                skb_pool_classes[i].name,
+                                skb_pool_classes[i].size,
+                                hits[i], misses[i],
+                                ACCESS_ONCE(d->total),
+                                ACCESS_ONCE(d->peak),
+                                cached[i] + ACCESS_ONCE(d->count));
+        }
+
+        len += snprintf(buf + len, buflen > len ? buflen - len : 0,
+                        "oversize=%d alloc=%d clone=%d free=%d\n",
+                        atomic_read(&skb_pool_oversize),
+                        atomic_read(&num_skb_alloc),
+                        atomic_read(&num_skb_clone),
+                        atomic_read(&num_skb_free));
+        return len;
+}
+
 static void skb_release_head_state(struct sk_buff *skb)
 {
 	/* Release state associated with head */
@@ -20,12 +362,41 @@ static void skb_release_head_state(struct sk_buff *skb)
 	}
 }
 
+static void skb_drop_list(struct sk_buff **listp)
+{
+	struct sk_buff *list = *listp;
+
+	*listp = NULL;
+
+	do {
+		struct sk_buff *this = list;
+		list = list->next;
+		kfree_skb(this);
+	} while (list);
+}
+
+static inline void skb_drop_fraglist(struct sk_buff *skb)
+{
+	skb_drop_list(&skb_shinfo(skb)->frag_list);
+}
+
+static void skb_clone_fraglist(struct sk_buff *skb)
+{
+	struct sk_buff *list;
+
+	skb_walk_frags(skb, list)
+		skb_get(list);
+}
+
 static void skb_release_data(struct sk_buff *skb)
 {
 	if (!skb->cloned ||
 	    !atomic_sub_return(skb->nohdr ? (1 << SKB_DATAREF_SHIFT) + 1 : 1,
 			       &skb_shinfo(skb)->dataref)) {
-		free(skb->head);
+		if (skb_has_frag_list(skb))
+			skb_drop_fraglist(skb);
+
+		skb_data_put(skb_data_hdr(skb->head));
 	}
 }
 
@@ -43,7 +414,7 @@ void __kfree_skb(struct sk_buff *skb)
                skb, atomic_read(&skb->users));
 #endif
 	skb_release_all(skb);
-	free(skb);
+	skb_shell_free(skb);
         atomic_inc(&num_skb_free);
 }
 
@@ -64,18 +435,44 @@ struct sk_buff *__alloc_skb(unsigned int size, int fclone, int node)
 	unsigned char *data;
 	struct sk_buff *skb;
 	struct skb_shared_info *shinfo;
-	
-	skb = (struct sk_buff *)malloc(sizeof(struct sk_buff));
+        unsigned int class;
 
-	if (!skb)
-		return NULL;
+        /* Find the smallest chunk that fits */
+        for (class = SKB_POOL_SMALL; class < SKB_POOL_NR; class++) {
+                if (size <= skb_pool_classes[class].capacity)
+                        break;
+        }
 
-        memset(skb, 0, sizeof(*skb));
+        if (class < SKB_POOL_NR) {
+                struct skb_data_hdr *hdr;
 
-	data = (unsigned char *)malloc(size + sizeof(struct skb_shared_info));
+                skb = (struct sk_buff *)skb_pool_alloc(class);
+                
+                if (!skb)
+                        return NULL;
 
-	if (!data)
-		goto nodata;
+                memset(skb, 0, sizeof(*skb));
+                skb->chunk = 1;
+                hdr = skb_chunk_hdr(skb);
+                /* One reference for the sk_buff, one for the data */
+                atomic_set(&hdr->refs, 2);
+                hdr->class = class;
+                data = (unsigned char *)(hdr + 1);
+        } else {
+                skb = (struct sk_buff *)skb_pool_alloc(SKB_POOL_SHELL);
+
+                if (!skb)
+                        return NULL;
+
+                memset(skb, 0, sizeof(*skb));
+
+                data = skb_data_alloc(size);
+
+                if (!data)
+                        goto nodata;
+
+                atomic_inc(&skb_pool_oversize);
+        }
 
         memset(data, 0, size + sizeof(struct skb_shared_info));
 
@@ -105,7 +502,7 @@ struct sk_buff *__alloc_skb(unsigned int size, int fclone, int node)
 
 	return skb;
 nodata:
-	free(skb);
+	skb_pool_free(SKB_POOL_SHELL, skb);
 	return NULL;
 }
 
@@ -169,7 +566,7 @@ struct sk_buff *skb_clone(struct sk_buff *skb, gfp_t gfp_mask)
 {
 	struct sk_buff *n;
 
-        n = (struct sk_buff *)malloc(sizeof(*n));
+        n = (struct sk_buff *)skb_pool_alloc(SKB_POOL_SHELL);
         
         if (!n)
                 return NULL;
@@ -239,10 +636,8 @@ struct sk_buff *skb_copy(const struct sk_buff *skb, gfp_t gfp_mask)
 	/* Set the tail pointer and length */
 	skb_put(n, skb->len);
 
-        /*
 	if (skb_copy_bits(skb, -headerlen, n->head, headerlen + skb->len))
 		BUG();
-        */
 
 	copy_skb_header(n, skb);
 	return n;
@@ -322,7 +717,7 @@ int pskb_expand_head(struct sk_buff *skb, int nhead, int ntail,
         
 	size = SKB_DATA_ALIGN(size);
 
-	data = malloc(size + sizeof(struct skb_shared_info));
+	data = skb_data_alloc(size);
 
 	if (!data)
 		goto nodata;
@@ -336,10 +731,10 @@ int pskb_expand_head(struct sk_buff *skb, int nhead, int ntail,
 /*
 	for (i = 0; i < skb_shinfo(skb)->nr_frags; i++)
 		get_page(skb_shinfo(skb)->frags[i].page);
-
-	if (skb_has_frags(skb))
-		skb_clone_fraglist(skb);
 */
+	if (skb_has_frag_list(skb))
+		skb_clone_fraglist(skb);
+
 	skb_release_data(skb);
 
 	off = (data + nhead) - skb->head;
@@ -435,6 +830,95 @@ struct sk_buff *skb_copy_expand(const struct sk_buff *skb,
         return n;
 }
 
+/**
+ *	__skb_linearize - copy a frag_list into the linear data area
+ *	@skb: buffer to linearize
+ *
+ *	Returns zero on success, or -ENOMEM if the data area could
+ *	not be expanded, in which case the skb is unchanged.
+ */
+int __skb_linearize(struct sk_buff *skb)
+{
+	int len = skb->data_len;
+	int ntail = len - skb_tailroom(skb);
+
+	if (ntail > 0 || skb_cloned(skb)) {
+		if (pskb_expand_head(skb, 0, ntail > 0 ? ntail : 0, 
+				     GFP_ATOMIC))
+			return -ENOMEM;
+	}
+
+	if (skb_copy_bits(skb, skb_headlen(skb), 
+			  skb_tail_pointer(skb), len))
+		BUG();
+
+	skb_drop_fraglist(skb);
+	skb->tail     += len;
+	skb->data_len  = 0;
+
+	return 0;
+}
+
+/**
+ *	skb_share_copy - copy headers and share the payload
+ *	@skb: buffer to copy
+ *	@hdr_len: bytes following skb->data to make private
+ *	@headroom: free bytes wanted in front of skb->data
+ *	@gfp_mask: allocation priority
+ *
+ *	Make a copy of an &sk_buff where everything from the network
+ *	header up to @hdr_len bytes past skb->data is private and may
+ *	be modified, while the rest of the data is shared with @skb
+ *	through a clone on the frag_list of the copy. This is much
+ *	cheaper than skb_copy() when sending the same payload with
+ *	different headers, e.g., to several forwarding targets.
+ *
+ *	The shared payload must not be modified through either
+ *	buffer. Falls back to skb_copy() if the headers are not all
+ *	in the linear data area. Returns %NULL on failure.
+ */
+struct sk_buff *skb_share_copy(struct sk_buff *skb, unsigned int hdr_len,
+                               unsigned int headroom, gfp_t gfp_mask)
+{
+	int nh_off = skb->data - skb_network_header(skb);
+	struct sk_buff *n, *payload;
+
+	if (nh_off < 0 || hdr_len >= skb_headlen(skb) || 
+	    (int)headroom < nh_off || skb_has_frag_list(skb) ||
+	    skb->ip_summed == CHECKSUM_PARTIAL)
+		return skb_copy(skb, gfp_mask);
+
+	payload = skb_clone(skb, gfp_mask);
+
+	if (!payload)
+		return NULL;
+
+	n = alloc_skb(headroom + hdr_len, gfp_mask);
+
+	if (!n) {
+		kfree_skb(payload);
+		return NULL;
+	}
+
+	skb_reserve(n, headroom - nh_off);
+	skb_copy_from_linear_data_offset(skb, -nh_off, 
+					 skb_put(n, nh_off + hdr_len),
+					 nh_off + hdr_len);
+	copy_skb_header(n, skb);
+	skb_reset_network_header(n);
+	skb_reset_mac_header(n);
+	__skb_pull(n, nh_off);
+	skb_set_transport_header(n, skb_transport_header(skb) - skb->data);
+
+	__skb_pull(payload, hdr_len);
+	skb_shinfo(n)->frag_list = payload;
+	n->data_len  = payload->len;
+	n->len	    += payload->len;
+	n->truesize += payload->truesize;
+
+	return n;
+}
+
 /**
  *	skb_dequeue - remove from the head of the queue
  *	@list: list to dequeue from
@@ -576,6 +1060,33 @@ void skb_insert(struct sk_buff *old, struct sk_buff *newsk,
 	spin_unlock(&list->lock);
 }
 
+/*
+  Point an iovec at the data of an skb, including any frag_list, so
+  that it can be sent without linearizing it first. Returns the
+  number of entries used, or -1 if they do not fit in iovlen.
+*/
+int skb_to_iovec(const struct sk_buff *skb, struct iovec *iov, int iovlen)
+{
+        struct sk_buff *frag_iter;
+        int n = 0;
+
+        if (iovlen < 1)
+                return -1;
+
+        iov[n].iov_base = skb->data;
+        iov[n++].iov_len = skb_headlen(skb);
+
+        skb_walk_frags(skb, frag_iter) {
+                if (n == iovlen || skb_is_nonlinear(frag_iter))
+                        return -1;
+
+                iov[n].iov_base = frag_iter->data;
+                iov[n++].iov_len = frag_iter->len;
+        }
+
+        return n;
+}
+
 int skb_copy_datagram_iovec(const struct sk_buff *skb,
                             int offset, struct iovec *to,
                             int len)
@@ -963,7 +1474,7 @@ fault:
 int skb_copy_bits(const struct sk_buff *skb, int offset, void *to, int len)
 {
 	int start = skb_headlen(skb);
-	//struct sk_buff *frag_iter;
+	struct sk_buff *frag_iter;
 	//int i;
         int copy;
 
@@ -1008,7 +1519,7 @@ int skb_copy_bits(const struct sk_buff *skb, int offset, void *to, int len)
 		}
 		start = end;
 	}
-
+        */
 	skb_walk_frags(skb, frag_iter) {
 		int end;
 
@@ -1027,7 +1538,7 @@ int skb_copy_bits(const struct sk_buff *skb, int offset, void *to, int len)
 		}
 		start = end;
 	}
-        */
+
 	if (!len)
 		return 0;
 
@@ -1040,6 +1551,8 @@ __wsum skb_checksum(const struct sk_buff *skb, int offset,
 {
 	int start = skb_headlen(skb);
 	int copy = start - offset;
+	struct sk_buff *frag_iter;
+	int pos = 0;
 
 	/* Checksum header. */
 	if (copy > 0) {
@@ -1049,7 +1562,31 @@ __wsum skb_checksum(const struct sk_buff *skb, int offset,
 		if ((len -= copy) == 0)
 			return csum;
 		offset += copy;
+		pos	= copy;
 	}
+
+	skb_walk_frags(skb, frag_iter) {
+		int end;
+
+		WARN_ON(start > offset + len);
+
+		end = start + frag_iter->len;
+		if ((copy = end - offset) > 0) {
+			__wsum csum2;
+			if (copy > len)
+				copy = len;
+			csum2 = skb_checksum(frag_iter, offset - start,
+					     copy, 0);
+			csum = csum_block_add(csum, csum2, pos);
+			if ((len -= copy) == 0)
+				return csum;
+			offset += copy;
+			pos    += copy;
+		}
+		start = end;
+	}
+	BUG_ON(len);
+
         return csum;
 }
 
@@ -45,6 +45,10 @@ static void sock_def_wakeup(struct sock *sk)
         if (wq_has_sleeper(wq)) {
                 wake_up_interruptible_all(&wq->wait);
         }
+
+        if (sk->sk_socket && sk->sk_socket->client)
+                client_signal_raise(sk->sk_socket->client, CLIENT_SIG_STATE);
+
         read_unlock(&sk->sk_callback_lock);
 }
 
@@ -56,6 +60,10 @@ static void sock_def_error_report(struct sock *sk)
         if (wq_has_sleeper(wq))
                 wake_up_interruptible_poll(&wq->wait, POLLERR);
         sk_wake_async(sk, SOCK_WAKE_IO, POLL_ERR);
+
+        if (sk->sk_socket && sk->sk_socket->client)
+                client_signal_raise(sk->sk_socket->client, CLIENT_SIG_STATE);
+
         read_unlock(&sk->sk_callback_lock);
 }
 
@@ -72,9 +80,17 @@ static void sock_def_readable(struct sock *sk, int bytes)
 
         sk_wake_async(sk, SOCK_WAKE_WAITD, POLL_IN);
 
-        if (skb_queue_len(&sk->sk_receive_queue) && 
-            !client_has_data(sk->sk_socket->client))
-                client_signal_raise(sk->sk_socket->client, CLIENT_SIG_READ);
+        /* A socket in the accept queue has no client yet */
+        if (sk->sk_socket && sk->sk_socket->client) {
+                struct client *c = sk->sk_socket->client;
+
+                if (!skb_queue_len(&sk->sk_receive_queue))
+                        /* E.g., a listening socket with a new
+                           connection */
+                        client_signal_raise(c, CLIENT_SIG_STATE);
+                else if (!client_has_data(c))
+                        client_signal_raise(c, CLIENT_SIG_READ);
+        }
         
         read_unlock(&sk->sk_callback_lock);
 }
@@ -92,6 +108,10 @@ static void sock_def_write_space(struct sock *sk)
                 /* Should agree with poll, otherwise some programs break */
                 if (sock_writeable(sk))
                         sk_wake_async(sk, SOCK_WAKE_SPACE, POLL_OUT);
+
+                if (sk->sk_socket && sk->sk_socket->client)
+                        client_signal_raise(sk->sk_socket->client,
+                                            CLIENT_SIG_WRITE);
         }
         read_unlock(&sk->sk_callback_lock);
 }
@@ -187,8 +207,12 @@ static void sock_net_set(struct sock *sk, struct net *net)
 
 void sk_setup_caps(struct sock *sk, struct dst_entry *dst)
 {
-        /*
-	__sk_dst_set(sk, dst);
+        /* Routes are not cached in the socket at user level, so this
+           only picks up what the device can offload. There are no
+           paged fragments either, so no NETIF_F_SG. */
+        if (!dst->dev)
+                return;
+
 	sk->sk_route_caps = dst->dev->features;
 	if (sk->sk_route_caps & NETIF_F_GSO)
 		sk->sk_route_caps |= NETIF_F_GSO_SOFTWARE;
@@ -197,11 +221,10 @@ void sk_setup_caps(struct sock *sk, struct dst_entry *dst)
 		if (dst->header_len) {
 			sk->sk_route_caps &= ~NETIF_F_GSO_MASK;
 		} else {
-			sk->sk_route_caps |= NETIF_F_SG | NETIF_F_HW_CSUM;
+			sk->sk_route_caps |= NETIF_F_HW_CSUM;
 			sk->sk_gso_max_size = dst->dev->gso_max_size;
 		}
 	}
-        */
 }
 
 struct sock *sk_alloc(struct net *net, int family, gfp_t priority,
@@ -333,12 +356,17 @@ struct sock *sk_clone(const struct sock *sk, const gfp_t priority)
         return newsk;
 }
 
+static void sk_free_rcu(struct rcu_head *head)
+{
+        free(container_of(head, struct sock, sk_rcu));
+}
+
 static void __sk_free(struct sock *sk)
 {
 	if (sk->sk_destruct)
 		sk->sk_destruct(sk);
         
-        free(sk);
+        call_rcu(&sk->sk_rcu, sk_free_rcu);
 }
 
 void sk_free(struct sock *sk)
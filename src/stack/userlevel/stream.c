@@ -24,6 +24,7 @@
 #include <serval_sock.h>
 #include <serval_tcp.h>
 #include <stdlib.h>
+#include "client.h"
 
 /**
  * sk_stream_write_space - stream socket write_space callback.
@@ -47,6 +48,9 @@ void sk_stream_write_space(struct sock *sk)
 		if (wq_has_sleeper(wq))
 			wake_up_interruptible_poll(&wq->wait, POLLOUT |
 						POLLWRNORM | POLLWRBAND);
+
+		if (sock->client)
+			client_signal_raise(sock->client, CLIENT_SIG_WRITE);
 		/*
 		if (wq && wq->fasync_list && !(sk->sk_shutdown & SEND_SHUTDOWN))
 			sock_wake_async(sock, SOCK_WAKE_SPACE, POLL_OUT);
@@ -7,6 +7,7 @@
 #include <pthread.h>
 #include <service.h>
 #include <serval_sock.h>
+#include <serval/skbuff.h>
 
 #define TELNET_ADDR "127.0.0.1"
 #define TELNET_PORT 9999
@@ -45,6 +46,23 @@ static void cmd_services_print(struct telnet_client *tc, char *buf,
 	send(tc->sock, buf, ret, 0);	
 }
 
+static void cmd_cache_print(struct telnet_client *tc, char *buf, size_t buflen)
+{
+	int ret;
+	
+	ret = sprintf(buf, "# Service resolution cache:\n");
+
+	ret += service_cache_print(buf + ret, buflen - ret);
+	
+	if (ret < 0)
+		return;
+
+	if (ret > buflen)
+		ret = buflen;
+
+	send(tc->sock, buf, ret, 0);	
+}
+
 static void cmd_flows_print(struct telnet_client *tc, char *buf, size_t buflen)
 {
 	int ret;
@@ -59,6 +77,23 @@ static void cmd_flows_print(struct telnet_client *tc, char *buf, size_t buflen)
 	send(tc->sock, buf, ret, 0);	
 }
 
+static void cmd_skbs_print(struct telnet_client *tc, char *buf, size_t buflen)
+{
+	int ret;
+	
+	ret = sprintf(buf, "# sk_buff pool:\n");
+
+	ret += skb_pool_print(buf + ret, buflen - ret);
+	
+	if (ret < 0)
+		return;
+
+	if (ret > buflen)
+		ret = buflen;
+
+	send(tc->sock, buf, ret, 0);	
+}
+
 static void cmd_quit(struct telnet_client *tc, char *buf, size_t buflen)
 {
 	telnet_client_destroy(tc);
@@ -72,6 +107,9 @@ static struct command command_list[] = {
 	{ "exit", "e", "quit telnet session", cmd_quit },
 	{ "flows", "f", "print neighbor table", cmd_flows_print },
 	{ "services", "s", "print service table", cmd_services_print },
+	{ "skbs", "k", "print sk_buff pool statistics", cmd_skbs_print },
+	{ "cache", "c", "print service resolution cache statistics", 
+	  cmd_cache_print },
 	{ NULL, NULL, NULL, NULL }
 };
 
@@ -9,29 +9,63 @@
 #include <unistd.h>
 #include <poll.h>
 
-struct timer_internal {
-	struct timespec expire_abs;
+/*
+  Hierarchical timing wheel, as in the Linux kernel.
+
+  Timers that expire within the next 256 jiffies are kept in tv1,
+  with one slot per jiffy. Timers further into the future are kept
+  in the coarser wheels tv2-tv5, where each slot covers 2^(8+6n)
+  jiffies, and are cascaded into the finer wheels as time
+  advances. Adding and removing a timer is O(1), and the cost of
+  running the wheel is proportional to the elapsed jiffies.
+*/
+#define TVN_BITS 6
+#define TVR_BITS 8
+#define TVN_SIZE (1 << TVN_BITS)
+#define TVR_SIZE (1 << TVR_BITS)
+#define TVN_MASK (TVN_SIZE - 1)
+#define TVR_MASK (TVR_SIZE - 1)
+#define MAX_TVAL ((unsigned long)((1ULL << (TVR_BITS + 4*TVN_BITS)) - 1))
+#define NEXT_TIMER_MAX_DELTA ((1UL << 30) - 1)
+
+struct tvec {
+	struct list_head vec[TVN_SIZE];
+};
+
+struct tvec_root {
+	struct list_head vec[TVR_SIZE];
 };
 
 struct timer_list_head {
 	unsigned long num_timers;
-        struct timespec start_time;
-	struct list_head head;
+        unsigned long timer_jiffies; /* Next jiffy to run */
+        unsigned long next_timer; /* Earliest expiry, unless stale */
+        int next_timer_stale;
+        /* The expiry the owner of the wheel is currently sleeping
+           until, if any. Only timers expiring before that require
+           a signal. */
+        unsigned long next_wakeup;
+        int has_wakeup;
 	pthread_mutex_t lock;
         int signal[2];
+	struct tvec_root tv1;
+	struct tvec tv2;
+	struct tvec tv3;
+	struct tvec tv4;
+	struct tvec tv5;
 };
 
-#if !defined(PER_THREAD_TIMER_LIST)
 #define CLOCK CLOCK_REALTIME
+
+static struct timespec start_time = { 0, 0 };
+
+/* Default wheel, also used by threads without a wheel of their own */
 static struct timer_list_head timer_list = {
-        .num_timers = 0,
-        .start_time = { 0, 0 },
-        .head = { &timer_list.head, &timer_list.head },
         .lock = PTHREAD_MUTEX_INITIALIZER,
         .signal = { -1, -1 },
 };
-#else
-#define CLOCK CLOCK_THREAD_CPUTIME_ID
+
+#if defined(PER_THREAD_TIMER_LIST)
 static pthread_key_t timer_list_head_key;
 static pthread_once_t key_once = PTHREAD_ONCE_INIT;
 #endif
@@ -66,11 +100,12 @@ unsigned long gettime_jiffies(void)
 
         gettime(&now);
 
-        timespec_sub(&now, &timer_list.start_time);
+        timespec_sub(&now, &start_time);
 
         return timespec_to_jiffies(&now);
 }
 
+
 static inline int timer_list_lock(struct timer_list_head *tlh)
 {
 	return pthread_mutex_lock(&tlh->lock);
@@ -81,18 +116,55 @@ static inline int timer_list_unlock(struct timer_list_head *tlh)
 	return pthread_mutex_unlock(&tlh->lock);
 }
 
+static void timer_list_head_init(struct timer_list_head *tlh)
+{
+        int i;
+
+        for (i = 0; i < TVN_SIZE; i++) {
+                INIT_LIST_HEAD(tlh->tv5.vec + i);
+                INIT_LIST_HEAD(tlh->tv4.vec + i);
+                INIT_LIST_HEAD(tlh->tv3.vec + i);
+                INIT_LIST_HEAD(tlh->tv2.vec + i);
+        }
+        for (i = 0; i < TVR_SIZE; i++)
+                INIT_LIST_HEAD(tlh->tv1.vec + i);
+
+        tlh->num_timers = 0;
+        tlh->timer_jiffies = jiffies;
+        tlh->next_timer = tlh->timer_jiffies;
+        tlh->next_timer_stale = 0;
+        tlh->has_wakeup = 0;
+}
+
 #if defined(PER_THREAD_TIMER_LIST)
+static void tvec_drop_timers(struct list_head *vec, int size)
+{
+        int i;
+
+        for (i = 0; i < size; i++) {
+                while (!list_empty(vec + i)) {
+                        struct timer_list *tl = 
+                                list_first_entry(vec + i, struct timer_list, 
+                                                 entry);
+                        list_del(&tl->entry);
+                        tl->entry.next = NULL;
+                        tl->base = NULL;
+                }
+        }
+}
+
 static void timer_list_head_destructor(void *arg)
 {
 	struct timer_list_head *tlh = (struct timer_list_head *)arg;
-	
-	while (!list_empty(&tlh->head)) {
-		struct timer_list *tl = list_first_entry(&tlh->head, 
-							 struct timer_list, 
-							 entry);
-		list_del(&tl->entry);
-                tl->entry.next = NULL;
-	}
+
+        /* Timers still pending on this wheel are dropped */
+        timer_list_lock(tlh);
+        tvec_drop_timers(tlh->tv1.vec, TVR_SIZE);
+        tvec_drop_timers(tlh->tv2.vec, TVN_SIZE);
+        tvec_drop_timers(tlh->tv3.vec, TVN_SIZE);
+        tvec_drop_timers(tlh->tv4.vec, TVN_SIZE);
+        tvec_drop_timers(tlh->tv5.vec, TVN_SIZE);
+        timer_list_unlock(tlh);
 
 	pthread_mutex_destroy(&tlh->lock);
 
@@ -103,25 +175,55 @@ static void timer_list_head_destructor(void *arg)
 static inline struct timer_list_head *timer_list_get(void)
 {
 #if defined(PER_THREAD_TIMER_LIST)
-	return (struct timer_list_head *)pthread_getspecific(timer_list_head_key);
-#else
-        return &timer_list;
+	struct timer_list_head *tlh = (struct timer_list_head *)
+                pthread_getspecific(timer_list_head_key);
+
+        if (tlh)
+                return tlh;
 #endif
+        return &timer_list;
 }
 
 static inline struct timer_list_head *timer_list_get_locked(void)
 {
 	struct timer_list_head *tlh = timer_list_get();
 
-	if (!tlh)
-		return NULL;
-
-	if (timer_list_lock(tlh) == -1)
+	if (timer_list_lock(tlh) != 0)
 		return NULL;
 	
 	return tlh;
 }
 
+/* Lock the wheel the timer is on, or the wheel of the calling thread
+ * if the timer has never been added. The timer stays on the same
+ * wheel for its lifetime. */
+static struct timer_list_head *lock_timer_base(struct timer_list *timer)
+{
+        while (1) {
+                struct timer_list_head *tlh = 
+                        (struct timer_list_head *)ACCESS_ONCE(timer->base);
+
+                if (!tlh) {
+                        tlh = timer_list_get_locked();
+
+                        if (!tlh)
+                                return NULL;
+
+                        if (timer->base == NULL) {
+                                timer->base = tlh;
+                                return tlh;
+                        }
+                } else {
+                        if (timer_list_lock(tlh) != 0)
+                                return NULL;
+
+                        if (timer->base == tlh)
+                                return tlh;
+                }
+                timer_list_unlock(tlh);
+        }
+}
+
 static int __timer_list_signal_pending(struct timer_list_head *tlh)
 {
         struct pollfd fds;
@@ -152,6 +254,9 @@ static int __timer_list_signal_lower(struct timer_list_head *tlh)
 	ssize_t sz = 1;
 	char r = 'r';
 
+        if (tlh->signal[0] == -1)
+                return 0;
+
         while (sz > 0 && __timer_list_signal_pending(tlh) & POLLIN) {
                 sz = read(tlh->signal[0], &r, 1);
 	}
@@ -177,10 +282,210 @@ static int timer_list_signal_timer_change(struct timer_list_head *tlh)
 	return (int)write(tlh->signal[1], &w, 1);
 }
 
+static void __internal_add_timer(struct timer_list_head *tlh, 
+                                 struct timer_list *timer)
+{
+	unsigned long expires = timer->expires;
+	unsigned long idx = expires - tlh->timer_jiffies;
+	struct list_head *vec;
+
+	if (idx < TVR_SIZE) {
+		vec = tlh->tv1.vec + (expires & TVR_MASK);
+	} else if (idx < 1 << (TVR_BITS + TVN_BITS)) {
+		vec = tlh->tv2.vec + ((expires >> TVR_BITS) & TVN_MASK);
+	} else if (idx < 1 << (TVR_BITS + 2 * TVN_BITS)) {
+		vec = tlh->tv3.vec + 
+                        ((expires >> (TVR_BITS + TVN_BITS)) & TVN_MASK);
+	} else if (idx < 1 << (TVR_BITS + 3 * TVN_BITS)) {
+		vec = tlh->tv4.vec + 
+                        ((expires >> (TVR_BITS + 2 * TVN_BITS)) & TVN_MASK);
+	} else if ((signed long)idx < 0) {
+		/* Expires in the past, run on the next tick */
+		vec = tlh->tv1.vec + (tlh->timer_jiffies & TVR_MASK);
+	} else {
+		if (idx > MAX_TVAL) {
+			idx = MAX_TVAL;
+			expires = idx + tlh->timer_jiffies;
+		}
+		vec = tlh->tv5.vec + 
+                        ((expires >> (TVR_BITS + 3 * TVN_BITS)) & TVN_MASK);
+	}
+
+	list_add_tail(&timer->entry, vec);
+}
+
+static void internal_add_timer(struct timer_list_head *tlh, 
+                               struct timer_list *timer)
+{
+        __internal_add_timer(tlh, timer);
+
+        if (tlh->num_timers++ == 0) {
+                tlh->next_timer = timer->expires;
+                tlh->next_timer_stale = 0;
+        } else if (!tlh->next_timer_stale &&
+                   time_before(timer->expires, tlh->next_timer)) {
+                tlh->next_timer = timer->expires;
+        }
+
+        /* Wake up the owner of the wheel if it sleeps too long */
+        if (!tlh->has_wakeup || 
+            time_before(timer->expires, tlh->next_wakeup)) {
+                tlh->next_wakeup = timer->expires;
+                tlh->has_wakeup = 1;
+                timer_list_signal_timer_change(tlh);
+        }
+}
+
+static void detach_timer(struct timer_list_head *tlh, 
+                         struct timer_list *timer)
+{
+        list_del(&timer->entry);
+        timer->entry.next = NULL;
+        tlh->num_timers--;
+
+        if (timer->expires == tlh->next_timer)
+                tlh->next_timer_stale = 1;
+}
+
+/* Move the timers of a slot in a coarse wheel into the finer
+ * wheels. Returns the index, so that the next wheel is cascaded when
+ * this one wraps around. */
+static int cascade(struct timer_list_head *tlh, struct tvec *tv, int index)
+{
+	struct timer_list *timer, *tmp;
+	struct list_head tv_list;
+
+	list_replace_init(tv->vec + index, &tv_list);
+
+	list_for_each_entry_safe(timer, tmp, &tv_list, entry) {
+		__internal_add_timer(tlh, timer);
+	}
+
+	return index;
+}
+
+#define INDEX(N) ((tlh->timer_jiffies >> (TVR_BITS + (N) * TVN_BITS)) & \
+                  TVN_MASK)
+
+/* Run all expired timers. Called with the wheel locked, which is
+ * released while timer functions run. */
+static int __run_timers(struct timer_list_head *tlh)
+{
+        unsigned long now = jiffies;
+        int n = 0;
+
+        if (tlh->num_timers == 0) {
+                tlh->timer_jiffies = now + 1;
+                return 0;
+        }
+
+	while (time_after_eq(now, tlh->timer_jiffies)) {
+		struct list_head work_list;
+		int index = tlh->timer_jiffies & TVR_MASK;
+
+		if (!index &&
+		    (!cascade(tlh, &tlh->tv2, INDEX(0))) &&
+                    (!cascade(tlh, &tlh->tv3, INDEX(1))) &&
+                    !cascade(tlh, &tlh->tv4, INDEX(2)))
+			cascade(tlh, &tlh->tv5, INDEX(3));
+
+		++tlh->timer_jiffies;
+		list_replace_init(tlh->tv1.vec + index, &work_list);
+
+		while (!list_empty(&work_list)) {
+			struct timer_list *timer;
+			void (*fn)(unsigned long);
+			unsigned long data;
+
+			timer = list_first_entry(&work_list, 
+                                                 struct timer_list, entry);
+			fn = timer->function;
+			data = timer->data;
+
+			detach_timer(tlh, timer);
+			timer_list_unlock(tlh);
+
+                        /* Call timer function, passing the data */
+                        if (fn) {
+                                fn(data);
+                        } else {
+                                LOG_WARN("timer function is NULL\n");
+                        }
+                        n++;
+
+			timer_list_lock(tlh);
+		}
+	}
+
+        return n;
+}
+
+/* Find the earliest expiry. The first timer found in tv1 is the
+ * earliest, unless a cascade happens before it expires, in which
+ * case the coarser wheels must be checked as well. */
+static unsigned long __next_timer_interrupt(struct timer_list_head *tlh)
+{
+	unsigned long timer_jiffies = tlh->timer_jiffies;
+	unsigned long expires = timer_jiffies + NEXT_TIMER_MAX_DELTA;
+	int index, slot, array, found = 0;
+	struct timer_list *nte;
+	struct tvec *varray[4];
+
+	index = slot = timer_jiffies & TVR_MASK;
+	do {
+		list_for_each_entry(nte, tlh->tv1.vec + slot, entry) {
+			found = 1;
+			expires = nte->expires;
+			/* Look at the cascade bucket(s)? */
+			if (!index || slot < index)
+				goto cascade;
+			return expires;
+		}
+		slot = (slot + 1) & TVR_MASK;
+	} while (slot != index);
+
+cascade:
+	/* Calculate the next cascade event */
+	if (index)
+		timer_jiffies += TVR_SIZE - index;
+	timer_jiffies >>= TVR_BITS;
+
+	varray[0] = &tlh->tv2;
+	varray[1] = &tlh->tv3;
+	varray[2] = &tlh->tv4;
+	varray[3] = &tlh->tv5;
+
+	for (array = 0; array < 4; array++) {
+		struct tvec *varp = varray[array];
+
+		index = slot = timer_jiffies & TVN_MASK;
+		do {
+			list_for_each_entry(nte, varp->vec + slot, entry) {
+				found = 1;
+				if (time_before(nte->expires, expires))
+					expires = nte->expires;
+			}
+			/* Do we still search for the first timer or are
+			 * we looking up the cascade buckets? */
+			if (found) {
+				/* Look at the cascade bucket(s)? */
+				if (!index || slot < index)
+					break;
+				return expires;
+			}
+			slot = (slot + 1) & TVN_MASK;
+		} while (slot != index);
+
+		if (index)
+			timer_jiffies += TVN_SIZE - index;
+		timer_jiffies >>= TVN_BITS;
+	}
+	return expires;
+}
+
 int timer_list_get_next_timeout(struct timespec *timeout, int signal[2])
 {
 	struct timer_list_head *tlh = timer_list_get_locked();
-	struct timer_list *timer;
 	struct timespec now = { 0, 0 };
 
 	if (!tlh)
@@ -191,15 +496,25 @@ int timer_list_get_next_timeout(struct timespec *timeout, int signal[2])
         /* Lower any pending signals */
         __timer_list_signal_lower(tlh);
 
-	if (list_empty(&tlh->head)) {
+	if (tlh->num_timers == 0) {
+                tlh->has_wakeup = 0;
 		timer_list_unlock(tlh);
 		return 0;
 	}
 
-	timer = list_first_entry(&tlh->head, struct timer_list, entry);
+        if (tlh->next_timer_stale) {
+                tlh->next_timer = __next_timer_interrupt(tlh);
+                tlh->next_timer_stale = 0;
+        }
+
+        tlh->next_wakeup = tlh->next_timer;
+        tlh->has_wakeup = 1;
 
+        /* Timers run on the first jiffy boundary at or after their
+         * expiry */
+        memcpy(timeout, &start_time, sizeof(*timeout));
+        timespec_add_nsec(timeout, jiffies_to_nsecs(tlh->next_timer));
         gettime(&now);
-	memcpy(timeout, &timer->expires_abs, sizeof(*timeout));
 	timespec_sub(timeout, &now);
 	timer_list_unlock(tlh);
 
@@ -209,31 +524,19 @@ int timer_list_get_next_timeout(struct timespec *timeout, int signal[2])
 int timer_list_handle_timeout(void)
 {
 	struct timer_list_head *tlh = timer_list_get_locked();
-	struct timer_list *timer;
+        int n;
 
 	if (!tlh)
 		return -1;
-	
-	if (list_empty(&tlh->head)) {
-		timer_list_unlock(tlh);
-		return 0;
-	}
-	
-	timer = list_first_entry(&tlh->head, struct timer_list, entry);
-	
-	list_del(&timer->entry);
-        timer->entry.next = NULL;
 
-	timer_list_unlock(tlh);
+        n = __run_timers(tlh);
 
-	/* Call timer function, passing the data */
-        if (timer->function) {
-                timer->function(timer->data); 
-        } else {
-                LOG_WARN("timer function is NULL\n");
-        }
+        /* The owner recalculates its timeout before sleeping again */
+        tlh->has_wakeup = 0;
+
+	timer_list_unlock(tlh);
         
-	return 1;
+	return n > 0;
 }
 
 #if defined(PER_THREAD_TIMER_LIST)
@@ -250,7 +553,7 @@ int timer_list_per_thread_init()
 	pthread_once(&key_once, make_keys);	
 
 	/* Check if init was already done for this thread */
-	if (timer_list_get())
+	if (pthread_getspecific(timer_list_head_key))
 		return 0;
 
 	tlh = (struct timer_list_head *)malloc(sizeof(*tlh));
@@ -266,9 +569,8 @@ int timer_list_per_thread_init()
 	}
 
 	memset(tlh, 0, sizeof(*tlh));
-	INIT_LIST_HEAD(&tlh->head);
-	tlh->num_timers = 0;
-        gettime(&tlh->start_time);
+        timer_list_head_init(tlh);
+        tlh->signal[0] = tlh->signal[1] = -1;
 
 	/* Make mutex recursive */
 #if RECURSIVE_MUTEX
@@ -284,8 +586,7 @@ int timer_list_per_thread_init()
 #endif
 	return 1;
 }
-#else
-/* !PER_THREAD */
+#endif
 
 #if defined(__GNUC__) || defined(__BIONIC__)
 /* Make this function be auto-called on load */
@@ -295,9 +596,9 @@ __attribute__((constructor))
 #endif
 void timer_list_init(void)
 {
-        gettime(&timer_list.start_time);
+        gettime(&start_time);
+        timer_list_head_init(&timer_list);
 }
-#endif
 
 void init_timer(struct timer_list *timer)
 {
@@ -313,97 +614,67 @@ void add_timer(struct timer_list *timer)
 
 int del_timer(struct timer_list *timer)
 {
-	struct timer_list_head *tlh = timer_list_get_locked();
-	int signal_change = 0;
+	struct timer_list_head *tlh;
+        int ret = 0;
 
-	if (!tlh)
-		return -1;
-	
-        if (timer->entry.next == NULL)
+        if (!timer_pending(timer))
                 return 0;
 
-	if (timer->entry.prev == &tlh->head) {
-                /* Entry is first in queue, must signal change */
-                signal_change = 1;
-        } 
+        tlh = lock_timer_base(timer);
 
-        list_del(&timer->entry);
-        timer->entry.next = NULL;
+	if (!tlh)
+		return -1;
+	
+        if (timer_pending(timer)) {
+                detach_timer(tlh, timer);
+                ret = 1;
+        }
 
 	timer_list_unlock(tlh);
 
-        if (signal_change) 
-                timer_list_signal_timer_change(tlh);
-
-	return 1;
+	return ret;
 }
 
-int mod_timer(struct timer_list *timer, unsigned long expires)
+static int __mod_timer(struct timer_list *timer, unsigned long expires,
+                       int pending_only)
 {
-	struct timer_list_head *tlh = timer_list_get_locked();
-        unsigned long delta;
+	struct timer_list_head *tlh = lock_timer_base(timer);
         int ret = 0;
 
 	if (!tlh)
 		return -1;
 
-        if (timer_pending(timer) && 
-            timer->expires == expires) {
-                timer_list_unlock(tlh);
-                return 1;
-        }
-
 	if (timer_pending(timer)) {
-		list_del(&timer->entry);
+                if (timer->expires == expires) {
+                        timer_list_unlock(tlh);
+                        return 1;
+                }
+		detach_timer(tlh, timer);
                 ret = 1;
+        } else if (pending_only) {
+                timer_list_unlock(tlh);
+                return 0;
         }
 
-        gettime(&timer->expires_abs);
 	timer->expires = expires;
-        delta = expires - jiffies;
-	timespec_add_nsec(&timer->expires_abs, 
-                          jiffies_to_nsecs(delta)); 
-        /*
-        LOG_DBG("timer[expires=%lu delta=%lu"
-                " tv_sec=%ld tv_nsec=%ld]\n",
-                expires, delta,
-                timer->expires_abs.tv_sec, 
-                timer->expires_abs.tv_nsec);
-        */
-	if (list_empty(&tlh->head)) {
-		list_add(&timer->entry, &tlh->head);
-                timer_list_signal_timer_change(tlh);
-	} else {
-		unsigned int num = 0;
-		struct timer_list *tl;
-		/* Find place where to insert based on absolute time */
-		list_for_each_entry(tl, &tlh->head, entry) {
-			if (timespec_lt(&timer->expires_abs, 
-                                        &tl->expires_abs))
-                                break;
-			num++;
-		}
-
-                list_add_tail(&timer->entry, &tl->entry);
-
-		if (timer->entry.prev == &tlh->head) {
-                        /* Inserted first in queue, so we must signal
-                         * that the timeout has changed. */
-                        timer_list_signal_timer_change(tlh);
-                } 
-	}
+        internal_add_timer(tlh, timer);
        
 	timer_list_unlock(tlh);
 
 	return ret;
 }
 
+int mod_timer(struct timer_list *timer, unsigned long expires)
+{
+        return __mod_timer(timer, expires, 0);
+}
+
 int mod_timer_pending(struct timer_list *timer, unsigned long expires)
 {
-	return 0;
+	return __mod_timer(timer, expires, 1);
 }
 
 int mod_timer_pinned(struct timer_list *timer, unsigned long expires)
 {
-	return 0;
+	return __mod_timer(timer, expires, 0);
 }
@@ -9,13 +9,104 @@
 #include <sys/select.h>
 #include <poll.h>
 #include <unistd.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#if defined(OS_LINUX)
+#include <sys/eventfd.h>
+#endif
 
 static pthread_key_t wq_key;
 static pthread_key_t w_key;
+static pthread_key_t notifier_key;
 static pthread_once_t key_once = PTHREAD_ONCE_INIT;
 
+/*
+  Each thread sleeps on one notifier, which is created the first
+  time the thread waits and closed when it exits. It is an eventfd
+  where available, otherwise a pipe. Since the notifier outlives
+  any single wait, a wakeup that arrives after the waiter gave up
+  may cause one spurious return from schedule_timeout(), which
+  callers handle by checking their condition again.
+*/
+struct wait_notifier {
+        int fd[2]; /* Read and write ends, the same for an eventfd */
+};
+
+static __thread struct wait_notifier *thread_notifier;
+
 #define MAX(x, y) (x >= y ? x : y)
 
+static void wait_notifier_free(void *arg)
+{
+        struct wait_notifier *n = arg;
+
+        close(n->fd[0]);
+
+        if (n->fd[1] != n->fd[0])
+                close(n->fd[1]);
+        free(n);
+}
+
+static void make_keys(void)
+{
+	pthread_key_create(&wq_key, NULL);
+	pthread_key_create(&w_key, NULL);
+	pthread_key_create(&notifier_key, wait_notifier_free);
+}
+
+static struct wait_notifier *wait_notifier_get(void)
+{
+        struct wait_notifier *n = thread_notifier;
+
+        if (n)
+                return n;
+
+	pthread_once(&key_once, make_keys);
+
+        n = malloc(sizeof(*n));
+
+        if (!n)
+                return NULL;
+
+#if defined(OS_LINUX)
+        n->fd[0] = n->fd[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+        if (n->fd[0] == -1) {
+                LOG_ERR("eventfd: %s\n", strerror(errno));
+                free(n);
+                return NULL;
+        }
+#else
+	if (pipe(n->fd) == -1) {
+                LOG_ERR("pipe: %s\n", strerror(errno));
+                free(n);
+                return NULL;
+        }
+        fcntl(n->fd[0], F_SETFL, O_NONBLOCK);
+        fcntl(n->fd[1], F_SETFL, O_NONBLOCK);
+#endif
+        pthread_setspecific(notifier_key, n);
+        thread_notifier = n;
+
+        return n;
+}
+
+/* Consume pending wakeups */
+static void wait_notifier_clear(struct wait_notifier *n)
+{
+#if defined(OS_LINUX)
+        uint64_t val;
+
+        if (read(n->fd[0], &val, sizeof(val)) == -1 && errno != EAGAIN)
+                LOG_ERR("eventfd read: %s\n", strerror(errno));
+#else
+        uint8_t buf[64];
+
+        while (read(n->fd[0], buf, sizeof(buf)) == sizeof(buf))
+                ;
+#endif
+}
+
 void init_waitqueue_head(wait_queue_head_t *q)
 {
 	pthread_mutex_init(&q->lock, NULL);
@@ -29,40 +120,48 @@ void destroy_waitqueue_head(wait_queue_head_t *q)
 
 void init_wait(wait_queue_t *w)
 {        
+        struct wait_notifier *n = wait_notifier_get();
+
 	pthread_mutex_init(&w->lock, NULL);
-	if (pipe(w->pipefd) == -1) {
-                LOG_ERR("pipe: %s\n", strerror(errno));
-        }
+        w->fd = n ? n->fd[1] : -1;
 	INIT_LIST_HEAD(&w->thread_list);
 }
 
 void destroy_wait(wait_queue_t *w)
 {
         pthread_mutex_destroy(&w->lock);
-        if (w->pipefd[0] > 0)
-                close(w->pipefd[0]);
-        if (w->pipefd[1] > 0)
-                close(w->pipefd[1]);
 }
 
 int default_wake_function(wait_queue_t *curr, unsigned mode, 
                           int wake_flags, void *key)
 {
-        uint8_t sig = 1;
         int ret;
 
         LOG_DBG("Waking up sleepers!\n");
         
-        if (curr->pipefd[1] == -1) {
-                LOG_ERR("pipefd[1] == -1\n");
+        if (curr->fd == -1) {
+                LOG_ERR("No notifier to wake up\n");
                 return -1;
         }
 
-        ret = write(curr->pipefd[1], &sig, sizeof(sig));
-        
+#if defined(OS_LINUX)
+        {
+                uint64_t val = 1;
+                ret = write(curr->fd, &val, sizeof(val));
+        }
+#else
+        {
+                uint8_t sig = 1;
+                ret = write(curr->fd, &sig, sizeof(sig));
+
+                /* A full pipe has wakeups pending already */
+                if (ret < 0 && errno == EAGAIN)
+                        ret = 1;
+        }
+#endif        
         if (ret < 0) {
-                LOG_ERR("Could not write in signal to pipe: %u\n", 
-                        curr->pipefd[1]);
+                LOG_ERR("Could not signal notifier %d: %s\n", 
+                        curr->fd, strerror(errno));
         }
 
 	return ret;
@@ -80,25 +179,28 @@ long schedule_timeout(long timeo)
         wait_queue_head_t *q = 
                 (wait_queue_head_t *)pthread_getspecific(wq_key);
         wait_queue_t *w = (wait_queue_t *)pthread_getspecific(w_key);
+        struct wait_notifier *n = thread_notifier;
         struct client *c = client_get_current();
         struct timespec now = { 0, 0 }, later = { 0, 0 };
         struct pollfd fds[3];
         int ret = 0;
 
-        if (!q || !w || !c) {
+        if (!q || !w || !c || !n) {
                 LOG_ERR("No client or wait queue!\n");
                 return timeo;
         }
 
         gettime(&now);
 
-        fds[0].fd = w->pipefd[0];
+        fds[0].fd = n->fd[0];
         fds[0].events = POLLERR | POLLIN;
         fds[1].fd = client_get_signalfd(c);
         fds[1].events = POLLERR | POLLIN;
         fds[2].fd = client_get_sockfd(c);
         fds[2].events = POLLERR | POLLHUP;
 
+        client_worker_block();
+
         if (timeo == MAX_SCHEDULE_TIMEOUT) {
                 ret = ppoll(fds, 3, NULL, NULL);
         } else {
@@ -106,7 +208,12 @@ long schedule_timeout(long timeo)
                 timespec_add_nsec(&timeout, jiffies_to_nsecs(timeo));
                 ret = ppoll(fds, 3, &timeout, NULL);
         }
+
+        client_worker_unblock();
         
+        if (ret > 0 && (fds[0].revents & POLLIN))
+                wait_notifier_clear(n);
+
         if (ret == -1) {
                 LOG_ERR("poll error: %s\n", strerror(errno));
         } else if (ret == 0) {
@@ -132,12 +239,6 @@ long schedule_timeout(long timeo)
         return timeo;
 }
 
-static void make_keys(void)
-{
-	pthread_key_create(&wq_key, NULL);
-	pthread_key_create(&w_key, NULL);
-}
-
 void pre_add_wait_queue(wait_queue_head_t *q, wait_queue_t *wait)
 {
         int ret;
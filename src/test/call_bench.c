@@ -0,0 +1,228 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*- */
+/*
+  Measure the overhead of libserval calls. Opens a number of bound
+  sockets, and then times:
+
+  - calls that fail right after the library has looked up the socket,
+    on the first and the last of the open sockets, which shows
+    whether lookups depend on the number of sockets;
+  - sendto_sv() of small datagrams to one of the sockets, and
+    recvfrom_sv() of them, which includes the round trips to the
+    stack.
+
+  Run with strace -c to count the system calls of each call.
+ */
+#include <sys/time.h>
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/serval.h>
+#include <libserval/serval.h>
+
+#define DEFAULT_SID 28673
+#define DEFAULT_SOCKS 1000
+#define DEFAULT_CALLS 100000
+#define DEFAULT_MSGS 10000
+#define MSG_LEN 64
+
+static double time_diff(const struct timeval *end,
+                        const struct timeval *start)
+{
+        return (end->tv_sec - start->tv_sec) +
+                (end->tv_usec - start->tv_usec) / 1000000.0;
+}
+
+static void print_cost(const char *what, unsigned long num, double secs)
+{
+        printf("%-24s %8lu calls in %.3f seconds, %.3f us per call\n",
+               what, num, secs, num ? secs * 1000000.0 / num : 0.0);
+}
+
+static void init_addr(struct sockaddr_sv *addr, unsigned long sid)
+{
+        memset(addr, 0, sizeof(*addr));
+        addr->sv_family = AF_SERVAL;
+        addr->sv_srvid.s_sid32[0] = htonl(sid);
+}
+
+static int open_socks(unsigned long sid, unsigned long num, int *socks)
+{
+        unsigned long i;
+
+        for (i = 0; i < num; i++) {
+                struct sockaddr_sv addr;
+
+                socks[i] = socket_sv(AF_SERVAL, SOCK_DGRAM, 0);
+
+                if (socks[i] == -1) {
+                        fprintf(stderr, "socket %lu: %s\n",
+                                i, strerror_sv(errno));
+                        break;
+                }
+
+                init_addr(&addr, sid + i);
+
+                if (bind_sv(socks[i], (struct sockaddr *)&addr,
+                            sizeof(addr)) == -1) {
+                        fprintf(stderr, "bind %lu: %s\n",
+                                i, strerror_sv(errno));
+                        close_sv(socks[i]);
+                        break;
+                }
+        }
+        return i;
+}
+
+/* A receive without buffer fails as soon as the socket is found */
+static void time_lookups(const char *what, int sock, unsigned long num)
+{
+        struct timeval start, end;
+        unsigned long i;
+
+        gettimeofday(&start, NULL);
+
+        for (i = 0; i < num; i++)
+                recvfrom_sv(sock, NULL, 0, 0, NULL, NULL);
+
+        gettimeofday(&end, NULL);
+        print_cost(what, num, time_diff(&end, &start));
+}
+
+static int time_messages(int sock, int peer, unsigned long sid,
+                         unsigned long num)
+{
+        struct sockaddr_sv addr;
+        struct timeval start, end;
+        char buf[MSG_LEN];
+        unsigned long i, n = 0;
+
+        init_addr(&addr, sid);
+        memset(buf, 'x', sizeof(buf));
+
+        gettimeofday(&start, NULL);
+
+        for (i = 0; i < num; i++) {
+                if (sendto_sv(sock, buf, sizeof(buf), 0,
+                              (struct sockaddr *)&addr,
+                              sizeof(addr)) == -1) {
+                        fprintf(stderr, "sendto: %s\n", strerror_sv(errno));
+                        break;
+                }
+        }
+
+        gettimeofday(&end, NULL);
+        print_cost("sendto_sv", i, time_diff(&end, &start));
+
+        if (i < num)
+                return -1;
+
+        gettimeofday(&start, NULL);
+
+        while (n < num) {
+                if (recvfrom_sv(peer, buf, sizeof(buf), MSG_DONTWAIT,
+                                NULL, NULL) == -1) {
+                        if (errno != EAGAIN && errno != EWOULDBLOCK)
+                                fprintf(stderr, "recvfrom: %s\n",
+                                        strerror_sv(errno));
+                        break;
+                }
+                n++;
+        }
+
+        gettimeofday(&end, NULL);
+        print_cost("recvfrom_sv", n, time_diff(&end, &start));
+
+        if (n < num)
+                printf("Received %lu of %lu datagrams\n", n, num);
+
+        return 0;
+}
+
+static void print_usage(const char *prog)
+{
+        printf("Usage: %s [OPTIONS]\n"
+               "-n, --socks NUM       - Open NUM sockets (default %u).\n"
+               "-c, --calls NUM       - Time NUM lookups (default %u).\n"
+               "-m, --msgs NUM        - Send NUM datagrams (default %u).\n"
+               "-i, --id SID          - Use service ids from SID (default %u).\n",
+               prog, DEFAULT_SOCKS, DEFAULT_CALLS, DEFAULT_MSGS, DEFAULT_SID);
+}
+
+int main(int argc, char **argv)
+{
+        unsigned long sid = DEFAULT_SID;
+        unsigned long num_socks = DEFAULT_SOCKS;
+        unsigned long num_calls = DEFAULT_CALLS;
+        unsigned long num_msgs = DEFAULT_MSGS;
+        const char *prog = argv[0];
+        int *socks, sock, ret = 0;
+        unsigned long i, n;
+
+        argc--;
+        argv++;
+
+        while (argc) {
+                if (argc > 1 && (strcmp(argv[0], "-n") == 0 ||
+                                 strcmp(argv[0], "--socks") == 0)) {
+                        num_socks = strtoul(argv[1], NULL, 10);
+                } else if (argc > 1 && (strcmp(argv[0], "-c") == 0 ||
+                                        strcmp(argv[0], "--calls") == 0)) {
+                        num_calls = strtoul(argv[1], NULL, 10);
+                } else if (argc > 1 && (strcmp(argv[0], "-m") == 0 ||
+                                        strcmp(argv[0], "--msgs") == 0)) {
+                        num_msgs = strtoul(argv[1], NULL, 10);
+                } else if (argc > 1 && (strcmp(argv[0], "-i") == 0 ||
+                                        strcmp(argv[0], "--id") == 0)) {
+                        sid = strtoul(argv[1], NULL, 10);
+                } else {
+                        print_usage(prog);
+                        return EXIT_FAILURE;
+                }
+                argc -= 2;
+                argv += 2;
+        }
+
+        if (num_socks == 0)
+                num_socks = 1;
+
+        socks = malloc(sizeof(int) * num_socks);
+
+        if (!socks)
+                return EXIT_FAILURE;
+
+        n = open_socks(sid, num_socks, socks);
+
+        if (n == 0) {
+                free(socks);
+                return EXIT_FAILURE;
+        }
+
+        printf("Opened %lu sockets\n", n);
+
+        time_lookups("Lookup of first socket", socks[0], num_calls);
+        time_lookups("Lookup of last socket", socks[n - 1], num_calls);
+
+        if (num_msgs) {
+                sock = socket_sv(AF_SERVAL, SOCK_DGRAM, 0);
+
+                if (sock == -1) {
+                        fprintf(stderr, "socket: %s\n", strerror_sv(errno));
+                        ret = -1;
+                } else {
+                        ret = time_messages(sock, socks[n - 1],
+                                            sid + n - 1, num_msgs);
+                        close_sv(sock);
+                }
+        }
+
+        for (i = 0; i < n; i++)
+                close_sv(socks[i]);
+
+        free(socks);
+
+        return ret == -1 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
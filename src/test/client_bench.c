@@ -0,0 +1,255 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*- */
+/*
+  Measure how the user-level stack copes with many clients. First
+  opens a number of sockets that are bound and then left idle, and
+  reports the rate at which they were opened and the memory and
+  threads of the stack while they are open. Then sets up and tears
+  down connections to a local sink, and reports the rate.
+
+  Compare the thread per client mode of the stack with the
+  event-driven one by running the stack with and without
+  --client-workers.
+ */
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/serval.h>
+#include <libserval/serval.h>
+
+#define DEFAULT_SID 24577
+#define DEFAULT_IDLE 1000
+#define DEFAULT_CONNS 1000
+#define PID_FILE "/tmp/serval.pid"
+
+static double time_diff(const struct timeval *end,
+                        const struct timeval *start)
+{
+        return (end->tv_sec - start->tv_sec) +
+                (end->tv_usec - start->tv_usec) / 1000000.0;
+}
+
+static void print_rate(const char *what, unsigned long num, double secs)
+{
+        printf("%s %lu in %.3f seconds, %.1f per second\n",
+               what, num, secs, secs > 0 ? num / secs : 0.0);
+}
+
+/* Print memory use and threads of the stack, as found in /proc */
+static void print_stack_usage(void)
+{
+        char path[64], line[128];
+        unsigned int pid;
+        FILE *f;
+
+        f = fopen(PID_FILE, "r");
+
+        if (!f || fscanf(f, "%u", &pid) != 1) {
+                fprintf(stderr, "Could not read stack PID from %s\n",
+                        PID_FILE);
+                if (f)
+                        fclose(f);
+                return;
+        }
+        fclose(f);
+
+        snprintf(path, sizeof(path), "/proc/%u/status", pid);
+        f = fopen(path, "r");
+
+        if (!f) {
+                fprintf(stderr, "Could not open %s: %s\n",
+                        path, strerror(errno));
+                return;
+        }
+
+        while (fgets(line, sizeof(line), f)) {
+                if (strncmp(line, "VmSize:", 7) == 0 ||
+                    strncmp(line, "VmRSS:", 6) == 0 ||
+                    strncmp(line, "Threads:", 8) == 0)
+                        printf("Stack %s", line);
+        }
+        fclose(f);
+}
+
+static int open_idle(unsigned long sid, unsigned long num, int *socks)
+{
+        struct timeval start, end;
+        unsigned long i;
+
+        gettimeofday(&start, NULL);
+
+        for (i = 0; i < num; i++) {
+                struct sockaddr_sv addr;
+
+                socks[i] = socket_sv(AF_SERVAL, SOCK_DGRAM, 0);
+
+                if (socks[i] == -1) {
+                        fprintf(stderr, "socket %lu: %s\n",
+                                i, strerror_sv(errno));
+                        break;
+                }
+
+                memset(&addr, 0, sizeof(addr));
+                addr.sv_family = AF_SERVAL;
+                addr.sv_srvid.s_sid32[0] = htonl(sid + i);
+
+                if (bind_sv(socks[i], (struct sockaddr *)&addr,
+                            sizeof(addr)) == -1) {
+                        fprintf(stderr, "bind %lu: %s\n",
+                                i, strerror_sv(errno));
+                        close_sv(socks[i]);
+                        break;
+                }
+        }
+
+        gettimeofday(&end, NULL);
+        print_rate("Opened idle clients", i, time_diff(&end, &start));
+
+        return i;
+}
+
+static void sink(struct sockaddr_sv *addr)
+{
+        int sock;
+
+        sock = socket_sv(AF_SERVAL, SOCK_STREAM, 0);
+
+        if (sock == -1) {
+                fprintf(stderr, "sink socket: %s\n", strerror_sv(errno));
+                exit(EXIT_FAILURE);
+        }
+
+        if (bind_sv(sock, (struct sockaddr *)addr, sizeof(*addr)) == -1 ||
+            listen_sv(sock, 128) == -1) {
+                fprintf(stderr, "sink bind/listen: %s\n",
+                        strerror_sv(errno));
+                exit(EXIT_FAILURE);
+        }
+
+        while (1) {
+                int csock = accept_sv(sock, NULL, NULL);
+
+                if (csock == -1) {
+                        fprintf(stderr, "accept: %s\n", strerror_sv(errno));
+                        break;
+                }
+                close_sv(csock);
+        }
+        close_sv(sock);
+        exit(EXIT_SUCCESS);
+}
+
+static int run_connections(struct sockaddr_sv *addr, unsigned long num)
+{
+        struct timeval start, end;
+        unsigned long i;
+
+        gettimeofday(&start, NULL);
+
+        for (i = 0; i < num; i++) {
+                int sock = socket_sv(AF_SERVAL, SOCK_STREAM, 0);
+
+                if (sock == -1) {
+                        fprintf(stderr, "socket: %s\n", strerror_sv(errno));
+                        break;
+                }
+
+                if (connect_sv(sock, (struct sockaddr *)addr,
+                               sizeof(*addr)) == -1) {
+                        fprintf(stderr, "connect: %s\n", strerror_sv(errno));
+                        close_sv(sock);
+                        break;
+                }
+                close_sv(sock);
+        }
+
+        gettimeofday(&end, NULL);
+        print_rate("Connections", i, time_diff(&end, &start));
+
+        return i == num ? 0 : -1;
+}
+
+static void print_usage(const char *prog)
+{
+        printf("Usage: %s [OPTIONS]\n"
+               "-n, --idle NUM        - Open NUM idle clients (default %u).\n"
+               "-c, --conns NUM       - Make NUM connections (default %u).\n"
+               "-i, --id SID          - Use service ids from SID (default %u).\n",
+               prog, DEFAULT_IDLE, DEFAULT_CONNS, DEFAULT_SID);
+}
+
+int main(int argc, char **argv)
+{
+        unsigned long sid = DEFAULT_SID;
+        unsigned long num_idle = DEFAULT_IDLE;
+        unsigned long num_conns = DEFAULT_CONNS;
+        const char *prog = argv[0];
+        struct sockaddr_sv addr;
+        int *socks, ret = 0;
+        unsigned long i, n;
+        pid_t pid;
+
+        argc--;
+        argv++;
+
+        while (argc) {
+                if (argc > 1 && (strcmp(argv[0], "-n") == 0 ||
+                                 strcmp(argv[0], "--idle") == 0)) {
+                        num_idle = strtoul(argv[1], NULL, 10);
+                } else if (argc > 1 && (strcmp(argv[0], "-c") == 0 ||
+                                        strcmp(argv[0], "--conns") == 0)) {
+                        num_conns = strtoul(argv[1], NULL, 10);
+                } else if (argc > 1 && (strcmp(argv[0], "-i") == 0 ||
+                                        strcmp(argv[0], "--id") == 0)) {
+                        sid = strtoul(argv[1], NULL, 10);
+                } else {
+                        print_usage(prog);
+                        return EXIT_FAILURE;
+                }
+                argc -= 2;
+                argv += 2;
+        }
+
+        socks = malloc(sizeof(int) * (num_idle ? num_idle : 1));
+
+        if (!socks)
+                return EXIT_FAILURE;
+
+        print_stack_usage();
+        n = open_idle(sid, num_idle, socks);
+        print_stack_usage();
+
+        if (num_conns) {
+                memset(&addr, 0, sizeof(addr));
+                addr.sv_family = AF_SERVAL;
+                addr.sv_srvid.s_sid32[0] = htonl(sid + num_idle);
+
+                pid = fork();
+
+                if (pid == -1) {
+                        fprintf(stderr, "fork: %s\n", strerror(errno));
+                        ret = -1;
+                } else if (pid == 0) {
+                        sink(&addr);
+                } else {
+                        /* Let the sink start listening */
+                        sleep(1);
+                        ret = run_connections(&addr, num_conns);
+                        kill(pid, SIGTERM);
+                        waitpid(pid, NULL, 0);
+                }
+        }
+
+        for (i = 0; i < n; i++)
+                close_sv(socks[i]);
+
+        free(socks);
+
+        return ret == -1 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,227 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*- */
+/*
+  Measure the goodput of a bulk Serval TCP transfer with a given
+  congestion control algorithm. Run one instance as a sink with -s,
+  and another one as the sender. Link delay and loss can be emulated
+  with the user-level stack's --netem option, or with tc on the
+  kernel version.
+ */
+#include <sys/time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netinet/serval.h>
+#include <libserval/serval.h>
+
+#define DEFAULT_SID 16385
+#define DEFAULT_DURATION 10
+#define BUFSIZE 65536
+
+static char buf[BUFSIZE];
+
+static double time_diff(const struct timeval *end,
+                        const struct timeval *start)
+{
+        return (end->tv_sec - start->tv_sec) +
+                (end->tv_usec - start->tv_usec) / 1000000.0;
+}
+
+static void print_goodput(const char *what, unsigned long long bytes,
+                          double secs)
+{
+        printf("%s %llu bytes in %.3f seconds, %.3f Mbit/s\n",
+               what, bytes, secs,
+               secs > 0 ? (bytes * 8 / secs) / 1000000.0 : 0.0);
+}
+
+static int server(struct sockaddr_sv *addr)
+{
+        int sock, ret;
+
+        sock = socket_sv(AF_SERVAL, SOCK_STREAM, 0);
+
+        if (sock == -1) {
+                fprintf(stderr, "socket: %s\n", strerror_sv(errno));
+                return EXIT_FAILURE;
+        }
+
+        ret = bind_sv(sock, (struct sockaddr *)addr, sizeof(*addr));
+
+        if (ret == -1) {
+                fprintf(stderr, "bind: %s\n", strerror_sv(errno));
+                goto out;
+        }
+
+        ret = listen_sv(sock, 10);
+
+        if (ret == -1) {
+                fprintf(stderr, "listen: %s\n", strerror_sv(errno));
+                goto out;
+        }
+
+        printf("Sink on service id %s\n",
+               service_id_to_str(&addr->sv_srvid));
+
+        while (1) {
+                unsigned long long total = 0;
+                struct timeval start, end;
+                int csock;
+                ssize_t n;
+
+                csock = accept_sv(sock, NULL, NULL);
+
+                if (csock == -1) {
+                        fprintf(stderr, "accept: %s\n", strerror_sv(errno));
+                        ret = -1;
+                        break;
+                }
+
+                gettimeofday(&start, NULL);
+
+                while ((n = recv_sv(csock, buf, BUFSIZE, 0)) > 0)
+                        total += n;
+
+                gettimeofday(&end, NULL);
+
+                if (n == -1)
+                        fprintf(stderr, "recv: %s\n", strerror_sv(errno));
+
+                print_goodput("Received", total, time_diff(&end, &start));
+                close_sv(csock);
+        }
+out:
+        close_sv(sock);
+
+        return ret == -1 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static int client(struct sockaddr_sv *addr, const char *cong,
+                  unsigned int duration)
+{
+        unsigned long long total = 0;
+        struct timeval start, now;
+        int sock, ret;
+
+        sock = socket_sv(AF_SERVAL, SOCK_STREAM, 0);
+
+        if (sock == -1) {
+                fprintf(stderr, "socket: %s\n", strerror_sv(errno));
+                return EXIT_FAILURE;
+        }
+
+        if (cong) {
+#if defined(SERVAL_NATIVE)
+                ret = setsockopt(sock, IPPROTO_TCP, TCP_CONGESTION,
+                                 cong, strlen(cong));
+
+                if (ret == -1) {
+                        fprintf(stderr, "TCP_CONGESTION %s: %s\n",
+                                cong, strerror(errno));
+                        goto out;
+                }
+#else
+                /* The user-level stack has no per-socket setting */
+                fprintf(stderr, "Start the stack with "
+                        "--congestion-control %s instead\n", cong);
+                ret = -1;
+                goto out;
+#endif
+        }
+
+        ret = connect_sv(sock, (struct sockaddr *)addr, sizeof(*addr));
+
+        if (ret == -1) {
+                fprintf(stderr, "connect: %s\n", strerror_sv(errno));
+                goto out;
+        }
+
+        printf("Sending to service id %s for %u seconds\n",
+               service_id_to_str(&addr->sv_srvid), duration);
+
+        memset(buf, 'x', BUFSIZE);
+        gettimeofday(&start, NULL);
+
+        do {
+                ssize_t n = send_sv(sock, buf, BUFSIZE, 0);
+
+                if (n == -1) {
+                        fprintf(stderr, "send: %s\n", strerror_sv(errno));
+                        ret = -1;
+                        break;
+                }
+
+                total += n;
+                gettimeofday(&now, NULL);
+        } while (time_diff(&now, &start) < duration);
+
+        print_goodput("Sent", total, time_diff(&now, &start));
+out:
+        close_sv(sock);
+
+        return ret == -1 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static void print_usage(const char *prog)
+{
+        printf("Usage: %s [OPTIONS]\n"
+               "-s, --server          - Run as the sink.\n"
+               "-i, --id SID          - Use service id SID (default %u).\n"
+               "-c, --cong NAME       - Use congestion control NAME.\n"
+               "-t, --time SECS       - Send for SECS seconds (default %u).\n",
+               prog, DEFAULT_SID, DEFAULT_DURATION);
+}
+
+int main(int argc, char **argv)
+{
+        struct sockaddr_sv addr;
+        unsigned long sid = DEFAULT_SID;
+        unsigned int duration = DEFAULT_DURATION;
+        const char *cong = NULL;
+        const char *prog = argv[0];
+        int is_server = 0;
+
+        argc--;
+        argv++;
+
+        while (argc) {
+                if (strcmp(argv[0], "-s") == 0 ||
+                    strcmp(argv[0], "--server") == 0) {
+                        is_server = 1;
+                } else if (argc > 1 && (strcmp(argv[0], "-i") == 0 ||
+                                        strcmp(argv[0], "--id") == 0)) {
+                        sid = strtoul(argv[1], NULL, 10);
+                        argc--;
+                        argv++;
+                } else if (argc > 1 && (strcmp(argv[0], "-c") == 0 ||
+                                        strcmp(argv[0], "--cong") == 0)) {
+                        cong = argv[1];
+                        argc--;
+                        argv++;
+                } else if (argc > 1 && (strcmp(argv[0], "-t") == 0 ||
+                                        strcmp(argv[0], "--time") == 0)) {
+                        duration = strtoul(argv[1], NULL, 10);
+                        argc--;
+                        argv++;
+                } else {
+                        print_usage(prog);
+                        return EXIT_FAILURE;
+                }
+                argc--;
+                argv++;
+        }
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sv_family = AF_SERVAL;
+        addr.sv_srvid.s_sid32[0] = htonl(sid);
+
+        if (is_server)
+                return server(&addr);
+
+        return client(&addr, cong, duration);
+}